@@ -260,6 +260,29 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
     qemu_mutex_unlock(&stats->lock);
 }
 
+/* Account a batch of requests that the device submitted while plugged */
+void block_acct_submit_batch(BlockAcctStats *stats, unsigned int num_requests)
+{
+    qemu_mutex_lock(&stats->lock);
+    stats->submit_batches++;
+    stats->submit_batch_reqs += num_requests;
+    qemu_mutex_unlock(&stats->lock);
+}
+
+/*
+ * Account a batch of completions that the device signalled to the guest
+ * together, @delay_ns after the oldest of them had completed.
+ */
+void block_acct_complete_batch(BlockAcctStats *stats, unsigned int num_requests,
+                               int64_t delay_ns)
+{
+    qemu_mutex_lock(&stats->lock);
+    stats->complete_batches++;
+    stats->complete_batch_reqs += num_requests;
+    stats->complete_delay_ns += delay_ns;
+    qemu_mutex_unlock(&stats->lock);
+}
+
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats)
 {
     return qemu_clock_get_ns(clock_type) - stats->last_access_time_ns;
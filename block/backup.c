@@ -23,6 +23,7 @@
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "sysemu/block-backend.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
@@ -30,6 +31,8 @@
 #include "block/backup-top.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_CHUNK_DEFAULT (1 * MiB)
+#define BACKUP_CHUNK_MAX (16 * MiB)
 
 typedef struct BackupBlockJob {
     BlockJob common;
@@ -46,6 +49,7 @@ typedef struct BackupBlockJob {
     uint64_t len;
     int64_t cluster_size;
     BackupPerf perf;
+    BlockJobTuner tuner;
 
     BlockCopyState *bcs;
 
@@ -157,7 +161,7 @@ static int coroutine_fn backup_loop(BackupBlockJob *job)
     while (true) { /* retry loop */
         job->bg_bcs_call = s = block_copy_async(job->bcs, 0,
                 QEMU_ALIGN_UP(job->len, job->cluster_size),
-                job->perf.max_workers, job->perf.max_chunk,
+                job->perf.max_workers, job->perf.max_chunk, &job->tuner,
                 backup_block_copy_callback, job);
 
         while (!block_copy_call_finished(s) &&
@@ -331,6 +335,19 @@ static void coroutine_fn backup_set_speed(BlockJob *job, int64_t speed)
     }
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    info->tuning = block_job_tuner_info(&s->tuner);
+    info->has_tuning = info->tuning != NULL;
+
+    if (s->perf.use_copy_range) {
+        info->has_offloaded = true;
+        info->offloaded = block_copy_offloaded_bytes(s->bcs);
+    }
+}
+
 static void backup_cancel(Job *job, bool force)
 {
     BackupBlockJob *s = container_of(job, BackupBlockJob, common.job);
@@ -352,6 +369,7 @@ static const BlockJobDriver backup_job_driver = {
         .cancel                 = backup_cancel,
     },
     .set_speed = backup_set_speed,
+    .query = backup_query,
 };
 
 static int64_t backup_calculate_cluster_size(BlockDriverState *target,
@@ -406,7 +424,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
 {
     int64_t len, target_len;
     BackupBlockJob *job = NULL;
-    int64_t cluster_size;
+    int64_t cluster_size, max_chunk;
     BdrvRequestFlags write_flags;
     BlockDriverState *backup_top = NULL;
     BlockCopyState *bcs = NULL;
@@ -549,6 +567,12 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->len = len;
     job->perf = *perf;
 
+    max_chunk = MAX(perf->max_chunk ?: BACKUP_CHUNK_MAX, cluster_size);
+    block_job_tuner_init(&job->tuner,
+                         MIN(MAX(BACKUP_CHUNK_DEFAULT, cluster_size), max_chunk),
+                         cluster_size, max_chunk,
+                         perf->max_workers, 1, perf->max_workers);
+
     block_copy_set_progress_meter(bcs, &job->common.job.progress);
     block_copy_set_speed(bcs, speed);
 
@@ -94,6 +94,10 @@ struct BlockBackend {
      * Accessed with atomic ops.
      */
     unsigned int in_flight;
+
+    /* Nesting depth of blk_io_plug() and requests submitted meanwhile */
+    unsigned int io_plugged;
+    unsigned int io_plugged_reqs;
 };
 
 typedef struct BlockBackendAIOCB {
@@ -1444,6 +1448,9 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     BlkAioEmAIOCB *acb;
     Coroutine *co;
 
+    if (blk->io_plugged) {
+        blk->io_plugged_reqs++;
+    }
     blk_inc_in_flight(blk);
     acb = blk_aio_get(&blk_aio_em_aiocb_info, blk, cb, opaque);
     acb->rwco = (BlkRwCo) {
@@ -2174,6 +2181,9 @@ void blk_io_plug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
+    if (blk->io_plugged++ == 0) {
+        blk->io_plugged_reqs = 0;
+    }
     if (bs) {
         bdrv_io_plug(bs);
     }
@@ -2186,6 +2196,11 @@ void blk_io_unplug(BlockBackend *blk)
     if (bs) {
         bdrv_io_unplug(bs);
     }
+
+    assert(blk->io_plugged);
+    if (--blk->io_plugged == 0 && blk->io_plugged_reqs) {
+        block_acct_submit_batch(&blk->stats, blk->io_plugged_reqs);
+    }
 }
 
 BlockAcctStats *blk_get_stats(BlockBackend *blk)
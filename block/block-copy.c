@@ -20,6 +20,7 @@
 #include "sysemu/block-backend.h"
 #include "qemu/units.h"
 #include "qemu/coroutine.h"
+#include "qemu/stats64.h"
 #include "block/aio_task.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
@@ -45,6 +46,7 @@ typedef struct BlockCopyCallState {
     int64_t bytes;
     int max_workers;
     int64_t max_chunk;
+    BlockJobTuner *tuner;
     bool ignore_ratelimit;
     BlockCopyAsyncCallbackFunc cb;
     void *cb_opaque;
@@ -134,6 +136,8 @@ typedef struct BlockCopyState {
     CoMutex lock;
     int64_t in_flight_bytes;
     BlockCopyMethod method;
+    /* When to attempt copy_range again after it failed */
+    BdrvCopyRangeFallback copy_range;
     QLIST_HEAD(, BlockCopyTask) tasks; /* All tasks from all block-copy calls */
     QLIST_HEAD(, BlockCopyCallState) calls;
     /*
@@ -156,6 +160,8 @@ typedef struct BlockCopyState {
     ProgressMeter *progress;
     SharedResource *mem;
     RateLimit rate_limit;
+    /* Bytes copied with copy_range */
+    Stat64 offloaded_bytes;
 } BlockCopyState;
 
 /* Called with lock held */
@@ -222,10 +228,16 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
                        int64_t offset, int64_t bytes)
 {
     BlockCopyTask *task;
+    BlockCopyMethod method;
     int64_t max_chunk;
 
     QEMU_LOCK_GUARD(&s->lock);
-    max_chunk = MIN_NON_ZERO(block_copy_chunk_size(s), call_state->max_chunk);
+    max_chunk = block_copy_chunk_size(s);
+    if (call_state->tuner && s->method != COPY_READ_WRITE_CLUSTER) {
+        /* The tuner decides, within what source and target accept */
+        max_chunk = MIN(call_state->tuner->chunk, s->max_transfer);
+    }
+    max_chunk = MIN_NON_ZERO(max_chunk, call_state->max_chunk);
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
                                            max_chunk, &offset, &bytes))
@@ -242,6 +254,13 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
     bdrv_reset_dirty_bitmap(s->copy_bitmap, offset, bytes);
     s->in_flight_bytes += bytes;
 
+    method = s->method;
+    if ((method == COPY_RANGE_SMALL || method == COPY_RANGE_FULL) &&
+        !bdrv_copy_range_fallback_try(&s->copy_range))
+    {
+        method = COPY_READ_WRITE;
+    }
+
     task = g_new(BlockCopyTask, 1);
     *task = (BlockCopyTask) {
         .task.func = block_copy_task_entry,
@@ -249,7 +268,7 @@ block_copy_task_create(BlockCopyState *s, BlockCopyCallState *call_state,
         .call_state = call_state,
         .offset = offset,
         .bytes = bytes,
-        .method = s->method,
+        .method = method,
     };
     qemu_co_queue_init(&task->wait_queue);
     QLIST_INSERT_HEAD(&s->tasks, task, list);
@@ -361,6 +380,8 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
          */
         s->method = use_copy_range ? COPY_RANGE_SMALL : COPY_READ_WRITE;
     }
+    bdrv_copy_range_fallback_init(&s->copy_range,
+                                  s->method == COPY_RANGE_SMALL);
 
     ratelimit_init(&s->rate_limit);
     qemu_co_mutex_init(&s->lock);
@@ -417,8 +438,9 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
  * No sync here: nor bitmap neighter intersecting requests handling, only copy.
  *
  * @method is an in-out argument, so that copy_range can be either extended to
- * a full-size buffer or disabled if the copy_range attempt fails.  The output
- * value of @method should be used for subsequent tasks.
+ * a full-size buffer, or reduced to buffer-sized requests (or disabled if it
+ * is not supported) if the copy_range attempt fails.  The output value of
+ * @method should be used for subsequent tasks.
  * Returns 0 on success.
  */
 static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
@@ -429,6 +451,7 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
     int ret;
     int64_t nbytes = MIN(offset + bytes, s->len) - offset;
     void *bounce_buffer = NULL;
+    bool copy_range_disabled = false;
 
     assert(offset >= 0 && bytes > 0 && INT64_MAX - offset >= bytes);
     assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
@@ -452,14 +475,23 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
     case COPY_RANGE_FULL:
         ret = bdrv_co_copy_range(s->source, offset, s->target, offset, nbytes,
                                  0, s->write_flags);
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            bdrv_copy_range_fallback_done(&s->copy_range, ret);
+            copy_range_disabled = s->copy_range.disabled;
+        }
         if (ret >= 0) {
             /* Successful copy-range, increase chunk size.  */
+            stat64_add(&s->offloaded_bytes, nbytes);
             *method = COPY_RANGE_FULL;
             return 0;
         }
 
         trace_block_copy_copy_range_fail(s, offset, ret);
-        *method = COPY_READ_WRITE;
+        /*
+         * Unless copy_range is not supported at all, it is attempted again
+         * for later tasks, see BdrvCopyRangeFallback.
+         */
+        *method = copy_range_disabled ? COPY_READ_WRITE : COPY_RANGE_SMALL;
         /* Fall through to read+write with allocated buffer */
 
     case COPY_READ_WRITE_CLUSTER:
@@ -508,6 +540,8 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     BlockCopyState *s = t->s;
     bool error_is_read = false;
     BlockCopyMethod method = t->method;
+    BlockJobTuner *tuner = t->call_state->tuner;
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int ret;
 
     ret = block_copy_do_copy(s, t->offset, t->bytes, &method, &error_is_read);
@@ -517,6 +551,12 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
             s->method = method;
         }
 
+        /* Zeroes are written without moving data, they would skew it */
+        if (tuner && t->method != COPY_WRITE_ZEROES) {
+            block_job_tuner_done(tuner, t->bytes, start_ns,
+                                 qemu_clock_get_ns(QEMU_CLOCK_REALTIME), ret);
+        }
+
         if (ret < 0) {
             if (!t->call_state->ret) {
                 t->call_state->ret = ret;
@@ -726,6 +766,9 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         if (!aio && bytes) {
             aio = aio_task_pool_new(call_state->max_workers);
         }
+        if (aio && call_state->tuner) {
+            aio_task_pool_set_max_busy_tasks(aio, call_state->tuner->in_flight);
+        }
 
         ret = block_copy_task_run(aio, task);
         if (ret < 0) {
@@ -853,6 +896,7 @@ static void coroutine_fn block_copy_async_co_entry(void *opaque)
 BlockCopyCallState *block_copy_async(BlockCopyState *s,
                                      int64_t offset, int64_t bytes,
                                      int max_workers, int64_t max_chunk,
+                                     BlockJobTuner *tuner,
                                      BlockCopyAsyncCallbackFunc cb,
                                      void *cb_opaque)
 {
@@ -864,6 +908,7 @@ BlockCopyCallState *block_copy_async(BlockCopyState *s,
         .bytes = bytes,
         .max_workers = max_workers,
         .max_chunk = max_chunk,
+        .tuner = tuner,
         .cb = cb,
         .cb_opaque = cb_opaque,
 
@@ -938,6 +983,11 @@ void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip)
     qatomic_set(&s->skip_unallocated, skip);
 }
 
+uint64_t block_copy_offloaded_bytes(BlockCopyState *s)
+{
+    return stat64_get(&s->offloaded_bytes);
+}
+
 void block_copy_set_speed(BlockCopyState *s, uint64_t speed)
 {
     ratelimit_set_speed(&s->rate_limit, speed, BLOCK_COPY_SLICE_TIME);
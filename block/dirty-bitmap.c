@@ -79,6 +79,21 @@ void bdrv_dirty_bitmap_unlock(BdrvDirtyBitmap *bitmap)
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
 }
 
+/*
+ * Tell the driver that a persistent bitmap changed other than by a write.
+ * Called with BQL taken and without the dirty bitmap lock held.
+ */
+static void bdrv_dirty_bitmap_changed(BdrvDirtyBitmap *bitmap, bool grown)
+{
+    BlockDriverState *bs = bitmap->bs;
+
+    if (bitmap->persistent && bs->drv &&
+        bs->drv->bdrv_persistent_dirty_bitmap_changed)
+    {
+        bs->drv->bdrv_persistent_dirty_bitmap_changed(bs, bitmap, grown);
+    }
+}
+
 /* Called with BQL or dirty_bitmap lock taken.  */
 BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs, const char *name)
 {
@@ -288,6 +303,7 @@ BdrvDirtyBitmap *bdrv_dirty_bitmap_abdicate(BdrvDirtyBitmap *bitmap,
     bitmap->persistent = false;
     bitmap->busy = false;
     bdrv_release_dirty_bitmap(bitmap);
+    bdrv_dirty_bitmap_changed(successor, false);
 
     return successor;
 }
@@ -667,6 +683,7 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
         *out = backup;
     }
     bdrv_dirty_bitmaps_unlock(bitmap->bs);
+    bdrv_dirty_bitmap_changed(bitmap, false);
 }
 
 void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup)
@@ -675,6 +692,7 @@ void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup)
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
     bitmap->bitmap = backup;
     hbitmap_free(tmp);
+    bdrv_dirty_bitmap_changed(bitmap, true);
 }
 
 uint64_t bdrv_dirty_bitmap_serialization_size(const BdrvDirtyBitmap *bitmap,
@@ -884,7 +902,7 @@ bool bdrv_dirty_bitmap_next_dirty_area(BdrvDirtyBitmap *bitmap,
 void bdrv_merge_dirty_bitmap(BdrvDirtyBitmap *dest, const BdrvDirtyBitmap *src,
                              HBitmap **backup, Error **errp)
 {
-    bool ret;
+    bool ret = false;
 
     bdrv_dirty_bitmaps_lock(dest->bs);
     if (src->bs != dest->bs) {
@@ -912,6 +930,10 @@ out:
     if (src->bs != dest->bs) {
         bdrv_dirty_bitmaps_unlock(src->bs);
     }
+
+    if (ret) {
+        bdrv_dirty_bitmap_changed(dest, true);
+    }
 }
 
 /**
@@ -953,6 +975,7 @@ bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
         if (src->bs != dest->bs) {
             bdrv_dirty_bitmaps_unlock(src->bs);
         }
+        bdrv_dirty_bitmap_changed(dest, true);
     }
 
     return ret;
@@ -159,6 +159,7 @@ typedef struct BDRVRawState {
 #endif
     bool has_discard:1;
     bool has_write_zeroes:1;
+    bool has_clone:1;
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
@@ -719,6 +720,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->has_discard = true;
     s->has_write_zeroes = true;
+    s->has_clone = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0 && !dio_byte_aligned(s->fd)) {
         s->needs_alignment = true;
     }
@@ -1601,7 +1603,8 @@ out:
     }
 }
 
-#if defined(CONFIG_FALLOCATE) || defined(BLKZEROOUT) || defined(BLKDISCARD)
+#if defined(CONFIG_FALLOCATE) || defined(BLKZEROOUT) || defined(BLKDISCARD) || \
+    defined(FICLONERANGE)
 static int translate_err(int err)
 {
     if (err == -ENODEV || err == -ENOSYS || err == -EOPNOTSUPP ||
@@ -1770,6 +1773,50 @@ static off_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
 }
 #endif
 
+/*
+ * Try to share the source extents with the destination instead of copying
+ * them.  This only works within one filesystem that supports reflinks (e.g.
+ * XFS or btrfs), and only for ranges aligned to its block size.
+ */
+static int handle_aiocb_copy_range_clone(RawPosixAIOData *aiocb)
+{
+    int ret = -ENOTSUP;
+    BDRVRawState *s = aiocb->bs->opaque;
+
+    if (!s->has_clone) {
+        return -ENOTSUP;
+    }
+
+#ifdef FICLONERANGE
+    do {
+        struct file_clone_range range = {
+            .src_fd         = aiocb->aio_fildes,
+            .src_offset     = aiocb->aio_offset,
+            .src_length     = aiocb->aio_nbytes,
+            .dest_offset    = aiocb->copy_range.aio_offset2,
+        };
+
+        if (ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &range) == 0) {
+            ret = 0;
+        } else {
+            ret = -errno;
+        }
+    } while (ret == -EINTR);
+
+    trace_file_clone_range(aiocb->bs, aiocb->aio_fildes, aiocb->aio_offset,
+                           aiocb->copy_range.aio_fd2,
+                           aiocb->copy_range.aio_offset2, aiocb->aio_nbytes,
+                           ret);
+
+    ret = translate_err(ret);
+    if (ret == -ENOTSUP) {
+        s->has_clone = false;
+    }
+#endif
+
+    return ret;
+}
+
 static int handle_aiocb_copy_range(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -1777,6 +1824,14 @@ static int handle_aiocb_copy_range(void *opaque)
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
 
+    /*
+     * Other errors (unaligned range, source in another filesystem, ...) only
+     * concern this request, copy_file_range() may still work for it.
+     */
+    if (handle_aiocb_copy_range_clone(aiocb) == 0) {
+        return 0;
+    }
+
     while (bytes) {
         ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
                                       aiocb->copy_range.aio_fd2, &out_off,
@@ -3345,6 +3345,40 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                                    bytes, read_flags, write_flags);
 }
 
+/* Upper limit for the log2 of the requests skipped after failures */
+#define BDRV_COPY_RANGE_MAX_BACKOFF 10
+
+void bdrv_copy_range_fallback_init(BdrvCopyRangeFallback *f, bool enabled)
+{
+    *f = (BdrvCopyRangeFallback) {
+        .disabled = !enabled,
+    };
+}
+
+bool bdrv_copy_range_fallback_try(BdrvCopyRangeFallback *f)
+{
+    if (f->disabled) {
+        return false;
+    }
+    if (f->skip) {
+        f->skip--;
+        return false;
+    }
+    return true;
+}
+
+void bdrv_copy_range_fallback_done(BdrvCopyRangeFallback *f, int ret)
+{
+    if (ret >= 0) {
+        f->failures = 0;
+    } else if (ret == -ENOTSUP) {
+        f->disabled = true;
+    } else {
+        f->failures++;
+        f->skip = 1u << MIN(f->failures, BDRV_COPY_RANGE_MAX_BACKOFF);
+    }
+}
+
 static void bdrv_parent_cb_resize(BlockDriverState *bs)
 {
     BdrvChild *c;
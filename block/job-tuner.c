@@ -0,0 +1,139 @@
+/*
+ * Adaptive request sizing for block jobs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/job-tuner.h"
+#include "trace.h"
+
+/* Latency growth over the baseline that counts as congestion */
+#define BLOCK_JOB_TUNER_CONGESTION_FACTOR 2
+
+void block_job_tuner_init(BlockJobTuner *t,
+                          int64_t chunk, int64_t min_chunk, int64_t max_chunk,
+                          int in_flight, int min_in_flight, int max_in_flight)
+{
+    assert(min_chunk > 0 && min_chunk <= chunk && chunk <= max_chunk);
+    assert(min_in_flight > 0 && min_in_flight <= in_flight &&
+           in_flight <= max_in_flight);
+
+    *t = (BlockJobTuner) {
+        .min_chunk = min_chunk,
+        .max_chunk = max_chunk,
+        .min_in_flight = min_in_flight,
+        .max_in_flight = max_in_flight,
+        .chunk = chunk,
+        .in_flight = in_flight,
+    };
+}
+
+static void block_job_tuner_new_period(BlockJobTuner *t, int64_t now_ns)
+{
+    t->period_start_ns = now_ns;
+    t->period_bytes = 0;
+    t->period_ops = 0;
+    t->period_latency_ns = 0;
+}
+
+static void block_job_tuner_increase(BlockJobTuner *t)
+{
+    if (t->in_flight < t->max_in_flight) {
+        t->in_flight++;
+    } else if (t->chunk < t->max_chunk) {
+        t->chunk = MIN(t->chunk * 2, t->max_chunk);
+        /* Longer requests take longer, start over with the baseline */
+        t->base_latency_ns = 0;
+    } else {
+        return;
+    }
+    t->adjustments++;
+}
+
+static void block_job_tuner_decrease(BlockJobTuner *t)
+{
+    if (t->in_flight > t->min_in_flight) {
+        t->in_flight = MAX(t->in_flight / 2, t->min_in_flight);
+    } else if (t->chunk > t->min_chunk) {
+        t->chunk = MAX(t->chunk / 2, t->min_chunk);
+        t->base_latency_ns = 0;
+    } else {
+        return;
+    }
+    t->adjustments++;
+}
+
+void block_job_tuner_done(BlockJobTuner *t, int64_t bytes,
+                          int64_t start_ns, int64_t now_ns, int ret)
+{
+    int64_t elapsed_ns;
+    uint64_t throughput, latency_ns;
+
+    if (!t->period_start_ns) {
+        block_job_tuner_new_period(t, start_ns);
+    }
+
+    if (ret < 0) {
+        block_job_tuner_decrease(t);
+        trace_block_job_tuner_update(t, t->chunk, t->in_flight,
+                                     t->throughput, t->latency_ns);
+        block_job_tuner_new_period(t, now_ns);
+        return;
+    }
+
+    t->period_bytes += bytes;
+    t->period_ops++;
+    t->period_latency_ns += MAX(now_ns - start_ns, 0);
+
+    /*
+     * Wait for enough requests to fill the pipeline once, otherwise a
+     * slow or rate limited job would be tuned from a handful of samples.
+     */
+    elapsed_ns = now_ns - t->period_start_ns;
+    if (elapsed_ns < BLOCK_JOB_TUNER_PERIOD_NS ||
+        t->period_ops < t->in_flight) {
+        return;
+    }
+
+    throughput = muldiv64(t->period_bytes, NANOSECONDS_PER_SECOND,
+                          elapsed_ns);
+    latency_ns = t->period_latency_ns / t->period_ops;
+
+    if (!t->base_latency_ns || latency_ns < t->base_latency_ns) {
+        t->base_latency_ns = latency_ns;
+    }
+
+    if (latency_ns > BLOCK_JOB_TUNER_CONGESTION_FACTOR * t->base_latency_ns &&
+        throughput <= t->throughput + t->throughput / 10) {
+        block_job_tuner_decrease(t);
+    } else if (throughput >= t->throughput - t->throughput / 20) {
+        block_job_tuner_increase(t);
+    }
+
+    t->sampled = true;
+    t->throughput = throughput;
+    t->latency_ns = latency_ns;
+    trace_block_job_tuner_update(t, t->chunk, t->in_flight,
+                                 t->throughput, t->latency_ns);
+    block_job_tuner_new_period(t, now_ns);
+}
+
+BlockJobTuningInfo *block_job_tuner_info(BlockJobTuner *t)
+{
+    BlockJobTuningInfo *info;
+
+    if (!t->sampled) {
+        return NULL;
+    }
+
+    info = g_new0(BlockJobTuningInfo, 1);
+    info->chunk_size = t->chunk;
+    info->max_in_flight = t->in_flight;
+    info->throughput = t->throughput;
+    info->latency_ns = t->latency_ns;
+    info->adjustments = t->adjustments;
+
+    return info;
+}
@@ -18,6 +18,7 @@
 #include "trace.h"
 #include "block/blockjob_int.h"
 #include "block/block_int.h"
+#include "block/job-tuner.h"
 #include "sysemu/block-backend.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
@@ -27,6 +28,8 @@
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
+/* Upper limit for the tuner, which starts from MAX_IN_FLIGHT */
+#define MAX_IN_FLIGHT_TUNED (4 * MAX_IN_FLIGHT)
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -76,6 +79,12 @@ typedef struct MirrorBlockJob {
     int in_flight;
     int64_t bytes_in_flight;
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
+    /* Length and number of the background copy operations */
+    BlockJobTuner tuner;
+    /* When to let the storage copy the data of background copy operations */
+    bool use_copy_range;
+    BdrvCopyRangeFallback copy_range;
+    uint64_t offloaded_bytes;
     int ret;
     bool unmap;
     int target_cluster_size;
@@ -105,6 +114,8 @@ struct MirrorOp {
     bool is_pseudo_op;
     bool is_active_write;
     bool is_in_flight;
+    /* Set by mirror_co_read() when the copy is started */
+    int64_t copy_start_ns;
     CoQueue waiting_requests;
     Coroutine *co;
     MirrorOp *waiting_for_op;
@@ -187,6 +198,11 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 
     trace_mirror_iteration_done(s, op->offset, op->bytes, ret);
 
+    if (op->copy_start_ns) {
+        block_job_tuner_done(&s->tuner, op->bytes, op->copy_start_ns,
+                             qemu_clock_get_ns(QEMU_CLOCK_REALTIME), ret);
+    }
+
     s->in_flight--;
     s->bytes_in_flight -= op->bytes;
     iov = op->qiov.iov;
@@ -325,6 +341,44 @@ mirror_wait_for_free_in_flight_slot(MirrorBlockJob *s)
     mirror_wait_for_any_operation(s, false);
 }
 
+/*
+ * Try to have the storage copy the data of @op, without reading and writing
+ * it.  Returns false if @op has to be read and written instead, otherwise
+ * @op has been completed.
+ */
+static bool coroutine_fn mirror_co_copy_range(MirrorOp *op)
+{
+    MirrorBlockJob *s = op->s;
+    int ret;
+
+    if (!bdrv_copy_range_fallback_try(&s->copy_range)) {
+        return false;
+    }
+
+    s->in_flight++;
+    s->bytes_in_flight += op->bytes;
+    op->is_in_flight = true;
+    op->copy_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    trace_mirror_one_iteration(s, op->offset, op->bytes);
+
+    ret = bdrv_co_copy_range(s->mirror_top_bs->backing, op->offset,
+                             blk_root(s->target), op->offset, op->bytes,
+                             0, 0);
+    bdrv_copy_range_fallback_done(&s->copy_range, ret);
+    if (ret < 0) {
+        trace_mirror_copy_range_fail(s, op->offset, ret);
+        s->in_flight--;
+        s->bytes_in_flight -= op->bytes;
+        op->is_in_flight = false;
+        op->copy_start_ns = 0;
+        return false;
+    }
+
+    s->offloaded_bytes += op->bytes;
+    mirror_iteration_done(op, 0);
+    return true;
+}
+
 /* Perform a mirror copy operation.
  *
  * *op->bytes_handled is set to the number of bytes copied after and
@@ -361,6 +415,11 @@ static void coroutine_fn mirror_co_read(void *opaque)
     assert(QEMU_IS_ALIGNED(op->offset, s->granularity));
     /* The range is sector-aligned, since bdrv_getlength() rounds up. */
     assert(QEMU_IS_ALIGNED(op->bytes, BDRV_SECTOR_SIZE));
+
+    if (mirror_co_copy_range(op)) {
+        return;
+    }
+
     nb_chunks = DIV_ROUND_UP(op->bytes, s->granularity);
 
     while (s->buf_free_count < nb_chunks) {
@@ -385,6 +444,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     s->in_flight++;
     s->bytes_in_flight += op->bytes;
     op->is_in_flight = true;
+    op->copy_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
     ret = bdrv_co_preadv(s->mirror_top_bs->backing, op->offset, op->bytes,
@@ -476,7 +536,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int64_t max_io_bytes = s->tuner.chunk;
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -573,7 +633,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->tuner.in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -897,6 +957,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     bool need_drain = true;
     int64_t length;
     int64_t target_length;
+    int64_t chunk;
     BlockDriverInfo bdi;
     char backing_filename[2]; /* we only need 2 characters because we are only
                                  checking for a NULL string */
@@ -975,6 +1036,17 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     mirror_free_init(s);
 
+    /*
+     * Start from the static defaults.  Copies may grow up to a quarter of
+     * the buffer, so that a few of them still fit in it at the same time.
+     */
+    chunk = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    block_job_tuner_init(&s->tuner, chunk, MIN(s->granularity, chunk),
+                         MAX(chunk, QEMU_ALIGN_DOWN(s->buf_size / 4,
+                                                    s->granularity)),
+                         MAX_IN_FLIGHT, 1, MAX_IN_FLIGHT_TUNED);
+    bdrv_copy_range_fallback_init(&s->copy_range, s->use_copy_range);
+
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     if (!s->is_none_mode) {
         ret = mirror_dirty_init(s);
@@ -1016,7 +1088,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->tuner.in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1190,6 +1262,18 @@ static bool mirror_drained_poll(BlockJob *job)
     return !!s->in_flight;
 }
 
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+
+    info->tuning = block_job_tuner_info(&s->tuner);
+    info->has_tuning = info->tuning != NULL;
+    if (s->use_copy_range) {
+        info->has_offloaded = true;
+        info->offloaded = s->offloaded_bytes;
+    }
+}
+
 static void mirror_cancel(Job *job, bool force)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common.job);
@@ -1214,6 +1298,7 @@ static const BlockJobDriver mirror_job_driver = {
         .cancel                 = mirror_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1229,6 +1314,7 @@ static const BlockJobDriver commit_active_job_driver = {
         .complete               = mirror_complete,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static void coroutine_fn
@@ -1590,7 +1676,7 @@ static BlockJob *mirror_start_job(
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
-                             Error **errp)
+                             bool use_copy_range, Error **errp)
 {
     MirrorBlockJob *s;
     MirrorBDSOpaque *bs_opaque;
@@ -1744,6 +1830,7 @@ static BlockJob *mirror_start_job(
     s->backing_mode = backing_mode;
     s->zero_target = zero_target;
     s->copy_mode = copy_mode;
+    s->use_copy_range = use_copy_range;
     s->base = base;
     s->base_overlay = bdrv_find_overlay(bs, base);
     s->granularity = granularity;
@@ -1860,7 +1947,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, bool use_copy_range,
+                  Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -1877,7 +1965,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, copy_mode, errp);
+                     filter_node_name, true, copy_mode, use_copy_range,
+                     errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -1904,7 +1993,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
                      filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
-                     errp);
+                     false, errp);
     if (!job) {
         goto error_restore_flags;
     }
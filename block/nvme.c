@@ -45,6 +45,9 @@ typedef struct BDRVNVMeState BDRVNVMeState;
 #define INDEX_ADMIN     0
 #define INDEX_IO(n)     (1 + n)
 
+/* Upper limit for the num-queues option */
+#define NVME_MAX_IO_QUEUES 64
+
 /* This driver shares a single MSIX IRQ for the admin and I/O queues */
 enum {
     MSIX_SHARED_IRQ_IDX = 0,
@@ -62,6 +65,7 @@ typedef struct {
 typedef struct {
     BlockCompletionFunc *cb;
     void *opaque;
+    uint32_t *result; /* receives DW0 of the completion if not NULL */
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
@@ -106,6 +110,8 @@ struct BDRVNVMeState {
      */
     NVMeQueuePair **queues;
     unsigned queue_count;
+    /* Next I/O queue to submit a request to, accessed in the AioContext */
+    unsigned next_io_queue;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -140,6 +146,7 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_NUM_QUEUES "num-queues"
 
 static void nvme_process_completion_bh(void *opaque);
 
@@ -157,6 +164,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_NUM_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of I/O queue pairs to spread requests over",
+        },
         { /* end of list */ }
     },
 };
@@ -412,8 +424,12 @@ static bool nvme_process_completion(NVMeQueuePair *q)
         req = *preq;
         assert(req.cid == cid);
         assert(req.cb);
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         nvme_put_free_req_locked(q, preq);
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
         q->inflight--;
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, ret);
@@ -490,7 +506,9 @@ static void nvme_admin_cmd_sync_cb(void *opaque, int ret)
     aio_wait_kick();
 }
 
-static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+/* If @result is not NULL, it receives DW0 of the completion on success */
+static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd,
+                               uint32_t *result)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q = s->queues[INDEX_ADMIN];
@@ -501,6 +519,7 @@ static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
     nvme_submit_command(q, req, cmd, nvme_admin_cmd_sync_cb, &ret);
 
     AIO_WAIT_WHILE(aio_context, ret == -EINPROGRESS);
@@ -539,7 +558,7 @@ static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 
     memset(id, 0, id_size);
     cmd.dptr.prp1 = cpu_to_le64(iova);
-    if (nvme_admin_cmd_sync(bs, &cmd)) {
+    if (nvme_admin_cmd_sync(bs, &cmd, NULL)) {
         error_setg(errp, "Failed to identify controller");
         goto out;
     }
@@ -562,7 +581,7 @@ static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
     memset(id, 0, id_size);
     cmd.cdw10 = 0;
     cmd.nsid = cpu_to_le32(namespace);
-    if (nvme_admin_cmd_sync(bs, &cmd)) {
+    if (nvme_admin_cmd_sync(bs, &cmd, NULL)) {
         error_setg(errp, "Failed to identify namespace");
         goto out;
     }
@@ -668,7 +687,7 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
         .cdw11 = cpu_to_le32(NVME_CQ_IEN | NVME_CQ_PC),
     };
-    if (nvme_admin_cmd_sync(bs, &cmd)) {
+    if (nvme_admin_cmd_sync(bs, &cmd, NULL)) {
         error_setg(errp, "Failed to create CQ io queue [%u]", n);
         goto out_error;
     }
@@ -678,19 +697,73 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
         .cdw11 = cpu_to_le32(NVME_SQ_PC | (n << 16)),
     };
-    if (nvme_admin_cmd_sync(bs, &cmd)) {
+    if (nvme_admin_cmd_sync(bs, &cmd, NULL)) {
         error_setg(errp, "Failed to create SQ io queue [%u]", n);
-        goto out_error;
+        goto out_delete_cq;
     }
     s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
     s->queues[n] = q;
     s->queue_count++;
     return true;
+out_delete_cq:
+    /* The controller must not keep using the memory of the CQ freed below */
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_DELETE_CQ,
+        .cdw10 = cpu_to_le32(n),
+    };
+    if (nvme_admin_cmd_sync(bs, &cmd, NULL)) {
+        warn_report("NVMe: Failed to delete CQ io queue [%u]", n);
+    }
 out_error:
     nvme_free_queue_pair(q);
     return false;
 }
 
+/*
+ * Ask the controller for @count I/O queue pairs and return how many to
+ * create, no more than the controller allocated.  Controllers that don't
+ * implement the feature get a single one.
+ */
+static unsigned nvme_request_io_queues(BlockDriverState *bs, unsigned count)
+{
+    BDRVNVMeState *s = bs->opaque;
+    unsigned max_queues = NVME_DOORBELL_SIZE /
+                          (sizeof(*s->doorbells) * s->doorbell_scale);
+    NvmeCmd cmd;
+    uint32_t result;
+    unsigned nsqa, ncqa;
+
+    /* The doorbells of all queues, including the admin queue, must fit
+     * into the mapped area */
+    count = MIN(count, MAX(max_queues, 2) - 1);
+    if (count == 1) {
+        return count;
+    }
+
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((count - 1) << 16) | (count - 1)),
+    };
+    if (nvme_admin_cmd_sync(bs, &cmd, &result)) {
+        return 1;
+    }
+
+    /* Both counts in the completion are zero-based */
+    nsqa = result & 0xffff;
+    ncqa = result >> 16;
+    return MIN(count, MIN(nsqa, ncqa) + 1);
+}
+
+/* Pick the I/O queue for the next request, round robin */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    unsigned nb_io_queues = s->queue_count - INDEX_IO(0);
+
+    assert(nb_io_queues > 0);
+    return s->queues[INDEX_IO(s->next_io_queue++ % nb_io_queues)];
+}
+
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
@@ -701,7 +774,7 @@ static bool nvme_poll_cb(void *opaque)
 }
 
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     unsigned num_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q;
@@ -712,6 +785,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     uint64_t timeout_ms;
     uint64_t deadline, now;
     volatile NvmeBar *regs = NULL;
+    unsigned i;
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
@@ -840,8 +914,21 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
-        ret = -EIO;
+    num_queues = nvme_request_io_queues(bs, num_queues);
+    for (i = 0; i < num_queues; i++) {
+        Error *local_err = NULL;
+
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            if (i == 0) {
+                error_propagate(errp, local_err);
+                ret = -EIO;
+                goto out;
+            }
+            /* The controller may grant fewer queues than requested */
+            warn_reportf_err(local_err, "Using %u of %u NVMe I/O queues: ",
+                             i, num_queues);
+            break;
+        }
     }
 out:
     if (regs) {
@@ -900,7 +987,7 @@ static int nvme_enable_disable_write_cache(BlockDriverState *bs, bool enable,
         .cdw11 = cpu_to_le32(enable ? 0x01 : 0x00),
     };
 
-    ret = nvme_admin_cmd_sync(bs, &cmd);
+    ret = nvme_admin_cmd_sync(bs, &cmd, NULL);
     if (ret) {
         error_setg(errp, "Failed to configure NVMe write cache");
     }
@@ -932,6 +1019,7 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    uint64_t num_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -947,7 +1035,14 @@ static int nvme_file_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    num_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NUM_QUEUES, 1);
+    if (num_queues < 1 || num_queues > NVME_MAX_IO_QUEUES) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_NUM_QUEUES "' must be between 1 "
+                   "and %d", NVME_MAX_IO_QUEUES);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, num_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -1141,7 +1236,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1259,7 +1354,7 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
@@ -1290,7 +1385,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
@@ -1343,7 +1438,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
@@ -1525,9 +1620,6 @@ static void nvme_register_buf(BlockDriverState *bs, void *host, size_t size)
 
     ret = qemu_vfio_dma_map(s->vfio, host, size, false, NULL);
     if (ret) {
-        /* FIXME: we may run out of IOVA addresses after repeated
-         * bdrv_register_buf/bdrv_unregister_buf, because nvme_vfio_dma_unmap
-         * doesn't reclaim addresses for fixed mappings. */
         error_report("nvme_register_buf failed: %s", strerror(-ret));
     }
 }
@@ -450,6 +450,11 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->rd_merged = stats->merged[BLOCK_ACCT_READ];
     ds->wr_merged = stats->merged[BLOCK_ACCT_WRITE];
     ds->unmap_merged = stats->merged[BLOCK_ACCT_UNMAP];
+    ds->submit_batches = stats->submit_batches;
+    ds->submit_batched_requests = stats->submit_batch_reqs;
+    ds->completion_batches = stats->complete_batches;
+    ds->completion_batched_requests = stats->complete_batch_reqs;
+    ds->completion_delay_total_ns = stats->complete_delay_ns;
     ds->flush_operations = stats->nr_ops[BLOCK_ACCT_FLUSH];
     ds->wr_total_time_ns = stats->total_time_ns[BLOCK_ACCT_WRITE];
     ds->rd_total_time_ns = stats->total_time_ns[BLOCK_ACCT_READ];
@@ -27,9 +27,12 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qemu/bitmap.h"
 #include "qemu/cutils.h"
+#include "qemu/error-report.h"
 
 #include "qcow2.h"
+#include "trace.h"
 
 /* NOTICE: BME here means Bitmaps Extension and used as a namespace for
  * _internal_ constants. Please do not use this _internal_ abbreviation for
@@ -89,6 +92,7 @@ typedef struct Qcow2Bitmap {
     char *name;
 
     BdrvDirtyBitmap *dirty_bitmap;
+    bool in_place; /* bitmap table in the image is up to date */
 
     QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
 } Qcow2Bitmap;
@@ -937,6 +941,784 @@ fail:
     return ret;
 }
 
+/*
+ * Bitmap journal
+ *
+ * With a bitmap-sync-interval, bitmaps loaded for writing are not marked
+ * in_use in the image.  Instead, their bitmap tables are kept a superset of
+ * the bitmaps in RAM, so that they stay usable if QEMU does not get to store
+ * them on close:
+ *
+ * - Before a write reaches a region whose bitmap table entry is not known to
+ *   cover it, the entry is set to all ones in the image ("armed").
+ * - Periodically and on close, armed entries and entries that changed other
+ *   than through writes are replaced by the bitmap data.  Bitmap data
+ *   clusters are never overwritten: the data goes to new clusters, then the
+ *   table entries are switched over and the old clusters are freed.
+ *
+ * Entries that are written to while they are synced keep all ones until the
+ * next sync, because such writes may not have set their bits yet.
+ */
+
+/* Maximum number of bitmap table entries synced at once */
+#define BITMAP_SYNC_BATCH 64
+
+typedef struct Qcow2JournaledBitmap {
+    char *name;
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint64_t *table;        /* copy of the bitmap table in the image */
+    uint64_t coverage;      /* bytes of the disk per bitmap table entry */
+
+    unsigned long *armed;   /* entries set to all ones ahead of writes */
+    unsigned long *stale;   /* entries changed other than by writes */
+    unsigned long *touched; /* entries written to during the current sync */
+
+    QSIMPLEQ_ENTRY(Qcow2JournaledBitmap) entry;
+} Qcow2JournaledBitmap;
+
+struct Qcow2BitmapJournal {
+    QSIMPLEQ_HEAD(, Qcow2JournaledBitmap) bitmaps;
+
+    /* Protects the bitmap tables and the armed bitmaps */
+    CoMutex lock;
+    /* Serializes syncs, taken before @lock */
+    CoMutex sync_lock;
+
+    bool syncing;   /* writes are recorded in the touched bitmaps */
+    bool stopped;   /* journaling failed, bitmaps are back to in_use */
+    QEMUTimer *timer;
+};
+
+typedef struct Qcow2BitmapSyncEntry {
+    Qcow2JournaledBitmap *jb;
+    uint32_t index;
+    uint64_t new_entry;
+    uint8_t *buf;   /* data for a new cluster, or NULL */
+} Qcow2BitmapSyncEntry;
+
+static Qcow2JournaledBitmap *bitmap_journal_find(Qcow2BitmapJournal *jnl,
+                                                 const char *name)
+{
+    Qcow2JournaledBitmap *jb;
+
+    QSIMPLEQ_FOREACH(jb, &jnl->bitmaps, entry) {
+        if (strcmp(name, jb->name) == 0) {
+            return jb;
+        }
+    }
+
+    return NULL;
+}
+
+static void bitmap_journal_free_bitmap(Qcow2JournaledBitmap *jb)
+{
+    g_free(jb->name);
+    g_free(jb->table);
+    g_free(jb->armed);
+    g_free(jb->stale);
+    g_free(jb->touched);
+    g_free(jb);
+}
+
+/* Whether the bitmap table in the image matches the bitmap in RAM */
+static bool bitmap_journal_clean(Qcow2JournaledBitmap *jb)
+{
+    return bitmap_empty(jb->armed, jb->table_size) &&
+           bitmap_empty(jb->stale, jb->table_size);
+}
+
+/* Find the bitmap table entries covering a range of the disk */
+static bool bitmap_journal_range(Qcow2JournaledBitmap *jb,
+                                 uint64_t offset, uint64_t bytes,
+                                 uint64_t *first, uint64_t *last)
+{
+    *first = offset / jb->coverage;
+    *last = MIN((offset + bytes - 1) / jb->coverage, jb->table_size - 1);
+
+    return *first < jb->table_size;
+}
+
+static uint64_t bitmap_journal_next_pending(Qcow2JournaledBitmap *jb,
+                                            uint64_t start)
+{
+    return MIN(find_next_bit(jb->armed, jb->table_size, start),
+               find_next_bit(jb->stale, jb->table_size, start));
+}
+
+static void bitmap_journal_timer_mod(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+
+    if (jnl->timer) {
+        timer_mod(jnl->timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  (int64_t) s->bitmap_sync_interval * 1000);
+    }
+}
+
+/*
+ * Mark all journaled bitmaps in_use in the image and stop journaling.
+ * Journaling only stops if the bitmaps could be marked.
+ * Called with jnl->sync_lock held.
+ */
+static int coroutine_fn bitmap_journal_stop_locked(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    int ret;
+
+    if (jnl->stopped) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&jnl->lock);
+    qemu_co_mutex_lock(&s->lock);
+
+    bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
+                               s->bitmap_directory_size, NULL);
+    if (bm_list == NULL) {
+        ret = -EIO;
+        goto out;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        if (bitmap_journal_find(jnl, bm->name)) {
+            bm->flags |= BME_FLAG_IN_USE;
+        }
+    }
+
+    ret = update_ext_header_and_dir_in_place(bs, bm_list);
+    bitmap_list_free(bm_list);
+
+out:
+    qemu_co_mutex_unlock(&s->lock);
+
+    /*
+     * As long as the bitmaps are not marked in_use, writes must keep arming
+     * their table entries, or a crash would leave bitmaps that look valid
+     * but miss writes.  Journaling goes on and the next sync or stop tries
+     * again.
+     */
+    if (ret == 0) {
+        jnl->stopped = true;
+    }
+    qemu_co_mutex_unlock(&jnl->lock);
+
+    trace_qcow2_bitmap_journal_stop(bs, ret);
+    if (ret < 0) {
+        error_report("Failed to mark persistent bitmaps of '%s' in use: %s",
+                     bdrv_get_device_or_node_name(bs), strerror(-ret));
+    }
+
+    return ret;
+}
+
+int coroutine_fn qcow2_co_bitmap_journal_stop(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    int ret;
+
+    if (!jnl) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&jnl->sync_lock);
+    ret = bitmap_journal_stop_locked(bs);
+    qemu_co_mutex_unlock(&jnl->sync_lock);
+
+    return ret;
+}
+
+/* Called with jnl->lock held */
+static int coroutine_fn bitmap_journal_arm(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    Qcow2JournaledBitmap *jb;
+    uint64_t ones = cpu_to_be64(BME_TABLE_ENTRY_FLAG_ALL_ONES);
+    uint64_t first, last, i;
+    bool written = false;
+    int ret;
+
+    if (jnl->stopped) {
+        return 0;
+    }
+
+    QSIMPLEQ_FOREACH(jb, &jnl->bitmaps, entry) {
+        if (!bitmap_journal_range(jb, offset, bytes, &first, &last)) {
+            continue;
+        }
+
+        for (i = find_next_zero_bit(jb->armed, last + 1, first); i <= last;
+             i = find_next_zero_bit(jb->armed, last + 1, i + 1))
+        {
+            if (jb->table[i] == BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+                continue;
+            }
+
+            trace_qcow2_bitmap_journal_arm(bs, jb->name, i);
+            ret = bdrv_co_pwrite(bs->file,
+                                 jb->table_offset + i * BME_TABLE_ENTRY_SIZE,
+                                 BME_TABLE_ENTRY_SIZE, &ones, 0);
+            if (ret < 0) {
+                return ret;
+            }
+            written = true;
+        }
+    }
+
+    if (written) {
+        ret = bdrv_co_flush(bs->file->bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    QSIMPLEQ_FOREACH(jb, &jnl->bitmaps, entry) {
+        if (!bitmap_journal_range(jb, offset, bytes, &first, &last)) {
+            continue;
+        }
+
+        for (i = find_next_zero_bit(jb->armed, last + 1, first); i <= last;
+             i = find_next_zero_bit(jb->armed, last + 1, i + 1))
+        {
+            uint64_t addr = jb->table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (addr) {
+                qcow2_free_clusters(bs, addr, s->cluster_size,
+                                    QCOW2_DISCARD_ALWAYS);
+            }
+            jb->table[i] = BME_TABLE_ENTRY_FLAG_ALL_ONES;
+            set_bit(i, jb->armed);
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return 0;
+}
+
+/*
+ * Make sure that the bitmap tables in the image cover a write request before
+ * it is issued.  This is cheap unless the request reaches a region of the
+ * disk that was not written to since the last sync.
+ */
+int coroutine_fn qcow2_co_bitmap_journal_prepare_write(BlockDriverState *bs,
+                                                       int64_t offset,
+                                                       int64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    Qcow2JournaledBitmap *jb;
+    uint64_t first, last;
+    bool need_arm = false;
+    int ret;
+
+    if (!jnl || jnl->stopped || bytes <= 0) {
+        return 0;
+    }
+
+    QSIMPLEQ_FOREACH(jb, &jnl->bitmaps, entry) {
+        if (!bitmap_journal_range(jb, offset, bytes, &first, &last)) {
+            continue;
+        }
+
+        if (jnl->syncing) {
+            bitmap_set(jb->touched, first, last - first + 1);
+        }
+        if (find_next_zero_bit(jb->armed, last + 1, first) <= last) {
+            need_arm = true;
+        }
+    }
+
+    if (!need_arm) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&jnl->lock);
+    ret = bitmap_journal_arm(bs, offset, bytes);
+    qemu_co_mutex_unlock(&jnl->lock);
+
+    return ret;
+}
+
+/* Returns the bitmap to sync @jb from, or NULL if it can't be synced now */
+static BdrvDirtyBitmap *bitmap_journal_get_bitmap(BlockDriverState *bs,
+                                                  Qcow2JournaledBitmap *jb)
+{
+    BdrvDirtyBitmap *bitmap = bdrv_find_dirty_bitmap(bs, jb->name);
+
+    /*
+     * While a bitmap has a successor, new writes only go to the successor.
+     * Keep the entries armed until the two are merged again or the
+     * successor takes over.
+     */
+    if (!bitmap || bdrv_dirty_bitmap_has_successor(bitmap) ||
+        bdrv_dirty_bitmap_inconsistent(bitmap))
+    {
+        return NULL;
+    }
+
+    return bitmap;
+}
+
+static void bitmap_journal_snapshot_entry(BlockDriverState *bs,
+                                          Qcow2JournaledBitmap *jb,
+                                          BdrvDirtyBitmap *bitmap,
+                                          Qcow2BitmapSyncEntry *e)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t offset = e->index * jb->coverage;
+    uint64_t count = MIN(bm_size - offset, jb->coverage);
+    uint64_t write_size;
+
+    if (bdrv_dirty_bitmap_next_dirty(bitmap, offset, count) < 0) {
+        e->new_entry = 0;
+    } else if (count == jb->coverage &&
+               bdrv_dirty_bitmap_next_zero(bitmap, offset, count) < 0)
+    {
+        e->new_entry = BME_TABLE_ENTRY_FLAG_ALL_ONES;
+    } else {
+        write_size = bdrv_dirty_bitmap_serialization_size(bitmap, offset,
+                                                          count);
+        assert(write_size <= s->cluster_size);
+
+        e->buf = g_malloc(s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, e->buf, offset, count);
+        memset(e->buf + write_size, 0, s->cluster_size - write_size);
+    }
+}
+
+/*
+ * Take the data of up to BITMAP_SYNC_BATCH pending entries, starting at
+ * entry *@index of *@pjb, and advance the position.  Nothing yields between
+ * taking the data and recording the writes that are in flight, so any write
+ * that is not accounted for in the data is recorded in jb->touched.
+ */
+static int coroutine_fn bitmap_journal_snapshot(BlockDriverState *bs,
+                                                Qcow2JournaledBitmap **pjb,
+                                                uint64_t *index,
+                                                Qcow2BitmapSyncEntry *batch)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    Qcow2JournaledBitmap *jb = *pjb;
+    BdrvTrackedRequest *req;
+    uint64_t i = *index;
+    int n = 0, k;
+
+    qemu_co_mutex_lock(&bs->reqs_lock);
+
+    jnl->syncing = true;
+    while (jb && n < BITMAP_SYNC_BATCH) {
+        BdrvDirtyBitmap *bitmap = bitmap_journal_get_bitmap(bs, jb);
+
+        if (bitmap) {
+            bitmap_zero(jb->touched, jb->table_size);
+            while (n < BITMAP_SYNC_BATCH &&
+                   (i = bitmap_journal_next_pending(jb, i)) < jb->table_size)
+            {
+                batch[n] = (Qcow2BitmapSyncEntry) { .jb = jb, .index = i };
+                bitmap_journal_snapshot_entry(bs, jb, bitmap, &batch[n]);
+                clear_bit(i, jb->stale);
+                n++;
+                i++;
+            }
+            if (n == BITMAP_SYNC_BATCH) {
+                break;
+            }
+        }
+
+        jb = QSIMPLEQ_NEXT(jb, entry);
+        i = 0;
+    }
+
+    QLIST_FOREACH(req, &bs->tracked_requests, list) {
+        if (req->type == BDRV_TRACKED_READ) {
+            continue;
+        }
+
+        for (k = 0; k < n; k++) {
+            uint64_t first, last;
+
+            if (bitmap_journal_range(batch[k].jb, req->offset,
+                                     MAX(req->bytes, 1), &first, &last) &&
+                first <= batch[k].index && batch[k].index <= last)
+            {
+                set_bit(batch[k].index, batch[k].jb->touched);
+            }
+        }
+    }
+
+    qemu_co_mutex_unlock(&bs->reqs_lock);
+
+    *pjb = jb;
+    *index = i;
+    return n;
+}
+
+static int coroutine_fn bitmap_journal_commit(BlockDriverState *bs,
+                                              Qcow2BitmapSyncEntry *batch,
+                                              int n)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    uint64_t old_entries[BITMAP_SYNC_BATCH];
+    int64_t off;
+    int ret, k;
+
+    /* Write the bitmap data to new clusters */
+    for (k = 0; k < n; k++) {
+        Qcow2BitmapSyncEntry *e = &batch[k];
+
+        if (!e->buf) {
+            continue;
+        }
+
+        qemu_co_mutex_lock(&s->lock);
+        off = qcow2_alloc_clusters(bs, s->cluster_size);
+        ret = off < 0 ? off :
+              qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size,
+                                            false);
+        qemu_co_mutex_unlock(&s->lock);
+        if (ret < 0) {
+            goto fail_data;
+        }
+
+        e->new_entry = off;
+        ret = bdrv_co_pwrite(bs->file, off, s->cluster_size, e->buf, 0);
+        if (ret < 0) {
+            goto fail_data;
+        }
+    }
+
+    /* The new clusters must be allocated in the image before they are used */
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_write_caches(bs);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto fail_data;
+    }
+
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret < 0) {
+        goto fail_data;
+    }
+
+    qemu_co_mutex_lock(&jnl->lock);
+
+    /*
+     * Writes from now on arm the entries again before they are issued, so
+     * only entries written to since the snapshot need to keep all ones.
+     */
+    jnl->syncing = false;
+    for (k = 0; k < n; k++) {
+        Qcow2BitmapSyncEntry *e = &batch[k];
+        Qcow2JournaledBitmap *jb = e->jb;
+
+        old_entries[k] = jb->table[e->index];
+        if (test_bit(e->index, jb->touched)) {
+            jb->table[e->index] = BME_TABLE_ENTRY_FLAG_ALL_ONES;
+            set_bit(e->index, jb->armed);
+        } else {
+            jb->table[e->index] = e->new_entry;
+            clear_bit(e->index, jb->armed);
+        }
+    }
+
+    for (k = 0; k < n; k++) {
+        Qcow2JournaledBitmap *jb = batch[k].jb;
+        uint64_t entry = cpu_to_be64(jb->table[batch[k].index]);
+
+        if (jb->table[batch[k].index] == old_entries[k]) {
+            continue;
+        }
+
+        ret = bdrv_co_pwrite(bs->file, jb->table_offset +
+                             batch[k].index * BME_TABLE_ENTRY_SIZE,
+                             BME_TABLE_ENTRY_SIZE, &entry, 0);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Free the clusters that are not referenced any more */
+    qemu_co_mutex_lock(&s->lock);
+    for (k = 0; k < n; k++) {
+        uint64_t entry = batch[k].jb->table[batch[k].index];
+        uint64_t old_addr = old_entries[k] & BME_TABLE_ENTRY_OFFSET_MASK;
+        uint64_t new_addr = batch[k].new_entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (old_addr && old_entries[k] != entry) {
+            qcow2_free_clusters(bs, old_addr, s->cluster_size,
+                                QCOW2_DISCARD_ALWAYS);
+        }
+        if (new_addr && batch[k].new_entry != entry) {
+            qcow2_free_clusters(bs, new_addr, s->cluster_size,
+                                QCOW2_DISCARD_ALWAYS);
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+out:
+    if (ret < 0) {
+        /*
+         * The image may have either the old or the new entries.  Forget
+         * both, so that the entries are armed again before the next write
+         * and rewritten by the next sync.  Their clusters are leaked.
+         */
+        for (k = 0; k < n; k++) {
+            Qcow2JournaledBitmap *jb = batch[k].jb;
+
+            jb->table[batch[k].index] = 0;
+            clear_bit(batch[k].index, jb->armed);
+            set_bit(batch[k].index, jb->stale);
+        }
+    }
+    qemu_co_mutex_unlock(&jnl->lock);
+    return ret;
+
+fail_data:
+    /* No entry was switched over yet, just sync them again next time */
+    qemu_co_mutex_lock(&jnl->lock);
+    for (k = 0; k < n; k++) {
+        set_bit(batch[k].index, batch[k].jb->stale);
+    }
+    qemu_co_mutex_unlock(&jnl->lock);
+    return ret;
+}
+
+/* Called with jnl->sync_lock held */
+static int coroutine_fn bitmap_journal_sync_locked(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    Qcow2BitmapSyncEntry batch[BITMAP_SYNC_BATCH];
+    Qcow2JournaledBitmap *jb = QSIMPLEQ_FIRST(&jnl->bitmaps);
+    uint64_t index = 0;
+    int total = 0;
+    int ret = 0;
+    int n, k;
+
+    while (jb) {
+        n = bitmap_journal_snapshot(bs, &jb, &index, batch);
+        if (n == 0) {
+            break;
+        }
+
+        ret = bitmap_journal_commit(bs, batch, n);
+        for (k = 0; k < n; k++) {
+            g_free(batch[k].buf);
+        }
+        if (ret < 0) {
+            break;
+        }
+        total += n;
+    }
+    jnl->syncing = false;
+
+    trace_qcow2_bitmap_journal_sync(bs, total, ret);
+    return ret;
+}
+
+static int coroutine_fn bitmap_journal_co_sync(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&jnl->sync_lock);
+    if (!jnl->stopped) {
+        ret = bitmap_journal_sync_locked(bs);
+        if (ret < 0) {
+            error_report("Failed to update persistent bitmaps of '%s': %s",
+                         bdrv_get_device_or_node_name(bs), strerror(-ret));
+            bitmap_journal_stop_locked(bs);
+        }
+    }
+    qemu_co_mutex_unlock(&jnl->sync_lock);
+
+    return ret;
+}
+
+typedef struct Qcow2BitmapSyncCo {
+    BlockDriverState *bs;
+    int ret;
+} Qcow2BitmapSyncCo;
+
+static void coroutine_fn bitmap_journal_sync_entry(void *opaque)
+{
+    Qcow2BitmapSyncCo *sco = opaque;
+
+    sco->ret = bitmap_journal_co_sync(sco->bs);
+    aio_wait_kick();
+}
+
+static int bitmap_journal_sync(BlockDriverState *bs)
+{
+    Qcow2BitmapSyncCo sco = {
+        .bs = bs,
+        .ret = -EINPROGRESS,
+    };
+
+    if (qemu_in_coroutine()) {
+        return bitmap_journal_co_sync(bs);
+    }
+
+    bdrv_coroutine_enter(bs, qemu_coroutine_create(bitmap_journal_sync_entry,
+                                                   &sco));
+    BDRV_POLL_WHILE(bs, sco.ret == -EINPROGRESS);
+
+    return sco.ret;
+}
+
+static void coroutine_fn bitmap_journal_timer_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+
+    bitmap_journal_co_sync(bs);
+    bitmap_journal_timer_mod(bs);
+    bdrv_dec_in_flight(bs);
+}
+
+static void bitmap_journal_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+
+    /* Don't start I/O in drained sections, try again later */
+    if (qatomic_read(&bs->quiesce_counter) > 0) {
+        bitmap_journal_timer_mod(bs);
+        return;
+    }
+
+    /* Counted as in flight, so that draining waits for the sync */
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs),
+                 qemu_coroutine_create(bitmap_journal_timer_entry, bs));
+}
+
+void qcow2_bitmap_journal_timer_init(BlockDriverState *bs, AioContext *context)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+
+    if (jnl && s->bitmap_sync_interval > 0) {
+        jnl->timer = aio_timer_new_with_attrs(context, QEMU_CLOCK_REALTIME,
+                                              SCALE_MS,
+                                              QEMU_TIMER_ATTR_EXTERNAL,
+                                              bitmap_journal_timer_cb, bs);
+        bitmap_journal_timer_mod(bs);
+    }
+}
+
+void qcow2_bitmap_journal_timer_del(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+
+    if (jnl && jnl->timer) {
+        timer_free(jnl->timer);
+        jnl->timer = NULL;
+    }
+}
+
+void qcow2_bitmap_journal_free(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    Qcow2JournaledBitmap *jb, *next;
+
+    if (!jnl) {
+        return;
+    }
+
+    qcow2_bitmap_journal_timer_del(bs);
+    QSIMPLEQ_FOREACH_SAFE(jb, &jnl->bitmaps, entry, next) {
+        bitmap_journal_free_bitmap(jb);
+    }
+    g_free(jnl);
+    s->bitmap_journal = NULL;
+}
+
+/* Start journaling @bm instead of marking it in_use */
+static int bitmap_journal_add(BlockDriverState *bs, Qcow2Bitmap *bm,
+                              BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    Qcow2JournaledBitmap *jb;
+    uint64_t *table;
+    int ret;
+
+    ret = bitmap_table_load(bs, &bm->table, &table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    jb = g_new0(Qcow2JournaledBitmap, 1);
+    jb->name = g_strdup(bm->name);
+    jb->table_offset = bm->table.offset;
+    jb->table_size = bm->table.size;
+    jb->table = table;
+    jb->coverage = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size,
+                                                            bitmap);
+    jb->armed = bitmap_new(jb->table_size);
+    jb->stale = bitmap_new(jb->table_size);
+    jb->touched = bitmap_new(jb->table_size);
+
+    if (!jnl) {
+        jnl = g_new0(Qcow2BitmapJournal, 1);
+        QSIMPLEQ_INIT(&jnl->bitmaps);
+        qemu_co_mutex_init(&jnl->lock);
+        qemu_co_mutex_init(&jnl->sync_lock);
+        s->bitmap_journal = jnl;
+        qcow2_bitmap_journal_timer_init(bs, bdrv_get_aio_context(bs));
+    }
+    QSIMPLEQ_INSERT_TAIL(&jnl->bitmaps, jb, entry);
+
+    return 0;
+}
+
+/*
+ * A journaled bitmap was changed other than by a write to the node.  Its
+ * whole table is synced on the next occasion; if bits were set, that must
+ * happen right away.
+ */
+void qcow2_persistent_dirty_bitmap_changed(BlockDriverState *bs,
+                                           BdrvDirtyBitmap *bitmap,
+                                           bool grown)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    const char *name = bdrv_dirty_bitmap_name(bitmap);
+    Qcow2JournaledBitmap *jb;
+
+    if (!jnl || jnl->stopped || !name) {
+        return;
+    }
+
+    jb = bitmap_journal_find(jnl, name);
+    if (!jb) {
+        return;
+    }
+
+    bitmap_set(jb->stale, 0, jb->table_size);
+    if (grown) {
+        bitmap_journal_sync(bs);
+    }
+}
+
 /* for g_slist_foreach for GSList of BdrvDirtyBitmap* elements */
 static void release_dirty_bitmap_helper(gpointer bitmap,
                                         gpointer bs)
@@ -1007,6 +1789,10 @@ bool qcow2_load_dirty_bitmaps(BlockDriverState *bs, bool *header_updated,
         bdrv_dirty_bitmap_set_persistence(bitmap, true);
         if (bm->flags & BME_FLAG_IN_USE) {
             bdrv_dirty_bitmap_set_inconsistent(bitmap);
+        } else if (s->bitmap_sync_interval > 0 && can_write(bs) &&
+                   bitmap_journal_add(bs, bm, bitmap) == 0)
+        {
+            /* The bitmap table is kept up to date, no need for in_use */
         } else {
             /* NB: updated flags only get written if can_write(bs) is true. */
             bm->flags |= BME_FLAG_IN_USE;
@@ -1042,6 +1828,7 @@ bool qcow2_load_dirty_bitmaps(BlockDriverState *bs, bool *header_updated,
     return true;
 
 fail:
+    qcow2_bitmap_journal_free(bs);
     g_slist_foreach(created_dirty_bitmaps, release_dirty_bitmap_helper, bs);
     g_slist_free(created_dirty_bitmaps);
     bitmap_list_free(bm_list);
@@ -1128,6 +1915,7 @@ int qcow2_reopen_bitmaps_rw(BlockDriverState *bs, Error **errp)
     GSList *ro_dirty_bitmaps = NULL;
     int ret = -EINVAL;
     bool need_header_update = false;
+    bool had_journal = s->bitmap_journal != NULL;
 
     if (s->nb_bitmaps == 0) {
         /* No bitmaps - nothing to do */
@@ -1150,6 +1938,12 @@ int qcow2_reopen_bitmaps_rw(BlockDriverState *bs, Error **errp)
         }
 
         if (!(bm->flags & BME_FLAG_IN_USE)) {
+            if (s->bitmap_journal &&
+                bitmap_journal_find(s->bitmap_journal, bm->name))
+            {
+                /* Already journaled, reopening RW -> RW */
+                continue;
+            }
             if (!bdrv_dirty_bitmap_readonly(bitmap)) {
                 error_setg(errp, "Corruption: bitmap '%s' is not marked IN_USE "
                            "in the image '%s' and not marked readonly in RAM",
@@ -1163,8 +1957,12 @@ int qcow2_reopen_bitmaps_rw(BlockDriverState *bs, Error **errp)
                 goto out;
             }
 
-            bm->flags |= BME_FLAG_IN_USE;
-            need_header_update = true;
+            if (s->bitmap_sync_interval == 0 ||
+                bitmap_journal_add(bs, bm, bitmap) < 0)
+            {
+                bm->flags |= BME_FLAG_IN_USE;
+                need_header_update = true;
+            }
         } else {
             /*
              * What if flags already has BME_FLAG_IN_USE ?
@@ -1193,13 +1991,15 @@ int qcow2_reopen_bitmaps_rw(BlockDriverState *bs, Error **errp)
         }
     }
 
-    if (need_header_update) {
+    if (need_header_update || (s->bitmap_journal && !had_journal)) {
         if (!can_write(bs->file->bs) || !(bs->file->perm & BLK_PERM_WRITE)) {
             error_setg(errp, "Failed to reopen bitmaps rw: no write access "
                        "the protocol file");
             goto out;
         }
+    }
 
+    if (need_header_update) {
         /* in_use flags must be updated */
         ret = update_ext_header_and_dir_in_place(bs, bm_list);
         if (ret < 0) {
@@ -1212,6 +2012,9 @@ int qcow2_reopen_bitmaps_rw(BlockDriverState *bs, Error **errp)
     ret = 0;
 
 out:
+    if (ret < 0 && !had_journal) {
+        qcow2_bitmap_journal_free(bs);
+    }
     g_slist_free(ro_dirty_bitmaps);
     bitmap_list_free(bm_list);
 
@@ -1449,6 +2252,8 @@ int coroutine_fn qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs,
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
+    Qcow2JournaledBitmap *jb;
     Qcow2Bitmap *bm = NULL;
     Qcow2BitmapList *bm_list;
 
@@ -1460,6 +2265,11 @@ int coroutine_fn qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs,
         return 0;
     }
 
+    if (jnl) {
+        /* The journal must not touch the bitmap table while it is freed */
+        qemu_co_mutex_lock(&jnl->sync_lock);
+        qemu_co_mutex_lock(&jnl->lock);
+    }
     qemu_co_mutex_lock(&s->lock);
 
     bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
@@ -1486,8 +2296,18 @@ int coroutine_fn qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs,
 
     free_bitmap_clusters(bs, &bm->table);
 
+    jb = jnl ? bitmap_journal_find(jnl, name) : NULL;
+    if (jb) {
+        QSIMPLEQ_REMOVE(&jnl->bitmaps, jb, Qcow2JournaledBitmap, entry);
+        bitmap_journal_free_bitmap(jb);
+    }
+
 out:
     qemu_co_mutex_unlock(&s->lock);
+    if (jnl) {
+        qemu_co_mutex_unlock(&jnl->lock);
+        qemu_co_mutex_unlock(&jnl->sync_lock);
+    }
 
     bitmap_free(bm);
     bitmap_list_free(bm_list);
@@ -1532,16 +2352,28 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
     Qcow2Bitmap *bm;
     QSIMPLEQ_HEAD(, Qcow2BitmapTable) drop_tables;
     Qcow2BitmapTable *tb, *tb_next;
+    Qcow2BitmapJournal *jnl = s->bitmap_journal;
     bool need_write = false;
 
     QSIMPLEQ_INIT(&drop_tables);
 
+    if (jnl) {
+        /*
+         * Bring the journaled bitmap tables up to date, so that only the
+         * bitmap directory needs to be written.  If this fails, journaling
+         * is stopped and the bitmaps are stored from scratch below.
+         */
+        qcow2_bitmap_journal_timer_del(bs);
+        bitmap_journal_sync(bs);
+    }
+
     if (s->nb_bitmaps == 0) {
         bm_list = bitmap_list_new();
     } else {
         bm_list = bitmap_list_load(bs, s->bitmap_directory_offset,
                                    s->bitmap_directory_size, errp);
         if (bm_list == NULL) {
+            qcow2_bitmap_journal_timer_init(bs, bdrv_get_aio_context(bs));
             return false;
         }
     }
@@ -1595,20 +2427,40 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
             QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
         } else {
             if (!(bm->flags & BME_FLAG_IN_USE)) {
-                error_setg(errp, "Bitmap '%s' already exists in the image",
-                           name);
-                goto fail;
+                Qcow2JournaledBitmap *jb =
+                    jnl ? bitmap_journal_find(jnl, name) : NULL;
+
+                if (!jb) {
+                    error_setg(errp, "Bitmap '%s' already exists in the image",
+                               name);
+                    goto fail;
+                }
+                bm->in_place = !jnl->stopped && bitmap_journal_clean(jb);
+            }
+            if (!bm->in_place) {
+                tb = g_memdup(&bm->table, sizeof(bm->table));
+                bm->table.offset = 0;
+                bm->table.size = 0;
+                QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
             }
-            tb = g_memdup(&bm->table, sizeof(bm->table));
-            bm->table.offset = 0;
-            bm->table.size = 0;
-            QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
         }
         bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
         bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
         bm->dirty_bitmap = bitmap;
     }
 
+    if (jnl) {
+        QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+            if (!bm->dirty_bitmap && !(bm->flags & BME_FLAG_IN_USE) &&
+                bitmap_journal_find(jnl, bm->name))
+            {
+                /* Not stored (e.g. migrated instead), so it's outdated */
+                bm->flags |= BME_FLAG_IN_USE;
+                need_write = true;
+            }
+        }
+    }
+
     if (!need_write) {
         goto success;
     }
@@ -1622,7 +2474,9 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
     QSIMPLEQ_FOREACH(bm, bm_list, entry) {
         BdrvDirtyBitmap *bitmap = bm->dirty_bitmap;
 
-        if (bitmap == NULL || bdrv_dirty_bitmap_readonly(bitmap)) {
+        if (bitmap == NULL || bdrv_dirty_bitmap_readonly(bitmap) ||
+            bm->in_place)
+        {
             continue;
         }
 
@@ -1646,6 +2500,8 @@ bool qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs,
     }
 
 success:
+    qcow2_bitmap_journal_free(bs);
+
     if (release_stored) {
         QSIMPLEQ_FOREACH(bm, bm_list, entry) {
             if (bm->dirty_bitmap == NULL) {
@@ -1662,7 +2518,7 @@ success:
 fail:
     QSIMPLEQ_FOREACH(bm, bm_list, entry) {
         if (bm->dirty_bitmap == NULL || bm->table.offset == 0 ||
-            bdrv_dirty_bitmap_readonly(bm->dirty_bitmap))
+            bdrv_dirty_bitmap_readonly(bm->dirty_bitmap) || bm->in_place)
         {
             continue;
         }
@@ -1674,6 +2530,9 @@ fail:
         g_free(tb);
     }
 
+    /* Journaled bitmap tables are still valid, keep them up to date */
+    qcow2_bitmap_journal_timer_init(bs, bdrv_get_aio_context(bs));
+
     bitmap_list_free(bm_list);
     return false;
 }
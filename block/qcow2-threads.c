@@ -43,9 +43,11 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
     int ret;
     BDRVQcow2State *s = bs->opaque;
     ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    /* s->crypto only has ciphers for QCOW2_MAX_THREADS threads */
+    int max_threads = s->crypto ? QCOW2_MAX_THREADS : s->compression_threads;
 
     qemu_co_mutex_lock(&s->lock);
-    while (s->nb_threads >= QCOW2_MAX_THREADS) {
+    while (s->nb_threads >= max_threads) {
         qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
     }
     s->nb_threads++;
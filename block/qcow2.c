@@ -697,6 +697,8 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_BITMAP_SYNC_INTERVAL,
+    QCOW2_OPT_COMPRESSION_THREADS,
     NULL
 };
 
@@ -808,6 +810,19 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_BITMAP_SYNC_INTERVAL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Journal persistent bitmaps instead of marking them in "
+                    "use, and sync them to the image at this interval "
+                    "(in seconds)",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSION_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of threads compressing or decompressing "
+                    "clusters in parallel",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -861,12 +876,14 @@ static void cache_clean_timer_del(BlockDriverState *bs)
 static void qcow2_detach_aio_context(BlockDriverState *bs)
 {
     cache_clean_timer_del(bs);
+    qcow2_bitmap_journal_timer_del(bs);
 }
 
 static void qcow2_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
     cache_clean_timer_init(bs, new_context);
+    qcow2_bitmap_journal_timer_init(bs, new_context);
 }
 
 static bool read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
@@ -969,6 +986,8 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t bitmap_sync_interval;
+    uint64_t compression_threads;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1070,6 +1089,27 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Interval for syncing journaled persistent bitmaps, 0 disables them */
+    r->bitmap_sync_interval =
+        qemu_opt_get_number(opts, QCOW2_OPT_BITMAP_SYNC_INTERVAL, 0);
+    if (r->bitmap_sync_interval > UINT_MAX) {
+        error_setg(errp, "Bitmap sync interval too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->compression_threads =
+        qemu_opt_get_number(opts, QCOW2_OPT_COMPRESSION_THREADS,
+                            QCOW2_MAX_THREADS);
+    if (r->compression_threads < 1 ||
+        r->compression_threads > QCOW2_MAX_COMPRESSION_THREADS)
+    {
+        error_setg(errp, "Number of compression threads must be between 1 "
+                   "and %d", QCOW2_MAX_COMPRESSION_THREADS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1225,6 +1265,18 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    /*
+     * Only affects how often journaled bitmaps are synced; whether bitmaps
+     * are journaled is decided when they are loaded for writing.
+     */
+    if (s->bitmap_sync_interval != r->bitmap_sync_interval) {
+        qcow2_bitmap_journal_timer_del(bs);
+        s->bitmap_sync_interval = r->bitmap_sync_interval;
+        qcow2_bitmap_journal_timer_init(bs, bdrv_get_aio_context(bs));
+    }
+
+    s->compression_threads = r->compression_threads;
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1850,6 +1902,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
     cache_clean_timer_del(bs);
+    qcow2_bitmap_journal_free(bs);
     if (s->l2_table_cache) {
         qcow2_cache_destroy(s->l2_table_cache);
     }
@@ -2609,6 +2662,11 @@ static coroutine_fn int qcow2_co_pwritev_part(
 
     trace_qcow2_writev_start_req(qemu_coroutine_self(), offset, bytes);
 
+    ret = qcow2_co_bitmap_journal_prepare_write(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
 
         l2meta = NULL;
@@ -2724,6 +2782,7 @@ static void qcow2_close(BlockDriverState *bs)
     }
 
     cache_clean_timer_del(bs);
+    qcow2_bitmap_journal_free(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
 
@@ -3954,6 +4013,11 @@ static coroutine_fn int qcow2_co_pwrite_zeroes(BlockDriverState *bs,
         tail = 0;
     }
 
+    ret = qcow2_co_bitmap_journal_prepare_write(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (head || tail) {
         uint64_t off;
         unsigned int nr;
@@ -4016,6 +4080,11 @@ static coroutine_fn int qcow2_co_pdiscard(BlockDriverState *bs,
         }
     }
 
+    ret = qcow2_co_bitmap_journal_prepare_write(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_cluster_discard(bs, offset, bytes, QCOW2_DISCARD_REQUEST,
                                 false);
@@ -4121,6 +4190,11 @@ qcow2_co_copy_range_to(BlockDriverState *bs,
 
     assert(!bs->encrypted);
 
+    ret = qcow2_co_bitmap_journal_prepare_write(bs, dst_offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
     qemu_co_mutex_lock(&s->lock);
 
     while (bytes != 0) {
@@ -4198,6 +4272,13 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
         return -EINVAL;
     }
 
+    /* Journaled bitmap tables can't be resized, mark the bitmaps in_use */
+    ret = qcow2_co_bitmap_journal_stop(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update persistent bitmaps");
+        return ret;
+    }
+
     qemu_co_mutex_lock(&s->lock);
 
     /*
@@ -4663,11 +4744,18 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         return -EINVAL;
     }
 
+    ret = qcow2_co_bitmap_journal_prepare_write(bs, offset, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
     while (bytes && aio_task_pool_status(aio) == 0) {
         uint64_t chunk_size = MIN(bytes, s->cluster_size);
 
         if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+            /* Keep all compression threads busy */
+            aio = aio_task_pool_new(MAX(QCOW2_MAX_WORKERS,
+                                        s->compression_threads));
         }
 
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
@@ -5118,6 +5206,7 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
     bdi->is_dirty = s->incompatible_features & QCOW2_INCOMPAT_DIRTY;
+    bdi->parallel_compressed_writes = !has_data_file(bs);
     return 0;
 }
 
@@ -5993,6 +6082,8 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_co_can_store_new_dirty_bitmap = qcow2_co_can_store_new_dirty_bitmap,
     .bdrv_co_remove_persistent_dirty_bitmap =
             qcow2_co_remove_persistent_dirty_bitmap,
+    .bdrv_persistent_dirty_bitmap_changed =
+            qcow2_persistent_dirty_bitmap_changed,
 };
 
 static void bdrv_qcow2_init(void)
@@ -150,6 +150,8 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_BITMAP_SYNC_INTERVAL "bitmap-sync-interval"
+#define QCOW2_OPT_COMPRESSION_THREADS "compression-threads"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -230,6 +232,7 @@ typedef struct QCowSnapshot {
 
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2BitmapJournal Qcow2BitmapJournal;
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
@@ -323,6 +326,8 @@ typedef struct Qcow2BitmapHeaderExt {
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
 #define QCOW2_MAX_THREADS 4
+/* Upper limit for the compression-threads option */
+#define QCOW2_MAX_COMPRESSION_THREADS 64
 
 typedef struct BDRVQcow2State {
     int cluster_bits;
@@ -348,6 +353,10 @@ typedef struct BDRVQcow2State {
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
+    /* Journal of the persistent bitmaps not marked in_use, see qcow2-bitmap.c */
+    Qcow2BitmapJournal *bitmap_journal;
+    unsigned bitmap_sync_interval;
+
     QLIST_HEAD(, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
@@ -408,6 +417,7 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int compression_threads;
 
     BdrvChild *data_file;
 
@@ -995,6 +1005,17 @@ int qcow2_co_remove_persistent_dirty_bitmap(BlockDriverState *bs,
                                             const char *name,
                                             Error **errp);
 bool qcow2_supports_persistent_dirty_bitmap(BlockDriverState *bs);
+void qcow2_persistent_dirty_bitmap_changed(BlockDriverState *bs,
+                                           BdrvDirtyBitmap *bitmap,
+                                           bool grown);
+int coroutine_fn qcow2_co_bitmap_journal_prepare_write(BlockDriverState *bs,
+                                                       int64_t offset,
+                                                       int64_t bytes);
+int coroutine_fn qcow2_co_bitmap_journal_stop(BlockDriverState *bs);
+void qcow2_bitmap_journal_timer_init(BlockDriverState *bs,
+                                     AioContext *context);
+void qcow2_bitmap_journal_timer_del(BlockDriverState *bs);
+void qcow2_bitmap_journal_free(BlockDriverState *bs);
 uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
                                                 uint32_t cluster_size);
 
@@ -23,6 +23,8 @@
 #include "ebpf/rss.bpf.skeleton.h"
 #include "trace.h"
 
+QEMU_BUILD_BUG_ON(EBPF_RSS_MAX_INDIRECTIONS_LEN < VIRTIO_NET_RSS_MAX_TABLE_LEN);
+
 void ebpf_rss_init(struct EBPFRSSContext *ctx)
 {
     if (ctx != NULL) {
@@ -65,6 +67,8 @@ bool ebpf_rss_load(struct EBPFRSSContext *ctx)
             rss_bpf_ctx->maps.tap_rss_map_indirection_table);
     ctx->map_toeplitz_key = bpf_map__fd(
             rss_bpf_ctx->maps.tap_rss_map_toeplitz_key);
+    /* Array maps start zeroed */
+    memset(ctx->indirections_table, 0, sizeof(ctx->indirections_table));
 
     return true;
 error:
@@ -89,11 +93,16 @@ static bool ebpf_rss_set_config(struct EBPFRSSContext *ctx,
     return true;
 }
 
+/*
+ * Only entries that differ from what the map holds are written, so
+ * rebalancing a few queues costs a few syscalls rather than one per entry.
+ */
 static bool ebpf_rss_set_indirections_table(struct EBPFRSSContext *ctx,
                                             uint16_t *indirections_table,
                                             size_t len)
 {
     uint32_t i = 0;
+    uint32_t updated = 0;
 
     if (!ebpf_rss_is_loaded(ctx) || indirections_table == NULL ||
        len > VIRTIO_NET_RSS_MAX_TABLE_LEN) {
@@ -101,11 +110,17 @@ static bool ebpf_rss_set_indirections_table(struct EBPFRSSContext *ctx,
     }
 
     for (; i < len; ++i) {
+        if (ctx->indirections_table[i] == indirections_table[i]) {
+            continue;
+        }
         if (bpf_map_update_elem(ctx->map_indirections_table, &i,
                                 indirections_table + i, 0) < 0) {
             return false;
         }
+        ctx->indirections_table[i] = indirections_table[i];
+        updated++;
     }
+    trace_ebpf_rss_set_indirections_table(len, updated);
     return true;
 }
 
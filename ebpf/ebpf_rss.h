@@ -14,12 +14,16 @@
 #ifndef QEMU_EBPF_RSS_H
 #define QEMU_EBPF_RSS_H
 
+#define EBPF_RSS_MAX_INDIRECTIONS_LEN 128
+
 struct EBPFRSSContext {
     void *obj;
     int program_fd;
     int map_configuration;
     int map_toeplitz_key;
     int map_indirections_table;
+    /* What the indirection table map currently holds */
+    uint16_t indirections_table[EBPF_RSS_MAX_INDIRECTIONS_LEN];
 };
 
 struct EBPFRSSConfig {
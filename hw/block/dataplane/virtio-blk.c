@@ -32,9 +32,21 @@ struct VirtIOBlockDataPlane {
 
     VirtIOBlkConf *conf;
     VirtIODevice *vdev;
-    QEMUBH *bh;                     /* bh for guest notification */
-    unsigned long *batch_notify_vqs;
-    bool batch_notifications;
+    QEMUBH *bh;                     /* bh for batched submission/completion */
+    QEMUTimer *notify_timer;        /* guest notification coalescing */
+
+    /* Requests from all kicked virtqueues, submitted together by the bh */
+    bool plugged;
+    MultiReqBuffer mrb;
+
+    /* Per-virtqueue completions not yet flushed to the used ring */
+    unsigned long *flush_vqs;
+    unsigned int *flush_count;
+
+    /* Per-virtqueue completions the guest has not been notified of */
+    unsigned long *notify_vqs;
+    unsigned int *notify_count;
+    int64_t *notify_since_ns;
 
     /* Note that these EventNotifiers are assigned by value.  This is
      * fine as long as you do not call event_notifier_cleanup on them
@@ -45,39 +57,116 @@ struct VirtIOBlockDataPlane {
     AioContext *ctx;
 };
 
-/* Raise an interrupt to signal guest, if necessary */
-void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
+/*
+ * Put a completed request on the used ring.  The ring is only flushed, and
+ * the guest notified, by the bh so that completions that arrive in the same
+ * event loop iteration are published together.
+ */
+void virtio_blk_data_plane_push(VirtIOBlockDataPlane *s, VirtQueue *vq,
+                                VirtQueueElement *elem, unsigned int len)
 {
-    if (s->batch_notifications) {
-        set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
-        qemu_bh_schedule(s->bh);
-    } else {
-        virtio_notify_irqfd(s->vdev, vq);
-    }
+    unsigned i = virtio_get_queue_index(vq);
+
+    virtqueue_fill(vq, elem, len, s->flush_count[i]++);
+    set_bit(i, s->flush_vqs);
+    qemu_bh_schedule(s->bh);
 }
 
-static void notify_guest_bh(void *opaque)
+static void virtio_blk_data_plane_notify_vq(VirtIOBlockDataPlane *s,
+                                            unsigned i, int64_t now)
+{
+    VirtQueue *vq = virtio_get_queue(s->vdev, i);
+    int64_t delay_ns = now - s->notify_since_ns[i];
+
+    trace_virtio_blk_data_plane_notify(s, i, s->notify_count[i], delay_ns);
+    block_acct_complete_batch(blk_get_stats(s->conf->conf.blk),
+                              s->notify_count[i], delay_ns);
+    s->notify_count[i] = 0;
+    clear_bit(i, s->notify_vqs);
+
+    virtio_notify_irqfd(s->vdev, vq);
+}
+
+/* Raise the interrupts that were held back by coalescing */
+static void virtio_blk_data_plane_notify_timer(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
     unsigned nvqs = s->conf->num_queues;
-    unsigned long bitmap[BITS_TO_LONGS(nvqs)];
-    unsigned j;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    unsigned i;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
+    for (i = find_first_bit(s->notify_vqs, nvqs); i < nvqs;
+         i = find_next_bit(s->notify_vqs, nvqs, i + 1)) {
+        virtio_blk_data_plane_notify_vq(s, i, now);
+    }
+}
 
-    for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j / BITS_PER_LONG];
+/*
+ * Flush the used rings and raise an interrupt for each virtqueue that got
+ * completions, unless coalescing is enabled.  In that case the interrupt
+ * is raised once notify-coalesce-frames completions are pending or when
+ * the oldest of them has waited for notify-coalesce-usecs.
+ */
+static void virtio_blk_data_plane_flush(VirtIOBlockDataPlane *s)
+{
+    unsigned nvqs = s->conf->num_queues;
+    uint32_t usecs = s->conf->notify_coalesce_usecs;
+    uint32_t frames = s->conf->notify_coalesce_frames;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    bool arm_timer = false;
+    unsigned i;
+
+    for (i = find_first_bit(s->flush_vqs, nvqs); i < nvqs;
+         i = find_next_bit(s->flush_vqs, nvqs, i + 1)) {
+        VirtQueue *vq = virtio_get_queue(s->vdev, i);
+
+        virtqueue_flush(vq, s->flush_count[i]);
+        if (!s->notify_count[i]) {
+            s->notify_since_ns[i] = now;
+        }
+        s->notify_count[i] += s->flush_count[i];
+        s->flush_count[i] = 0;
+        clear_bit(i, s->flush_vqs);
+
+        if (!usecs || (frames && s->notify_count[i] >= frames)) {
+            virtio_blk_data_plane_notify_vq(s, i, now);
+        } else {
+            trace_virtio_blk_data_plane_coalesce(s, i, s->notify_count[i]);
+            set_bit(i, s->notify_vqs);
+            arm_timer = true;
+        }
+    }
 
-        while (bits != 0) {
-            unsigned i = j + ctzl(bits);
-            VirtQueue *vq = virtio_get_queue(s->vdev, i);
+    if (arm_timer && !timer_pending(s->notify_timer)) {
+        timer_mod(s->notify_timer, now + (int64_t)usecs * SCALE_US);
+    }
+}
 
-            virtio_notify_irqfd(s->vdev, vq);
+/* Submit the requests gathered since the first virtqueue was kicked */
+static void virtio_blk_data_plane_unplug(VirtIOBlockDataPlane *s)
+{
+    BlockBackend *blk = s->conf->conf.blk;
 
-            bits &= bits - 1; /* clear right-most bit */
+    aio_context_acquire(s->ctx);
+    if (s->plugged) {
+        if (s->mrb.num_reqs) {
+            virtio_blk_submit_multireq(blk, &s->mrb);
         }
+        blk_io_unplug(blk);
+        s->plugged = false;
     }
+    aio_context_release(s->ctx);
+}
+
+static void virtio_blk_data_plane_batch_bh(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    virtio_blk_data_plane_unplug(s);
+
+    aio_context_acquire(s->ctx);
+    virtio_blk_data_plane_flush(s);
+    aio_context_release(s->ctx);
 }
 
 /* Context: QEMU global mutex held */
@@ -127,8 +216,14 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     } else {
         s->ctx = qemu_get_aio_context();
     }
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
-    s->batch_notify_vqs = bitmap_new(conf->num_queues);
+    s->bh = aio_bh_new(s->ctx, virtio_blk_data_plane_batch_bh, s);
+    s->notify_timer = aio_timer_new(s->ctx, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                    virtio_blk_data_plane_notify_timer, s);
+    s->flush_vqs = bitmap_new(conf->num_queues);
+    s->flush_count = g_new0(unsigned int, conf->num_queues);
+    s->notify_vqs = bitmap_new(conf->num_queues);
+    s->notify_count = g_new0(unsigned int, conf->num_queues);
+    s->notify_since_ns = g_new0(int64_t, conf->num_queues);
 
     *dataplane = s;
 
@@ -146,7 +241,12 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
-    g_free(s->batch_notify_vqs);
+    g_free(s->notify_since_ns);
+    g_free(s->notify_count);
+    g_free(s->notify_vqs);
+    g_free(s->flush_count);
+    g_free(s->flush_vqs);
+    timer_free(s->notify_timer);
     qemu_bh_delete(s->bh);
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
@@ -157,12 +257,26 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
                                                 VirtQueue *vq)
 {
-    VirtIOBlock *s = (VirtIOBlock *)vdev;
+    VirtIOBlock *vblk = (VirtIOBlock *)vdev;
+    VirtIOBlockDataPlane *s = vblk->dataplane;
+
+    assert(s);
+    assert(vblk->dataplane_started);
 
-    assert(s->dataplane);
-    assert(s->dataplane_started);
+    /*
+     * Stay plugged until the bh runs, so that the requests of all
+     * virtqueues kicked in this event loop iteration are merged and
+     * submitted together.
+     */
+    aio_context_acquire(s->ctx);
+    if (!s->plugged) {
+        blk_io_plug(s->conf->conf.blk);
+        s->plugged = true;
+        qemu_bh_schedule(s->bh);
+    }
+    aio_context_release(s->ctx);
 
-    return virtio_blk_handle_vq(s, vq);
+    return virtio_blk_handle_vq(vblk, vq, &s->mrb);
 }
 
 /* Context: QEMU global mutex held */
@@ -184,12 +298,6 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
     s->starting = true;
 
-    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        s->batch_notifications = true;
-    } else {
-        s->batch_notifications = false;
-    }
-
     /* Set up guest notifier (irq) */
     r = k->set_guest_notifiers(qbus->parent, nvqs, true);
     if (r != 0) {
@@ -304,6 +412,22 @@ static void virtio_blk_data_plane_stop_bh(void *opaque)
 
         virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
     }
+
+    virtio_blk_data_plane_unplug(s);
+}
+
+/* Publish the remaining completions to the guest.
+ *
+ * Context: BH in IOThread
+ */
+static void virtio_blk_data_plane_flush_bh(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+
+    qemu_bh_cancel(s->bh);
+    virtio_blk_data_plane_batch_bh(s);
+    timer_del(s->notify_timer);
+    virtio_blk_data_plane_notify_timer(s);
 }
 
 /* Context: QEMU global mutex held */
@@ -336,6 +460,9 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
      * keep the BlockBackend in the iothread, that's ok */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context(), NULL);
 
+    /* Final chance to notify guest */
+    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_flush_bh, s);
+
     aio_context_release(s->ctx);
 
     /*
@@ -358,9 +485,6 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
         virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
     }
 
-    qemu_bh_cancel(s->bh);
-    notify_guest_bh(s); /* final chance to notify guest */
-
     /* Clean up guest notifier (irq) */
     k->set_guest_notifiers(qbus->parent, nvqs, false);
 
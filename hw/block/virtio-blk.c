@@ -82,10 +82,11 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
     stb_p(&req->in->status, status);
     iov_discard_undo(&req->inhdr_undo);
     iov_discard_undo(&req->outhdr_undo);
-    virtqueue_push(req->vq, &req->elem, req->in_len);
     if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane, req->vq);
+        virtio_blk_data_plane_push(s->dataplane, req->vq, &req->elem,
+                                   req->in_len);
     } else {
+        virtqueue_push(req->vq, &req->elem, req->in_len);
         virtio_notify(vdev, req->vq);
     }
 }
@@ -446,7 +447,7 @@ static int multireq_compare(const void *a, const void *b)
     }
 }
 
-static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
+void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
 {
     int i = 0, start = 0, num_reqs = 0, niov = 0, nb_sectors = 0;
     uint32_t max_transfer;
@@ -767,13 +768,21 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     return 0;
 }
 
-bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
+/*
+ * Requests are gathered in @mrb, which the caller then has to submit.  If
+ * @mrb is NULL they are submitted before returning.
+ */
+bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq, MultiReqBuffer *mrb)
 {
     VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {};
+    MultiReqBuffer local_mrb = {};
     bool suppress_notifications = virtio_queue_get_notification(vq);
     bool progress = false;
 
+    if (!mrb) {
+        mrb = &local_mrb;
+    }
+
     aio_context_acquire(blk_get_aio_context(s->blk));
     blk_io_plug(s->blk);
 
@@ -784,7 +793,7 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 
         while ((req = virtio_blk_get_request(s, vq))) {
             progress = true;
-            if (virtio_blk_handle_request(req, &mrb)) {
+            if (virtio_blk_handle_request(req, mrb)) {
                 virtqueue_detach_element(req->vq, &req->elem, 0);
                 virtio_blk_free_request(req);
                 break;
@@ -796,8 +805,8 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
         }
     } while (!virtio_queue_empty(vq));
 
-    if (mrb.num_reqs) {
-        virtio_blk_submit_multireq(s->blk, &mrb);
+    if (local_mrb.num_reqs) {
+        virtio_blk_submit_multireq(s->blk, &local_mrb);
     }
 
     blk_io_unplug(s->blk);
@@ -807,7 +816,7 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 
 static void virtio_blk_handle_output_do(VirtIOBlock *s, VirtQueue *vq)
 {
-    virtio_blk_handle_vq(s, vq);
+    virtio_blk_handle_vq(s, vq, NULL);
 }
 
 static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
@@ -1177,6 +1186,11 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
                    conf->queue_size, VIRTQUEUE_MAX_SIZE);
         return;
     }
+    if (conf->notify_coalesce_frames && !conf->notify_coalesce_usecs) {
+        error_setg(errp, "notify-coalesce-frames requires "
+                   "notify-coalesce-usecs");
+        return;
+    }
 
     if (!blkconf_apply_backend_options(&conf->conf,
                                        !blk_supports_write_perm(conf->conf.blk),
@@ -1313,6 +1327,10 @@ static Property virtio_blk_properties[] = {
                        conf.max_write_zeroes_sectors, BDRV_REQUEST_MAX_SECTORS),
     DEFINE_PROP_BOOL("x-enable-wce-if-config-wce", VirtIOBlock,
                      conf.x_enable_wce_if_config_wce, true),
+    DEFINE_PROP_UINT32("notify-coalesce-usecs", VirtIOBlock,
+                       conf.notify_coalesce_usecs, 0),
+    DEFINE_PROP_UINT32("notify-coalesce-frames", VirtIOBlock,
+                       conf.notify_coalesce_frames, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
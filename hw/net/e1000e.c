@@ -40,7 +40,9 @@
 #include "net/tap.h"
 #include "qemu/module.h"
 #include "qemu/range.h"
+#include "qemu/error-report.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/iothread.h"
 #include "hw/hw.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
@@ -78,6 +80,7 @@ struct E1000EState {
     uint16_t subsys_used;
 
     bool disable_vnet;
+    IOThread *iothread;
 
     E1000ECore core;
     bool init_vet;
@@ -364,6 +367,54 @@ e1000e_init_net_peer(E1000EState *s, PCIDevice *pci_dev, uint8_t *macaddr)
     }
 }
 
+/*
+ * Run the rings and the netdev backend in the IOThread.  This needs a
+ * backend that can be driven from there, otherwise the device stays in
+ * the main loop.
+ */
+static void
+e1000e_init_iothread(E1000EState *s)
+{
+    int queues = MAX(s->conf.peers.queues, 1);
+    AioContext *ctx;
+    int i;
+
+    if (!s->iothread) {
+        return;
+    }
+
+    ctx = iothread_get_aio_context(s->iothread);
+    for (i = 0; i < queues; i++) {
+        if (!qemu_net_client_set_aio_context(qemu_get_subqueue(s->nic, i),
+                                             ctx)) {
+            warn_report("e1000e: netdev can't run in an IOThread, "
+                        "using the main loop");
+            while (i-- > 0) {
+                qemu_net_client_set_aio_context(qemu_get_subqueue(s->nic, i),
+                                                NULL);
+            }
+            return;
+        }
+    }
+
+    s->core.ctx = ctx;
+}
+
+static void
+e1000e_cleanup_iothread(E1000EState *s)
+{
+    int queues = MAX(s->conf.peers.queues, 1);
+    int i;
+
+    if (!s->core.ctx) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        qemu_net_client_set_aio_context(qemu_get_subqueue(s->nic, i), NULL);
+    }
+}
+
 static inline uint64_t
 e1000e_gen_dsn(uint8_t *mac)
 {
@@ -494,6 +545,7 @@ static void e1000e_pci_realize(PCIDevice *pci_dev, Error **errp)
                           e1000e_gen_dsn(macaddr));
 
     e1000e_init_net_peer(s, pci_dev, macaddr);
+    e1000e_init_iothread(s);
 
     /* Initialize core */
     e1000e_core_realize(s);
@@ -510,6 +562,7 @@ static void e1000e_pci_uninit(PCIDevice *pci_dev)
 
     trace_e1000e_cb_pci_uninit();
 
+    e1000e_cleanup_iothread(s);
     e1000e_core_pci_uninit(&s->core);
 
     pcie_aer_exit(pci_dev);
@@ -672,6 +725,8 @@ static Property e1000e_properties[] = {
     DEFINE_PROP_SIGNED("subsys", E1000EState, subsys, 0,
                         e1000e_prop_subsys, uint16_t),
     DEFINE_PROP_BOOL("init-vet", E1000EState, init_vet, true),
+    DEFINE_PROP_LINK("iothread", E1000EState, iothread, TYPE_IOTHREAD,
+                     IOThread *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -35,6 +35,8 @@
 
 #include "qemu/osdep.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
 #include "net/net.h"
 #include "net/tap.h"
 #include "hw/pci/msi.h"
@@ -72,19 +74,121 @@ e1000e_process_snap_option(E1000ECore *core, uint32_t cmd_and_length)
     }
 }
 
+/*
+ * With an IOThread, the device state is protected by its AioContext:
+ * the IOThread runs the rings with the lock held, and everything coming
+ * from the main loop or vCPUs takes it here.
+ */
+static inline void
+e1000e_core_lock(E1000ECore *core)
+{
+    if (core->ctx) {
+        aio_context_acquire(core->ctx);
+    }
+}
+
+static inline void
+e1000e_core_unlock(E1000ECore *core)
+{
+    if (core->ctx) {
+        aio_context_release(core->ctx);
+    }
+}
+
+/*
+ * e1000e signals RX, TX and "other" causes on up to E1000E_MSIX_VEC_NUM
+ * MSI-X vectors, on MSI or on INTx.  When the rings run in the IOThread,
+ * the ICR updates that raise them happen without the BQL that
+ * msix_notify(), msi_notify() and pci_set_irq() need.  The vectors that
+ * fired are then kept in a bitmap and the MSI and INTx updates in flags,
+ * and the main loop injects them in irq_bh.  A busy RX queue that fires
+ * its vector several times before the bottom half runs costs one
+ * injection, and INTx gets the level of ICR & IMS at that point.
+ *
+ * Context: BQL and AioContext lock held
+ */
+static void
+e1000e_irq_flush(E1000ECore *core)
+{
+    uint32_t vecs;
+    int vec;
+
+    vecs = core->irq_msix_pending;
+    core->irq_msix_pending = 0;
+    for (vec = 0; vecs; vec++, vecs >>= 1) {
+        if (vecs & 1) {
+            msix_notify(core->owner, vec);
+        }
+    }
+    if (core->irq_msi_pending) {
+        core->irq_msi_pending = false;
+        msi_notify(core->owner, 0);
+    }
+    if (core->irq_legacy_pending) {
+        core->irq_legacy_pending = false;
+        pci_set_irq(core->owner, core->irq_level);
+    }
+}
+
+static void
+e1000e_irq_bh(void *opaque)
+{
+    E1000ECore *core = opaque;
+
+    e1000e_core_lock(core);
+    e1000e_irq_flush(core);
+    e1000e_core_unlock(core);
+}
+
+static void
+e1000e_notify_msix_vec(E1000ECore *core, int vec)
+{
+    if (qemu_mutex_iothread_locked()) {
+        msix_notify(core->owner, vec);
+        return;
+    }
+    trace_e1000e_irq_deferred(vec);
+    core->irq_msix_pending |= BIT(vec);
+    qemu_bh_schedule(core->irq_bh);
+}
+
+static void
+e1000e_notify_msi(E1000ECore *core)
+{
+    if (qemu_mutex_iothread_locked()) {
+        msi_notify(core->owner, 0);
+        return;
+    }
+    core->irq_msi_pending = true;
+    qemu_bh_schedule(core->irq_bh);
+}
+
+static void
+e1000e_set_legacy_irq(E1000ECore *core, int level)
+{
+    core->irq_level = level;
+    if (qemu_mutex_iothread_locked()) {
+        pci_set_irq(core->owner, level);
+        return;
+    }
+    /* The BH applies the latest level, not the one recorded here */
+    core->irq_legacy_pending = true;
+    qemu_bh_schedule(core->irq_bh);
+}
+
 static inline void
 e1000e_raise_legacy_irq(E1000ECore *core)
 {
     trace_e1000e_irq_legacy_notify(true);
     e1000x_inc_reg_if_not_full(core->mac, IAC);
-    pci_set_irq(core->owner, 1);
+    e1000e_set_legacy_irq(core, 1);
 }
 
 static inline void
 e1000e_lower_legacy_irq(E1000ECore *core)
 {
     trace_e1000e_irq_legacy_notify(false);
-    pci_set_irq(core->owner, 0);
+    e1000e_set_legacy_irq(core, 0);
 }
 
 static inline void
@@ -139,8 +243,10 @@ e1000e_intrmgr_on_timer(void *opaque)
 
     trace_e1000e_irq_throttling_timer(timer->delay_reg << 2);
 
+    e1000e_core_lock(timer->core);
     timer->running = false;
     e1000e_intrmgr_fire_delayed_interrupts(timer->core);
+    e1000e_core_unlock(timer->core);
 }
 
 static void
@@ -150,20 +256,19 @@ e1000e_intrmgr_on_throttling_timer(void *opaque)
 
     assert(!msix_enabled(timer->core->owner));
 
+    e1000e_core_lock(timer->core);
     timer->running = false;
 
     if (!timer->core->itr_intr_pending) {
         trace_e1000e_irq_throttling_no_pending_interrupts();
-        return;
-    }
-
-    if (msi_enabled(timer->core->owner)) {
+    } else if (msi_enabled(timer->core->owner)) {
         trace_e1000e_irq_msi_notify_postponed();
         e1000e_set_interrupt_cause(timer->core, 0);
     } else {
         trace_e1000e_irq_legacy_notify_postponed();
         e1000e_set_interrupt_cause(timer->core, 0);
     }
+    e1000e_core_unlock(timer->core);
 }
 
 static void
@@ -174,15 +279,30 @@ e1000e_intrmgr_on_msix_throttling_timer(void *opaque)
 
     assert(msix_enabled(timer->core->owner));
 
+    e1000e_core_lock(timer->core);
     timer->running = false;
 
     if (!timer->core->eitr_intr_pending[idx]) {
         trace_e1000e_irq_throttling_no_pending_vec(idx);
-        return;
+    } else {
+        trace_e1000e_irq_msix_notify_postponed_vec(idx);
+        e1000e_notify_msix_vec(timer->core, idx);
     }
+    e1000e_core_unlock(timer->core);
+}
 
-    trace_e1000e_irq_msix_notify_postponed_vec(idx);
-    msix_notify(timer->core->owner, idx);
+/*
+ * With an IOThread the moderation timers run there too, next to the rings
+ * that arm them; the interrupts they release are injected by irq_bh.
+ */
+static QEMUTimer *
+e1000e_intrmgr_timer_new(E1000ECore *core, QEMUTimerCB *cb, void *opaque)
+{
+    if (core->ctx) {
+        return aio_timer_new(core->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                             cb, opaque);
+    }
+    return timer_new_ns(QEMU_CLOCK_VIRTUAL, cb, opaque);
 }
 
 static void
@@ -223,26 +343,26 @@ e1000e_intrmgr_initialize_all_timers(E1000ECore *core, bool create)
     }
 
     core->radv.timer =
-        timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000e_intrmgr_on_timer, &core->radv);
+        e1000e_intrmgr_timer_new(core, e1000e_intrmgr_on_timer, &core->radv);
     core->rdtr.timer =
-        timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000e_intrmgr_on_timer, &core->rdtr);
+        e1000e_intrmgr_timer_new(core, e1000e_intrmgr_on_timer, &core->rdtr);
     core->raid.timer =
-        timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000e_intrmgr_on_timer, &core->raid);
+        e1000e_intrmgr_timer_new(core, e1000e_intrmgr_on_timer, &core->raid);
 
     core->tadv.timer =
-        timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000e_intrmgr_on_timer, &core->tadv);
+        e1000e_intrmgr_timer_new(core, e1000e_intrmgr_on_timer, &core->tadv);
     core->tidv.timer =
-        timer_new_ns(QEMU_CLOCK_VIRTUAL, e1000e_intrmgr_on_timer, &core->tidv);
+        e1000e_intrmgr_timer_new(core, e1000e_intrmgr_on_timer, &core->tidv);
 
-    core->itr.timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
-                                   e1000e_intrmgr_on_throttling_timer,
-                                   &core->itr);
+    core->itr.timer =
+        e1000e_intrmgr_timer_new(core, e1000e_intrmgr_on_throttling_timer,
+                                 &core->itr);
 
     for (i = 0; i < E1000E_MSIX_VEC_NUM; i++) {
         core->eitr[i].timer =
-            timer_new_ns(QEMU_CLOCK_VIRTUAL,
-                         e1000e_intrmgr_on_msix_throttling_timer,
-                         &core->eitr[i]);
+            e1000e_intrmgr_timer_new(core,
+                                     e1000e_intrmgr_on_msix_throttling_timer,
+                                     &core->eitr[i]);
     }
 }
 
@@ -1793,8 +1913,10 @@ void
 e1000e_core_set_link_status(E1000ECore *core)
 {
     NetClientState *nc = qemu_get_queue(core->owner_nic);
-    uint32_t old_status = core->mac[STATUS];
+    uint32_t old_status;
 
+    e1000e_core_lock(core);
+    old_status = core->mac[STATUS];
     trace_e1000e_link_status_changed(nc->link_down ? false : true);
 
     if (nc->link_down) {
@@ -1813,6 +1935,7 @@ e1000e_core_set_link_status(E1000ECore *core)
     if (core->mac[STATUS] != old_status) {
         e1000e_set_interrupt_cause(core, E1000_ICR_LSC);
     }
+    e1000e_core_unlock(core);
 }
 
 static void
@@ -1997,7 +2120,7 @@ e1000e_msix_notify_one(E1000ECore *core, uint32_t cause, uint32_t int_cfg)
         if (vec < E1000E_MSIX_VEC_NUM) {
             if (!e1000e_eitr_should_postpone(core, vec)) {
                 trace_e1000e_irq_msix_notify_vec(vec);
-                msix_notify(core->owner, vec);
+                e1000e_notify_msix_vec(core, vec);
             }
         } else {
             trace_e1000e_wrn_msix_vec_wrong(cause, int_cfg);
@@ -2125,7 +2248,7 @@ e1000e_send_msi(E1000ECore *core, bool msix)
     } else {
         if (!e1000e_itr_should_postpone(core)) {
             trace_e1000e_irq_msi_notify(causes);
-            msi_notify(core->owner, 0);
+            e1000e_notify_msi(core);
         }
     }
 }
@@ -2196,6 +2319,8 @@ static inline void
 e1000e_autoneg_timer(void *opaque)
 {
     E1000ECore *core = opaque;
+
+    e1000e_core_lock(core);
     if (!qemu_get_queue(core->owner_nic)->link_down) {
         e1000x_update_regs_on_autoneg_done(core->mac, core->phy[0]);
         e1000e_start_recv(core);
@@ -2204,6 +2329,7 @@ e1000e_autoneg_timer(void *opaque)
         /* signal link status change to the guest */
         e1000e_set_interrupt_cause(core, E1000_ICR_LSC);
     }
+    e1000e_core_unlock(core);
 }
 
 static inline uint16_t
@@ -2412,34 +2538,61 @@ e1000e_set_dbal(E1000ECore *core, int index, uint32_t val)
 }
 
 static void
-e1000e_set_tctl(E1000ECore *core, int index, uint32_t val)
+e1000e_tx_bh(void *opaque)
 {
+    struct e1000e_tx *tx = opaque;
+    E1000ECore *core = tx->core;
     E1000E_TxRing txr;
+
+    e1000e_core_lock(core);
+    e1000e_tx_ring_init(core, &txr, tx - core->tx);
+    e1000e_start_xmit(core, &txr);
+    e1000e_core_unlock(core);
+}
+
+/*
+ * A tail write only kicks the IOThread, which walks the ring while the
+ * vCPU goes back to the guest.  The kick cannot be an ioeventfd, as the
+ * device needs the value written.
+ */
+static void
+e1000e_kick_xmit(E1000ECore *core, int qidx)
+{
+    E1000E_TxRing txr;
+
+    if (core->ctx) {
+        qemu_bh_schedule(core->tx[qidx].bh);
+        return;
+    }
+
+    e1000e_tx_ring_init(core, &txr, qidx);
+    e1000e_start_xmit(core, &txr);
+}
+
+static void
+e1000e_set_tctl(E1000ECore *core, int index, uint32_t val)
+{
     core->mac[index] = val;
 
     if (core->mac[TARC0] & E1000_TARC_ENABLE) {
-        e1000e_tx_ring_init(core, &txr, 0);
-        e1000e_start_xmit(core, &txr);
+        e1000e_kick_xmit(core, 0);
     }
 
     if (core->mac[TARC1] & E1000_TARC_ENABLE) {
-        e1000e_tx_ring_init(core, &txr, 1);
-        e1000e_start_xmit(core, &txr);
+        e1000e_kick_xmit(core, 1);
     }
 }
 
 static void
 e1000e_set_tdt(E1000ECore *core, int index, uint32_t val)
 {
-    E1000E_TxRing txr;
     int qidx = e1000e_mq_queue_idx(TDT, index);
     uint32_t tarc_reg = (qidx == 0) ? TARC0 : TARC1;
 
     core->mac[index] = val & 0xffff;
 
     if (core->mac[tarc_reg] & E1000_TARC_ENABLE) {
-        e1000e_tx_ring_init(core, &txr, qidx);
-        e1000e_start_xmit(core, &txr);
+        e1000e_kick_xmit(core, qidx);
     }
 }
 
@@ -3251,7 +3404,9 @@ e1000e_core_write(E1000ECore *core, hwaddr addr, uint64_t val, unsigned size)
             trace_e1000e_wrn_regs_write_trivial(index << 2);
         }
         trace_e1000e_core_write(index << 2, size, val);
+        e1000e_core_lock(core);
         e1000e_macreg_writeops[index](core, index, val);
+        e1000e_core_unlock(core);
     } else if (index < E1000E_NREADOPS && e1000e_macreg_readops[index]) {
         trace_e1000e_wrn_regs_write_ro(index << 2, size, val);
     } else {
@@ -3269,7 +3424,9 @@ e1000e_core_read(E1000ECore *core, hwaddr addr, unsigned size)
         if (mac_reg_access[index] & MAC_ACCESS_PARTIAL) {
             trace_e1000e_wrn_regs_read_trivial(index << 2);
         }
+        e1000e_core_lock(core);
         val = e1000e_macreg_readops[index](core, index);
+        e1000e_core_unlock(core);
         trace_e1000e_core_read(index << 2, size, val);
         return val;
     } else {
@@ -3295,20 +3452,67 @@ e1000e_autoneg_resume(E1000ECore *core)
     }
 }
 
+/*
+ * Stop the IOThread from touching guest memory once the VM is stopped,
+ * and inject the interrupts it recorded so that they are part of the
+ * interrupt controller state that gets migrated.  TX kicks that were
+ * still scheduled are dropped; e1000e_resume_xmit() redoes them.
+ *
+ * Context: BQL and AioContext lock held
+ */
+static void
+e1000e_quiesce(E1000ECore *core)
+{
+    int i;
+
+    if (!core->ctx) {
+        return;
+    }
+
+    for (i = 0; i < E1000E_NUM_QUEUES; i++) {
+        qemu_bh_cancel(core->tx[i].bh);
+    }
+    qemu_bh_cancel(core->irq_bh);
+    e1000e_irq_flush(core);
+}
+
+/* Kick the rings that still have descriptors, on resume or after load */
+static void
+e1000e_resume_xmit(E1000ECore *core)
+{
+    E1000E_TxRing txr;
+    int i;
+
+    if (!core->ctx) {
+        return;
+    }
+
+    for (i = 0; i < E1000E_NUM_QUEUES; i++) {
+        e1000e_tx_ring_init(core, &txr, i);
+        if (!e1000e_ring_empty(core, txr.i)) {
+            qemu_bh_schedule(core->tx[i].bh);
+        }
+    }
+}
+
 static void
 e1000e_vm_state_change(void *opaque, bool running, RunState state)
 {
     E1000ECore *core = opaque;
 
+    e1000e_core_lock(core);
     if (running) {
         trace_e1000e_vm_state_running();
         e1000e_intrmgr_resume(core);
         e1000e_autoneg_resume(core);
+        e1000e_resume_xmit(core);
     } else {
         trace_e1000e_vm_state_stopped();
         e1000e_autoneg_pause(core);
         e1000e_intrmgr_pause(core);
+        e1000e_quiesce(core);
     }
+    e1000e_core_unlock(core);
 }
 
 void
@@ -3329,6 +3533,13 @@ e1000e_core_pci_realize(E1000ECore     *core,
     for (i = 0; i < E1000E_NUM_QUEUES; i++) {
         net_tx_pkt_init(&core->tx[i].tx_pkt, core->owner,
                         E1000E_MAX_TX_FRAGS, core->has_vnet);
+        core->tx[i].core = core;
+        if (core->ctx) {
+            core->tx[i].bh = aio_bh_new(core->ctx, e1000e_tx_bh, &core->tx[i]);
+        }
+    }
+    if (core->ctx) {
+        core->irq_bh = qemu_bh_new(e1000e_irq_bh, core);
     }
 
     net_rx_pkt_init(&core->rx_pkt, core->has_vnet);
@@ -3346,9 +3557,22 @@ e1000e_core_pci_uninit(E1000ECore *core)
 {
     int i;
 
+    e1000e_core_lock(core);
+    for (i = 0; core->ctx && i < E1000E_NUM_QUEUES; i++) {
+        qemu_bh_delete(core->tx[i].bh);
+        core->tx[i].bh = NULL;
+    }
+    e1000e_core_unlock(core);
+    if (core->irq_bh) {
+        qemu_bh_delete(core->irq_bh);
+        core->irq_bh = NULL;
+    }
+
     timer_free(core->autoneg_timer);
 
+    e1000e_core_lock(core);
     e1000e_intrmgr_pci_unint(core);
+    e1000e_core_unlock(core);
 
     qemu_del_vm_change_state_handler(core->vmstate);
 
@@ -3447,6 +3671,7 @@ e1000e_core_reset(E1000ECore *core)
 {
     int i;
 
+    e1000e_core_lock(core);
     timer_del(core->autoneg_timer);
 
     e1000e_intrmgr_reset(core);
@@ -3469,6 +3694,11 @@ e1000e_core_reset(E1000ECore *core)
         memset(&core->tx[i].props, 0, sizeof(core->tx[i].props));
         core->tx[i].skip_cp = false;
     }
+
+    core->irq_msix_pending = 0;
+    core->irq_msi_pending = false;
+    core->irq_level = 0;
+    e1000e_core_unlock(core);
 }
 
 void e1000e_core_pre_save(E1000ECore *core)
@@ -3476,6 +3706,7 @@ void e1000e_core_pre_save(E1000ECore *core)
     int i;
     NetClientState *nc = qemu_get_queue(core->owner_nic);
 
+    e1000e_core_lock(core);
     /*
     * If link is down and auto-negotiation is supported and ongoing,
     * complete auto-negotiation immediately. This allows us to look
@@ -3491,6 +3722,10 @@ void e1000e_core_pre_save(E1000ECore *core)
             core->tx[i].skip_cp = true;
         }
     }
+
+    /* Nothing recorded by the IOThread may be left out of the stream */
+    e1000e_quiesce(core);
+    e1000e_core_unlock(core);
 }
 
 int
@@ -3498,10 +3733,12 @@ e1000e_core_post_load(E1000ECore *core)
 {
     NetClientState *nc = qemu_get_queue(core->owner_nic);
 
+    e1000e_core_lock(core);
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in core.mac[STATUS].
      */
     nc->link_down = (core->mac[STATUS] & E1000_STATUS_LU) == 0;
+    e1000e_core_unlock(core);
 
     return 0;
 }
@@ -77,6 +77,10 @@ struct E1000Core {
         unsigned char sum_needed;
         bool cptse;
         struct NetTxPkt *tx_pkt;
+
+        /* Runs the ring in the IOThread */
+        QEMUBH *bh;
+        E1000ECore *core;
     } tx[E1000E_NUM_QUEUES];
 
     struct NetRxPkt *rx_pkt;
@@ -114,6 +118,15 @@ struct E1000Core {
     void (*owner_start_recv)(PCIDevice *d);
 
     uint32_t msi_causes_pending;
+
+    /* IOThread running the rings, NULL for the main loop */
+    AioContext *ctx;
+    /* Interrupts raised in the IOThread, injected by irq_bh */
+    QEMUBH *irq_bh;
+    uint32_t irq_msix_pending;
+    bool irq_msi_pending;
+    bool irq_legacy_pending;
+    int irq_level;
 };
 
 void
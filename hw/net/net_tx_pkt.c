@@ -608,12 +608,148 @@ static bool net_tx_pkt_do_sw_fragmentation(struct NetTxPkt *pkt,
     return true;
 }
 
+static bool net_tx_pkt_is_tcp_gso(struct NetTxPkt *pkt)
+{
+    switch (pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+    case VIRTIO_NET_HDR_GSO_TCPV4:
+    case VIRTIO_NET_HDR_GSO_TCPV6:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Software TSO: cut the payload into gso_size segments.  Each segment is
+ * an iovec of the shared L2/L3 headers, a private copy of the TCP header
+ * and slices of the guest buffers, so payload is never copied; only the
+ * headers are patched and the checksum computed per segment.
+ */
+static bool net_tx_pkt_do_sw_segmentation(struct NetTxPkt *pkt,
+    NetClientState *nc)
+{
+    enum {
+        SEG_L2_HDR_POS = 0,
+        SEG_L3_HDR_POS,
+        SEG_L4_HDR_POS,
+        SEG_PL_START_POS
+    };
+    struct iovec segment[NET_MAX_FRAG_SG_LIST];
+    uint8_t l4_hdr[ETH_MAX_TCP_HDR_LEN];
+    struct tcp_hdr *th = (struct tcp_hdr *)l4_hdr;
+    struct iovec *src = pkt->vec;
+    struct iovec *l3 = &pkt->vec[NET_TX_PKT_L3HDR_FRAG];
+    struct ip_header *ip = l3->iov_base;
+    struct ip6_header *ip6 = l3->iov_base;
+    bool is_ipv4 = (pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) ==
+                   VIRTIO_NET_HDR_GSO_TCPV4;
+    int src_end = pkt->payload_frags + NET_TX_PKT_PL_START_FRAG;
+    int src_idx = NET_TX_PKT_PL_START_FRAG;
+    size_t src_offset;
+    size_t l4_hdr_len = pkt->virt_hdr.hdr_len - pkt->hdr_len;
+    size_t gso_size = pkt->virt_hdr.gso_size;
+    size_t data_len, data_offset = 0;
+    uint16_t ip_id = is_ipv4 ? be16_to_cpu(ip->ip_id) : 0;
+    uint32_t seq;
+    uint8_t th_flags;
+
+    if (l4_hdr_len < sizeof(struct tcp_hdr) ||
+        l4_hdr_len > sizeof(l4_hdr) ||
+        l4_hdr_len >= pkt->payload_len || !gso_size) {
+        return false;
+    }
+    if (iov_to_buf(&src[NET_TX_PKT_PL_START_FRAG], pkt->payload_frags, 0,
+                   l4_hdr, l4_hdr_len) != l4_hdr_len) {
+        return false;
+    }
+
+    /* Skip the TCP header in the guest buffers */
+    src_offset = l4_hdr_len;
+    while (src_idx < src_end && src_offset >= src[src_idx].iov_len) {
+        src_offset -= src[src_idx].iov_len;
+        src_idx++;
+    }
+
+    segment[SEG_L2_HDR_POS] = pkt->vec[NET_TX_PKT_L2HDR_FRAG];
+    segment[SEG_L3_HDR_POS] = *l3;
+    segment[SEG_L4_HDR_POS].iov_base = l4_hdr;
+    segment[SEG_L4_HDR_POS].iov_len = l4_hdr_len;
+
+    seq = be32_to_cpu(th->th_seq);
+    th_flags = th->th_flags;
+    data_len = pkt->payload_len - l4_hdr_len;
+
+    while (data_offset < data_len) {
+        size_t seg_len = 0;
+        int dst_idx = SEG_PL_START_POS;
+        uint32_t csum_cntr, cso;
+        uint16_t csl;
+
+        while (seg_len < gso_size && src_idx < src_end &&
+               dst_idx < NET_MAX_FRAG_SG_LIST) {
+            size_t len = MIN(src[src_idx].iov_len - src_offset,
+                             gso_size - seg_len);
+
+            segment[dst_idx].iov_base = src[src_idx].iov_base + src_offset;
+            segment[dst_idx].iov_len = len;
+            dst_idx++;
+
+            seg_len += len;
+            src_offset += len;
+            if (src_offset == src[src_idx].iov_len) {
+                src_offset = 0;
+                src_idx++;
+            }
+        }
+        if (!seg_len) {
+            break;
+        }
+
+        /* FIN and PSH only on the last segment, CWR only on the first */
+        th->th_seq = cpu_to_be32(seq + data_offset);
+        th->th_flags = th_flags;
+        if (data_offset) {
+            th->th_flags &= ~TH_CWR;
+        }
+        if (data_offset + seg_len < data_len) {
+            th->th_flags &= ~(TH_FIN | TH_PUSH);
+        }
+
+        csl = l4_hdr_len + seg_len;
+        if (is_ipv4) {
+            ip->ip_len = cpu_to_be16(l3->iov_len + csl);
+            ip->ip_id = cpu_to_be16(ip_id++);
+            eth_fix_ip4_checksum(l3->iov_base, l3->iov_len);
+            csum_cntr = eth_calc_ip4_pseudo_hdr_csum(ip, csl, &cso);
+        } else {
+            ip6->ip6_ctlun.ip6_un1.ip6_un1_plen =
+                cpu_to_be16(l3->iov_len - sizeof(struct ip6_header) + csl);
+            csum_cntr = eth_calc_ip6_pseudo_hdr_csum(ip6, csl,
+                                                     IP_PROTO_TCP, &cso);
+        }
+
+        th->th_sum = 0;
+        csum_cntr += net_checksum_add_iov(&segment[SEG_L4_HDR_POS],
+                                          dst_idx - SEG_L4_HDR_POS, 0,
+                                          csl, cso);
+        th->th_sum = cpu_to_be16(net_checksum_finish_nozero(csum_cntr));
+
+        net_tx_pkt_sendv(pkt, nc, segment, dst_idx);
+
+        data_offset += seg_len;
+    }
+
+    return true;
+}
+
 bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
 {
     assert(pkt);
 
+    /* Segmentation computes the checksum of each segment itself */
     if (!pkt->has_virt_hdr &&
-        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM &&
+        !net_tx_pkt_is_tcp_gso(pkt)) {
         net_tx_pkt_do_sw_csum(pkt);
     }
 
@@ -637,6 +773,10 @@ bool net_tx_pkt_send(struct NetTxPkt *pkt, NetClientState *nc)
         return true;
     }
 
+    if (net_tx_pkt_is_tcp_gso(pkt)) {
+        return net_tx_pkt_do_sw_segmentation(pkt, nc);
+    }
+
     return net_tx_pkt_do_sw_fragmentation(pkt, nc);
 }
 
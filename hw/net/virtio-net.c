@@ -44,6 +44,7 @@
 #include "hw/pci/pci.h"
 #include "net_rx_pkt.h"
 #include "hw/virtio/vhost.h"
+#include "block/aio-wait.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -168,6 +169,45 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     }
 }
 
+static void virtio_net_queue_acquire(VirtIONetQueue *q)
+{
+    if (q->ctx) {
+        aio_context_acquire(q->ctx);
+    }
+}
+
+static void virtio_net_queue_release(VirtIONetQueue *q)
+{
+    if (q->ctx) {
+        aio_context_release(q->ctx);
+    }
+}
+
+/* Keep the IOThreads out of the state shared by all queue pairs */
+static void virtio_net_acquire_all(VirtIONet *n)
+{
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+    for (i = 0; i < n->net_conf.num_iothreads; i++) {
+        aio_context_acquire(iothread_get_aio_context(n->iothreads[i]));
+    }
+}
+
+static void virtio_net_release_all(VirtIONet *n)
+{
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+    for (i = n->net_conf.num_iothreads - 1; i >= 0; i--) {
+        aio_context_release(iothread_get_aio_context(n->iothreads[i]));
+    }
+}
+
 static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -179,7 +219,9 @@ static void virtio_net_set_config(VirtIODevice *vdev, const uint8_t *config)
     if (!virtio_vdev_has_feature(vdev, VIRTIO_NET_F_CTRL_MAC_ADDR) &&
         !virtio_vdev_has_feature(vdev, VIRTIO_F_VERSION_1) &&
         memcmp(netcfg.mac, n->mac, ETH_ALEN)) {
+        virtio_net_acquire_all(n);
         memcpy(n->mac, netcfg.mac, ETH_ALEN);
+        virtio_net_release_all(n);
         qemu_format_nic_info_str(qemu_get_queue(n->nic), n->mac);
     }
 
@@ -350,14 +392,35 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/* Queues served by an IOThread must signal the guest through irqfd */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
+static int virtio_net_dataplane_start(VirtIONet *n);
+static void virtio_net_dataplane_stop(VirtIONet *n);
+
+static bool virtio_net_dataplane_wanted(VirtIONet *n, uint8_t status)
+{
+    return n->iothreads && virtio_net_started(n, status) &&
+           !n->vhost_started;
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -368,6 +431,10 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
+    if (n->dataplane_started && !virtio_net_dataplane_wanted(n, status)) {
+        virtio_net_dataplane_stop(n);
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -385,8 +452,11 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             qemu_flush_queued_packets(ncs);
         }
 
+        if (n->dataplane_started) {
+            virtio_net_queue_acquire(q);
+        }
         if (!q->tx_waiting) {
-            continue;
+            goto next;
         }
 
         if (queue_started) {
@@ -412,6 +482,15 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
                 virtio_net_drop_tx_queue_data(vdev, q->tx_vq);
             }
         }
+next:
+        if (n->dataplane_started) {
+            virtio_net_queue_release(q);
+        }
+    }
+
+    if (!n->dataplane_started && virtio_net_dataplane_wanted(n, status)) {
+        /* On failure the queues simply stay in the main loop */
+        virtio_net_dataplane_start(n);
     }
 }
 
@@ -1452,6 +1531,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         iov2 = iov = g_memdup(elem->out_sg, sizeof(struct iovec) * elem->out_num);
         s = iov_to_buf(iov, iov_cnt, 0, &ctrl, sizeof(ctrl));
         iov_discard_front(&iov, &iov_cnt, sizeof(ctrl));
+        virtio_net_acquire_all(n);
         if (s != sizeof(ctrl)) {
             status = VIRTIO_NET_ERR;
         } else if (ctrl.class == VIRTIO_NET_CTRL_RX) {
@@ -1467,6 +1547,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         } else if (ctrl.class == VIRTIO_NET_CTRL_GUEST_OFFLOADS) {
             status = virtio_net_handle_offloads(n, ctrl.cmd, iov, iov_cnt);
         }
+        virtio_net_release_all(n);
 
         s = iov_from_buf(elem->in_sg, elem->in_num, 0, &status, sizeof(status));
         assert(s == sizeof(status));
@@ -1852,7 +1933,11 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (q->rx_batching) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify(n, q->rx_vq);
+    }
 
     return size;
 }
@@ -2469,16 +2554,42 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
     }
 }
 
+/*
+ * Fill RX descriptors for as many packets as the guest has room for and
+ * notify it once.  Stops at the first packet that has to be queued.
+ */
+static int virtio_net_receive_batch(NetClientState *nc,
+                                    const struct iovec *pkts, int count)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    int i;
+
+    q->rx_batching = true;
+    for (i = 0; i < count; i++) {
+        if (virtio_net_receive(nc, pkts[i].iov_base, pkts[i].iov_len) == 0) {
+            break;
+        }
+    }
+    q->rx_batching = false;
+
+    if (q->rx_notify_pending) {
+        q->rx_notify_pending = false;
+        virtio_net_notify(n, q->rx_vq);
+    }
+
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
@@ -2573,7 +2684,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
 drop:
         virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        virtio_net_notify(n, q->tx_vq);
         g_free(elem);
 
         if (++num_packets >= n->tx_burst) {
@@ -2708,6 +2819,24 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+static void virtio_net_tx_timer_aio(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    aio_context_acquire(q->ctx);
+    virtio_net_tx_timer(q);
+    aio_context_release(q->ctx);
+}
+
+static void virtio_net_tx_bh_aio(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    aio_context_acquire(q->ctx);
+    virtio_net_tx_bh(q);
+    aio_context_release(q->ctx);
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -2731,6 +2860,11 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+    if (n->iothreads) {
+        IOThread *iothread = n->iothreads[index % n->net_conf.num_iothreads];
+
+        n->vqs[index].ctx = iothread_get_aio_context(iothread);
+    }
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -2750,9 +2884,225 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
         q->tx_bh = NULL;
     }
     q->tx_waiting = 0;
+    q->ctx = NULL;
     virtio_del_queue(vdev, index * 2 + 1);
 }
 
+/*
+ * Move the tx timer or bottom half of @q to @ctx, or back to the main
+ * loop if @ctx is NULL, keeping a pending flush pending.
+ */
+static void virtio_net_queue_set_context(VirtIONetQueue *q, AioContext *ctx)
+{
+    VirtIONet *n = q->n;
+
+    if (q->tx_timer) {
+        timer_free(q->tx_timer);
+        if (ctx) {
+            q->tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                        virtio_net_tx_timer_aio, q);
+        } else {
+            q->tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                       virtio_net_tx_timer, q);
+        }
+        if (q->tx_waiting) {
+            timer_mod(q->tx_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
+        }
+    } else {
+        qemu_bh_delete(q->tx_bh);
+        if (ctx) {
+            q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh_aio, q);
+        } else {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+        if (q->tx_waiting) {
+            qemu_bh_schedule(q->tx_bh);
+        }
+    }
+}
+
+static bool virtio_net_dataplane_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    assert(n->dataplane_started);
+
+    aio_context_acquire(q->ctx);
+    virtio_net_handle_rx(vdev, vq);
+    aio_context_release(q->ctx);
+    return true;
+}
+
+static bool virtio_net_dataplane_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    assert(n->dataplane_started);
+
+    aio_context_acquire(q->ctx);
+    if (q->tx_timer) {
+        virtio_net_handle_tx_timer(vdev, vq);
+    } else {
+        virtio_net_handle_tx_bh(vdev, vq);
+    }
+    aio_context_release(q->ctx);
+    return true;
+}
+
+/*
+ * Hand the queue pairs and their backends over to the IOThreads.  Only
+ * backends that can run outside the main loop are supported; otherwise
+ * the device keeps using the main loop.
+ *
+ * Context: QEMU global mutex held
+ */
+static int virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i, r;
+
+    for (i = 0; i < queues; i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (!peer || !peer->info->set_aio_context) {
+            return -ENOTSUP;
+        }
+    }
+
+    if (!k->set_guest_notifiers) {
+        return -ENOSYS;
+    }
+
+    /* guest_notifier_mask is only implemented for vhost backends */
+    n->saved_guest_notifier_mask = vdev->use_guest_notifier_mask;
+    vdev->use_guest_notifier_mask = false;
+
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r < 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -accel kvm is set.", r);
+        goto fail_guest_notifiers;
+    }
+
+    r = virtio_device_grab_ioeventfd(vdev);
+    if (r < 0) {
+        error_report("virtio-net: ioeventfd is not available (%d)", r);
+        goto fail_ioeventfd;
+    }
+
+    /*
+     * Batch all the host notifiers in a single transaction to avoid
+     * quadratic time complexity in address_space_update_ioeventfds().
+     */
+    memory_region_transaction_begin();
+    for (i = 0; i < nvqs; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r < 0) {
+            int j = i;
+
+            error_report("virtio-net failed to set host notifier (%d)", r);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+            }
+            memory_region_transaction_commit();
+            while (j--) {
+                virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), j);
+            }
+            goto fail_host_notifiers;
+        }
+    }
+    memory_region_transaction_commit();
+
+    n->dataplane_started = true;
+    trace_virtio_net_dataplane_start(n, queues);
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_context_acquire(q->ctx);
+        virtio_net_queue_set_context(q, q->ctx);
+        qemu_net_client_set_aio_context(qemu_get_subqueue(n->nic, i), q->ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx,
+                virtio_net_dataplane_handle_rx);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx,
+                virtio_net_dataplane_handle_tx);
+        aio_context_release(q->ctx);
+    }
+
+    /* Kick right away to pick up buffers already in the rings */
+    for (i = 0; i < nvqs; i++) {
+        VirtQueue *vq = virtio_get_queue(vdev, i);
+
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+    return 0;
+
+fail_host_notifiers:
+    virtio_device_release_ioeventfd(vdev);
+fail_ioeventfd:
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+fail_guest_notifiers:
+    vdev->use_guest_notifier_mask = n->saved_guest_notifier_mask;
+    return r;
+}
+
+/* Context: BH in IOThread */
+static void virtio_net_dataplane_stop_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx, NULL);
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx, NULL);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+    trace_virtio_net_dataplane_stop(n);
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_context_acquire(q->ctx);
+        aio_wait_bh_oneshot(q->ctx, virtio_net_dataplane_stop_bh, q);
+        qemu_net_client_set_aio_context(qemu_get_subqueue(n->nic, i), NULL);
+        virtio_net_queue_set_context(q, NULL);
+        aio_context_release(q->ctx);
+    }
+
+    memory_region_transaction_begin();
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+    }
+    memory_region_transaction_commit();
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+    }
+    virtio_device_release_ioeventfd(vdev);
+
+    n->dataplane_started = false;
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+    vdev->use_guest_notifier_mask = n->saved_guest_notifier_mask;
+}
+
 static void virtio_net_change_num_queues(VirtIONet *n, int new_max_queues)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -3142,6 +3492,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3376,6 +3727,36 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+
+    if (n->net_conf.num_iothreads) {
+        if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS) ||
+            virtio_has_feature(n->host_features, VIRTIO_NET_F_HASH_REPORT) ||
+            virtio_has_feature(n->host_features, VIRTIO_NET_F_RSC_EXT)) {
+            error_setg(errp, "'iothreads' is not supported with 'rss', "
+                       "'hash' or 'guest_rsc_ext'");
+            virtio_cleanup(vdev);
+            return;
+        }
+        n->iothreads = g_new0(IOThread *, n->net_conf.num_iothreads);
+        for (i = 0; i < n->net_conf.num_iothreads; i++) {
+            IOThread *iothread = iothread_by_id(n->net_conf.iothread_ids[i]);
+
+            if (!iothread) {
+                error_setg(errp, "IOThread '%s' not found",
+                           n->net_conf.iothread_ids[i]);
+                while (i--) {
+                    object_unref(OBJECT(n->iothreads[i]));
+                }
+                g_free(n->iothreads);
+                n->iothreads = NULL;
+                virtio_cleanup(vdev);
+                return;
+            }
+            object_ref(OBJECT(iothread));
+            n->iothreads[i] = iothread;
+        }
+    }
+
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->curr_queues = 1;
     n->tx_timeout = n->net_conf.txtimer;
@@ -3497,6 +3878,11 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     virtio_net_rsc_cleanup(n);
     g_free(n->rss_data.indirections_table);
     net_rx_pkt_uninit(n->rx_pkt);
+    for (i = 0; n->iothreads && i < n->net_conf.num_iothreads; i++) {
+        object_unref(OBJECT(n->iothreads[i]));
+    }
+    g_free(n->iothreads);
+    n->iothreads = NULL;
     virtio_cleanup(vdev);
 }
 
@@ -3516,6 +3902,14 @@ static void virtio_net_instance_init(Object *obj)
     ebpf_rss_init(&n->ebpf_rss);
 }
 
+static void virtio_net_instance_finalize(Object *obj)
+{
+    VirtIONet *n = VIRTIO_NET(obj);
+
+    /* The array property does not free the array itself */
+    g_free(n->net_conf.iothread_ids);
+}
+
 static int virtio_net_pre_save(void *opaque)
 {
     VirtIONet *n = opaque;
@@ -3625,6 +4019,8 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
     DEFINE_PROP_BOOL("failover", VirtIONet, failover, false),
+    DEFINE_PROP_ARRAY("iothreads", VirtIONet, net_conf.num_iothreads,
+                      net_conf.iothread_ids, qdev_prop_string, char *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -3658,6 +4054,7 @@ static const TypeInfo virtio_net_info = {
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VirtIONet),
     .instance_init = virtio_net_instance_init,
+    .instance_finalize = virtio_net_instance_finalize,
     .class_init = virtio_net_class_init,
 };
 
@@ -35,6 +35,8 @@
  *              mdts=<N[optional]>,vsl=<N[optional]>, \
  *              zoned.zasl=<N[optional]>, \
  *              zoned.auto_transition=<on|off[optional]>, \
+ *              iothread=<iothread_id[optional]>, \
+ *              ioeventfd=<on|off[optional]>, \
  *              subsys=<subsys_id>
  *      -device nvme-ns,drive=<drive_id>,bus=<bus_name>,nsid=<nsid>,\
  *              zoned=<true|false[optional]>, \
@@ -106,6 +108,17 @@
  *   transitioned to zone state closed for resource management purposes.
  *   Defaults to 'on'.
  *
+ * - `iothread`
+ *   Process the submission and completion queues in the given IOThread. The
+ *   namespaces attached to the controller are moved to its AioContext, so
+ *   all controllers in a subsystem must use the same IOThread.
+ *
+ * - `ioeventfd`
+ *   Signal I/O queue doorbell writes through an ioeventfd once the host has
+ *   set up shadow doorbells with the Doorbell Buffer Config command. The
+ *   doorbell values are read from the shadow doorbell buffer. Defaults to
+ *   'off'.
+ *
  * nvme namespace device parameters
  * ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  * - `shared`
@@ -153,9 +166,11 @@
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/units.h"
 #include "qapi/error.h"
 #include "qapi/visitor.h"
+#include "block/aio-wait.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/block-backend.h"
 #include "sysemu/hostmem.h"
@@ -220,6 +235,7 @@ static const uint32_t nvme_cse_acs[256] = {
     [NVME_ADM_CMD_GET_FEATURES]     = NVME_CMD_EFF_CSUPP,
     [NVME_ADM_CMD_ASYNC_EV_REQ]     = NVME_CMD_EFF_CSUPP,
     [NVME_ADM_CMD_NS_ATTACHMENT]    = NVME_CMD_EFF_CSUPP | NVME_CMD_EFF_NIC,
+    [NVME_ADM_CMD_DBBUF_CONFIG]     = NVME_CMD_EFF_CSUPP,
     [NVME_ADM_CMD_FORMAT_NVM]       = NVME_CMD_EFF_CSUPP | NVME_CMD_EFF_LBCC,
 };
 
@@ -250,7 +266,7 @@ static const uint32_t nvme_cse_iocs_zoned[256] = {
     [NVME_CMD_ZONE_MGMT_RECV]       = NVME_CMD_EFF_CSUPP,
 };
 
-static void nvme_process_sq(void *opaque);
+static void nvme_process_sq_bh(void *opaque);
 
 static uint16_t nvme_sqid(NvmeRequest *req)
 {
@@ -437,6 +453,138 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
+/*
+ * Shadow doorbells: once the host has issued a Doorbell Buffer Config, it
+ * writes the SQ tail and CQ head doorbells to memory and only rings the MMIO
+ * doorbell when the EventIdx published by the controller asks for it.
+ */
+static void nvme_dbbuf_write(NvmeCtrl *n, uint64_t addr, uint32_t val)
+{
+    uint32_t v = cpu_to_le32(val);
+
+    pci_dma_write(&n->parent_obj, addr, &v, sizeof(v));
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    trace_pci_nvme_eventidx_sq(sq->sqid, sq->tail);
+    nvme_dbbuf_write(sq->ctrl, sq->ei_addr, sq->tail);
+}
+
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    if (pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &v, sizeof(v))) {
+        return;
+    }
+
+    v = le32_to_cpu(v);
+    if (unlikely(v >= sq->size)) {
+        NVME_GUEST_ERR(pci_nvme_ub_db_shadow_invalid_sqtail,
+                       "shadow doorbell value beyond queue size,"
+                       " sqid=%"PRIu16", new_tail=%"PRIu32", ignoring",
+                       sq->sqid, v);
+        return;
+    }
+
+    trace_pci_nvme_shadow_doorbell_sq(sq->sqid, v);
+    sq->tail = v;
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    trace_pci_nvme_eventidx_cq(cq->cqid, cq->head);
+    nvme_dbbuf_write(cq->ctrl, cq->ei_addr, cq->head);
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    if (pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &v, sizeof(v))) {
+        return;
+    }
+
+    v = le32_to_cpu(v);
+    if (unlikely(v >= cq->size)) {
+        NVME_GUEST_ERR(pci_nvme_ub_db_shadow_invalid_cqhead,
+                       "shadow doorbell value beyond queue size,"
+                       " cqid=%"PRIu16", new_head=%"PRIu32", ignoring",
+                       cq->cqid, v);
+        return;
+    }
+
+    trace_pci_nvme_shadow_doorbell_cq(cq->cqid, v);
+    cq->head = v;
+}
+
+/*
+ * With an IOThread, the controller state is protected by its AioContext.
+ * The queue bottom halves, the DSM, Copy, Flush, Zone Reset and Format
+ * bottom halves and request completions in the IOThread take the lock, as
+ * does everything coming from vCPUs or the main loop.  The lock is
+ * recursive, so callbacks that can run both from a locked bottom half and
+ * from a block layer completion take it as well.
+ */
+static inline void nvme_lock(NvmeCtrl *n)
+{
+    if (n->iothread) {
+        aio_context_acquire(n->ctx);
+    }
+}
+
+static inline void nvme_unlock(NvmeCtrl *n)
+{
+    if (n->iothread) {
+        aio_context_release(n->ctx);
+    }
+}
+
+static void nvme_irq_check(NvmeCtrl *n);
+
+/*
+ * Each completion queue has its own MSI-X vector, or with pin-based
+ * interrupts a bit in irq_status that INTMS can mask.  CQEs posted in the
+ * IOThread cannot call msix_notify() or change the pin there, as both
+ * need the BQL, so the vector is marked in irq_msix_pending (or the pin
+ * flagged for re-evaluation) and irq_bh does it from the main loop.  A CQ
+ * that gets many CQEs before the bottom half runs is signalled once,
+ * much like interrupt coalescing, and the pin follows irq_status and
+ * INTMS as they are when the bottom half runs.
+ */
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    uint32_t vector;
+
+    nvme_lock(n);
+    for (vector = find_first_bit(n->irq_msix_pending, n->params.msix_qsize);
+         vector < n->params.msix_qsize;
+         vector = find_next_bit(n->irq_msix_pending, n->params.msix_qsize,
+                                vector + 1)) {
+        clear_bit(vector, n->irq_msix_pending);
+        msix_notify(&n->parent_obj, vector);
+    }
+    if (n->irq_pin_pending) {
+        n->irq_pin_pending = false;
+        nvme_irq_check(n);
+    }
+    nvme_unlock(n);
+}
+
+static void nvme_msix_notify(NvmeCtrl *n, uint32_t vector)
+{
+    if (qemu_mutex_iothread_locked()) {
+        msix_notify(&n->parent_obj, vector);
+        return;
+    }
+
+    trace_pci_nvme_irq_deferred(vector);
+    set_bit(vector, n->irq_msix_pending);
+    qemu_bh_schedule(n->irq_bh);
+}
+
 static void nvme_irq_check(NvmeCtrl *n)
 {
     uint32_t intms = ldl_le_p(&n->bar.intms);
@@ -444,6 +592,12 @@ static void nvme_irq_check(NvmeCtrl *n)
     if (msix_enabled(&(n->parent_obj))) {
         return;
     }
+    if (!qemu_mutex_iothread_locked()) {
+        /* the bottom half applies the latest irq_status, not this one */
+        n->irq_pin_pending = true;
+        qemu_bh_schedule(n->irq_bh);
+        return;
+    }
     if (~intms & n->irq_status) {
         pci_irq_assert(&n->parent_obj);
     } else {
@@ -456,7 +610,7 @@ static void nvme_irq_assert(NvmeCtrl *n, NvmeCQueue *cq)
     if (cq->irq_enabled) {
         if (msix_enabled(&(n->parent_obj))) {
             trace_pci_nvme_irq_msix(cq->vector);
-            msix_notify(&(n->parent_obj), cq->vector);
+            nvme_msix_notify(n, cq->vector);
         } else {
             trace_pci_nvme_irq_pin();
             assert(cq->vector < 32);
@@ -1265,14 +1419,28 @@ static inline void nvme_blk_write(BlockBackend *blk, int64_t offset,
     }
 }
 
+static void nvme_cq_head_updated(NvmeCtrl *n, NvmeCQueue *cq, bool was_full);
+
 static void nvme_post_cqes(void *opaque)
 {
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
-    bool pending = cq->head != cq->tail;
+    bool pending;
     int ret;
 
+    if (cq->db_addr) {
+        uint32_t head = cq->head;
+        bool full = nvme_cq_full(cq);
+
+        /* the host may have consumed CQEs without ringing the doorbell */
+        nvme_update_cq_head(cq);
+        if (cq->head != head) {
+            nvme_cq_head_updated(n, cq, full);
+        }
+    }
+    pending = cq->head != cq->tail;
+
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
@@ -1297,8 +1465,29 @@ static void nvme_post_cqes(void *opaque)
         QTAILQ_REMOVE(&cq->req_list, req, entry);
         nvme_inc_cq_tail(cq);
         nvme_sg_unmap(&req->sg);
+
+        /* the SQ stopped fetching when it ran out of requests */
+        if (QTAILQ_EMPTY(&sq->req_list) && !nvme_sq_empty(sq)) {
+            qemu_bh_schedule(sq->bh);
+        }
+
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
+
+    if (cq->db_addr) {
+        /*
+         * Ask for a doorbell once the host moves past the head seen here,
+         * then catch a head update that raced with publishing it.
+         */
+        nvme_update_cq_eventidx(cq);
+        if (nvme_cq_full(cq) && !QTAILQ_EMPTY(&cq->req_list)) {
+            nvme_update_cq_head(cq);
+            if (!nvme_cq_full(cq)) {
+                qemu_bh_schedule(cq->bh);
+            }
+        }
+    }
+
     if (cq->tail != cq->head) {
         if (cq->irq_enabled && !pending) {
             n->cq_pending++;
@@ -1308,8 +1497,42 @@ static void nvme_post_cqes(void *opaque)
     }
 }
 
+static void nvme_post_cqes_bh(void *opaque)
+{
+    NvmeQueueBH *qbh = opaque;
+    NvmeCtrl *n = qbh->ctrl;
+
+    nvme_lock(n);
+    if (n->cq[qbh->qid]) {
+        nvme_post_cqes(n->cq[qbh->qid]);
+    }
+    nvme_unlock(n);
+}
+
+/* the host consumed completions, from a doorbell write or notification */
+static void nvme_cq_head_updated(NvmeCtrl *n, NvmeCQueue *cq, bool was_full)
+{
+    if (was_full) {
+        NvmeSQueue *sq;
+        QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+            qemu_bh_schedule(sq->bh);
+        }
+        qemu_bh_schedule(cq->bh);
+    }
+
+    if (cq->tail == cq->head) {
+        if (cq->irq_enabled) {
+            n->cq_pending--;
+        }
+
+        nvme_irq_deassert(n, cq);
+    }
+}
+
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
 {
+    NvmeCtrl *n = cq->ctrl;
+
     assert(cq->cqid == req->sq->cqid);
     trace_pci_nvme_enqueue_req_completion(nvme_cid(req), cq->cqid,
                                           le32_to_cpu(req->cqe.result),
@@ -1321,9 +1544,12 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
                                       req->status, req->cmd.opcode);
     }
 
+    /* request completions run in the IOThread without the lock held */
+    nvme_lock(n);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    nvme_unlock(n);
+    qemu_bh_schedule(cq->bh);
 }
 
 static void nvme_process_aers(void *opaque)
@@ -1856,7 +2082,7 @@ static inline bool nvme_is_write(NvmeRequest *req)
 
 static AioContext *nvme_get_aio_context(BlockAIOCB *acb)
 {
-    return qemu_get_aio_context();
+    return acb->bs ? bdrv_get_aio_context(acb->bs) : qemu_get_aio_context();
 }
 
 static void nvme_misc_cb(void *opaque, int ret)
@@ -2229,12 +2455,15 @@ static const AIOCBInfo nvme_dsm_aiocb_info = {
 static void nvme_dsm_bh(void *opaque)
 {
     NvmeDSMAIOCB *iocb = opaque;
+    NvmeCtrl *n = nvme_ctrl(iocb->req);
 
+    nvme_lock(n);
     iocb->common.cb(iocb->common.opaque, iocb->ret);
 
     qemu_bh_delete(iocb->bh);
     iocb->bh = NULL;
     qemu_aio_unref(iocb);
+    nvme_unlock(n);
 }
 
 static void nvme_dsm_cb(void *opaque, int ret);
@@ -2349,7 +2578,7 @@ static uint16_t nvme_dsm(NvmeCtrl *n, NvmeRequest *req)
                                          nvme_misc_cb, req);
 
         iocb->req = req;
-        iocb->bh = qemu_bh_new(nvme_dsm_bh, iocb);
+        iocb->bh = aio_bh_new(n->ctx, nvme_dsm_bh, iocb);
         iocb->ret = 0;
         iocb->range = g_new(NvmeDsmRange, nr);
         iocb->nr = nr;
@@ -2474,9 +2703,11 @@ static void nvme_copy_bh(void *opaque)
 {
     NvmeCopyAIOCB *iocb = opaque;
     NvmeRequest *req = iocb->req;
+    NvmeCtrl *n = nvme_ctrl(req);
     NvmeNamespace *ns = req->ns;
     BlockAcctStats *stats = blk_get_stats(ns->blkconf.blk);
 
+    nvme_lock(n);
     if (iocb->idx != iocb->nr) {
         req->cqe.result = cpu_to_le32(iocb->idx);
     }
@@ -2497,6 +2728,7 @@ static void nvme_copy_bh(void *opaque)
 
     iocb->common.cb(iocb->common.opaque, iocb->ret);
     qemu_aio_unref(iocb);
+    nvme_unlock(n);
 }
 
 static void nvme_copy_cb(void *opaque, int ret);
@@ -2833,7 +3065,7 @@ static uint16_t nvme_copy(NvmeCtrl *n, NvmeRequest *req)
     }
 
     iocb->req = req;
-    iocb->bh = qemu_bh_new(nvme_copy_bh, iocb);
+    iocb->bh = aio_bh_new(n->ctx, nvme_copy_bh, iocb);
     iocb->ret = 0;
     iocb->nr = nr;
     iocb->idx = 0;
@@ -2982,6 +3214,7 @@ static void nvme_flush_bh(void *opaque)
     NvmeCtrl *n = nvme_ctrl(req);
     int i;
 
+    nvme_lock(n);
     if (iocb->ret < 0) {
         goto done;
     }
@@ -3001,6 +3234,7 @@ static void nvme_flush_bh(void *opaque)
     }
 
     nvme_flush_ns_cb(iocb, 0);
+    nvme_unlock(n);
     return;
 
 done:
@@ -3010,8 +3244,7 @@ done:
     iocb->common.cb(iocb->common.opaque, iocb->ret);
 
     qemu_aio_unref(iocb);
-
-    return;
+    nvme_unlock(n);
 }
 
 static uint16_t nvme_flush(NvmeCtrl *n, NvmeRequest *req)
@@ -3023,7 +3256,7 @@ static uint16_t nvme_flush(NvmeCtrl *n, NvmeRequest *req)
     iocb = qemu_aio_get(&nvme_flush_aiocb_info, NULL, nvme_misc_cb, req);
 
     iocb->req = req;
-    iocb->bh = qemu_bh_new(nvme_flush_bh, iocb);
+    iocb->bh = aio_bh_new(n->ctx, nvme_flush_bh, iocb);
     iocb->ret = 0;
     iocb->ns = NULL;
     iocb->nsid = 0;
@@ -3495,12 +3728,15 @@ static const AIOCBInfo nvme_zone_reset_aiocb_info = {
 static void nvme_zone_reset_bh(void *opaque)
 {
     NvmeZoneResetAIOCB *iocb = opaque;
+    NvmeCtrl *n = nvme_ctrl(iocb->req);
 
+    nvme_lock(n);
     iocb->common.cb(iocb->common.opaque, iocb->ret);
 
     qemu_bh_delete(iocb->bh);
     iocb->bh = NULL;
     qemu_aio_unref(iocb);
+    nvme_unlock(n);
 }
 
 static void nvme_zone_reset_cb(void *opaque, int ret);
@@ -3657,7 +3893,7 @@ static uint16_t nvme_zone_mgmt_send(NvmeCtrl *n, NvmeRequest *req)
                            nvme_misc_cb, req);
 
         iocb->req = req;
-        iocb->bh = qemu_bh_new(nvme_zone_reset_bh, iocb);
+        iocb->bh = aio_bh_new(n->ctx, nvme_zone_reset_bh, iocb);
         iocb->ret = 0;
         iocb->all = all;
         iocb->idx = zone_idx;
@@ -3923,10 +4159,117 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeRequest *req)
     return NVME_INVALID_OPCODE | NVME_DNR;
 }
 
+/* CAP.DSTRD is 0, so doorbells are 4 bytes apart starting at 1000h */
+static inline hwaddr nvme_sq_db(uint16_t sqid)
+{
+    return sqid << 3;
+}
+
+static inline hwaddr nvme_cq_db(uint16_t cqid)
+{
+    return (cqid << 3) + (1 << 2);
+}
+
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeQueueBH *qbh = container_of(e, NvmeQueueBH, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq_bh(qbh);
+    }
+}
+
+static void nvme_cq_notifier(EventNotifier *e)
+{
+    NvmeQueueBH *qbh = container_of(e, NvmeQueueBH, notifier);
+    NvmeCtrl *n = qbh->ctrl;
+    NvmeCQueue *cq;
+    bool full;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    nvme_lock(n);
+    cq = n->cq[qbh->qid];
+    if (cq) {
+        full = nvme_cq_full(cq);
+        nvme_update_cq_head(cq);
+        nvme_cq_head_updated(n, cq, full);
+    }
+    nvme_unlock(n);
+}
+
+/*
+ * An ioeventfd drops the value written to the doorbell, so it is only used
+ * for I/O queues once the host also writes their doorbells to the shadow
+ * doorbell buffer.
+ */
+static void nvme_init_ioeventfd(NvmeCtrl *n, NvmeQueueBH *qbh, hwaddr offset,
+                                EventNotifierHandler *handler)
+{
+    if (qbh->ioeventfd_enabled) {
+        return;
+    }
+
+    if (!qbh->notifier_initialized) {
+        if (event_notifier_init(&qbh->notifier, 0) < 0) {
+            /* keep trapping the doorbell write */
+            return;
+        }
+        qbh->notifier_initialized = true;
+    }
+
+    trace_pci_nvme_ioeventfd(offset);
+    aio_set_event_notifier(n->ctx, &qbh->notifier, true, handler, NULL);
+    memory_region_add_eventfd(&n->iomem, 0x1000 + offset, 4, false, 0,
+                              &qbh->notifier);
+    qbh->ioeventfd_enabled = true;
+}
+
+static void nvme_cleanup_ioeventfd(NvmeCtrl *n, NvmeQueueBH *qbh,
+                                   hwaddr offset)
+{
+    if (!qbh->ioeventfd_enabled) {
+        return;
+    }
+
+    memory_region_del_eventfd(&n->iomem, 0x1000 + offset, 4, false, 0,
+                              &qbh->notifier);
+    aio_set_event_notifier(n->ctx, &qbh->notifier, true, NULL, NULL);
+    qbh->ioeventfd_enabled = false;
+}
+
+static void nvme_init_sq_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    sq->db_addr = n->dbbuf_dbs + nvme_sq_db(sq->sqid);
+    sq->ei_addr = n->dbbuf_eis + nvme_sq_db(sq->sqid);
+    nvme_dbbuf_write(n, sq->db_addr, sq->tail);
+    nvme_dbbuf_write(n, sq->ei_addr, sq->tail);
+
+    if (n->params.ioeventfd && sq->sqid) {
+        nvme_init_ioeventfd(n, &n->sq_bh[sq->sqid], nvme_sq_db(sq->sqid),
+                            nvme_sq_notifier);
+    }
+}
+
+static void nvme_init_cq_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    cq->db_addr = n->dbbuf_dbs + nvme_cq_db(cq->cqid);
+    cq->ei_addr = n->dbbuf_eis + nvme_cq_db(cq->cqid);
+    nvme_dbbuf_write(n, cq->db_addr, cq->head);
+    nvme_dbbuf_write(n, cq->ei_addr, cq->head);
+
+    if (n->params.ioeventfd && cq->cqid) {
+        nvme_init_ioeventfd(n, &n->cq_bh[cq->cqid], nvme_cq_db(cq->cqid),
+                            nvme_cq_notifier);
+    }
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
+    nvme_cleanup_ioeventfd(n, &n->sq_bh[sq->sqid], nvme_sq_db(sq->sqid));
     n->sq[sq->sqid] = NULL;
-    timer_free(sq->timer);
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -3986,6 +4329,7 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->size = size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->db_addr = sq->ei_addr = 0;
     sq->io_req = g_new0(NvmeRequest, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -3994,7 +4338,10 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->bh = n->sq_bh[sqid].bh;
+    if (n->dbbuf_enabled) {
+        nvme_init_sq_dbbuf(n, sq);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
@@ -4293,8 +4640,8 @@ static uint16_t nvme_get_log(NvmeCtrl *n, NvmeRequest *req)
 
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
+    nvme_cleanup_ioeventfd(n, &n->cq_bh[cq->cqid], nvme_cq_db(cq->cqid));
     n->cq[cq->cqid] = NULL;
-    timer_free(cq->timer);
     if (msix_enabled(&n->parent_obj)) {
         msix_vector_unuse(&n->parent_obj, cq->vector);
     }
@@ -4348,10 +4695,14 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->db_addr = cq->ei_addr = 0;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
+    cq->bh = n->cq_bh[cqid].bh;
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    if (n->dbbuf_enabled) {
+        nvme_init_cq_dbbuf(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeRequest *req)
@@ -5290,6 +5641,7 @@ static const AIOCBInfo nvme_format_aiocb_info = {
     .get_aio_context = nvme_get_aio_context,
 };
 
+/* Context: nvme_lock() held, the namespace format is controller state */
 static void nvme_format_set(NvmeNamespace *ns, NvmeCmd *cmd)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
@@ -5310,9 +5662,11 @@ static void nvme_format_ns_cb(void *opaque, int ret)
 {
     NvmeFormatAIOCB *iocb = opaque;
     NvmeRequest *req = iocb->req;
+    NvmeCtrl *n = nvme_ctrl(req);
     NvmeNamespace *ns = iocb->ns;
     int bytes;
 
+    nvme_lock(n);
     if (ret < 0) {
         iocb->ret = ret;
         goto done;
@@ -5328,6 +5682,7 @@ static void nvme_format_ns_cb(void *opaque, int ret)
                                             nvme_format_ns_cb, iocb);
 
         iocb->offset += bytes;
+        nvme_unlock(n);
         return;
     }
 
@@ -5339,6 +5694,7 @@ static void nvme_format_ns_cb(void *opaque, int ret)
 done:
     iocb->aiocb = NULL;
     qemu_bh_schedule(iocb->bh);
+    nvme_unlock(n);
 }
 
 static uint16_t nvme_format_check(NvmeNamespace *ns, uint8_t lbaf, uint8_t pi)
@@ -5373,6 +5729,7 @@ static void nvme_format_bh(void *opaque)
     uint16_t status;
     int i;
 
+    nvme_lock(n);
     if (iocb->ret < 0) {
         goto done;
     }
@@ -5399,6 +5756,7 @@ static void nvme_format_bh(void *opaque)
 
     iocb->ns->status = NVME_FORMAT_IN_PROGRESS;
     nvme_format_ns_cb(iocb, 0);
+    nvme_unlock(n);
     return;
 
 done:
@@ -5408,6 +5766,7 @@ done:
     iocb->common.cb(iocb->common.opaque, iocb->ret);
 
     qemu_aio_unref(iocb);
+    nvme_unlock(n);
 }
 
 static uint16_t nvme_format(NvmeCtrl *n, NvmeRequest *req)
@@ -5419,7 +5778,7 @@ static uint16_t nvme_format(NvmeCtrl *n, NvmeRequest *req)
     iocb = qemu_aio_get(&nvme_format_aiocb_info, NULL, nvme_misc_cb, req);
 
     iocb->req = req;
-    iocb->bh = qemu_bh_new(nvme_format_bh, iocb);
+    iocb->bh = aio_bh_new(n->ctx, nvme_format_bh, iocb);
     iocb->ret = 0;
     iocb->ns = NULL;
     iocb->nsid = 0;
@@ -5451,6 +5810,38 @@ out:
     return status;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, const NvmeRequest *req)
+{
+    uint64_t dbs_addr = le64_to_cpu(req->cmd.dptr.prp1);
+    uint64_t eis_addr = le64_to_cpu(req->cmd.dptr.prp2);
+    int i;
+
+    trace_pci_nvme_dbbuf_config(dbs_addr, eis_addr);
+
+    /* both buffers are memory page aligned */
+    if (!dbs_addr || !eis_addr ||
+        dbs_addr & (n->page_size - 1) || eis_addr & (n->page_size - 1)) {
+        trace_pci_nvme_err_invalid_dbbuf_addr(dbs_addr, eis_addr);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n, n->sq[i]);
+        }
+
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n, n->cq[i]);
+        }
+    }
+
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeRequest *req)
 {
     trace_pci_nvme_admin_cmd(nvme_cid(req), nvme_sqid(req), req->cmd.opcode,
@@ -5491,6 +5882,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeRequest *req)
         return nvme_ns_attachment(n, req);
     case NVME_ADM_CMD_FORMAT_NVM:
         return nvme_format(n, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, req);
     default:
         assert(false);
     }
@@ -5509,6 +5902,10 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         if (nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd))) {
@@ -5532,9 +5929,31 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (sq->db_addr) {
+            /*
+             * Publish the tail consumed so far after every command, so the
+             * host only rings the doorbell for entries this loop will not
+             * pick up, then catch updates that raced with it.
+             */
+            nvme_update_sq_eventidx(sq);
+            nvme_update_sq_tail(sq);
+        }
     }
 }
 
+static void nvme_process_sq_bh(void *opaque)
+{
+    NvmeQueueBH *qbh = opaque;
+    NvmeCtrl *n = qbh->ctrl;
+
+    nvme_lock(n);
+    if (n->sq[qbh->qid]) {
+        nvme_process_sq(n->sq[qbh->qid]);
+    }
+    nvme_unlock(n);
+}
+
 static void nvme_ctrl_reset(NvmeCtrl *n)
 {
     NvmeNamespace *ns;
@@ -5569,6 +5988,10 @@ static void nvme_ctrl_reset(NvmeCtrl *n)
     n->aer_queued = 0;
     n->outstanding_aers = 0;
     n->qs_created = false;
+
+    n->dbbuf_dbs = 0;
+    n->dbbuf_eis = 0;
+    n->dbbuf_enabled = false;
 }
 
 static void nvme_ctrl_shutdown(NvmeCtrl *n)
@@ -5982,6 +6405,7 @@ static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
 {
     NvmeCtrl *n = (NvmeCtrl *)opaque;
     uint8_t *ptr = (uint8_t *)&n->bar;
+    uint64_t val;
 
     trace_pci_nvme_mmio_read(addr, size);
 
@@ -6015,7 +6439,11 @@ static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
         memory_region_msync(&n->pmr.dev->mr, 0, n->pmr.dev->size);
     }
 
-    return ldn_le_p(ptr + addr, size);
+    nvme_lock(n);
+    val = ldn_le_p(ptr + addr, size);
+    nvme_unlock(n);
+
+    return val;
 }
 
 static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
@@ -6086,21 +6514,16 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
         start_sqs = nvme_cq_full(cq) ? 1 : 0;
         cq->head = new_head;
-        if (start_sqs) {
-            NvmeSQueue *sq;
-            QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-            }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        if (!qid && cq->db_addr) {
+            /*
+             * The host should write the shadow doorbell first, but drivers
+             * (Linux included) do not shadow the admin queue doorbells, so
+             * keep it in sync from here.
+             */
+            nvme_dbbuf_write(n, cq->db_addr, cq->head);
         }
 
-        if (cq->tail == cq->head) {
-            if (cq->irq_enabled) {
-                n->cq_pending--;
-            }
-
-            nvme_irq_deassert(n, cq);
-        }
+        nvme_cq_head_updated(n, cq, start_sqs);
     } else {
         /* Submission queue doorbell write */
 
@@ -6143,7 +6566,12 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         trace_pci_nvme_mmio_doorbell_sq(sq->sqid, new_tail);
 
         sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        if (!qid && sq->db_addr) {
+            /* see the completion queue doorbell above */
+            nvme_dbbuf_write(n, sq->db_addr, sq->tail);
+        }
+
+        qemu_bh_schedule(sq->bh);
     }
 }
 
@@ -6154,11 +6582,13 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
 
     trace_pci_nvme_mmio_write(addr, data, size);
 
+    nvme_lock(n);
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else {
         nvme_process_db(n, addr, data);
     }
+    nvme_unlock(n);
 }
 
 static const MemoryRegionOps nvme_mmio_ops = {
@@ -6259,11 +6689,37 @@ static void nvme_check_constraints(NvmeCtrl *n, Error **errp)
 
 static void nvme_init_state(NvmeCtrl *n)
 {
+    int i;
+
     /* add one to max_ioqpairs to account for the admin queue pair */
     n->reg_size = pow2ceil(sizeof(NvmeBar) +
                            2 * (n->params.max_ioqpairs + 1) * NVME_DB_SIZE);
     n->sq = g_new0(NvmeSQueue *, n->params.max_ioqpairs + 1);
     n->cq = g_new0(NvmeCQueue *, n->params.max_ioqpairs + 1);
+
+    if (n->iothread) {
+        n->ctx = iothread_get_aio_context(n->iothread);
+        object_ref(OBJECT(n->iothread));
+        n->irq_bh = qemu_bh_new(nvme_irq_bh, n);
+        n->irq_msix_pending = bitmap_new(n->params.msix_qsize);
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+
+    /*
+     * Creating and deleting queues does MSI-X vector bookkeeping, which needs
+     * the BQL, so the admin queue pair always runs in the main loop.
+     */
+    n->sq_bh = g_new0(NvmeQueueBH, n->params.max_ioqpairs + 1);
+    n->cq_bh = g_new0(NvmeQueueBH, n->params.max_ioqpairs + 1);
+    for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        AioContext *ctx = i ? n->ctx : qemu_get_aio_context();
+
+        n->sq_bh[i].ctrl = n->cq_bh[i].ctrl = n;
+        n->sq_bh[i].qid = n->cq_bh[i].qid = i;
+        n->sq_bh[i].bh = aio_bh_new(ctx, nvme_process_sq_bh, &n->sq_bh[i]);
+        n->cq_bh[i].bh = aio_bh_new(ctx, nvme_post_cqes_bh, &n->cq_bh[i]);
+    }
     n->temperature = NVME_TEMPERATURE;
     n->features.temp_thresh_hi = NVME_TEMPERATURE_WARNING;
     n->starttime_ms = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
@@ -6420,7 +6876,8 @@ static void nvme_init_ctrl(NvmeCtrl *n, PCIDevice *pci_dev)
 
     id->mdts = n->params.mdts;
     id->ver = cpu_to_le32(NVME_SPEC_VER);
-    id->oacs = cpu_to_le16(NVME_OACS_NS_MGMT | NVME_OACS_FORMAT);
+    id->oacs = cpu_to_le16(NVME_OACS_NS_MGMT | NVME_OACS_FORMAT |
+                           NVME_OACS_DBBUF);
     id->cntrltype = 0x1;
 
     /*
@@ -6553,17 +7010,39 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
             return;
         }
 
+        if (nvme_ns_set_aio_context(ns, n->ctx, errp) < 0) {
+            return;
+        }
+
         nvme_attach_ns(n, ns);
     }
 }
 
+static void nvme_iothread_sync_bh(void *opaque)
+{
+}
+
 static void nvme_exit(PCIDevice *pci_dev)
 {
     NvmeCtrl *n = NVME(pci_dev);
     NvmeNamespace *ns;
     int i;
 
+    nvme_lock(n);
     nvme_ctrl_reset(n);
+    for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        qemu_bh_delete(n->sq_bh[i].bh);
+        qemu_bh_delete(n->cq_bh[i].bh);
+    }
+    if (n->iothread) {
+        /* let the IOThread finish a queue bottom half it already started */
+        aio_wait_bh_oneshot(n->ctx, nvme_iothread_sync_bh, n);
+    }
+    nvme_unlock(n);
+
+    if (n->namespace.blkconf.blk) {
+        nvme_ns_set_aio_context(&n->namespace, qemu_get_aio_context(), NULL);
+    }
 
     if (n->subsys) {
         for (i = 1; i <= NVME_MAX_NAMESPACES; i++) {
@@ -6576,6 +7055,23 @@ static void nvme_exit(PCIDevice *pci_dev)
         nvme_subsys_unregister_ctrl(n->subsys, n);
     }
 
+    for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        if (n->sq_bh[i].notifier_initialized) {
+            event_notifier_cleanup(&n->sq_bh[i].notifier);
+        }
+        if (n->cq_bh[i].notifier_initialized) {
+            event_notifier_cleanup(&n->cq_bh[i].notifier);
+        }
+    }
+
+    if (n->iothread) {
+        qemu_bh_delete(n->irq_bh);
+        g_free(n->irq_msix_pending);
+        object_unref(OBJECT(n->iothread));
+    }
+
+    g_free(n->cq_bh);
+    g_free(n->sq_bh);
     g_free(n->cq);
     g_free(n->sq);
     g_free(n->aer_reqs);
@@ -6597,6 +7093,8 @@ static Property nvme_props[] = {
                      HostMemoryBackend *),
     DEFINE_PROP_LINK("subsys", NvmeCtrl, subsys, TYPE_NVME_SUBSYS,
                      NvmeSubsystem *),
+    DEFINE_PROP_LINK("iothread", NvmeCtrl, iothread, TYPE_IOTHREAD,
+                     IOThread *),
     DEFINE_PROP_STRING("serial", NvmeCtrl, params.serial),
     DEFINE_PROP_UINT32("cmb_size_mb", NvmeCtrl, params.cmb_size_mb, 0),
     DEFINE_PROP_UINT32("num_queues", NvmeCtrl, params.num_queues, 0),
@@ -6608,6 +7106,7 @@ static Property nvme_props[] = {
     DEFINE_PROP_UINT8("vsl", NvmeCtrl, params.vsl, 7),
     DEFINE_PROP_BOOL("use-intel-id", NvmeCtrl, params.use_intel_id, false),
     DEFINE_PROP_BOOL("legacy-cmb", NvmeCtrl, params.legacy_cmb, false),
+    DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, params.ioeventfd, false),
     DEFINE_PROP_UINT8("zoned.zasl", NvmeCtrl, params.zasl, 0),
     DEFINE_PROP_BOOL("zoned.auto_transition", NvmeCtrl,
                      params.auto_transition_zones, true),
@@ -6645,6 +7144,7 @@ static void nvme_set_smart_warning(Object *obj, Visitor *v, const char *name,
         return;
     }
 
+    nvme_lock(n);
     old_value = n->smart_critical_warning;
     n->smart_critical_warning = value;
 
@@ -6654,6 +7154,7 @@ static void nvme_set_smart_warning(Object *obj, Visitor *v, const char *name,
         if (value & ~old_value & event)
             nvme_smart_event(n, event);
     }
+    nvme_unlock(n);
 }
 
 static const VMStateDescription nvme_vmstate = {
@@ -441,12 +441,38 @@ void nvme_ns_cleanup(NvmeNamespace *ns)
     }
 }
 
+/*
+ * Move the backing BlockBackend to the AioContext the controller processes
+ * its queues in.
+ */
+int nvme_ns_set_aio_context(NvmeNamespace *ns, AioContext *ctx, Error **errp)
+{
+    AioContext *old_context = blk_get_aio_context(ns->blkconf.blk);
+    int ret;
+
+    if (old_context == ctx) {
+        return 0;
+    }
+
+    aio_context_acquire(old_context);
+    ret = blk_set_aio_context(ns->blkconf.blk, ctx, errp);
+    aio_context_release(old_context);
+
+    return ret;
+}
+
 static void nvme_ns_unrealize(DeviceState *dev)
 {
     NvmeNamespace *ns = NVME_NS(dev);
+    AioContext *ctx = blk_get_aio_context(ns->blkconf.blk);
 
+    aio_context_acquire(ctx);
     nvme_ns_drain(ns);
     nvme_ns_shutdown(ns);
+    aio_context_release(ctx);
+
+    /* if other users keep the BlockBackend in the IOThread, that's ok */
+    nvme_ns_set_aio_context(ns, qemu_get_aio_context(), NULL);
     nvme_ns_cleanup(ns);
 }
 
@@ -485,6 +511,10 @@ static void nvme_ns_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (nvme_ns_set_aio_context(ns, n->ctx, errp) < 0) {
+        return;
+    }
+
     if (!nsid) {
         for (i = 1; i <= NVME_MAX_NAMESPACES; i++) {
             if (nvme_ns(n, i) || nvme_subsys_ns(subsys, i)) {
@@ -21,6 +21,8 @@
 #include "qemu/uuid.h"
 #include "hw/pci/pci.h"
 #include "hw/block/block.h"
+#include "sysemu/iothread.h"
+#include "qemu/event_notifier.h"
 
 #include "block/nvme.h"
 
@@ -259,6 +261,7 @@ int nvme_ns_setup(NvmeNamespace *ns, Error **errp);
 void nvme_ns_drain(NvmeNamespace *ns);
 void nvme_ns_shutdown(NvmeNamespace *ns);
 void nvme_ns_cleanup(NvmeNamespace *ns);
+int nvme_ns_set_aio_context(NvmeNamespace *ns, AioContext *ctx, Error **errp);
 
 typedef struct NvmeAsyncEvent {
     QTAILQ_ENTRY(NvmeAsyncEvent) entry;
@@ -320,6 +323,7 @@ static inline const char *nvme_adm_opc_str(uint8_t opc)
     case NVME_ADM_CMD_GET_FEATURES:     return "NVME_ADM_CMD_GET_FEATURES";
     case NVME_ADM_CMD_ASYNC_EV_REQ:     return "NVME_ADM_CMD_ASYNC_EV_REQ";
     case NVME_ADM_CMD_NS_ATTACHMENT:    return "NVME_ADM_CMD_NS_ATTACHMENT";
+    case NVME_ADM_CMD_DBBUF_CONFIG:     return "NVME_ADM_CMD_DBBUF_CONFIG";
     case NVME_ADM_CMD_FORMAT_NVM:       return "NVME_ADM_CMD_FORMAT_NVM";
     default:                            return "NVME_ADM_CMD_UNKNOWN";
     }
@@ -351,7 +355,9 @@ typedef struct NvmeSQueue {
     uint32_t    tail;
     uint32_t    size;
     uint64_t    dma_addr;
-    QEMUTimer   *timer;
+    uint64_t    db_addr;
+    uint64_t    ei_addr;
+    QEMUBH      *bh;
     NvmeRequest *io_req;
     QTAILQ_HEAD(, NvmeRequest) req_list;
     QTAILQ_HEAD(, NvmeRequest) out_req_list;
@@ -368,11 +374,27 @@ typedef struct NvmeCQueue {
     uint32_t    vector;
     uint32_t    size;
     uint64_t    dma_addr;
-    QEMUTimer   *timer;
+    uint64_t    db_addr;
+    uint64_t    ei_addr;
+    QEMUBH      *bh;
     QTAILQ_HEAD(, NvmeSQueue) sq_list;
     QTAILQ_HEAD(, NvmeRequest) req_list;
 } NvmeCQueue;
 
+/*
+ * Queue bottom halves and doorbell notifiers live as long as the controller
+ * and look their queue up by id, so a queue can be deleted while its bottom
+ * half is pending or its doorbell is being signalled.
+ */
+typedef struct NvmeQueueBH {
+    struct NvmeCtrl *ctrl;
+    uint16_t        qid;
+    QEMUBH          *bh;
+    EventNotifier   notifier;
+    bool            notifier_initialized;
+    bool            ioeventfd_enabled;
+} NvmeQueueBH;
+
 #define TYPE_NVME "nvme"
 #define NVME(obj) \
         OBJECT_CHECK(NvmeCtrl, (obj), TYPE_NVME)
@@ -391,6 +413,7 @@ typedef struct NvmeParams {
     uint8_t  zasl;
     bool     auto_transition_zones;
     bool     legacy_cmb;
+    bool     ioeventfd;
 } NvmeParams;
 
 typedef struct NvmeCtrl {
@@ -439,6 +462,11 @@ typedef struct NvmeCtrl {
 
     uint32_t    dmrsl;
 
+    /* shadow doorbell and EventIdx buffers (Doorbell Buffer Config) */
+    uint64_t    dbbuf_dbs;
+    uint64_t    dbbuf_eis;
+    bool        dbbuf_enabled;
+
     /* Namespace ID is started with 1 so bitmap should be 1-based */
 #define NVME_CHANGED_NSID_SIZE  (NVME_MAX_NAMESPACES + 1)
     DECLARE_BITMAP(changed_nsids, NVME_CHANGED_NSID_SIZE);
@@ -451,8 +479,18 @@ typedef struct NvmeCtrl {
     NvmeCQueue      **cq;
     NvmeSQueue      admin_sq;
     NvmeCQueue      admin_cq;
+    NvmeQueueBH     *sq_bh;
+    NvmeQueueBH     *cq_bh;
     NvmeIdCtrl      id_ctrl;
 
+    IOThread        *iothread;
+    AioContext      *ctx;
+
+    /* interrupts raised from the IOThread, injected by the main loop */
+    QEMUBH          *irq_bh;
+    unsigned long   *irq_msix_pending;
+    bool            irq_pin_pending;
+
     struct {
         struct {
             uint16_t temp_thresh_hi;
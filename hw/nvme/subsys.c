@@ -14,7 +14,16 @@
 int nvme_subsys_register_ctrl(NvmeCtrl *n, Error **errp)
 {
     NvmeSubsystem *subsys = n->subsys;
-    int cntlid;
+    int cntlid, i;
+
+    /* shared namespaces can only live in one AioContext */
+    for (i = 0; i < ARRAY_SIZE(subsys->ctrls); i++) {
+        if (subsys->ctrls[i] && subsys->ctrls[i]->iothread != n->iothread) {
+            error_setg(errp, "all controllers in a subsystem must use the "
+                       "same iothread");
+            return -1;
+        }
+    }
 
     for (cntlid = 0; cntlid < ARRAY_SIZE(subsys->ctrls); cntlid++) {
         if (!subsys->ctrls[cntlid]) {
@@ -86,6 +86,11 @@ struct BlockAcctStats {
     uint64_t failed_ops[BLOCK_MAX_IOTYPE];
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
     uint64_t merged[BLOCK_MAX_IOTYPE];
+    uint64_t submit_batches;
+    uint64_t submit_batch_reqs;
+    uint64_t complete_batches;
+    uint64_t complete_batch_reqs;
+    uint64_t complete_delay_ns;
     int64_t last_access_time_ns;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
     bool account_invalid;
@@ -113,6 +118,9 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
+void block_acct_submit_batch(BlockAcctStats *stats, unsigned int num_requests);
+void block_acct_complete_batch(BlockAcctStats *stats, unsigned int num_requests,
+                               int64_t delay_ns);
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
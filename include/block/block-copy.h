@@ -16,6 +16,7 @@
 #define BLOCK_COPY_H
 
 #include "block/block.h"
+#include "block/job-tuner.h"
 #include "qemu/co-shared-resource.h"
 
 /* All APIs are thread-safe */
@@ -50,10 +51,15 @@ int coroutine_fn block_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
  * must be > 0.
  *
  * @max_chunk means maximum length for one IO operation. Zero means unlimited.
+ *
+ * If @tuner is not NULL, it further limits the number of parallel
+ * coroutines and the length of one IO operation, and is fed with the
+ * results of the copy operations.  It must outlive the call.
  */
 BlockCopyCallState *block_copy_async(BlockCopyState *s,
                                      int64_t offset, int64_t bytes,
                                      int max_workers, int64_t max_chunk,
+                                     BlockJobTuner *tuner,
                                      BlockCopyAsyncCallbackFunc cb,
                                      void *cb_opaque);
 
@@ -91,4 +97,7 @@ void block_copy_call_cancel(BlockCopyCallState *call_state);
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
 
+/* Number of bytes copied with bdrv_co_copy_range() rather than read+write */
+uint64_t block_copy_offloaded_bytes(BlockCopyState *s);
+
 #endif /* BLOCK_COPY_H */
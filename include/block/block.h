@@ -36,6 +36,11 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * True if a compressed write may cover several clusters, which the
+     * driver then compresses in parallel
+     */
+    bool parallel_compressed_writes;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -829,10 +834,9 @@ void bdrv_unregister_buf(BlockDriverState *bs, void *host);
  * by the driver, or if the backend storage doesn't support it, a negative
  * error code will be returned.
  *
- * Note: block layer doesn't emulate or fallback to a bounce buffer approach
- * because usually the caller shouldn't attempt offloaded copy any more (e.g.
- * calling copy_file_range(2)) after the first error, thus it should fall back
- * to a read+write path in the caller level.
+ * Note: block layer doesn't emulate or fallback to a bounce buffer approach,
+ * the caller should fall back to a read+write path itself.  Use
+ * BdrvCopyRangeFallback to decide when to attempt offloaded copy again.
  *
  * @src: Source child to copy data from
  * @src_offset: offset in @src image to read data
@@ -855,6 +859,30 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                                     int64_t bytes, BdrvRequestFlags read_flags,
                                     BdrvRequestFlags write_flags);
 
+/*
+ * Decides when a caller that fell back to read+write after a failed
+ * bdrv_co_copy_range() attempts offloaded copy again.
+ *
+ * -ENOTSUP means that the nodes cannot offload copies at all, so they are
+ * never attempted again.  Other errors may only concern the failed range (it
+ * may not be aligned for sharing extents, or end beyond the end of the source
+ * file), so offloaded copy is attempted again after a number of requests that
+ * doubles with every consecutive failure.
+ *
+ * Not thread-safe, the caller must serialize the calls.
+ */
+typedef struct BdrvCopyRangeFallback {
+    bool disabled;
+    unsigned failures;  /* consecutive failed attempts */
+    unsigned skip;      /* requests to go before the next attempt */
+} BdrvCopyRangeFallback;
+
+void bdrv_copy_range_fallback_init(BdrvCopyRangeFallback *f, bool enabled);
+/* Returns whether the next request should attempt bdrv_co_copy_range() */
+bool bdrv_copy_range_fallback_try(BdrvCopyRangeFallback *f);
+/* Accounts the return value of an attempted bdrv_co_copy_range() */
+void bdrv_copy_range_fallback_done(BdrvCopyRangeFallback *f, int ret);
+
 void bdrv_cancel_in_flight(BlockDriverState *bs);
 
 #endif
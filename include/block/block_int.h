@@ -627,6 +627,15 @@ struct BlockDriver {
     int (*bdrv_co_remove_persistent_dirty_bitmap)(BlockDriverState *bs,
                                                   const char *name,
                                                   Error **errp);
+    /*
+     * Called when a persistent dirty bitmap was changed other than by a
+     * write to the node.  @grown is true if bits may have been set, which
+     * the driver should persist before returning if it keeps the bitmap in
+     * the image up to date while the node is in use.
+     */
+    void (*bdrv_persistent_dirty_bitmap_changed)(BlockDriverState *bs,
+                                                 BdrvDirtyBitmap *bitmap,
+                                                 bool grown);
 
     /**
      * Register/unregister a buffer for I/O. For example, when the driver is
@@ -1236,6 +1245,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
  * driver that the mirror job inserts into the graph above @bs. NULL means that
  * a node name should be autogenerated.
  * @copy_mode: When to trigger writes to the target.
+ * @use_copy_range: Whether to attempt copy offloading for background copies.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -1252,7 +1262,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp);
+                  MirrorCopyMode copy_mode, bool use_copy_range,
+                  Error **errp);
 
 /*
  * backup_job_create:
@@ -0,0 +1,67 @@
+/*
+ * Adaptive request sizing for block jobs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef BLOCK_JOB_TUNER_H
+#define BLOCK_JOB_TUNER_H
+
+#include "qapi/qapi-types-block-core.h"
+#include "qemu/timer.h"
+
+/*
+ * Tunes the request length and the number of parallel requests of a copy
+ * loop from the throughput and latency of its completed requests.
+ *
+ * Requests are sampled over periods of at least BLOCK_JOB_TUNER_PERIOD_NS.
+ * At the end of each period the number of parallel requests is increased
+ * by one if throughput did not drop, and halved if the average latency grew
+ * well above the lowest latency seen without any throughput gain, which
+ * means the requests just queue up somewhere.  The request length is only
+ * changed at the edges: it doubles while parallelism is at its maximum and
+ * still pays off, and halves when parallelism cannot be reduced any more.
+ */
+typedef struct BlockJobTuner {
+    /* Limits, never changed after block_job_tuner_init() */
+    int64_t min_chunk;
+    int64_t max_chunk;
+    int min_in_flight;
+    int max_in_flight;
+
+    /* Current settings, read by the copy loop */
+    int64_t chunk;
+    int in_flight;
+
+    /* Requests completed in the current period */
+    int64_t period_start_ns;
+    uint64_t period_bytes;
+    uint64_t period_ops;
+    uint64_t period_latency_ns;
+
+    /* Results of the last complete period */
+    bool sampled;
+    uint64_t throughput;
+    uint64_t latency_ns;
+    uint64_t base_latency_ns;
+    uint64_t adjustments;
+} BlockJobTuner;
+
+#define BLOCK_JOB_TUNER_PERIOD_NS (100 * SCALE_MS)
+
+void block_job_tuner_init(BlockJobTuner *t,
+                          int64_t chunk, int64_t min_chunk, int64_t max_chunk,
+                          int in_flight, int min_in_flight, int max_in_flight);
+
+/*
+ * Account a request of @bytes that was started at @start_ns and completed
+ * at @now_ns with result @ret.  Failed requests reduce parallelism at once.
+ */
+void block_job_tuner_done(BlockJobTuner *t, int64_t bytes,
+                          int64_t start_ns, int64_t now_ns, int ret);
+
+/* Returns NULL until the first sampling period has completed */
+BlockJobTuningInfo *block_job_tuner_info(BlockJobTuner *t);
+
+#endif /* BLOCK_JOB_TUNER_H */
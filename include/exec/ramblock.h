@@ -69,6 +69,17 @@ struct RAMBlock {
      * could not have been valid on the source.
      */
     ram_addr_t postcopy_length;
+
+    /*
+     * With the mapped-ram migration capability, every page of the block
+     * has a fixed location in the migration file: page N is stored at
+     * pages_offset + N * TARGET_PAGE_SIZE.  file_bmap tracks the pages
+     * whose data is present there and is itself saved at bitmap_offset
+     * when the migration completes.  Only used on the source.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 #endif
 #endif
@@ -45,6 +45,8 @@ struct VirtIOBlkConf
     uint32_t max_discard_sectors;
     uint32_t max_write_zeroes_sectors;
     bool x_enable_wce_if_config_wce;
+    uint32_t notify_coalesce_usecs;
+    uint32_t notify_coalesce_frames;
 };
 
 struct VirtIOBlockDataPlane;
@@ -90,7 +92,8 @@ typedef struct MultiReqBuffer {
     bool is_write;
 } MultiReqBuffer;
 
-bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
+void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb);
+bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq, MultiReqBuffer *mrb);
 void virtio_blk_process_queued_requests(VirtIOBlock *s, bool is_bh);
 
 #endif
@@ -18,6 +18,7 @@
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
 #include "net/announce.h"
+#include "sysemu/iothread.h"
 #include "qemu/option_int.h"
 #include "qom/object.h"
 
@@ -47,6 +48,8 @@ typedef struct virtio_net_conf
     char *duplex_str;
     uint8_t duplex;
     char *primary_id_str;
+    uint32_t num_iothreads;
+    char **iothread_ids;
 } virtio_net_conf;
 
 /* Coalesced packets type & status */
@@ -147,6 +150,11 @@ typedef struct VirtIONetQueue {
     VirtQueue *tx_vq;
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
+    /* IOThread serving this queue pair, NULL for the main loop */
+    AioContext *ctx;
+    /* Inside virtio_net_receive_batch(), the guest is notified at the end */
+    bool rx_batching;
+    bool rx_notify_pending;
     uint32_t tx_waiting;
     struct {
         VirtQueueElement *elem;
@@ -213,6 +221,9 @@ struct VirtIONet {
     VirtioNetRssData rss_data;
     struct NetRxPkt *rx_pkt;
     struct EBPFRSSContext ebpf_rss;
+    IOThread **iothreads;
+    bool dataplane_started;
+    bool saved_guest_notifier_mask;
 };
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -32,12 +32,16 @@ OBJECT_DECLARE_TYPE(QIOChannel, QIOChannelClass,
 
 #define QIO_CHANNEL_ERR_BLOCK -2
 
+#define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY 0x1
+
 typedef enum QIOChannelFeature QIOChannelFeature;
 
 enum QIOChannelFeature {
     QIO_CHANNEL_FEATURE_FD_PASS,
     QIO_CHANNEL_FEATURE_SHUTDOWN,
     QIO_CHANNEL_FEATURE_LISTEN,
+    QIO_CHANNEL_FEATURE_SEEKABLE,
+    QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY,
 };
 
 
@@ -104,6 +108,7 @@ struct QIOChannelClass {
                          size_t niov,
                          int *fds,
                          size_t nfds,
+                         int flags,
                          Error **errp);
     ssize_t (*io_readv)(QIOChannel *ioc,
                         const struct iovec *iov,
@@ -131,6 +136,18 @@ struct QIOChannelClass {
                      off_t offset,
                      int whence,
                      Error **errp);
+    ssize_t (*io_pwritev)(QIOChannel *ioc,
+                          const struct iovec *iov,
+                          size_t niov,
+                          off_t offset,
+                          Error **errp);
+    ssize_t (*io_preadv)(QIOChannel *ioc,
+                         const struct iovec *iov,
+                         size_t niov,
+                         off_t offset,
+                         Error **errp);
+    int (*io_flush)(QIOChannel *ioc,
+                    Error **errp);
     void (*io_set_aio_fd_handler)(QIOChannel *ioc,
                                   AioContext *ctx,
                                   IOHandler *io_read,
@@ -228,6 +245,7 @@ ssize_t qio_channel_readv_full(QIOChannel *ioc,
  * @niov: the length of the @iov array
  * @fds: an array of file handles to send
  * @nfds: number of file handles in @fds
+ * @flags: write flags (QIO_CHANNEL_WRITE_FLAG_*)
  * @errp: pointer to a NULL-initialized error object
  *
  * Write data to the IO channel, reading it from the
@@ -251,6 +269,14 @@ ssize_t qio_channel_readv_full(QIOChannel *ioc,
  * unless qio_channel_has_feature() returns a true
  * value for the QIO_CHANNEL_FEATURE_FD_PASS constant.
  *
+ * If @flags contains QIO_CHANNEL_WRITE_FLAG_ZERO_COPY
+ * the data is not copied by the kernel; the caller
+ * must keep the memory referenced by @iov unmodified
+ * until qio_channel_flush() has returned. It is an
+ * error to pass this flag unless qio_channel_has_feature()
+ * returns a true value for the
+ * QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY constant.
+ *
  * Returns: the number of bytes sent, or -1 on error,
  * or QIO_CHANNEL_ERR_BLOCK if no data is can be sent
  * and the channel is non-blocking
@@ -260,6 +286,7 @@ ssize_t qio_channel_writev_full(QIOChannel *ioc,
                                 size_t niov,
                                 int *fds,
                                 size_t nfds,
+                                int flags,
                                 Error **errp);
 
 /**
@@ -598,6 +625,76 @@ off_t qio_channel_io_seek(QIOChannel *ioc,
                           int whence,
                           Error **errp);
 
+/**
+ * qio_channel_pwritev:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @offset: offset in the channel where writes should begin
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Write data from the memory regions referenced by @iov to
+ * the channel, starting at @offset, without moving the
+ * current I/O position of the channel. Not all channels
+ * support positioned I/O; callers should check for the
+ * QIO_CHANNEL_FEATURE_SEEKABLE feature first.
+ *
+ * Like qio_channel_writev(), this may write less data than
+ * requested.
+ *
+ * Returns: the number of bytes written, or -1 on error
+ */
+ssize_t qio_channel_pwritev(QIOChannel *ioc, const struct iovec *iov,
+                            size_t niov, off_t offset, Error **errp);
+
+/**
+ * qio_channel_pwrite:
+ * @ioc: the channel object
+ * @buf: the memory region to write data from
+ * @buflen: the number of bytes in @buf
+ * @offset: offset in the channel where writes should begin
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves as qio_channel_pwritev() but for a single buffer.
+ */
+ssize_t qio_channel_pwrite(QIOChannel *ioc, char *buf, size_t buflen,
+                           off_t offset, Error **errp);
+
+/**
+ * qio_channel_preadv:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to read data into
+ * @niov: the length of the @iov array
+ * @offset: offset in the channel where reads should begin
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Read data from the channel, starting at @offset, into the
+ * memory regions referenced by @iov, without moving the
+ * current I/O position of the channel. Not all channels
+ * support positioned I/O; callers should check for the
+ * QIO_CHANNEL_FEATURE_SEEKABLE feature first.
+ *
+ * Like qio_channel_readv(), this may read less data than
+ * requested; 0 is returned at end of file.
+ *
+ * Returns: the number of bytes read, or -1 on error
+ */
+ssize_t qio_channel_preadv(QIOChannel *ioc, const struct iovec *iov,
+                           size_t niov, off_t offset, Error **errp);
+
+/**
+ * qio_channel_pread:
+ * @ioc: the channel object
+ * @buf: the memory region to read data into
+ * @buflen: the number of bytes in @buf
+ * @offset: offset in the channel where reads should begin
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Behaves as qio_channel_preadv() but for a single buffer.
+ */
+ssize_t qio_channel_pread(QIOChannel *ioc, char *buf, size_t buflen,
+                          off_t offset, Error **errp);
+
 
 /**
  * qio_channel_create_watch:
@@ -837,6 +934,7 @@ int qio_channel_readv_full_all(QIOChannel *ioc,
  * @niov: the length of the @iov array
  * @fds: an array of file handles to send
  * @nfds: number of file handles in @fds
+ * @flags: write flags (QIO_CHANNEL_WRITE_FLAG_*)
  * @errp: pointer to a NULL-initialized error object
  *
  *
@@ -846,6 +944,11 @@ int qio_channel_readv_full_all(QIOChannel *ioc,
  * to be written, yielding from the current coroutine
  * if required.
  *
+ * If QIO_CHANNEL_WRITE_FLAG_ZERO_COPY is passed in @flags,
+ * the data is only guaranteed to have been sent once
+ * qio_channel_flush() returns, and the buffers must not be
+ * modified until then.
+ *
  * Returns: 0 if all bytes were written, or -1 on error
  */
 
@@ -853,6 +956,25 @@ int qio_channel_writev_full_all(QIOChannel *ioc,
                                 const struct iovec *iov,
                                 size_t niov,
                                 int *fds, size_t nfds,
+                                int flags,
                                 Error **errp);
 
+/**
+ * qio_channel_flush:
+ * @ioc: the channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Wait until all data previously written with
+ * QIO_CHANNEL_WRITE_FLAG_ZERO_COPY has been sent by the
+ * kernel, so that the buffers can be safely reused.
+ * Channels that do not implement zero copy have nothing
+ * to flush and return immediately.
+ *
+ * Returns: -1 on error, 0 if all data was sent with zero
+ * copy, 1 if all data was sent but the kernel had to fall
+ * back to copying for at least part of it.
+ */
+int qio_channel_flush(QIOChannel *ioc,
+                      Error **errp);
+
 #endif /* QIO_CHANNEL_H */
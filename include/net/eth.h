@@ -238,6 +238,7 @@ struct tcp_hdr {
 
 #define ETH_MAX_IP4_HDR_LEN   (60)
 #define ETH_MAX_IP_DGRAM_LEN  (0xFFFF)
+#define ETH_MAX_TCP_HDR_LEN   (60)
 
 #define IP_FRAG_UNIT_SIZE     (8)
 #define IP_FRAG_ALIGN_SIZE(x) ((x) & ~0x7)
@@ -46,6 +46,7 @@ typedef void (NetPoll)(NetClientState *, bool enable);
 typedef bool (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef int (NetReceiveBatch)(NetClientState *, const struct iovec *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -62,6 +63,7 @@ typedef struct SocketReadState SocketReadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 typedef void (NetAnnounce)(NetClientState *);
 typedef bool (SetSteeringEBPF)(NetClientState *, int);
+typedef void (NetSetAioContext)(NetClientState *, AioContext *);
 
 typedef struct NetClientInfo {
     NetClientDriver type;
@@ -69,6 +71,7 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    NetReceiveBatch *receive_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
@@ -84,6 +87,7 @@ typedef struct NetClientInfo {
     SetVnetBE *set_vnet_be;
     NetAnnounce *announce;
     SetSteeringEBPF *set_steering_ebpf;
+    NetSetAioContext *set_aio_context;
 } NetClientInfo;
 
 struct NetClientState {
@@ -101,9 +105,13 @@ struct NetClientState {
     unsigned rxfilter_notify_enabled:1;
     int vring_enable;
     int vnet_hdr_len;
+    /* TSO4 enabled with qemu_set_offload(): accepts TCPv4 GSO packets */
+    bool tso4_offload;
     bool is_netdev;
     bool do_not_pad; /* do not pad to the minimum ethernet frame length */
     QTAILQ_HEAD(, NetFilterState) filters;
+    /* IOThread context the client runs in, NULL for the main loop */
+    AioContext *ctx;
 };
 
 typedef struct NICState {
@@ -161,9 +169,14 @@ ssize_t qemu_receive_packet_iov(NetClientState *nc,
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+int qemu_send_packet_batch_async(NetClientState *nc, const struct iovec *pkts,
+                                 int count, NetPacketSent *sent_cb);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge);
+bool qemu_net_client_set_aio_context(NetClientState *nc, AioContext *ctx);
+AioContext *net_client_acquire(NetClientState *nc);
+void net_client_release(AioContext *ctx);
 void qemu_format_nic_info_str(NetClientState *nc, uint8_t macaddr[6]);
 bool qemu_has_ufo(NetClientState *nc);
 bool qemu_has_vnet_hdr(NetClientState *nc);
@@ -44,6 +44,12 @@ typedef ssize_t (NetQueueDeliverFunc)(NetClientState *sender,
                                       int iovcnt,
                                       void *opaque);
 
+/* Returns the number of packets consumed, starting from the first */
+typedef int (NetQueueDeliverBatchFunc)(NetClientState *sender,
+                                       const struct iovec *pkts,
+                                       int count,
+                                       void *opaque);
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque);
 
 void qemu_net_queue_append_iov(NetQueue *queue,
@@ -53,6 +59,13 @@ void qemu_net_queue_append_iov(NetQueue *queue,
                                int iovcnt,
                                NetPacketSent *sent_cb);
 
+void qemu_net_queue_append_batch(NetQueue *queue,
+                                 NetClientState *sender,
+                                 unsigned flags,
+                                 const struct iovec *pkts,
+                                 int count,
+                                 NetPacketSent *sent_cb);
+
 void qemu_del_net_queue(NetQueue *queue);
 
 ssize_t qemu_net_queue_receive(NetQueue *queue,
@@ -77,6 +90,12 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              const struct iovec *pkts,
+                              int count,
+                              NetQueueDeliverBatchFunc *deliver_batch);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
@@ -31,6 +31,9 @@
 #ifndef bit_MOVBE
 #define bit_MOVBE       (1 << 22)
 #endif
+#ifndef bit_POPCNT
+#define bit_POPCNT      (1 << 23)
+#endif
 #ifndef bit_OSXSAVE
 #define bit_OSXSAVE     (1 << 27)
 #endif
@@ -349,4 +349,13 @@ bool hbitmap_next_dirty_area(const HBitmap *hb, int64_t start, int64_t end,
  */
 int64_t hbitmap_iter_next(HBitmapIter *hbi);
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Disable the currently used vectorized implementation of the bulk bitmap
+ * operations and select the next one, so that unit tests can cover all of
+ * them.  Return false once the plain C implementation is in use.
+ */
+bool test_hbitmap_next_accel(void);
+
 #endif
@@ -547,4 +547,10 @@ bool kvm_cpu_check_are_resettable(void);
 
 bool kvm_arch_cpu_check_are_resettable(void);
 
+/**
+ * kvm_dirty_ring_enabled - return whether dirty pages are collected
+ * through the per-vCPU KVM dirty rings rather than the dirty log
+ */
+bool kvm_dirty_ring_enabled(void);
+
 #endif
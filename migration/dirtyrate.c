@@ -15,17 +15,28 @@
 #include "qapi/error.h"
 #include "cpu.h"
 #include "exec/ramblock.h"
+#include "exec/ram_addr.h"
+#include "exec/memory.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/main-loop.h"
 #include "qapi/qapi-commands-migration.h"
 #include "ram.h"
+#include "migration.h"
 #include "trace.h"
 #include "dirtyrate.h"
 #include "monitor/hmp.h"
 #include "monitor/monitor.h"
 #include "qapi/qmp/qdict.h"
+#include "sysemu/kvm.h"
+#include "sysemu/runstate.h"
+#include "hw/core/cpu.h"
 
 static int CalculatingState = DIRTY_RATE_STATUS_UNSTARTED;
 static struct DirtyRateStat DirtyStat;
+static DirtyRateMeasureMode dirtyrate_mode =
+                DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+/* Protected by the BQL */
+static bool dirty_bitmap_in_use;
 
 static int64_t set_sample_page_period(int64_t msec, int64_t initial_time)
 {
@@ -68,53 +79,127 @@ static int dirtyrate_set_state(int *state, int old_state, int new_state)
     }
 }
 
+/*
+ * Whether a dirty-bitmap measurement is pending or running: it clears
+ * the migration dirty bitmap, so it can't overlap with a migration.
+ */
+bool dirtyrate_dirty_bitmap_in_use(void)
+{
+    return dirty_bitmap_in_use;
+}
+
 static struct DirtyRateInfo *query_dirty_rate_info(void)
 {
+    int i;
     int64_t dirty_rate = DirtyStat.dirty_rate;
     struct DirtyRateInfo *info = g_malloc0(sizeof(DirtyRateInfo));
 
     if (qatomic_read(&CalculatingState) == DIRTY_RATE_STATUS_MEASURED) {
         info->has_dirty_rate = true;
         info->dirty_rate = dirty_rate;
+
+        if (dirtyrate_mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
+            DirtyRateVcpuList **tail = &info->vcpu_dirty_rate;
+
+            info->has_vcpu_dirty_rate = true;
+            for (i = 0; i < DirtyStat.dirty_ring.nvcpu; i++) {
+                DirtyRateVcpu *rate = g_new0(DirtyRateVcpu, 1);
+
+                rate->id = DirtyStat.dirty_ring.rates[i].id;
+                rate->dirty_rate = DirtyStat.dirty_ring.rates[i].dirty_rate;
+                QAPI_LIST_APPEND(tail, rate);
+            }
+        } else if (dirtyrate_mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP) {
+            DirtyRateRamBlockList **tail = &info->ramblock_dirty_rate;
+
+            info->has_ramblock_dirty_rate = true;
+            for (i = 0; i < DirtyStat.dirty_bitmap.nblock; i++) {
+                DirtyRateRamBlock *rate = g_new0(DirtyRateRamBlock, 1);
+
+                rate->id = g_strdup(DirtyStat.dirty_bitmap.rates[i].id);
+                rate->dirty_rate = DirtyStat.dirty_bitmap.rates[i].dirty_rate;
+                QAPI_LIST_APPEND(tail, rate);
+            }
+        }
     }
 
     info->status = CalculatingState;
     info->start_time = DirtyStat.start_time;
     info->calc_time = DirtyStat.calc_time;
     info->sample_pages = DirtyStat.sample_pages;
+    info->mode = dirtyrate_mode;
 
     trace_query_dirty_rate_info(DirtyRateStatus_str(CalculatingState));
 
     return info;
 }
 
-static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time,
-                                uint64_t sample_pages)
+static void cleanup_dirtyrate_stat(void)
+{
+    int i;
+
+    /* The union only holds allocated arrays for the exact modes */
+    switch (dirtyrate_mode) {
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_RING:
+        g_free(DirtyStat.dirty_ring.rates);
+        DirtyStat.dirty_ring.rates = NULL;
+        DirtyStat.dirty_ring.nvcpu = 0;
+        break;
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP:
+        for (i = 0; i < DirtyStat.dirty_bitmap.nblock; i++) {
+            g_free(DirtyStat.dirty_bitmap.rates[i].id);
+        }
+        g_free(DirtyStat.dirty_bitmap.rates);
+        DirtyStat.dirty_bitmap.rates = NULL;
+        DirtyStat.dirty_bitmap.nblock = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+static void init_dirtyrate_stat(int64_t start_time,
+                                struct DirtyRateConfig config)
 {
-    DirtyStat.total_dirty_samples = 0;
-    DirtyStat.total_sample_count = 0;
-    DirtyStat.total_block_mem_MB = 0;
     DirtyStat.dirty_rate = -1;
     DirtyStat.start_time = start_time;
-    DirtyStat.calc_time = calc_time;
-    DirtyStat.sample_pages = sample_pages;
+    DirtyStat.calc_time = config.sample_period_seconds;
+    DirtyStat.sample_pages = config.sample_pages_per_gigabytes;
+
+    switch (config.mode) {
+    case DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING:
+        DirtyStat.page_sampling.total_dirty_samples = 0;
+        DirtyStat.page_sampling.total_sample_count = 0;
+        DirtyStat.page_sampling.total_block_mem_MB = 0;
+        break;
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_RING:
+        DirtyStat.dirty_ring.nvcpu = 0;
+        DirtyStat.dirty_ring.rates = NULL;
+        break;
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP:
+        DirtyStat.dirty_bitmap.nblock = 0;
+        DirtyStat.dirty_bitmap.rates = NULL;
+        break;
+    default:
+        break;
+    }
 }
 
 static void update_dirtyrate_stat(struct RamblockDirtyInfo *info)
 {
-    DirtyStat.total_dirty_samples += info->sample_dirty_count;
-    DirtyStat.total_sample_count += info->sample_pages_count;
+    DirtyStat.page_sampling.total_dirty_samples += info->sample_dirty_count;
+    DirtyStat.page_sampling.total_sample_count += info->sample_pages_count;
     /* size of total pages in MB */
-    DirtyStat.total_block_mem_MB += (info->ramblock_pages *
-                                     TARGET_PAGE_SIZE) >> 20;
+    DirtyStat.page_sampling.total_block_mem_MB += (info->ramblock_pages *
+                                                   TARGET_PAGE_SIZE) >> 20;
 }
 
 static void update_dirtyrate(uint64_t msec)
 {
     uint64_t dirtyrate;
-    uint64_t total_dirty_samples = DirtyStat.total_dirty_samples;
-    uint64_t total_sample_count = DirtyStat.total_sample_count;
-    uint64_t total_block_mem_MB = DirtyStat.total_block_mem_MB;
+    uint64_t total_dirty_samples = DirtyStat.page_sampling.total_dirty_samples;
+    uint64_t total_sample_count = DirtyStat.page_sampling.total_sample_count;
+    uint64_t total_block_mem_MB = DirtyStat.page_sampling.total_block_mem_MB;
 
     dirtyrate = total_dirty_samples * total_block_mem_MB *
                 1000 / (total_sample_count * msec);
@@ -327,21 +412,198 @@ static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
         update_dirtyrate_stat(block_dinfo);
     }
 
-    if (DirtyStat.total_sample_count == 0) {
+    if (DirtyStat.page_sampling.total_sample_count == 0) {
         return false;
     }
 
     return true;
 }
 
-static void calculate_dirtyrate(struct DirtyRateConfig config)
+/* Dirty rate in MB/s of @pages dirtied in @msec milliseconds */
+static int64_t do_calculate_dirtyrate(uint64_t pages, int64_t msec)
+{
+    uint64_t memory_size_MB = (pages * TARGET_PAGE_SIZE) >> 20;
+
+    return memory_size_MB * 1000 / msec;
+}
+
+static void record_dirtypages(DirtyPageRecord *dirty_pages, bool start)
+{
+    CPUState *cpu;
+    int i;
+
+    for (i = 0; i < DirtyStat.dirty_ring.nvcpu; i++) {
+        int64_t id = DirtyStat.dirty_ring.rates[i].id;
+
+        /* A vcpu unplugged during the period keeps its start count */
+        cpu = qemu_get_cpu(id);
+        if (!cpu) {
+            continue;
+        }
+        if (start) {
+            dirty_pages[i].start_pages = cpu->dirty_pages;
+            dirty_pages[i].end_pages = cpu->dirty_pages;
+        } else {
+            dirty_pages[i].end_pages = cpu->dirty_pages;
+        }
+    }
+}
+
+/*
+ * Count the pages each vcpu pushes to its KVM dirty ring during the
+ * period.  Dirty logging is only requested for the dirty rate, so it
+ * coexists with a running migration.
+ */
+static void calculate_dirtyrate_dirty_ring(struct DirtyRateConfig config)
+{
+    CPUState *cpu;
+    DirtyPageRecord *dirty_pages;
+    uint64_t total_pages = 0;
+    int64_t start_time;
+    int64_t msec;
+    int nvcpu = 0;
+    int i;
+
+    qemu_mutex_lock_iothread();
+
+    CPU_FOREACH(cpu) {
+        nvcpu++;
+    }
+    DirtyStat.dirty_ring.nvcpu = nvcpu;
+    DirtyStat.dirty_ring.rates = g_new0(DirtyRateVcpu, nvcpu);
+    dirty_pages = g_new0(DirtyPageRecord, nvcpu);
+
+    i = 0;
+    CPU_FOREACH(cpu) {
+        DirtyStat.dirty_ring.rates[i++].id = cpu->cpu_index;
+    }
+
+    memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE);
+
+    /* Collect what is already in the rings, it predates the period */
+    memory_global_dirty_log_sync();
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    record_dirtypages(dirty_pages, true);
+
+    qemu_mutex_unlock_iothread();
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, start_time);
+    DirtyStat.start_time = start_time / 1000;
+    DirtyStat.calc_time = msec / 1000;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+    record_dirtypages(dirty_pages, false);
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_DIRTY_RATE);
+    qemu_mutex_unlock_iothread();
+
+    for (i = 0; i < nvcpu; i++) {
+        uint64_t pages = dirty_pages[i].end_pages - dirty_pages[i].start_pages;
+
+        DirtyStat.dirty_ring.rates[i].dirty_rate =
+            do_calculate_dirtyrate(pages, msec);
+        trace_dirtyrate_vcpu(DirtyStat.dirty_ring.rates[i].id, pages);
+        total_pages += pages;
+    }
+    DirtyStat.dirty_rate = do_calculate_dirtyrate(total_pages, msec);
+
+    g_free(dirty_pages);
+}
+
+/*
+ * Count and clear the dirty bits of @block, re-arming dirty logging for
+ * its pages.  Called with the BQL held, after a sync.
+ */
+static uint64_t dirty_bitmap_count_and_clear(RAMBlock *block)
+{
+    DirtyBitmapSnapshot *snap;
+    uint64_t pages;
+
+    snap = cpu_physical_memory_snapshot_and_clear_dirty(block->mr, 0,
+                                                        block->used_length,
+                                                        DIRTY_MEMORY_MIGRATION);
+    pages = cpu_physical_memory_snapshot_count_dirty(snap, block->offset,
+                                                     block->used_length);
+    g_free(snap);
+
+    return pages;
+}
+
+/*
+ * Count the pages set in the dirty log of each RAMBlock during the
+ * period.  Clearing the log at the start steals bits a migration would
+ * need, hence dirty_bitmap_in_use.
+ */
+static void calculate_dirtyrate_dirty_bitmap(struct DirtyRateConfig config)
+{
+    RAMBlock *block;
+    uint64_t total_pages = 0;
+    int64_t start_time;
+    int64_t msec;
+    int nblock = 0;
+    int i;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE);
+
+    /*
+     * Pages may be reported dirty as soon as logging starts (e.g. with
+     * KVM's initially-set dirty log), so sync and discard those first.
+     */
+    memory_global_dirty_log_sync();
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            dirty_bitmap_count_and_clear(block);
+            nblock++;
+        }
+    }
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, start_time);
+    DirtyStat.start_time = start_time / 1000;
+    DirtyStat.calc_time = msec / 1000;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+
+    DirtyStat.dirty_bitmap.rates = g_new0(DirtyRateRamBlock, nblock);
+    i = 0;
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            uint64_t pages;
+
+            /* Blocks can't be added without the BQL, but be safe */
+            if (i >= nblock) {
+                break;
+            }
+            pages = dirty_bitmap_count_and_clear(block);
+            DirtyStat.dirty_bitmap.rates[i].id = g_strdup(block->idstr);
+            DirtyStat.dirty_bitmap.rates[i].dirty_rate =
+                do_calculate_dirtyrate(pages, msec);
+            trace_dirtyrate_ramblock(block->idstr, pages);
+            total_pages += pages;
+            i++;
+        }
+    }
+    DirtyStat.dirty_bitmap.nblock = i;
+
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_DIRTY_RATE);
+    dirty_bitmap_in_use = false;
+    qemu_mutex_unlock_iothread();
+
+    DirtyStat.dirty_rate = do_calculate_dirtyrate(total_pages, msec);
+}
+
+static void calculate_dirtyrate_sample_vm(struct DirtyRateConfig config)
 {
     struct RamblockDirtyInfo *block_dinfo = NULL;
     int block_count = 0;
     int64_t msec = 0;
     int64_t initial_time;
 
-    rcu_register_thread();
     rcu_read_lock();
     initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     if (!record_ramblock_hash_info(&block_dinfo, config, &block_count)) {
@@ -364,7 +626,23 @@ static void calculate_dirtyrate(struct DirtyRateConfig config)
 out:
     rcu_read_unlock();
     free_ramblock_dirty_info(block_dinfo, block_count);
-    rcu_unregister_thread();
+}
+
+static void calculate_dirtyrate(struct DirtyRateConfig config)
+{
+    switch (config.mode) {
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_RING:
+        calculate_dirtyrate_dirty_ring(config);
+        break;
+    case DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP:
+        calculate_dirtyrate_dirty_bitmap(config);
+        break;
+    default:
+        calculate_dirtyrate_sample_vm(config);
+        break;
+    }
+
+    trace_dirtyrate_calculate(DirtyStat.dirty_rate);
 }
 
 void *get_dirtyrate_thread(void *arg)
@@ -372,20 +650,22 @@ void *get_dirtyrate_thread(void *arg)
     struct DirtyRateConfig config = *(struct DirtyRateConfig *)arg;
     int ret;
     int64_t start_time;
-    int64_t calc_time;
-    uint64_t sample_pages;
+
+    rcu_register_thread();
 
     ret = dirtyrate_set_state(&CalculatingState, DIRTY_RATE_STATUS_UNSTARTED,
                               DIRTY_RATE_STATUS_MEASURING);
     if (ret == -1) {
         error_report("change dirtyrate state failed.");
+        qemu_mutex_lock_iothread();
+        dirty_bitmap_in_use = false;
+        qemu_mutex_unlock_iothread();
+        rcu_unregister_thread();
         return NULL;
     }
 
     start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
-    calc_time = config.sample_period_seconds;
-    sample_pages = config.sample_pages_per_gigabytes;
-    init_dirtyrate_stat(start_time, calc_time, sample_pages);
+    init_dirtyrate_stat(start_time, config);
 
     calculate_dirtyrate(config);
 
@@ -394,11 +674,17 @@ void *get_dirtyrate_thread(void *arg)
     if (ret == -1) {
         error_report("change dirtyrate state failed.");
     }
+
+    rcu_unregister_thread();
     return NULL;
 }
 
-void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
-                         int64_t sample_pages, Error **errp)
+void qmp_calc_dirty_rate(int64_t calc_time,
+                         bool has_sample_pages,
+                         int64_t sample_pages,
+                         bool has_mode,
+                         DirtyRateMeasureMode mode,
+                         Error **errp)
 {
     static struct DirtyRateConfig config;
     QemuThread thread;
@@ -419,6 +705,29 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
         return;
     }
 
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+
+    if (has_sample_pages && mode != DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        error_setg(errp, "sample-pages is used only in page-sampling mode");
+        return;
+    }
+
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING &&
+        !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "dirty-ring mode needs the KVM dirty ring, "
+                   "set the dirty-ring-size property of the kvm accelerator");
+        return;
+    }
+
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP &&
+        migration_is_running(migrate_get_current()->state)) {
+        error_setg(errp, "dirty-bitmap mode can't be used while migration "
+                   "is running");
+        return;
+    }
+
     if (has_sample_pages) {
         if (!is_sample_pages_valid(sample_pages)) {
             error_setg(errp, "sample-pages is out of range[%d, %d].",
@@ -440,8 +749,14 @@ void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
         return;
     }
 
+    /* Results of the previous measure are no longer reported */
+    cleanup_dirtyrate_stat();
+    dirtyrate_mode = mode;
+    dirty_bitmap_in_use = (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP);
+
     config.sample_period_seconds = calc_time;
     config.sample_pages_per_gigabytes = sample_pages;
+    config.mode = mode;
     qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
                        (void *)&config, QEMU_THREAD_DETACHED);
 }
@@ -459,17 +774,39 @@ void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
                    DirtyRateStatus_str(info->status));
     monitor_printf(mon, "Start Time: %"PRIi64" (ms)\n",
                    info->start_time);
-    monitor_printf(mon, "Sample Pages: %"PRIu64" (per GB)\n",
-                   info->sample_pages);
+    monitor_printf(mon, "Mode: %s\n",
+                   DirtyRateMeasureMode_str(info->mode));
+    if (info->mode == DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING) {
+        monitor_printf(mon, "Sample Pages: %"PRIu64" (per GB)\n",
+                       info->sample_pages);
+    }
     monitor_printf(mon, "Period: %"PRIi64" (sec)\n",
                    info->calc_time);
     monitor_printf(mon, "Dirty rate: ");
     if (info->has_dirty_rate) {
         monitor_printf(mon, "%"PRIi64" (MB/s)\n", info->dirty_rate);
+        if (info->has_vcpu_dirty_rate) {
+            DirtyRateVcpuList *rate;
+
+            for (rate = info->vcpu_dirty_rate; rate; rate = rate->next) {
+                monitor_printf(mon, "vcpu[%"PRIi64"], Dirty rate: %"PRIi64
+                               " (MB/s)\n", rate->value->id,
+                               rate->value->dirty_rate);
+            }
+        }
+        if (info->has_ramblock_dirty_rate) {
+            DirtyRateRamBlockList *rate;
+
+            for (rate = info->ramblock_dirty_rate; rate; rate = rate->next) {
+                monitor_printf(mon, "ramblock[%s], Dirty rate: %"PRIi64
+                               " (MB/s)\n", rate->value->id,
+                               rate->value->dirty_rate);
+            }
+        }
     } else {
         monitor_printf(mon, "(not ready)\n");
     }
-    g_free(info);
+    qapi_free_DirtyRateInfo(info);
 }
 
 void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
@@ -477,6 +814,9 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
     int64_t sec = qdict_get_try_int(qdict, "second", 0);
     int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages_per_GB", -1);
     bool has_sample_pages = (sample_pages != -1);
+    bool dirty_ring = qdict_get_try_bool(qdict, "dirty_ring", false);
+    bool dirty_bitmap = qdict_get_try_bool(qdict, "dirty_bitmap", false);
+    DirtyRateMeasureMode mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
     Error *err = NULL;
 
     if (!sec) {
@@ -484,7 +824,20 @@ void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
         return;
     }
 
-    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, &err);
+    if (dirty_ring && dirty_bitmap) {
+        monitor_printf(mon, "Either dirty ring or dirty bitmap "
+                       "can be specified!\n");
+        return;
+    }
+
+    if (dirty_bitmap) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_BITMAP;
+    } else if (dirty_ring) {
+        mode = DIRTY_RATE_MEASURE_MODE_DIRTY_RING;
+    }
+
+    qmp_calc_dirty_rate(sec, has_sample_pages, sample_pages, true,
+                        mode, &err);
     if (err) {
         hmp_handle_error(mon, err);
         return;
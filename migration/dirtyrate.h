@@ -13,6 +13,8 @@
 #ifndef QEMU_MIGRATION_DIRTYRATE_H
 #define QEMU_MIGRATION_DIRTYRATE_H
 
+#include "qapi/qapi-types-migration.h"
+
 /*
  * Sample 512 pages per GB as default.
  */
@@ -43,6 +45,7 @@
 struct DirtyRateConfig {
     uint64_t sample_pages_per_gigabytes; /* sample pages per GB */
     int64_t sample_period_seconds; /* time duration between two sampling */
+    DirtyRateMeasureMode mode; /* mode of dirtyrate measurement */
 };
 
 /*
@@ -59,17 +62,44 @@ struct RamblockDirtyInfo {
 };
 
 /*
- * Store calculation statistics for each measure.
+ * Store dirty page counters of a vcpu at the start and end of a measure.
  */
-struct DirtyRateStat {
+typedef struct DirtyPageRecord {
+    uint64_t start_pages;
+    uint64_t end_pages;
+} DirtyPageRecord;
+
+typedef struct SampleVMStat {
     uint64_t total_dirty_samples; /* total dirty sampled page */
     uint64_t total_sample_count; /* total sampled pages */
     uint64_t total_block_mem_MB; /* size of total sampled pages in MB */
+} SampleVMStat;
+
+typedef struct VcpuStat {
+    int nvcpu; /* number of vcpu */
+    DirtyRateVcpu *rates; /* array of dirty rate for each vcpu */
+} VcpuStat;
+
+typedef struct RamblockStat {
+    int nblock; /* number of ramblock */
+    DirtyRateRamBlock *rates; /* array of dirty rate for each ramblock */
+} RamblockStat;
+
+/*
+ * Store calculation statistics for each measure.
+ */
+struct DirtyRateStat {
     int64_t dirty_rate; /* dirty rate in MB/s */
     int64_t start_time; /* calculation start time in units of second */
     int64_t calc_time; /* time duration of two sampling in units of second */
     uint64_t sample_pages; /* sample pages per GB */
+    union {
+        SampleVMStat page_sampling;
+        VcpuStat dirty_ring;
+        RamblockStat dirty_bitmap;
+    };
 };
 
 void *get_dirtyrate_thread(void *arg);
+bool dirtyrate_dirty_bitmap_in_use(void);
 #endif
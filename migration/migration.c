@@ -20,6 +20,7 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
@@ -60,6 +61,7 @@
 #include "qemu/yank.h"
 #include "sysemu/cpus.h"
 #include "yank_functions.h"
+#include "dirtyrate.h"
 
 #define MAX_THROTTLE  (128 << 20)      /* Migration transfer speed throttling */
 
@@ -162,7 +164,8 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_COMPRESS,
     MIGRATION_CAPABILITY_XBZRLE,
     MIGRATION_CAPABILITY_X_COLO,
-    MIGRATION_CAPABILITY_VALIDATE_UUID);
+    MIGRATION_CAPABILITY_VALIDATE_UUID,
+    MIGRATION_CAPABILITY_POSTCOPY_PREEMPT);
 
 /* When we add fault tolerance, we could have several
    migrations at once.  For now we don't need to add
@@ -179,7 +182,8 @@ static int migration_maybe_pause(MigrationState *s,
                                  int new_state);
 static void migrate_fd_cancel(MigrationState *s);
 
-static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp)
+static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp,
+                                  gpointer unused)
 {
     uintptr_t a = (uintptr_t) ap, b = (uintptr_t) bp;
 
@@ -205,8 +209,10 @@ void migration_object_init(void)
     qemu_event_init(&current_incoming->main_thread_load_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
+    qemu_sem_init(&current_incoming->postcopy_qemufile_dst_sem, 0);
     qemu_mutex_init(&current_incoming->page_request_mutex);
-    current_incoming->page_requested = g_tree_new(page_request_addr_cmp);
+    current_incoming->page_requested = g_tree_new_full(page_request_addr_cmp,
+                                                       NULL, NULL, g_free);
 
     migration_object_check(current_migration, &error_fatal);
 
@@ -273,6 +279,11 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        migration_ioc_unregister_yank_from_file(mis->postcopy_qemufile_dst);
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -399,10 +410,13 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         if (!received && !g_tree_lookup(mis->page_requested, aligned)) {
             /*
              * The page has not been received, and it's not yet in the page
-             * request list.  Queue it.  Set the value of element to 1, so that
-             * things like g_tree_lookup() will return TRUE (1) when found.
+             * request list.  Queue it, with the time of the request so that
+             * we know how long it took to resolve.
              */
-            g_tree_insert(mis->page_requested, aligned, (gpointer)1);
+            int64_t *req_time = g_new(int64_t, 1);
+
+            *req_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+            g_tree_insert(mis->page_requested, aligned, req_time);
             mis->page_requested_count++;
             trace_postcopy_page_req_add(aligned, mis->page_requested_count);
         }
@@ -453,6 +467,11 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p = NULL;
 
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "Mapped-ram needs a file: migration URI");
+        return;
+    }
+
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
     if (strstart(uri, "tcp:", &p) ||
         strstart(uri, "unix:", NULL) ||
@@ -466,6 +485,8 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
         exec_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -706,6 +727,17 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
          * right now.  Multifd needs more than one channel, we wait.
          */
         start_migration = !migrate_use_multifd();
+    } else if (migrate_postcopy_preempt()) {
+        /*
+         * The source connects the channel for urgent pages once it enters
+         * postcopy, the migration is already running by then.
+         */
+        if (mis->postcopy_qemufile_dst) {
+            error_setg(errp, "Extra postcopy preempt channel");
+            return;
+        }
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        return;
     } else {
         /* Multiple connections */
         assert(migrate_use_multifd());
@@ -733,6 +765,9 @@ bool migration_has_all_channels(void)
     bool all_channels;
 
     all_channels = multifd_recv_all_channels_created();
+    if (migrate_postcopy_preempt() && !mis->postcopy_qemufile_dst) {
+        all_channels = false;
+    }
 
     return all_channels && mis->from_src_file != NULL;
 }
@@ -999,6 +1034,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->dirty_sync_missed_zero_copy =
+        ram_counters.dirty_sync_missed_zero_copy;
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -1202,6 +1239,73 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        /*
+         * The destination tells the extra channel apart from the main one
+         * by their order, there's no room for multifd channels.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Postcopy preempt is not compatible with multifd");
+            return false;
+        }
+
+        /* The decompression threads can't serve two loading channels */
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Postcopy preempt is not compatible with "
+                       "compress");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        /* Pages are written in place, there's no page stream to share */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Mapped-ram is not compatible with multifd");
+            return false;
+        }
+
+        if (cap_list[MIGRATION_CAPABILITY_XBZRLE]) {
+            error_setg(errp, "Mapped-ram is not compatible with xbzrle");
+            return false;
+        }
+
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Mapped-ram is not compatible with compress");
+            return false;
+        }
+
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Mapped-ram is not compatible with postcopy");
+            return false;
+        }
+
+        if (cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "Mapped-ram is not compatible with COLO");
+            return false;
+        }
+    }
+
+#ifdef CONFIG_LINUX
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+        if (!cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Zero copy send requires multifd");
+            return false;
+        }
+
+        /* The pages must be sent as they are in guest memory */
+        if (migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+            error_setg(errp, "Zero copy send is not compatible with "
+                       "multifd compression");
+            return false;
+        }
+    }
+#endif
+
     if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
         WriteTrackingSupport wt_support;
         int idx;
@@ -1238,6 +1342,24 @@ static bool migrate_caps_check(bool *cap_list,
     return true;
 }
 
+static void fill_destination_postcopy_latency(MigrationInfo *info)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint64List **tail = &info->postcopy_latency_dist;
+    int i;
+
+    QEMU_LOCK_GUARD(&mis->page_request_mutex);
+
+    info->has_postcopy_latency = true;
+    info->postcopy_latency = mis->postcopy_latency_count ?
+        mis->postcopy_latency_total / mis->postcopy_latency_count : 0;
+
+    info->has_postcopy_latency_dist = true;
+    for (i = 0; i < POSTCOPY_LATENCY_BUCKETS; i++) {
+        QAPI_LIST_APPEND(tail, mis->postcopy_latency_dist[i]);
+    }
+}
+
 static void fill_destination_migration_info(MigrationInfo *info)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
@@ -1255,16 +1377,22 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_CANCELLING:
     case MIGRATION_STATUS_CANCELLED:
     case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_FAILED:
+    case MIGRATION_STATUS_COLO:
+        info->has_status = true;
+        break;
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_POSTCOPY_PAUSED:
     case MIGRATION_STATUS_POSTCOPY_RECOVER:
-    case MIGRATION_STATUS_FAILED:
-    case MIGRATION_STATUS_COLO:
         info->has_status = true;
+        fill_destination_postcopy_latency(info);
         break;
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
+        if (mis->postcopy_latency_count) {
+            fill_destination_postcopy_latency(info);
+        }
         break;
     }
     info->status = mis->state;
@@ -1396,6 +1524,14 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (migrate_use_zero_copy_send() &&
+        params->has_multifd_compression &&
+        params->multifd_compression != MULTIFD_COMPRESSION_NONE) {
+        error_setg(errp, "Zero copy send is not compatible with "
+                   "multifd compression");
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1780,7 +1916,7 @@ static void migrate_fd_cleanup(MigrationState *s)
     qemu_savevm_state_cleanup();
 
     if (s->to_dst_file) {
-        QEMUFile *tmp;
+        QEMUFile *tmp, *preempt;
 
         trace_migrate_fd_cleanup();
         qemu_mutex_unlock_iothread();
@@ -1794,6 +1930,8 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_mutex_lock(&s->qemu_file_lock);
         tmp = s->to_dst_file;
         s->to_dst_file = NULL;
+        preempt = s->postcopy_qemufile_src;
+        s->postcopy_qemufile_src = NULL;
         qemu_mutex_unlock(&s->qemu_file_lock);
         /*
          * Close the file handle without the lock to make sure the
@@ -1801,6 +1939,10 @@ static void migrate_fd_cleanup(MigrationState *s)
          */
         migration_ioc_unregister_yank_from_file(tmp);
         qemu_fclose(tmp);
+        if (preempt) {
+            migration_ioc_unregister_yank_from_file(preempt);
+            qemu_fclose(preempt);
+        }
     }
 
     assert(!migration_is_active(s));
@@ -1873,6 +2015,9 @@ static void migrate_fd_cancel(MigrationState *s)
             /* shutdown the rp socket, so causing the rp thread to shutdown */
             qemu_file_shutdown(s->rp_state.from_dst_file);
         }
+        if (s->postcopy_qemufile_src) {
+            qemu_file_shutdown(s->postcopy_qemufile_src);
+        }
     }
 
     do {
@@ -2228,6 +2373,12 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
         return false;
     }
 
+    /* Both would consume the same dirty bits */
+    if (dirtyrate_dirty_bitmap_in_use()) {
+        error_setg(errp, "Dirty rate is being measured in dirty-bitmap mode");
+        return false;
+    }
+
     if (blk || blk_inc) {
         if (migrate_colo_enabled()) {
             error_setg(errp, "No disk migration is required in COLO mode");
@@ -2268,6 +2419,36 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     MigrationState *s = migrate_get_current();
     const char *p = NULL;
 
+    if (migrate_postcopy_preempt()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL) &&
+            !strstart(uri, "vsock:", NULL)) {
+            error_setg(errp, "Postcopy preempt needs a socket migration URI");
+            return;
+        }
+        if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+            error_setg(errp, "Postcopy preempt is not compatible with TLS");
+            return;
+        }
+    }
+
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "Mapped-ram needs a file: migration URI");
+        return;
+    }
+
+    if (migrate_use_zero_copy_send()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL) &&
+            !strstart(uri, "vsock:", NULL)) {
+            error_setg(errp, "Zero copy send needs a socket migration URI");
+            return;
+        }
+        /* TLS encrypts into a bounce buffer, there's nothing to pin */
+        if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+            error_setg(errp, "Zero copy send is not compatible with TLS");
+            return;
+        }
+    }
+
     if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
                          has_resume && resume, errp)) {
         /* Error detected, put into errp */
@@ -2292,6 +2473,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         exec_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         if (!(has_resume && resume)) {
             yank_unregister_instance(MIGRATION_YANK_INSTANCE);
@@ -2380,6 +2563,24 @@ bool migrate_postcopy_blocktime(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
 bool migrate_use_compression(void)
 {
     MigrationState *s;
@@ -2470,6 +2671,17 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+#ifdef CONFIG_LINUX
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+#endif
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2918,6 +3130,16 @@ static int postcopy_start(MigrationState *ms)
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+
+    /*
+     * Connect the channel for urgent pages now that the destination has
+     * surely taken the main one; this needs the main loop, so before
+     * taking the iothread lock.
+     */
+    if (migrate_postcopy_preempt()) {
+        postcopy_preempt_setup(ms);
+    }
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -3450,7 +3672,8 @@ static MigThrError migration_detect_error(MigrationState *s)
 /* How many bytes have we transferred since the beginning of the migration */
 static uint64_t migration_total_bytes(MigrationState *s)
 {
-    return qemu_ftell(s->to_dst_file) + ram_counters.multifd_bytes;
+    return qemu_file_total_transferred(s->to_dst_file) +
+           ram_counters.multifd_bytes;
 }
 
 static void migration_calculate_complete(MigrationState *s)
@@ -4198,6 +4421,13 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
     DEFINE_PROP_MIG_CAP("x-background-snapshot",
             MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+#ifdef CONFIG_LINUX
+    DEFINE_PROP_MIG_CAP("x-zero-copy-send",
+            MIGRATION_CAPABILITY_ZERO_COPY_SEND),
+#endif
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -4225,6 +4455,7 @@ static void migration_instance_finalize(Object *obj)
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     error_free(ms->error);
 }
 
@@ -4271,6 +4502,7 @@ static void migration_instance_init(Object *obj)
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
     qemu_sem_init(&ms->wait_unplug_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_mutex_init(&ms->qemu_file_lock);
 }
 
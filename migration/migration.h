@@ -45,6 +45,24 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * Channels that can carry RAM pages.  The postcopy channel only exists
+ * when the postcopy-preempt capability is set; it carries the pages the
+ * destination explicitly requested during postcopy.
+ */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
+
+/*
+ * Number of buckets in the postcopy page request latency histogram.  Bucket
+ * N counts the requests resolved within [2^N, 2^(N+1)) microseconds, the
+ * last bucket (~8s and above) also takes anything slower.
+ */
+#define POSTCOPY_LATENCY_BUCKETS          24
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -81,8 +99,21 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* Temporary pages used to place host pages, one per RAM channel */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
+    /* Last RAMBlock received on each RAM channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
+
+    /* Channel for urgent postcopy pages (postcopy-preempt capability) */
+    QEMUFile      *postcopy_qemufile_dst;
+    /* Posted when postcopy_qemufile_dst arrives, or when quitting */
+    QemuSemaphore postcopy_qemufile_dst_sem;
+    bool          have_preempt_thread;
+    QemuThread    preempt_thread;
+    /* Set this when we want the preempt thread to quit */
+    bool          preempt_thread_quit;
+
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -110,7 +141,11 @@ struct MigrationIncomingState {
     /* List of listening socket addresses  */
     SocketAddressList *socket_address_list;
 
-    /* A tree of pages that we requested to the source VM */
+    /*
+     * A tree of pages that we requested to the source VM; the value of each
+     * element is the time (in microseconds, QEMU_CLOCK_REALTIME) at which
+     * the page was first requested.
+     */
     GTree *page_requested;
     /* For debugging purpose only, but would be nice to keep */
     int page_requested_count;
@@ -124,8 +159,16 @@ struct MigrationIncomingState {
      * serialize and blocked by slow operations like UFFDIO_* ioctls.  However
      * this should be enough to make sure the page_requested tree always
      * contains valid information.
+     *
+     * It also protects the postcopy page request latency statistics below.
      */
     QemuMutex page_request_mutex;
+
+    /* Number of page requests that have been resolved */
+    uint64_t postcopy_latency_count;
+    /* Sum of the latencies of the resolved page requests, in microseconds */
+    uint64_t postcopy_latency_total;
+    uint64_t postcopy_latency_dist[POSTCOPY_LATENCY_BUCKETS];
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -156,6 +199,13 @@ struct MigrationState {
     QEMUBH *cleanup_bh;
     /* Protected by qemu_file_lock */
     QEMUFile *to_dst_file;
+    /*
+     * Channel for urgent postcopy pages (postcopy-preempt capability).
+     * Protected by qemu_file_lock.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    /* Posted once the attempt to create postcopy_qemufile_src finished */
+    QemuSemaphore postcopy_qemufile_src_sem;
     QIOChannelBuffer *bioc;
     /*
      * Protects to_dst_file/from_dst_file pointers.  We need to make sure we
@@ -333,6 +383,11 @@ bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+#ifdef CONFIG_LINUX
+bool migrate_use_zero_copy_send(void);
+#else
+#define migrate_use_zero_copy_send() (false)
+#endif
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
@@ -357,6 +412,8 @@ int migrate_compress_wait_thread(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_mapped_ram(void);
 bool migrate_background_snapshot(void);
 
 /* Sending on the return path - generic and then for each message type */
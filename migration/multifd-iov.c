@@ -0,0 +1,54 @@
+/*
+ * Multifd receive side page placement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qapi/error.h"
+#include "multifd-iov.h"
+
+/**
+ * multifd_iov_from_offsets: map the pages of a packet to host memory
+ *
+ * Fill @iov with the location of the @used pages whose big-endian
+ * offsets in a RAMBlock of @length bytes mapped at @host are listed in
+ * @offset, which may be unaligned as it points into the packet.
+ *
+ * The sender queues the pages of a block in bitmap order, so most of
+ * them are contiguous in host memory: those are merged into a single
+ * entry, letting the recv method fill each run with one read or one
+ * decompression call.
+ *
+ * Returns the number of entries of @iov, at most @used, or -1 if an
+ * offset lies outside the block.
+ */
+int multifd_iov_from_offsets(struct iovec *iov, uint8_t *host,
+                             uint64_t length, const void *offset,
+                             uint32_t used, size_t page_size, Error **errp)
+{
+    int iovs_num = 0;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        uint64_t page = ldq_be_p((const uint64_t *)offset + i);
+        struct iovec *last = iovs_num ? &iov[iovs_num - 1] : NULL;
+
+        if (page > length - page_size) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max %" PRIu64 ")", page, length);
+            return -1;
+        }
+        if (last && (uint8_t *)last->iov_base + last->iov_len == host + page) {
+            last->iov_len += page_size;
+            continue;
+        }
+        iov[iovs_num].iov_base = host + page;
+        iov[iovs_num].iov_len = page_size;
+        iovs_num++;
+    }
+
+    return iovs_num;
+}
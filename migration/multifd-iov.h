@@ -0,0 +1,14 @@
+/*
+ * Multifd receive side page placement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_MULTIFD_IOV_H
+#define QEMU_MIGRATION_MULTIFD_IOV_H
+
+int multifd_iov_from_offsets(struct iovec *iov, uint8_t *host,
+                             uint64_t length, const void *offset,
+                             uint32_t used, size_t page_size, Error **errp);
+#endif
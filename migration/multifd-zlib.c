@@ -263,12 +263,13 @@ static int zlib_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
     zs->avail_in = in_size;
     zs->next_in = z->zbuff;
 
-    for (i = 0; i < used; i++) {
+    /* Each iovec is a run of contiguous pages, inflate straight into it */
+    for (i = 0; i < p->iovs_num; i++) {
         struct iovec *iov = &p->pages->iov[i];
         int flush = Z_NO_FLUSH;
         unsigned long start = zs->total_out;
 
-        if (i == used - 1) {
+        if (i == p->iovs_num - 1) {
             flush = Z_SYNC_FLUSH;
         }
 
@@ -281,7 +282,7 @@ static int zlib_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
          * We need to loop while:
          * - return is Z_OK
          * - there are input available
-         * - we haven't completed a full page
+         * - we haven't filled the whole run
          */
         do {
             ret = inflate(zs, flush);
@@ -282,7 +282,8 @@ static int zstd_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
     z->in.size = in_size;
     z->in.pos = 0;
 
-    for (i = 0; i < used; i++) {
+    /* Each iovec is a run of contiguous pages, decompress straight into it */
+    for (i = 0; i < p->iovs_num; i++) {
         struct iovec *iov = &p->pages->iov[i];
 
         z->out.dst = iov->iov_base;
@@ -295,7 +296,7 @@ static int zstd_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
          * We need to loop while:
          * - return is > 0
          * - there is input available
-         * - we haven't put out a full page
+         * - we haven't filled the whole run
          */
         do {
             ret = ZSTD_decompressStream(z->zds, &z->out, &z->in);
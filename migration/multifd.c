@@ -24,6 +24,7 @@
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
+#include "multifd-iov.h"
 
 #include "qemu/yank.h"
 #include "io/channel-socket.h"
@@ -95,7 +96,10 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
 /**
  * nocomp_send_write: do the actual write of the data
  *
- * For no compression we just have to write the data.
+ * For no compression we just have to write the data.  With zero copy
+ * send the pages go out straight from guest memory, and are only
+ * known to have left once the channel is flushed in
+ * multifd_send_sync_main().
  *
  * Returns 0 for success or -1 for error
  *
@@ -105,7 +109,8 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
  */
 static int nocomp_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
 {
-    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+    return qio_channel_writev_full_all(p->c, p->pages->iov, used,
+                                       NULL, 0, p->write_flags, errp);
 }
 
 /**
@@ -154,7 +159,7 @@ static int nocomp_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
                    p->id, flags, MULTIFD_FLAG_NOCOMP);
         return -1;
     }
-    return qio_channel_readv_all(p->c, p->pages->iov, used, errp);
+    return qio_channel_readv_all(p->c, p->pages->iov, p->iovs_num, errp);
 }
 
 static MultiFDMethods multifd_nocomp_ops = {
@@ -291,7 +296,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     MultiFDPacket_t *packet = p->packet;
     uint32_t pages_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
     RAMBlock *block;
-    int i;
+    int ret;
 
     packet->magic = be32_to_cpu(packet->magic);
     if (packet->magic != MULTIFD_MAGIC) {
@@ -355,18 +360,14 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
-    for (i = 0; i < p->pages->used; i++) {
-        uint64_t offset = be64_to_cpu(packet->offset[i]);
-
-        if (offset > (block->used_length - qemu_target_page_size())) {
-            error_setg(errp, "multifd: offset too long %" PRIu64
-                       " (max " RAM_ADDR_FMT ")",
-                       offset, block->used_length);
-            return -1;
-        }
-        p->pages->iov[i].iov_base = block->host + offset;
-        p->pages->iov[i].iov_len = qemu_target_page_size();
+    ret = multifd_iov_from_offsets(p->pages->iov, block->host,
+                                   block->used_length, packet->offset,
+                                   p->pages->used, qemu_target_page_size(),
+                                   errp);
+    if (ret < 0) {
+        return -1;
     }
+    p->iovs_num = ret;
 
     return 0;
 }
@@ -575,17 +576,17 @@ void multifd_save_cleanup(void)
     multifd_send_state = NULL;
 }
 
-void multifd_send_sync_main(QEMUFile *f)
+int multifd_send_sync_main(QEMUFile *f)
 {
     int i;
 
     if (!migrate_use_multifd()) {
-        return;
+        return 0;
     }
     if (multifd_send_state->pages->used) {
         if (multifd_send_pages(f) < 0) {
             error_report("%s: multifd_send_pages fail", __func__);
-            return;
+            return -1;
         }
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -598,7 +599,7 @@ void multifd_send_sync_main(QEMUFile *f)
         if (p->quit) {
             error_report("%s: channel %d has already quit", __func__, i);
             qemu_mutex_unlock(&p->mutex);
-            return;
+            return -1;
         }
 
         p->packet_num = multifd_send_state->packet_num++;
@@ -615,8 +616,36 @@ void multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        /*
+         * The channel thread is idle now; make sure every page queued
+         * with zero copy has left before the next dirty bitmap sync, so
+         * a page sent in this round can't overtake a later copy of it.
+         */
+        if (p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
+            Error *err = NULL;
+            int res = qio_channel_flush(p->c, &err);
+
+            if (res < 0) {
+                /*
+                 * Pages of this round may not have reached the
+                 * destination; fail the migration rather than carry on
+                 * with a dirty bitmap that no longer covers them.
+                 */
+                error_prepend(&err, "multifd channel %d: ", p->id);
+                multifd_send_terminate_threads(err);
+                qemu_file_set_error(f, -EIO);
+                error_free(err);
+                return -1;
+            } else if (res == 1) {
+                ram_counters.dirty_sync_missed_zero_copy++;
+            }
+            trace_multifd_send_sync_main_flush(p->id, res);
+        }
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
+
+    return 0;
 }
 
 static void *multifd_send_thread(void *opaque)
@@ -850,6 +879,12 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     trace_multifd_new_send_channel_async(p->id);
     if (qio_task_propagate_error(task, &local_err)) {
         goto cleanup;
+    } else if ((p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) &&
+               !qio_channel_has_feature(sioc,
+                                        QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg(&local_err, "multifd: zero copy send is not supported "
+                   "by this host or transport");
+        goto cleanup;
     } else {
         p->c = QIO_CHANNEL(sioc);
         qio_channel_set_delay(p->c, false);
@@ -900,6 +935,8 @@ int multifd_save_setup(Error **errp)
         p->packet->version = cpu_to_be32(MULTIFD_VERSION);
         p->name = g_strdup_printf("multifdsend_%d", i);
         p->tls_hostname = g_strdup(s->hostname);
+        p->write_flags = migrate_use_zero_copy_send() ?
+                         QIO_CHANNEL_WRITE_FLAG_ZERO_COPY : 0;
         socket_send_channel_create(multifd_new_send_channel_async, p);
     }
 
@@ -18,9 +18,14 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
+#include "qemu-file-channel.h"
+#include "socket.h"
+#include "yank_functions.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
@@ -530,8 +535,26 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        /*
+         * Normally the source ends the channel of urgent pages with an EOS
+         * that the thread waits for, so that no page gets lost.  Only kick
+         * it when the channel never showed up or the main stream failed.
+         */
+        qatomic_set(&mis->preempt_thread_quit, true);
+        qemu_sem_post(&mis->postcopy_qemufile_dst_sem);
+        if (mis->postcopy_qemufile_dst &&
+            qemu_file_get_error(mis->from_src_file)) {
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -566,9 +589,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
     }
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -1062,8 +1087,52 @@ retry:
     return NULL;
 }
 
+/*
+ * Loads the pages that the source sends on the channel of urgent pages
+ * (postcopy-preempt capability), in parallel with the main channel.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret;
+
+    rcu_register_thread();
+
+    /* The source only connects the channel once it enters postcopy */
+    qemu_sem_wait(&mis->postcopy_qemufile_dst_sem);
+    if (!mis->postcopy_qemufile_dst) {
+        /* Quitting before the channel showed up */
+        rcu_unregister_thread();
+        return NULL;
+    }
+
+    trace_postcopy_preempt_thread_entry();
+
+    /* The source ends the channel with an EOS once postcopy completes */
+    WITH_RCU_READ_LOCK_GUARD() {
+        ret = ram_load_postcopy(mis->postcopy_qemufile_dst,
+                                RAM_CHANNEL_POSTCOPY);
+    }
+
+    if (ret && !qatomic_read(&mis->preempt_thread_quit)) {
+        /*
+         * Make sure the source notices, so that postcopy gets paused and the
+         * pages we are missing are requested again on recovery.
+         */
+        error_report("%s: loading urgent pages failed: %s", __func__,
+                     strerror(-ret));
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    }
+
+    trace_postcopy_preempt_thread_exit(ret);
+    rcu_unregister_thread();
+    return NULL;
+}
+
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
+    int i, channels;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -1102,14 +1171,18 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                                  PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                                  MAP_ANONYMOUS, -1, 0);
-    if (mis->postcopy_tmp_page == MAP_FAILED) {
-        mis->postcopy_tmp_page = NULL;
-        error_report("%s: Failed to map postcopy_tmp_page %s",
-                     __func__, strerror(errno));
-        return -1;
+    /* The channel of urgent pages places pages in parallel, give it its own */
+    channels = migrate_postcopy_preempt() ? RAM_CHANNEL_MAX : 1;
+    for (i = 0; i < channels; i++) {
+        mis->postcopy_tmp_pages[i] = mmap(NULL, mis->largest_page_size,
+                                          PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                                          MAP_ANONYMOUS, -1, 0);
+        if (mis->postcopy_tmp_pages[i] == MAP_FAILED) {
+            mis->postcopy_tmp_pages[i] = NULL;
+            error_report("%s: Failed to map postcopy_tmp_page %s",
+                         __func__, strerror(errno));
+            return -1;
+        }
     }
 
     /*
@@ -1128,11 +1201,37 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     }
     memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
 
+    if (migrate_postcopy_preempt()) {
+        qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
 }
 
+/*
+ * Account the latency of a page request resolved at @host_addr, that was
+ * sent at @req_time.  Called with page_request_mutex held.
+ */
+static void postcopy_page_req_account(MigrationIncomingState *mis,
+                                      void *host_addr, int64_t req_time)
+{
+    int64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    uint64_t latency = now > req_time ? now - req_time : 0;
+    int bucket = 0;
+
+    if (latency) {
+        bucket = MIN(63 - clz64(latency), POSTCOPY_LATENCY_BUCKETS - 1);
+    }
+    mis->postcopy_latency_count++;
+    mis->postcopy_latency_total += latency;
+    mis->postcopy_latency_dist[bucket]++;
+    trace_postcopy_page_req_latency(host_addr, latency);
+}
+
 static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
                                void *from_addr, uint64_t pagesize, RAMBlock *rb)
 {
@@ -1154,6 +1253,8 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
         ret = ioctl(userfault_fd, UFFDIO_ZEROPAGE, &zero_struct);
     }
     if (!ret) {
+        int64_t *req_time;
+
         qemu_mutex_lock(&mis->page_request_mutex);
         ramblock_recv_bitmap_set_range(rb, host_addr,
                                        pagesize / qemu_target_page_size());
@@ -1161,7 +1262,9 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
          * If this page resolves a page fault for a previous recorded faulted
          * address, take a special note to maintain the requested page list.
          */
-        if (g_tree_lookup(mis->page_requested, host_addr)) {
+        req_time = g_tree_lookup(mis->page_requested, host_addr);
+        if (req_time) {
+            postcopy_page_req_account(mis, host_addr, *req_time);
             g_tree_remove(mis->page_requested, host_addr);
             mis->page_requested_count--;
             trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
@@ -1312,6 +1415,66 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
 
 /* ------------------------------------------------------------------------- */
 
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        trace_postcopy_preempt_send_channel_error(
+            error_get_pretty(local_err));
+        warn_report_err(local_err);
+    } else {
+        QEMUFile *f = qemu_fopen_channel_output(ioc);
+
+        migration_ioc_register_yank(ioc);
+        qemu_mutex_lock(&s->qemu_file_lock);
+        s->postcopy_qemufile_src = f;
+        qemu_mutex_unlock(&s->qemu_file_lock);
+        trace_postcopy_preempt_new_channel();
+    }
+
+    object_unref(OBJECT(ioc));
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+/**
+ * postcopy_preempt_setup: Connect the channel for urgent postcopy pages
+ *
+ * Called by the migration thread when entering postcopy, so that the
+ * destination has already taken the main channel and can tell them apart.
+ * Not getting the channel is not fatal: the urgent pages then share the
+ * main channel, like without the postcopy-preempt capability.
+ *
+ * @s: Current migration state.
+ */
+void postcopy_preempt_setup(MigrationState *s)
+{
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+    qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+
+    if (!s->postcopy_qemufile_src) {
+        warn_report("postcopy-preempt: no channel for urgent pages, "
+                    "using the main channel");
+    }
+}
+
+/**
+ * postcopy_preempt_new_channel: Take the channel for urgent postcopy pages
+ *
+ * @mis: Current incoming migration state.
+ * @f: The new channel from the source.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f)
+{
+    /* The preempt thread reads it synchronously */
+    qemu_file_set_blocking(f, true);
+    mis->postcopy_qemufile_dst = f;
+    trace_postcopy_preempt_new_channel();
+    qemu_sem_post(&mis->postcopy_qemufile_dst_sem);
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
@@ -41,6 +41,16 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis);
  */
 int postcopy_ram_prepare_discard(MigrationIncomingState *mis);
 
+/*
+ * Source side: connect the channel for urgent pages (postcopy-preempt).
+ */
+void postcopy_preempt_setup(MigrationState *s);
+
+/*
+ * Destination side: the channel for urgent pages has been accepted.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f);
+
 /*
  * Called at the start of each RAMBlock by the bitmap code.
  */
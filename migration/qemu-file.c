@@ -43,6 +43,8 @@ struct QEMUFile {
 
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
+    int64_t pos_skipped; /* moved by qemu_set_offset(), not transferred */
+    int64_t bytes_at; /* written by qemu_put_buffer_at(), not in pos */
     int buf_index;
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
@@ -665,6 +667,158 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Number of bytes written to the file so far.  Unlike qemu_ftell() this
+ * counts data written at explicit offsets, and not the gaps left by
+ * moving the stream position.
+ */
+int64_t qemu_file_total_transferred(QEMUFile *f)
+{
+    qemu_fflush(f);
+    return f->pos - f->pos_skipped + f->bytes_at;
+}
+
+/*
+ * Whether the file supports positioned I/O, i.e. qemu_set_offset(),
+ * qemu_put_buffer_at() and qemu_get_buffer_at().
+ */
+bool qemu_file_is_seekable(QEMUFile *f)
+{
+    return f->has_ioc &&
+           qio_channel_has_feature(QIO_CHANNEL(f->opaque),
+                                   QIO_CHANNEL_FEATURE_SEEKABLE);
+}
+
+/*
+ * Move the stream position of a seekable file.  Data already queued for
+ * writing is flushed at the old position; data read ahead is discarded.
+ */
+void qemu_set_offset(QEMUFile *f, off_t off, int whence)
+{
+    Error *local_error = NULL;
+    off_t ret;
+
+    if (qemu_file_get_error(f)) {
+        return;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+        if (qemu_file_get_error(f)) {
+            return;
+        }
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    if (!qemu_file_is_seekable(f)) {
+        error_setg(&local_error, "Migration stream is not seekable");
+        qemu_file_set_error_obj(f, -EINVAL, local_error);
+        return;
+    }
+
+    ret = qio_channel_io_seek(QIO_CHANNEL(f->opaque), off, whence,
+                              &local_error);
+    if (ret == (off_t)-1) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+        return;
+    }
+
+    f->pos_skipped += ret - f->pos;
+    f->pos = ret;
+}
+
+/* Current stream position, including data not yet flushed or consumed */
+off_t qemu_get_offset(QEMUFile *f)
+{
+    if (qemu_file_is_writable(f)) {
+        return qemu_ftell_fast(f);
+    }
+
+    return f->pos - (f->buf_size - f->buf_index);
+}
+
+/*
+ * Write @buflen bytes at absolute offset @pos without moving the stream
+ * position; the bytes count against the rate limit like any other write.
+ */
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t buflen,
+                        off_t pos)
+{
+    Error *local_error = NULL;
+    size_t done = 0;
+
+    if (qemu_file_get_error(f)) {
+        return;
+    }
+
+    if (!qemu_file_is_seekable(f)) {
+        error_setg(&local_error, "Migration stream is not seekable");
+        qemu_file_set_error_obj(f, -EINVAL, local_error);
+        return;
+    }
+
+    while (done < buflen) {
+        ssize_t ret = qio_channel_pwrite(QIO_CHANNEL(f->opaque),
+                                         (char *)buf + done, buflen - done,
+                                         pos + done, &local_error);
+        if (ret < 0) {
+            qemu_file_set_error_obj(f, -EIO, local_error);
+            return;
+        }
+        if (ret == 0) {
+            /* No progress at all: the file cannot grow any further */
+            error_setg(&local_error, "Unable to write to file at offset %lld",
+                       (long long int)(pos + done));
+            qemu_file_set_error_obj(f, -ENOSPC, local_error);
+            return;
+        }
+        done += ret;
+    }
+
+    f->bytes_xfer += buflen;
+    f->bytes_at += buflen;
+}
+
+/*
+ * Read up to @buflen bytes from absolute offset @pos without moving the
+ * stream position.  Returns the number of bytes read, which is short
+ * only on error or end of file.
+ */
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t buflen,
+                          off_t pos)
+{
+    Error *local_error = NULL;
+    size_t done = 0;
+
+    if (qemu_file_get_error(f)) {
+        return 0;
+    }
+
+    if (!qemu_file_is_seekable(f)) {
+        error_setg(&local_error, "Migration stream is not seekable");
+        qemu_file_set_error_obj(f, -EINVAL, local_error);
+        return 0;
+    }
+
+    while (done < buflen) {
+        ssize_t ret = qio_channel_pread(QIO_CHANNEL(f->opaque),
+                                        (char *)buf + done, buflen - done,
+                                        pos + done, &local_error);
+        if (ret < 0) {
+            qemu_file_set_error_obj(f, -EIO, local_error);
+            break;
+        }
+        if (ret == 0) {
+            break;
+        }
+        done += ret;
+    }
+
+    return done;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (f->shutdown) {
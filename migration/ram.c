@@ -28,6 +28,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
@@ -329,6 +330,14 @@ struct RAMState {
     /* Start using XBZRLE (e.g., after the first round). */
     bool xbzrle_enabled;
 
+    /*
+     * mapped-ram: run of contiguous pages of mapped_ram_block that has
+     * been accounted as sent but not yet written to the file
+     */
+    RAMBlock *mapped_ram_block;
+    ram_addr_t mapped_ram_start;
+    ram_addr_t mapped_ram_len;
+
     /* compression statistics since the beginning of the period */
     /* amount of count that no free thread to compress data */
     uint64_t compress_thread_busy_prev;
@@ -1069,6 +1078,114 @@ static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
     return len;
 }
 
+/*
+ * mapped-ram file layout: in the RAM setup section, the description of
+ * each RAMBlock is followed by a header giving the location of the
+ * block's page bitmap and page data in the file, after which the
+ * stream continues past the end of the page data.  The page data is
+ * aligned so it can be mapped or read directly into guest memory.
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+#define MAPPED_RAM_HDR_SIZE (4 + 3 * 8)
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT (1 * MiB)
+/* Largest run of contiguous pages that is written with a single call */
+#define MAPPED_RAM_MAX_RUN (4 * MiB)
+
+/* Size in the file of the little endian page bitmap for @length of RAM */
+static uint64_t mapped_ram_bitmap_size(ram_addr_t length)
+{
+    unsigned long nbits = length >> TARGET_PAGE_BITS;
+
+    return ROUND_UP(DIV_ROUND_UP(nbits, 8), 8);
+}
+
+/*
+ * Reserve room for @block in the file: write its header, then move
+ * the stream position past the bitmap and the page data.
+ */
+static void mapped_ram_setup_ramblock(QEMUFile *f, RAMBlock *block)
+{
+    off_t bitmap_offset = qemu_get_offset(f) + MAPPED_RAM_HDR_SIZE;
+    off_t pages_offset;
+
+    pages_offset = ROUND_UP(bitmap_offset +
+                            mapped_ram_bitmap_size(block->used_length),
+                            MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    block->file_bmap = bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+    block->bitmap_offset = bitmap_offset;
+    block->pages_offset = pages_offset;
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, bitmap_offset);
+    qemu_put_be64(f, pages_offset);
+
+    trace_mapped_ram_setup_ramblock(block->idstr, bitmap_offset,
+                                    pages_offset);
+
+    qemu_set_offset(f, pages_offset + block->used_length, SEEK_SET);
+}
+
+/* Write out the run of pages queued by mapped_ram_save_page() */
+static void mapped_ram_flush(RAMState *rs)
+{
+    RAMBlock *block = rs->mapped_ram_block;
+
+    if (!rs->mapped_ram_len) {
+        return;
+    }
+
+    qemu_put_buffer_at(rs->f, block->host + rs->mapped_ram_start,
+                       rs->mapped_ram_len,
+                       block->pages_offset + rs->mapped_ram_start);
+    rs->mapped_ram_len = 0;
+}
+
+/*
+ * Queue a page to be written at its fixed offset in the file.  Pages
+ * are sent in increasing order within a block, so they are coalesced
+ * into runs that are written with a single call.
+ */
+static int mapped_ram_save_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    if (rs->mapped_ram_len &&
+        (rs->mapped_ram_block != block ||
+         rs->mapped_ram_start + rs->mapped_ram_len != offset ||
+         rs->mapped_ram_len >= MAPPED_RAM_MAX_RUN)) {
+        mapped_ram_flush(rs);
+    }
+
+    if (!rs->mapped_ram_len) {
+        rs->mapped_ram_block = block;
+        rs->mapped_ram_start = offset;
+    }
+    rs->mapped_ram_len += TARGET_PAGE_SIZE;
+
+    set_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    ram_counters.normal++;
+    return 1;
+}
+
+/* Write the bitmaps telling which pages of each block are in the file */
+static void mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        unsigned long nbits = block->used_length >> TARGET_PAGE_BITS;
+        unsigned long *le_bitmap = bitmap_new(nbits + BITS_PER_LONG);
+
+        bitmap_to_le(le_bitmap, block->file_bmap, nbits);
+        qemu_put_buffer_at(f, (uint8_t *)le_bitmap,
+                           mapped_ram_bitmap_size(block->used_length),
+                           block->bitmap_offset);
+        g_free(le_bitmap);
+    }
+}
+
 /**
  * save_zero_page: send the zero page to the stream
  *
@@ -1080,7 +1197,23 @@ static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
  */
 static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
 {
-    int len = save_zero_page_to_file(rs, rs->f, block, offset);
+    int len;
+
+    /*
+     * Zero pages are not written to the file at all, the destination
+     * RAM is already zero.  The page may have been written with data in
+     * an earlier round though, so that copy must be dropped.
+     */
+    if (migrate_mapped_ram()) {
+        if (!is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+            return -1;
+        }
+        clear_bit(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    len = save_zero_page_to_file(rs, rs->f, block, offset);
 
     if (len) {
         ram_counters.duplicate++;
@@ -1151,6 +1284,10 @@ static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
 static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
                             uint8_t *buf, bool async)
 {
+    if (migrate_mapped_ram()) {
+        return mapped_ram_save_page(rs, block, offset);
+    }
+
     ram_counters.transferred += save_page_header(rs, rs->f, block,
                                                  offset | RAM_SAVE_FLAG_PAGE);
     if (async) {
@@ -1500,6 +1637,7 @@ static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
         uint64_t run_length = (pss->page - start_page + 1) << TARGET_PAGE_BITS;
 
         /* Flush async buffers before un-protect. */
+        mapped_ram_flush(rs);
         qemu_fflush(rs->f);
         /* Un-protect memory range. */
         res = uffd_change_protection(rs->uffdio_fd, page_address, run_length,
@@ -2079,6 +2217,96 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     return (res < 0 ? res : pages);
 }
 
+/**
+ * postcopy_preempt_file: channel to send urgent postcopy pages on
+ *
+ * Returns the dedicated channel for the pages explicitly requested by the
+ * destination, or NULL if they should go on the main channel.
+ */
+static QEMUFile *postcopy_preempt_file(void)
+{
+    MigrationState *s = migrate_get_current();
+    QEMUFile *f;
+
+    if (!migrate_postcopy_preempt() || !migration_in_postcopy()) {
+        return NULL;
+    }
+
+    /* Only the migration thread modifies the pointer after it's set */
+    f = s->postcopy_qemufile_src;
+    if (!f || qemu_file_get_error(f)) {
+        return NULL;
+    }
+    return f;
+}
+
+/**
+ * ram_save_switch_channel: change the channel that pages are sent to
+ *
+ * @rs: current RAM state
+ * @f: QEMUFile to send the following pages on
+ */
+static void ram_save_switch_channel(RAMState *rs, QEMUFile *f)
+{
+    if (rs->f != f) {
+        trace_ram_save_switch_channel(rs->f, f);
+        rs->f = f;
+        /*
+         * The destination tracks the last block per channel, make sure the
+         * first page on the new channel carries the block name.
+         */
+        rs->last_sent_block = NULL;
+    }
+}
+
+/**
+ * ram_save_urgent_host_page: send a page requested by the destination
+ *
+ * With the postcopy-preempt capability the page goes on the dedicated
+ * channel and is flushed right away, so it doesn't wait behind the
+ * background stream.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_urgent_host_page(RAMState *rs, PageSearchStatus *pss,
+                                     bool last_stage)
+{
+    QEMUFile *main_f = rs->f;
+    QEMUFile *preempt_f = postcopy_preempt_file();
+    int pages, ret;
+
+    if (!preempt_f) {
+        return ram_save_host_page(rs, pss, last_stage);
+    }
+
+    ram_save_switch_channel(rs, preempt_f);
+    pages = ram_save_host_page(rs, pss, last_stage);
+    qemu_fflush(preempt_f);
+    ram_save_switch_channel(rs, main_f);
+
+    ret = qemu_file_get_error(preempt_f);
+    if (ret) {
+        /*
+         * We can't tell whether the page made it.  Fail the main channel
+         * too, so that postcopy pauses; on recovery the destination asks
+         * again for every page it hasn't got, and from then on those go on
+         * the main channel.
+         */
+        error_report("%s: postcopy preempt channel failed: %s",
+                     __func__, strerror(-ret));
+        /* Don't leave the destination's preempt thread waiting for more */
+        qemu_file_shutdown(preempt_f);
+        qemu_file_set_error(main_f, ret);
+        return ret;
+    }
+
+    return pages;
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2117,11 +2345,14 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         again = true;
         found = get_queued_page(rs, &pss);
 
-        if (!found) {
-            /* priority queue empty, so just search for something dirty */
-            found = find_dirty_block(rs, &pss, &again);
+        if (found) {
+            pages = ram_save_urgent_host_page(rs, &pss, last_stage);
+            continue;
         }
 
+        /* priority queue empty, so just search for something dirty */
+        found = find_dirty_block(rs, &pss, &again);
+
         if (found) {
             pages = ram_save_host_page(rs, &pss, last_stage);
         }
@@ -2218,7 +2449,7 @@ static void ram_save_cleanup(void *opaque)
         /* caller have hold iothread lock or is in a bh, so there is
          * no writing race against the migration bitmap
          */
-        memory_global_dirty_log_stop();
+        memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
@@ -2226,6 +2457,8 @@ static void ram_save_cleanup(void *opaque)
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
@@ -2680,7 +2913,7 @@ static void ram_init_bitmaps(RAMState *rs)
         ram_list_init_bitmaps();
         /* We don't use dirty log with background snapshots */
         if (!migrate_background_snapshot()) {
-            memory_global_dirty_log_start();
+            memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
             migration_bitmap_sync_precopy(rs);
         }
     }
@@ -2805,6 +3038,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMState **rsp = opaque;
     RAMBlock *block;
+    int ret;
 
     if (compress_threads_save_setup()) {
         return -1;
@@ -2819,6 +3053,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
     (*rsp)->f = f;
 
+    if (migrate_mapped_ram() && !qemu_file_is_seekable(f)) {
+        error_report("Mapped-ram needs a seekable migration file");
+        return -1;
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
         qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
 
@@ -2833,13 +3072,20 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram()) {
+                mapped_ram_setup_ramblock(f, block);
+            }
         }
     }
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
-    multifd_send_sync_main(f);
+    ret = multifd_send_sync_main(f);
+    if (ret < 0) {
+        return ret;
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
@@ -2936,6 +3182,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
             }
             i++;
         }
+
+        mapped_ram_flush(rs);
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
@@ -2948,7 +3196,11 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 out:
     if (ret >= 0
         && migration_is_setup_or_active(migrate_get_current()->state)) {
-        multifd_send_sync_main(rs->f);
+        ret = multifd_send_sync_main(rs->f);
+        if (ret < 0) {
+            return ret;
+        }
+
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
         ram_counters.transferred += 8;
@@ -3003,13 +3255,30 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
 
         flush_compressed_data(rs);
+
+        if (migrate_mapped_ram()) {
+            mapped_ram_flush(rs);
+            mapped_ram_save_bitmaps(f);
+        }
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     }
 
     if (ret >= 0) {
-        multifd_send_sync_main(rs->f);
+        QEMUFile *preempt_f = postcopy_preempt_file();
+
+        ret = multifd_send_sync_main(rs->f);
+        if (ret < 0) {
+            return ret;
+        }
+
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
+
+        /* Let the destination's preempt thread know there's nothing more */
+        if (preempt_f) {
+            qemu_put_be64(preempt_f, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(preempt_f);
+        }
     }
 
     return ret;
@@ -3085,12 +3354,16 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * Returns a pointer from within the RCU-protected ram_list.
  *
+ * @mis: the migration incoming state pointer
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the RAM channel that @f belongs to
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
+                                              QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block;
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3111,6 +3384,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         error_report("Can't find block %s", id);
         return NULL;
     }
+    mis->last_recv_block[channel] = block;
 
     if (ramblock_is_ignored(block)) {
         error_report("block %s should not be migrated !", id);
@@ -3437,7 +3711,7 @@ void colo_incoming_start_dirty_log(void)
             /* Discard this dirty bitmap record */
             bitmap_zero(block->bmap, block->max_length >> TARGET_PAGE_BITS);
         }
-        memory_global_dirty_log_start();
+        memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
     }
     ram_state->migration_dirty_pages = 0;
     qemu_mutex_unlock_ramlist();
@@ -3449,7 +3723,7 @@ void colo_release_ram_cache(void)
 {
     RAMBlock *block;
 
-    memory_global_dirty_log_stop();
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
         block->bmap = NULL;
@@ -3526,19 +3800,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load() for the main channel, and by the
+ * postcopy preempt thread for the channel of urgent pages.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the RAM channel that @f belongs to
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = mis->postcopy_tmp_pages[channel];
     void *host_page = NULL;
     bool all_zero = true;
     int target_pages = 0;
@@ -3568,7 +3844,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(mis, f, flags, channel);
             if (!block) {
                 ret = -EINVAL;
                 break;
@@ -3667,7 +3943,9 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: 0x%x"
@@ -3759,6 +4037,86 @@ void colo_flush_ram_cache(void)
     qemu_mutex_unlock(&ram_state->bitmap_mutex);
 }
 
+/*
+ * Load the pages of @block from their fixed location in the file, reading
+ * each run of pages present in the file straight into guest memory, then
+ * move the stream position past the block's page data.
+ */
+static int mapped_ram_read_ramblock(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length)
+{
+    unsigned long nbits = length >> TARGET_PAGE_BITS;
+    unsigned long *le_bitmap, *bitmap;
+    unsigned long set, clear = 0;
+    uint64_t bitmap_size = mapped_ram_bitmap_size(length);
+    uint64_t page_size, bitmap_offset, pages_offset;
+    uint32_t version;
+    int ret = 0;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+
+    if (version != MAPPED_RAM_HDR_VERSION) {
+        error_report("Unsupported mapped-ram header version %u for "
+                     "block %s", version, block->idstr);
+        return -EINVAL;
+    }
+
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched mapped-ram page size %" PRIu64
+                     " for block %s", page_size, block->idstr);
+        return -EINVAL;
+    }
+
+    trace_mapped_ram_read_ramblock(block->idstr, bitmap_offset,
+                                   pages_offset);
+
+    le_bitmap = bitmap_new(nbits + BITS_PER_LONG);
+    bitmap = bitmap_new(nbits);
+
+    if (qemu_get_buffer_at(f, (uint8_t *)le_bitmap, bitmap_size,
+                           bitmap_offset) != bitmap_size) {
+        error_report("Failed to read mapped-ram bitmap of block %s",
+                     block->idstr);
+        ret = -EIO;
+        goto out;
+    }
+    bitmap_from_le(bitmap, le_bitmap, nbits);
+
+    for (set = find_first_bit(bitmap, nbits); set < nbits;
+         set = find_next_bit(bitmap, nbits, clear + 1)) {
+        ram_addr_t offset = (ram_addr_t)set << TARGET_PAGE_BITS;
+        size_t len;
+        void *host;
+
+        clear = find_next_zero_bit(bitmap, nbits, set + 1);
+        len = (size_t)(clear - set) << TARGET_PAGE_BITS;
+
+        host = host_from_ram_block_offset(block, offset);
+        if (!host) {
+            error_report("Illegal RAM offset " RAM_ADDR_FMT, offset);
+            ret = -EINVAL;
+            goto out;
+        }
+
+        if (qemu_get_buffer_at(f, host, len, pages_offset + offset) != len) {
+            error_report("Failed to read pages of block %s at offset "
+                         RAM_ADDR_FMT, block->idstr, offset);
+            ret = -EIO;
+            goto out;
+        }
+    }
+
+    qemu_set_offset(f, pages_offset + length, SEEK_SET);
+
+out:
+    g_free(bitmap);
+    g_free(le_bitmap);
+    return ret;
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -3771,6 +4129,7 @@ void colo_flush_ram_cache(void)
  */
 static int ram_load_precopy(QEMUFile *f)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
     int flags = 0, ret = 0, invalid_flags = 0, len = 0, i = 0;
     /* ADVISE is earlier, it shows the source has the postcopy capability on */
     bool postcopy_advised = postcopy_is_advised();
@@ -3809,7 +4168,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(mis, f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -3898,6 +4258,9 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_read_ramblock(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -3986,7 +4349,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -293,6 +293,11 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
                            info->ram->postcopy_requests);
         }
+        if (info->ram->dirty_sync_missed_zero_copy) {
+            monitor_printf(mon,
+                           "zero-copy-send fallbacks: %" PRIu64 " times\n",
+                           info->ram->dirty_sync_missed_zero_copy);
+        }
     }
 
     if (info->has_disk) {
@@ -355,6 +360,24 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+
+    if (info->has_postcopy_latency) {
+        monitor_printf(mon, "postcopy request latency: %" PRIu64 " us\n",
+                       info->postcopy_latency);
+    }
+
+    if (info->has_postcopy_latency_dist) {
+        Visitor *v;
+        char *str;
+        v = string_output_visitor_new(false, &str);
+        visit_type_uint64List(v, NULL, &info->postcopy_latency_dist,
+                              &error_abort);
+        visit_complete(v, &str);
+        monitor_printf(mon, "postcopy request latency distribution: %s\n",
+                       str);
+        g_free(str);
+        visit_free(v);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -19,24 +19,49 @@
 #include "net/checksum.h"
 #include "net/eth.h"
 
+/*
+ * Sum the buffer as big endian 64-bit words into a 64-bit accumulator,
+ * which the compiler can keep in vector registers, and fold the result
+ * down to 16 bits.  The ones' complement sum of wider words folded this
+ * way equals the sum of the 16-bit words, so callers can keep adding the
+ * returned values and pass them to net_checksum_finish().
+ */
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
 {
-    uint32_t sum1 = 0, sum2 = 0;
-    int i;
-
-    for (i = 0; i < len - 1; i += 2) {
-        sum1 += (uint32_t)buf[i];
-        sum2 += (uint32_t)buf[i + 1];
+    uint64_t sum = 0;
+    uint32_t res;
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        uint64_t w0 = ldq_be_p(buf + i);
+        uint64_t w1 = ldq_be_p(buf + i + 8);
+        uint64_t w2 = ldq_be_p(buf + i + 16);
+        uint64_t w3 = ldq_be_p(buf + i + 24);
+
+        sum += (w0 >> 32) + (uint32_t)w0 + (w1 >> 32) + (uint32_t)w1 +
+               (w2 >> 32) + (uint32_t)w2 + (w3 >> 32) + (uint32_t)w3;
+    }
+    for (; i + 4 <= len; i += 4) {
+        sum += ldl_be_p(buf + i);
+    }
+    if (i + 2 <= len) {
+        sum += lduw_be_p(buf + i);
+        i += 2;
     }
     if (i < len) {
-        sum1 += (uint32_t)buf[i];
+        sum += (uint32_t)buf[i] << 8;
     }
 
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    res = (sum & 0xffff) + (sum >> 16);
+    res = (res & 0xffff) + (res >> 16);
+
+    /* An odd starting offset swaps the bytes of every 16-bit word */
     if (seq & 1) {
-        return sum1 + (sum2 << 8);
-    } else {
-        return sum2 + (sum1 << 8);
+        res = bswap16(res);
     }
+    return res;
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
@@ -55,6 +55,8 @@ static NotifierList colo_compare_notifiers =
 #define REGULAR_PACKET_CHECK_MS 1000
 #define DEFAULT_TIME_OUT_MS 3000
 
+#define MAX_COMPARE_THREADS 64
+
 /* #define DEBUG_COLO_PACKETS */
 
 static QemuMutex colo_compare_mutex;
@@ -103,6 +105,38 @@ typedef struct SendEntry {
     uint8_t *buf;
 } SendEntry;
 
+typedef struct CompareShardItem {
+    int mode;
+    Packet *pkt;
+    ConnectionKey key;
+} CompareShardItem;
+
+/*
+ * With compare_threads > 1, connections are spread over compare threads
+ * by the hash of their key.  The iothread only parses incoming packets
+ * and hands them to the thread owning the connection; packets released
+ * by the compare threads are sent from the iothread again.
+ */
+typedef struct CompareShard {
+    struct CompareState *s;
+    QemuThread thread;
+
+    QemuMutex lock;
+    QemuCond cond;
+    QemuCond flushed;
+    /* Element type: CompareShardItem, protected by lock */
+    GQueue input;
+    uint32_t flush_req;
+    uint32_t flush_done;
+    bool quit;
+
+    /* Only used by the compare thread */
+    GQueue conn_list;
+    GHashTable *connection_track_table;
+    /* Read by the max_lag_ms getter, 32 bits so that it can be atomic */
+    uint32_t max_lag_ms;
+} CompareShard;
+
 struct CompareState {
     Object parent;
 
@@ -134,6 +168,16 @@ struct CompareState {
     IOThread *iothread;
     GMainContext *worker_context;
     QEMUTimer *packet_check_timer;
+    /* Age of the oldest held primary packet at the last scan */
+    uint32_t max_lag_ms;
+
+    uint32_t compare_threads;
+    CompareShard *shards;
+    /* Primary packets released by the compare threads, protected by out_lock */
+    QemuMutex out_lock;
+    GQueue out_pending;
+    QEMUBH *out_bh;
+    bool notify_pending;
 
     QEMUBH *event_bh;
     enum colo_event event;
@@ -184,7 +228,7 @@ static void notify_remote_frame(CompareState *s)
     }
 }
 
-static void colo_compare_inconsistency_notify(CompareState *s)
+static void colo_compare_do_inconsistency_notify(CompareState *s)
 {
     if (s->notify_dev) {
         notify_remote_frame(s);
@@ -194,12 +238,43 @@ static void colo_compare_inconsistency_notify(CompareState *s)
     }
 }
 
+static void colo_compare_inconsistency_notify(CompareState *s)
+{
+    if (s->shards) {
+        /* Leave it to the iothread, see colo_compare_output_bh() */
+        qatomic_set(&s->notify_pending, true);
+        qemu_bh_schedule(s->out_bh);
+        return;
+    }
+
+    colo_compare_do_inconsistency_notify(s);
+}
+
 /* Use restricted to colo_insert_packet() */
 static gint seq_sorter(Packet *a, Packet *b, gpointer data)
 {
     return a->tcp_seq - b->tcp_seq;
 }
 
+/*
+ * The queues of a TCP connection are kept in sequence number order and
+ * consumed from the head.  Segments mostly arrive in order, so look for
+ * the insertion point from the tail; this is what g_queue_insert_sorted()
+ * would do, without walking the whole queue for every packet.
+ */
+static void colo_insert_sorted(GQueue *queue, Packet *pkt)
+{
+    GList *l;
+
+    for (l = queue->tail; l; l = l->prev) {
+        if (seq_sorter(l->data, pkt, NULL) <= 0) {
+            g_queue_insert_after(queue, l, pkt);
+            return;
+        }
+    }
+    g_queue_push_head(queue, pkt);
+}
+
 static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
 {
     Packet *pkt = data;
@@ -226,10 +301,7 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     if (g_queue_get_length(queue) <= max_queue_size) {
         if (pkt->ip->ip_p == IPPROTO_TCP) {
             fill_pkt_tcp_info(pkt, max_ack);
-            g_queue_insert_sorted(queue,
-                                  pkt,
-                                  (GCompareDataFunc)seq_sorter,
-                                  NULL);
+            colo_insert_sorted(queue, pkt);
         } else {
             g_queue_push_tail(queue, pkt);
         }
@@ -238,16 +310,61 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     return 0;
 }
 
+static Connection *connection_enqueue(GHashTable *connection_track_table,
+                                      GQueue *conn_list, int mode,
+                                      Packet *pkt, ConnectionKey *key)
+{
+    Connection *conn;
+    int ret;
+
+    conn = connection_get(connection_track_table, key, conn_list);
+
+    if (!conn->processing) {
+        g_queue_push_tail(conn_list, conn);
+        conn->processing = true;
+    }
+
+    if (mode == PRIMARY_IN) {
+        ret = colo_insert_packet(&conn->primary_list, pkt, &conn->pack);
+    } else {
+        ret = colo_insert_packet(&conn->secondary_list, pkt, &conn->sack);
+    }
+
+    if (!ret) {
+        trace_colo_compare_drop_packet(colo_mode[mode],
+            "queue size too big, drop packet");
+        packet_destroy(pkt, NULL);
+    }
+
+    return conn;
+}
+
+static void colo_compare_shard_push(CompareState *s, int mode, Packet *pkt,
+                                    ConnectionKey *key)
+{
+    CompareShard *shard;
+    CompareShardItem *item = g_slice_new(CompareShardItem);
+
+    item->mode = mode;
+    item->pkt = pkt;
+    item->key = *key;
+
+    shard = &s->shards[connection_key_hash(key) % s->compare_threads];
+    qemu_mutex_lock(&shard->lock);
+    g_queue_push_tail(&shard->input, item);
+    qemu_cond_signal(&shard->cond);
+    qemu_mutex_unlock(&shard->lock);
+}
+
 /*
  * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
+ * is unsupported(arp and ipv6) and will be sent later.
+ * @con is NULL when a compare thread takes care of the packet.
  */
 static int packet_enqueue(CompareState *s, int mode, Connection **con)
 {
     ConnectionKey key;
     Packet *pkt = NULL;
-    Connection *conn;
-    int ret;
 
     if (mode == PRIMARY_IN) {
         pkt = packet_new(s->pri_rs.buf,
@@ -266,30 +383,14 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
     }
     fill_connection_key(pkt, &key);
 
-    conn = connection_get(s->connection_track_table,
-                          &key,
-                          &s->conn_list);
-
-    if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
-        conn->processing = true;
-    }
-
-    if (mode == PRIMARY_IN) {
-        ret = colo_insert_packet(&conn->primary_list, pkt, &conn->pack);
-    } else {
-        ret = colo_insert_packet(&conn->secondary_list, pkt, &conn->sack);
-    }
-
-    if (!ret) {
-        trace_colo_compare_drop_packet(colo_mode[mode],
-            "queue size too big, drop packet");
-        packet_destroy(pkt, NULL);
-        pkt = NULL;
+    if (s->shards) {
+        colo_compare_shard_push(s, mode, pkt, &key);
+        *con = NULL;
+        return 0;
     }
 
-    *con = conn;
-
+    *con = connection_enqueue(s->connection_track_table, &s->conn_list,
+                              mode, pkt, &key);
     return 0;
 }
 
@@ -298,9 +399,18 @@ static inline bool after(uint32_t seq1, uint32_t seq2)
         return (int32_t)(seq1 - seq2) > 0;
 }
 
-static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+static void colo_send_primary_pkt(CompareState *s, Packet *pkt)
 {
     int ret;
+
+    if (s->shards) {
+        qemu_mutex_lock(&s->out_lock);
+        g_queue_push_tail(&s->out_pending, pkt);
+        qemu_mutex_unlock(&s->out_lock);
+        qemu_bh_schedule(s->out_bh);
+        return;
+    }
+
     ret = compare_chr_send(s,
                            pkt->data,
                            pkt->size,
@@ -310,10 +420,15 @@ static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
     if (ret < 0) {
         error_report("colo send primary packet failed");
     }
-    trace_colo_compare_main("packet same and release packet");
     packet_destroy_partial(pkt, NULL);
 }
 
+static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+{
+    trace_colo_compare_main("packet same and release packet");
+    colo_send_primary_pkt(s, pkt);
+}
+
 /*
  * The IP packets sent by primary and secondary
  * will be compared in here
@@ -648,18 +763,49 @@ out:
 /*
  * Look for old packets that the secondary hasn't matched,
  * if we have some then we have to checkpoint to wake
- * the secondary up.
+ * the secondary up.  Also record how long each connection
+ * has been holding back primary packets.
  */
+static void colo_old_packet_check_list(CompareState *s, GQueue *conn_list,
+                                       uint32_t *max_lag_ms)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    uint64_t max_lag = 0;
+    bool found = false;
+    GList *l;
+
+    for (l = conn_list->head; l; l = l->next) {
+        Connection *conn = l->data;
+        Packet *pkt = g_queue_peek_head(&conn->primary_list);
+
+        if (pkt) {
+            uint64_t lag = now - pkt->creation_ms;
+
+            trace_colo_compare_conn_lag(ntohl(conn->key.src.s_addr),
+                conn->key.src_port, ntohl(conn->key.dst.s_addr),
+                conn->key.dst_port, conn->ip_proto, lag,
+                g_queue_get_length(&conn->primary_list),
+                g_queue_get_length(&conn->secondary_list));
+            max_lag = MAX(max_lag, lag);
+        }
+
+        /*
+         * If we find one old packet, stop finding job and notify
+         * COLO frame do checkpoint.
+         */
+        if (!found && !colo_old_packet_check_one_conn(conn, s)) {
+            found = true;
+        }
+    }
+
+    qatomic_set(max_lag_ms, MIN(max_lag, UINT32_MAX));
+}
+
 static void colo_old_packet_check(void *opaque)
 {
     CompareState *s = opaque;
 
-    /*
-     * If we find one old packet, stop finding job and notify
-     * COLO frame do checkpoint.
-     */
-    g_queue_find_custom(&s->conn_list, s,
-                        (GCompareFunc)colo_old_packet_check_one_conn);
+    colo_old_packet_check_list(s, &s->conn_list, &s->max_lag_ms);
 }
 
 static void colo_compare_packet(CompareState *s, Connection *conn,
@@ -946,13 +1092,183 @@ static void colo_compare_timer_del(CompareState *s)
 
 static void colo_flush_packets(void *opaque, void *user_data);
 
+/* Send the primary packets released by the compare threads */
+static void colo_compare_output_drain(CompareState *s)
+{
+    GQueue pending;
+    Packet *pkt;
+
+    qemu_mutex_lock(&s->out_lock);
+    pending = s->out_pending;
+    g_queue_init(&s->out_pending);
+    qemu_mutex_unlock(&s->out_lock);
+
+    while ((pkt = g_queue_pop_head(&pending))) {
+        if (compare_chr_send(s, pkt->data, pkt->size, pkt->vnet_hdr_len,
+                             false, true) < 0) {
+            error_report("colo send primary packet failed");
+        }
+        packet_destroy_partial(pkt, NULL);
+    }
+}
+
+static void colo_compare_output_bh(void *opaque)
+{
+    CompareState *s = opaque;
+
+    colo_compare_output_drain(s);
+    if (qatomic_xchg(&s->notify_pending, false)) {
+        colo_compare_do_inconsistency_notify(s);
+    }
+}
+
+static void *colo_compare_shard_thread(void *opaque)
+{
+    CompareShard *shard = opaque;
+    CompareState *s = shard->s;
+    int64_t next_check = qemu_clock_get_ms(QEMU_CLOCK_HOST) +
+                         s->expired_scan_cycle;
+
+    qemu_mutex_lock(&shard->lock);
+    for (;;) {
+        int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+        CompareShardItem *item;
+        uint32_t flush_req;
+        GQueue items;
+        bool quit;
+
+        if (g_queue_is_empty(&shard->input) && !shard->quit &&
+            shard->flush_req == shard->flush_done && now < next_check) {
+            qemu_cond_timedwait(&shard->cond, &shard->lock, next_check - now);
+            continue;
+        }
+
+        items = shard->input;
+        g_queue_init(&shard->input);
+        flush_req = shard->flush_req;
+        quit = shard->quit;
+        qemu_mutex_unlock(&shard->lock);
+
+        while ((item = g_queue_pop_head(&items))) {
+            Connection *conn;
+
+            conn = connection_enqueue(shard->connection_track_table,
+                                      &shard->conn_list, item->mode,
+                                      item->pkt, &item->key);
+            colo_compare_connection(conn, s);
+            g_slice_free(CompareShardItem, item);
+        }
+
+        now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+        if (now >= next_check) {
+            colo_old_packet_check_list(s, &shard->conn_list,
+                                       &shard->max_lag_ms);
+            next_check = now + s->expired_scan_cycle;
+        }
+
+        if (quit || flush_req != shard->flush_done) {
+            g_queue_foreach(&shard->conn_list, colo_flush_packets, s);
+        }
+
+        qemu_mutex_lock(&shard->lock);
+        shard->flush_done = flush_req;
+        qemu_cond_broadcast(&shard->flushed);
+        if (quit) {
+            break;
+        }
+    }
+    qemu_mutex_unlock(&shard->lock);
+
+    return NULL;
+}
+
+static void colo_compare_shards_start(CompareState *s)
+{
+    AioContext *ctx = iothread_get_aio_context(s->iothread);
+    int i;
+
+    qemu_mutex_init(&s->out_lock);
+    g_queue_init(&s->out_pending);
+    s->out_bh = aio_bh_new(ctx, colo_compare_output_bh, s);
+
+    s->shards = g_new0(CompareShard, s->compare_threads);
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        shard->s = s;
+        qemu_mutex_init(&shard->lock);
+        qemu_cond_init(&shard->cond);
+        qemu_cond_init(&shard->flushed);
+        g_queue_init(&shard->input);
+        g_queue_init(&shard->conn_list);
+        shard->connection_track_table =
+            g_hash_table_new_full(connection_key_hash, connection_key_equal,
+                                  g_free, connection_destroy);
+        qemu_thread_create(&shard->thread, "colo-compare",
+                           colo_compare_shard_thread, shard,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/* Stop the compare threads; their packets end up in out_pending */
+static void colo_compare_shards_stop(CompareState *s)
+{
+    int i;
+
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        qemu_mutex_lock(&shard->lock);
+        shard->quit = true;
+        qemu_cond_signal(&shard->cond);
+        qemu_mutex_unlock(&shard->lock);
+        qemu_thread_join(&shard->thread);
+
+        g_queue_clear(&shard->conn_list);
+        g_hash_table_destroy(shard->connection_track_table);
+        qemu_cond_destroy(&shard->flushed);
+        qemu_cond_destroy(&shard->cond);
+        qemu_mutex_destroy(&shard->lock);
+    }
+}
+
+/* Release all held primary packets and drop the secondary ones */
+static void colo_compare_flush_all(CompareState *s)
+{
+    int i;
+
+    if (!s->shards) {
+        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        return;
+    }
+
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        qemu_mutex_lock(&shard->lock);
+        shard->flush_req++;
+        qemu_cond_signal(&shard->cond);
+        qemu_mutex_unlock(&shard->lock);
+    }
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        qemu_mutex_lock(&shard->lock);
+        while (shard->flush_done != shard->flush_req) {
+            qemu_cond_wait(&shard->flushed, &shard->lock);
+        }
+        qemu_mutex_unlock(&shard->lock);
+    }
+    colo_compare_output_drain(s);
+}
+
 static void colo_compare_handle_event(void *opaque)
 {
     CompareState *s = opaque;
 
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush_all(s);
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -1152,6 +1468,51 @@ out:
     error_propagate(errp, local_err);
 }
 
+static void compare_get_threads(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->compare_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_threads(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (s->connection_track_table) {
+        error_setg(errp, "Property '%s.%s' can't be changed once created",
+                   object_get_typename(obj), name);
+        return;
+    }
+    if (!value || value > MAX_COMPARE_THREADS) {
+        error_setg(errp, "Property '%s.%s' must be between 1 and %d",
+                   object_get_typename(obj), name, MAX_COMPARE_THREADS);
+        return;
+    }
+    s->compare_threads = value;
+}
+
+static void compare_get_max_lag(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint64_t value = qatomic_read(&s->max_lag_ms);
+    int i;
+
+    for (i = 0; s->shards && i < s->compare_threads; i++) {
+        value = MAX(value, qatomic_read(&s->shards[i].max_lag_ms));
+    }
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
@@ -1165,7 +1526,7 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
                          pri_rs->vnet_hdr_len,
                          false,
                          false);
-    } else {
+    } else if (conn) {
         /* compare packet in the specified connection */
         colo_compare_connection(conn, s);
     }
@@ -1178,7 +1539,7 @@ static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 
     if (packet_enqueue(s, SECONDARY_IN, &conn)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
+    } else if (conn) {
         /* compare packet in the specified connection */
         colo_compare_connection(conn, s);
     }
@@ -1202,7 +1563,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->buf,
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_compare_flush_all(s);
     } else {
         error_report("COLO compare got unsupported instruction");
     }
@@ -1325,6 +1686,9 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
                                                       connection_destroy);
 
     colo_compare_iothread(s);
+    if (s->compare_threads > 1) {
+        colo_compare_shards_start(s);
+    }
 
     qemu_mutex_lock(&colo_compare_mutex);
     if (!colo_compare_active) {
@@ -1346,13 +1710,7 @@ static void colo_flush_packets(void *opaque, void *user_data)
 
     while (!g_queue_is_empty(&conn->primary_list)) {
         pkt = g_queue_pop_head(&conn->primary_list);
-        compare_chr_send(s,
-                         pkt->data,
-                         pkt->size,
-                         pkt->vnet_hdr_len,
-                         false,
-                         true);
-        packet_destroy_partial(pkt, NULL);
+        colo_send_primary_pkt(s, pkt);
     }
     while (!g_queue_is_empty(&conn->secondary_list)) {
         pkt = g_queue_pop_head(&conn->secondary_list);
@@ -1397,6 +1755,14 @@ static void colo_compare_init(Object *obj)
                         get_max_queue_size,
                         set_max_queue_size, NULL, NULL);
 
+    s->compare_threads = 1;
+    object_property_add(obj, "compare_threads", "uint32",
+                        compare_get_threads,
+                        compare_set_threads, NULL, NULL);
+
+    object_property_add(obj, "max_lag_ms", "uint64",
+                        compare_get_max_lag, NULL, NULL, NULL);
+
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
@@ -1442,6 +1808,11 @@ static void colo_compare_finalize(Object *obj)
 
     qemu_bh_delete(s->event_bh);
 
+    if (s->shards) {
+        colo_compare_shards_stop(s);
+        qemu_bh_delete(s->out_bh);
+    }
+
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     aio_context_acquire(ctx);
     AIO_WAIT_WHILE(ctx, !s->out_sendco.done);
@@ -1451,6 +1822,12 @@ static void colo_compare_finalize(Object *obj)
     aio_context_release(ctx);
 
     /* Release all unhandled packets after compare thead exited */
+    if (s->shards) {
+        colo_compare_output_drain(s);
+        g_free(s->shards);
+        s->shards = NULL;
+        qemu_mutex_destroy(&s->out_lock);
+    }
     g_queue_foreach(&s->conn_list, colo_flush_packets, s);
     AIO_WAIT_WHILE(NULL, !s->out_sendco.done);
 
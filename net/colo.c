@@ -135,6 +135,7 @@ Connection *connection_new(ConnectionKey *key)
 {
     Connection *conn = g_slice_new0(Connection);
 
+    conn->key = *key;
     conn->ip_proto = key->ip_proto;
     conn->processing = false;
     conn->tcp_state = TCPS_CLOSED;
@@ -66,6 +66,7 @@ typedef struct ConnectionKey {
 } QEMU_PACKED ConnectionKey;
 
 typedef struct Connection {
+    ConnectionKey key;
     /* connection primary send queue: element type: Packet */
     GQueue primary_list;
     /* connection secondary send queue: element type: Packet */
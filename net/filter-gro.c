@@ -0,0 +1,606 @@
+/*
+ * Generic receive offload filter
+ *
+ * Coalesces consecutive TCP segments of the same IPv4 flow into one large
+ * packet before it is handed to the next filter or to the receiver, so that
+ * the NIC model and the guest process one packet per burst instead of one
+ * per MSS sized segment.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/filter.h"
+#include "net/checksum.h"
+#include "qapi/error.h"
+#include "qemu/timer.h"
+#include "qemu/iov.h"
+#include "qemu/queue.h"
+#include "qapi/qapi-builtin-visit.h"
+#include "qapi/qmp/qerror.h"
+#include "qom/object.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "colo.h"
+#include "util.h"
+#include "trace.h"
+
+#define TYPE_FILTER_GRO "filter-gro"
+
+OBJECT_DECLARE_SIMPLE_TYPE(FilterGroState, FILTER_GRO)
+
+#define FILTER_GRO_DEFAULT_INTERVAL 50
+#define FILTER_GRO_MAX_SIZE 65535
+/* A frame that fits a 1500 bytes MTU, as NICs accept without GSO */
+#define FILTER_GRO_MTU_FRAME_SIZE (ETH_HLEN + 1500)
+/* Flows whose counters are kept; later flows are merged but not counted */
+#define FILTER_GRO_MAX_FLOW_STATS 1024
+
+typedef struct GroFlowStats {
+    ConnectionKey key;
+    uint64_t segments;
+    uint64_t coalesced;
+    uint64_t flushed;
+} GroFlowStats;
+
+typedef struct GroFlow {
+    ConnectionKey key;
+    NetClientState *sender;
+    unsigned flags;
+    /* Merged packet: vnet header, headers of the first segment, payload */
+    uint8_t *buf;
+    size_t size;
+    size_t alloc;
+    uint32_t vnet_hdr_len;
+    uint32_t l3_off;
+    uint32_t l4_off;
+    uint32_t hdr_len;
+    /* Sequence number the next segment must carry to be merged */
+    uint32_t next_seq;
+    uint32_t mss;
+    uint32_t segs;
+    /* Counters of the connection, NULL if there are too many */
+    GroFlowStats *stats;
+    QTAILQ_ENTRY(GroFlow) next;
+} GroFlow;
+
+typedef struct GroSegment {
+    struct tcp_hdr *tcp;
+    uint32_t l3_off;
+    uint32_t l4_off;
+    uint32_t hdr_len;
+    uint32_t ip_len;
+    uint32_t payload_len;
+} GroSegment;
+
+struct FilterGroState {
+    NetFilterState parent_obj;
+
+    /* ConnectionKey -> GroFlow, plus the same flows in arrival order */
+    GHashTable *flows;
+    QTAILQ_HEAD(, GroFlow) flow_list;
+    QEMUTimer flush_timer;
+    uint32_t interval;
+    /* max-size property, 0 to pick a size the receiver accepts */
+    uint32_t max_size;
+    /* Size limit applied to the packet being processed */
+    uint32_t cur_max_size;
+    bool vnet_hdr;
+
+    /* ConnectionKey -> GroFlowStats */
+    GHashTable *flow_stats;
+
+    uint64_t segments;
+    uint64_t coalesced;
+    uint64_t flushed;
+};
+
+/*
+ * Only plain IPv4 TCP data segments are merged: no IP options or
+ * fragments, only ACK and optionally PSH set, and a non-empty payload.
+ */
+static bool filter_gro_parse(Packet *pkt, GroSegment *seg)
+{
+    uint8_t *data = pkt->data;
+    int tcp_len;
+
+    if (pkt->vnet_hdr_len >= sizeof(struct virtio_net_hdr)) {
+        struct virtio_net_hdr *vhdr = pkt->data;
+
+        if (vhdr->gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+            (vhdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            return false;
+        }
+    }
+
+    if (pkt->ip->ip_v != 4 || pkt->ip->ip_hl != 5 ||
+        (ntohs(pkt->ip->ip_off) & (IP_MF | IP_OFFMASK))) {
+        return false;
+    }
+
+    seg->tcp = (struct tcp_hdr *)pkt->transport_header;
+    seg->l3_off = pkt->network_header - data;
+    seg->l4_off = pkt->transport_header - data;
+    seg->ip_len = ntohs(pkt->ip->ip_len);
+    tcp_len = seg->tcp->th_off * 4;
+
+    if (tcp_len < sizeof(struct tcp_hdr) ||
+        seg->l3_off + seg->ip_len > pkt->size ||
+        seg->l4_off - seg->l3_off + tcp_len >= seg->ip_len) {
+        return false;
+    }
+    if ((seg->tcp->th_flags & ~TH_PUSH) != TH_ACK) {
+        return false;
+    }
+
+    seg->hdr_len = seg->l4_off + tcp_len;
+    seg->payload_len = seg->l3_off + seg->ip_len - seg->hdr_len;
+    return true;
+}
+
+static bool filter_gro_flow_match(FilterGroState *s, GroFlow *flow,
+                                  Packet *pkt, GroSegment *seg)
+{
+    struct ip *ip = (struct ip *)(flow->buf + flow->l3_off);
+    struct tcp_hdr *tcp = (struct tcp_hdr *)(flow->buf + flow->l4_off);
+    uint8_t *data = pkt->data;
+
+    if (seg->hdr_len != flow->hdr_len || seg->l4_off != flow->l4_off ||
+        seg->payload_len > flow->mss ||
+        flow->size - flow->vnet_hdr_len + seg->payload_len > s->cur_max_size) {
+        return false;
+    }
+    if (ntohl(seg->tcp->th_seq) != flow->next_seq ||
+        seg->tcp->th_ack != tcp->th_ack || seg->tcp->th_win != tcp->th_win ||
+        pkt->ip->ip_tos != ip->ip_tos || pkt->ip->ip_ttl != ip->ip_ttl) {
+        return false;
+    }
+
+    /* TCP options, including timestamps, must be identical */
+    return !memcmp(data + seg->l4_off + sizeof(struct tcp_hdr),
+                   flow->buf + flow->l4_off + sizeof(struct tcp_hdr),
+                   seg->hdr_len - seg->l4_off - sizeof(struct tcp_hdr));
+}
+
+/* Fix up the headers of the first segment to describe the merged packet */
+static void filter_gro_flow_finish(GroFlow *flow)
+{
+    struct ip *ip = (struct ip *)(flow->buf + flow->l3_off);
+
+    ip->ip_len = htons(flow->size - flow->l3_off);
+    net_checksum_calculate(flow->buf + flow->vnet_hdr_len,
+                           flow->size - flow->vnet_hdr_len,
+                           CSUM_IP | CSUM_TCP);
+
+    if (flow->vnet_hdr_len >= sizeof(struct virtio_net_hdr)) {
+        struct virtio_net_hdr *vhdr = (struct virtio_net_hdr *)flow->buf;
+
+        vhdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        vhdr->gso_size = flow->mss;
+        vhdr->hdr_len = flow->hdr_len - flow->vnet_hdr_len;
+    }
+}
+
+static void filter_gro_flow_flush(NetFilterState *nf, GroFlow *flow)
+{
+    FilterGroState *s = FILTER_GRO(nf);
+    struct iovec iov;
+
+    QTAILQ_REMOVE(&s->flow_list, flow, next);
+    g_hash_table_remove(s->flows, &flow->key);
+
+    if (flow->segs > 1) {
+        filter_gro_flow_finish(flow);
+    }
+    s->flushed++;
+    if (flow->stats) {
+        flow->stats->flushed++;
+    }
+    trace_filter_gro_flush(ntohl(flow->key.src.s_addr), flow->key.src_port,
+                           ntohl(flow->key.dst.s_addr), flow->key.dst_port,
+                           flow->segs, flow->size);
+
+    /*
+     * Passing the packet on may end up sending packets back through this
+     * filter, so the flow is unlinked before.
+     */
+    iov.iov_base = flow->buf;
+    iov.iov_len = flow->size;
+    qemu_netfilter_pass_to_next(flow->sender, flow->flags, &iov, 1, nf);
+
+    g_free(flow->buf);
+    g_free(flow);
+}
+
+static void filter_gro_flush(NetFilterState *nf)
+{
+    FilterGroState *s = FILTER_GRO(nf);
+    GroFlow *flow;
+
+    while ((flow = QTAILQ_FIRST(&s->flow_list))) {
+        filter_gro_flow_flush(nf, flow);
+    }
+}
+
+static void filter_gro_flush_timer(void *opaque)
+{
+    filter_gro_flush(opaque);
+}
+
+static GroFlowStats *filter_gro_flow_stats(FilterGroState *s,
+                                           ConnectionKey *key)
+{
+    GroFlowStats *stats = g_hash_table_lookup(s->flow_stats, key);
+
+    if (!stats &&
+        g_hash_table_size(s->flow_stats) < FILTER_GRO_MAX_FLOW_STATS) {
+        stats = g_new0(GroFlowStats, 1);
+        stats->key = *key;
+        g_hash_table_insert(s->flow_stats, &stats->key, stats);
+    }
+    return stats;
+}
+
+static GroFlow *filter_gro_flow_new(NetFilterState *nf, ConnectionKey *key,
+                                    NetClientState *sender, unsigned flags,
+                                    Packet *pkt, GroSegment *seg)
+{
+    FilterGroState *s = FILTER_GRO(nf);
+    GroFlow *flow = g_new0(GroFlow, 1);
+
+    flow->key = *key;
+    flow->sender = sender;
+    flow->flags = flags;
+    /* Take over the linear copy of the packet, minus any padding */
+    flow->buf = pkt->data;
+    flow->alloc = pkt->size;
+    flow->size = seg->l3_off + seg->ip_len;
+    flow->vnet_hdr_len = pkt->vnet_hdr_len;
+    flow->l3_off = seg->l3_off;
+    flow->l4_off = seg->l4_off;
+    flow->hdr_len = seg->hdr_len;
+    flow->next_seq = ntohl(seg->tcp->th_seq) + seg->payload_len;
+    flow->mss = seg->payload_len;
+    flow->segs = 1;
+    flow->stats = filter_gro_flow_stats(s, key);
+
+    g_hash_table_insert(s->flows, &flow->key, flow);
+    QTAILQ_INSERT_TAIL(&s->flow_list, flow, next);
+
+    if (!timer_pending(&s->flush_timer)) {
+        timer_mod(&s->flush_timer,
+                  qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) + s->interval);
+    }
+    return flow;
+}
+
+static void filter_gro_flow_append(FilterGroState *s, GroFlow *flow,
+                                   Packet *pkt, GroSegment *seg)
+{
+    struct tcp_hdr *tcp = (struct tcp_hdr *)(flow->buf + flow->l4_off);
+    uint8_t *data = pkt->data;
+
+    if (flow->size + seg->payload_len > flow->alloc) {
+        flow->alloc = flow->vnet_hdr_len + s->cur_max_size;
+        flow->buf = g_realloc(flow->buf, flow->alloc);
+        tcp = (struct tcp_hdr *)(flow->buf + flow->l4_off);
+    }
+
+    memcpy(flow->buf + flow->size, data + seg->hdr_len, seg->payload_len);
+    flow->size += seg->payload_len;
+    flow->next_seq += seg->payload_len;
+    tcp->th_flags |= seg->tcp->th_flags & TH_PUSH;
+    flow->segs++;
+    s->coalesced++;
+    if (flow->stats) {
+        flow->stats->coalesced++;
+    }
+}
+
+/*
+ * A merged packet is larger than the MTU, which the receiver only
+ * accepts as a GSO packet: that needs a vnet header, and TSO enabled on
+ * the netdev by the NIC model.
+ */
+static uint32_t filter_gro_max_size(NetFilterState *nf)
+{
+    FilterGroState *s = FILTER_GRO(nf);
+
+    if (s->max_size) {
+        return s->max_size;
+    }
+    if (s->vnet_hdr &&
+        nf->netdev->vnet_hdr_len >= sizeof(struct virtio_net_hdr) &&
+        nf->netdev->tso4_offload) {
+        return FILTER_GRO_MAX_SIZE;
+    }
+    return FILTER_GRO_MTU_FRAME_SIZE;
+}
+
+/* filter APIs */
+static ssize_t filter_gro_receive_iov(NetFilterState *nf,
+                                      NetClientState *sender,
+                                      unsigned flags,
+                                      const struct iovec *iov,
+                                      int iovcnt,
+                                      NetPacketSent *sent_cb)
+{
+    FilterGroState *s = FILTER_GRO(nf);
+    ssize_t size = iov_size(iov, iovcnt);
+    uint32_t vnet_hdr_len = 0;
+    ConnectionKey key;
+    GroFlowStats *stats;
+    GroSegment seg;
+    GroFlow *flow;
+    Packet *pkt;
+    char *buf;
+
+    if (flags & QEMU_NET_PACKET_FLAG_RAW) {
+        return 0;
+    }
+
+    if (s->vnet_hdr) {
+        vnet_hdr_len = nf->netdev->vnet_hdr_len;
+    }
+    s->cur_max_size = filter_gro_max_size(nf);
+
+    buf = g_malloc(size);
+    iov_to_buf(iov, iovcnt, 0, buf, size);
+    pkt = packet_new_nocopy(buf, size, vnet_hdr_len);
+
+    if (parse_packet_early(pkt) || pkt->ip->ip_p != IPPROTO_TCP ||
+        pkt->transport_header + sizeof(struct tcp_hdr) >
+        (uint8_t *)pkt->data + size) {
+        packet_destroy(pkt, NULL);
+        return 0;
+    }
+
+    fill_connection_key(pkt, &key);
+    flow = g_hash_table_lookup(s->flows, &key);
+    s->segments++;
+    stats = flow ? flow->stats : filter_gro_flow_stats(s, &key);
+    if (stats) {
+        stats->segments++;
+    }
+
+    if (!filter_gro_parse(pkt, &seg)) {
+        /*
+         * Control segments are not merged, but what is already held for
+         * the flow must reach the receiver before them.
+         */
+        if (flow) {
+            filter_gro_flow_flush(nf, flow);
+        }
+        packet_destroy(pkt, NULL);
+        return 0;
+    }
+
+    if (flow && (flow->sender != sender ||
+                 !filter_gro_flow_match(s, flow, pkt, &seg))) {
+        filter_gro_flow_flush(nf, flow);
+        flow = NULL;
+    }
+
+    if (flow) {
+        filter_gro_flow_append(s, flow, pkt, &seg);
+        packet_destroy(pkt, NULL);
+    } else {
+        flow = filter_gro_flow_new(nf, &key, sender, flags, pkt, &seg);
+        packet_destroy_partial(pkt, NULL);
+    }
+
+    /*
+     * A short or pushed segment ends the burst; also stop once the next
+     * full segment would not fit.
+     */
+    if (seg.payload_len < flow->mss || (seg.tcp->th_flags & TH_PUSH) ||
+        flow->size - flow->vnet_hdr_len + flow->mss > s->cur_max_size) {
+        filter_gro_flow_flush(nf, flow);
+    }
+
+    return size;
+}
+
+static void filter_gro_cleanup(NetFilterState *nf)
+{
+    FilterGroState *s = FILTER_GRO(nf);
+
+    if (s->flows) {
+        timer_del(&s->flush_timer);
+        filter_gro_flush(nf);
+        g_hash_table_destroy(s->flows);
+        s->flows = NULL;
+    }
+    if (s->flow_stats) {
+        g_hash_table_destroy(s->flow_stats);
+        s->flow_stats = NULL;
+    }
+}
+
+static void filter_gro_setup(NetFilterState *nf, Error **errp)
+{
+    FilterGroState *s = FILTER_GRO(nf);
+
+    s->flows = g_hash_table_new(connection_key_hash, connection_key_equal);
+    s->flow_stats = g_hash_table_new_full(connection_key_hash,
+                                          connection_key_equal,
+                                          NULL, g_free);
+    QTAILQ_INIT(&s->flow_list);
+    timer_init_us(&s->flush_timer, QEMU_CLOCK_VIRTUAL,
+                  filter_gro_flush_timer, nf);
+}
+
+static void filter_gro_status_changed(NetFilterState *nf, Error **errp)
+{
+    FilterGroState *s = FILTER_GRO(nf);
+
+    if (!nf->on) {
+        timer_del(&s->flush_timer);
+        filter_gro_flush(nf);
+    }
+}
+
+static void filter_gro_get_uint32(Object *obj, Visitor *v, const char *name,
+                                  void *opaque, Error **errp)
+{
+    uint32_t value = *(uint32_t *)opaque;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void filter_gro_set_interval(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    FilterGroState *s = FILTER_GRO(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value) {
+        error_setg(errp, "Property '%s.%s' requires a positive value",
+                   object_get_typename(obj), name);
+        return;
+    }
+    s->interval = value;
+}
+
+static void filter_gro_set_max_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    FilterGroState *s = FILTER_GRO(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value && (value < ETH_ZLEN || value > FILTER_GRO_MAX_SIZE)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, name,
+                   "0 or a value between 60 and 65535");
+        return;
+    }
+    s->max_size = value;
+}
+
+static void filter_gro_get_stat(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    uint64_t value = *(uint64_t *)opaque;
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+/*
+ * The "flows" property is a struct with one member per connection,
+ * named "src:port-dst:port", holding the counters of that connection.
+ */
+static bool filter_gro_visit_flow(Visitor *v, GroFlowStats *stats,
+                                  Error **errp)
+{
+    g_autofree char *src = g_strdup(inet_ntoa(stats->key.src));
+    g_autofree char *name = g_strdup_printf("%s:%u-%s:%u",
+                                            src, stats->key.src_port,
+                                            inet_ntoa(stats->key.dst),
+                                            stats->key.dst_port);
+    bool ok;
+
+    if (!visit_start_struct(v, name, NULL, 0, errp)) {
+        return false;
+    }
+    ok = visit_type_uint64(v, "segments", &stats->segments, errp) &&
+         visit_type_uint64(v, "coalesced", &stats->coalesced, errp) &&
+         visit_type_uint64(v, "flushed", &stats->flushed, errp) &&
+         visit_check_struct(v, errp);
+    visit_end_struct(v, NULL);
+    return ok;
+}
+
+static void filter_gro_get_flows(Object *obj, Visitor *v, const char *name,
+                                 void *opaque, Error **errp)
+{
+    FilterGroState *s = FILTER_GRO(obj);
+    GHashTableIter iter;
+    GroFlowStats *stats;
+
+    if (!visit_start_struct(v, name, NULL, 0, errp)) {
+        return;
+    }
+    if (s->flow_stats) {
+        g_hash_table_iter_init(&iter, s->flow_stats);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stats)) {
+            if (!filter_gro_visit_flow(v, stats, errp)) {
+                goto out;
+            }
+        }
+    }
+    visit_check_struct(v, errp);
+out:
+    visit_end_struct(v, NULL);
+}
+
+static bool filter_gro_get_vnet_hdr(Object *obj, Error **errp)
+{
+    FilterGroState *s = FILTER_GRO(obj);
+
+    return s->vnet_hdr;
+}
+
+static void filter_gro_set_vnet_hdr(Object *obj, bool value, Error **errp)
+{
+    FilterGroState *s = FILTER_GRO(obj);
+
+    s->vnet_hdr = value;
+}
+
+static void filter_gro_init(Object *obj)
+{
+    FilterGroState *s = FILTER_GRO(obj);
+
+    s->interval = FILTER_GRO_DEFAULT_INTERVAL;
+
+    object_property_add(obj, "interval", "uint32",
+                        filter_gro_get_uint32, filter_gro_set_interval,
+                        NULL, &s->interval);
+    object_property_add(obj, "max-size", "uint32",
+                        filter_gro_get_uint32, filter_gro_set_max_size,
+                        NULL, &s->max_size);
+    object_property_add(obj, "segments", "uint64",
+                        filter_gro_get_stat, NULL, NULL, &s->segments);
+    object_property_add(obj, "coalesced", "uint64",
+                        filter_gro_get_stat, NULL, NULL, &s->coalesced);
+    object_property_add(obj, "flushed", "uint64",
+                        filter_gro_get_stat, NULL, NULL, &s->flushed);
+    object_property_add(obj, "flows", "any",
+                        filter_gro_get_flows, NULL, NULL, NULL);
+}
+
+static void filter_gro_class_init(ObjectClass *oc, void *data)
+{
+    NetFilterClass *nfc = NETFILTER_CLASS(oc);
+
+    object_class_property_add_bool(oc, "vnet_hdr_support",
+                                   filter_gro_get_vnet_hdr,
+                                   filter_gro_set_vnet_hdr);
+
+    nfc->setup = filter_gro_setup;
+    nfc->cleanup = filter_gro_cleanup;
+    nfc->receive_iov = filter_gro_receive_iov;
+    nfc->status_changed = filter_gro_status_changed;
+}
+
+static const TypeInfo filter_gro_info = {
+    .name = TYPE_FILTER_GRO,
+    .parent = TYPE_NETFILTER,
+    .class_init = filter_gro_class_init,
+    .instance_init = filter_gro_init,
+    .instance_size = sizeof(FilterGroState),
+};
+
+static void register_types(void)
+{
+    type_register_static(&filter_gro_info);
+}
+
+type_init(register_types);
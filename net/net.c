@@ -491,6 +491,7 @@ void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
         return;
     }
 
+    nc->tso4_offload = tso4;
     nc->info->set_offload(nc, csum, tso4, tso6, ecn, ufo);
 }
 
@@ -556,6 +557,13 @@ int qemu_can_send_packet(NetClientState *sender)
     return qemu_can_receive_packet(sender->peer);
 }
 
+/* Whether packets from @sender to its peer go through any netfilter */
+static bool qemu_net_has_filters(NetClientState *sender)
+{
+    return !QTAILQ_EMPTY(&sender->filters) ||
+           !QTAILQ_EMPTY(&sender->peer->filters);
+}
+
 static ssize_t filter_receive_iov(NetClientState *nc,
                                   NetFilterDirection direction,
                                   NetClientState *sender,
@@ -604,16 +612,80 @@ static ssize_t filter_receive(NetClientState *nc,
     return filter_receive_iov(nc, direction, sender, flags, &iov, 1, sent_cb);
 }
 
+/*
+ * A client bound to an IOThread is only used with the IOThread's
+ * AioContext held, together with its peer; callers from other threads
+ * take the lock here.  The context can change under the BQL while the
+ * IOThread waits for it, hence the check after acquiring.
+ */
+AioContext *net_client_acquire(NetClientState *nc)
+{
+    AioContext *ctx;
+
+    while ((ctx = qatomic_read(&nc->ctx))) {
+        aio_context_acquire(ctx);
+        if (qatomic_read(&nc->ctx) == ctx) {
+            return ctx;
+        }
+        aio_context_release(ctx);
+    }
+    return NULL;
+}
+
+void net_client_release(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
+/*
+ * Bind @nc and its peer to @ctx, or back to the main loop if @ctx is
+ * NULL.  Fails if the peer cannot be driven from an IOThread.
+ *
+ * Context: BQL held
+ */
+bool qemu_net_client_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetClientState *clients[] = { nc, nc->peer };
+    int i;
+
+    if (ctx && nc->peer && !nc->peer->info->set_aio_context) {
+        return false;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(clients); i++) {
+        NetClientState *c = clients[i];
+        AioContext *old_ctx;
+
+        if (!c || c->ctx == ctx) {
+            continue;
+        }
+        old_ctx = net_client_acquire(c);
+        if (c->info->set_aio_context) {
+            c->info->set_aio_context(c, ctx);
+        }
+        qatomic_set(&c->ctx, ctx);
+        net_client_release(old_ctx);
+    }
+    return true;
+}
+
 void qemu_purge_queued_packets(NetClientState *nc)
 {
+    AioContext *ctx;
+
     if (!nc->peer) {
         return;
     }
 
+    ctx = net_client_acquire(nc);
     qemu_net_queue_purge(nc->peer->incoming_queue, nc);
+    net_client_release(ctx);
 }
 
-void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
+static void qemu_do_flush_or_purge_queued_packets(NetClientState *nc,
+                                                  bool purge)
 {
     nc->receive_disabled = 0;
 
@@ -633,15 +705,23 @@ void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
     }
 }
 
+void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge)
+{
+    AioContext *ctx = net_client_acquire(nc);
+
+    qemu_do_flush_or_purge_queued_packets(nc, purge);
+    net_client_release(ctx);
+}
+
 void qemu_flush_queued_packets(NetClientState *nc)
 {
     qemu_flush_or_purge_queued_packets(nc, false);
 }
 
-static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
-                                                 unsigned flags,
-                                                 const uint8_t *buf, int size,
-                                                 NetPacketSent *sent_cb)
+static ssize_t qemu_do_send_packet_async(NetClientState *sender,
+                                         unsigned flags,
+                                         const uint8_t *buf, int size,
+                                         NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     int ret;
@@ -656,16 +736,18 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
     }
 
     /* Let filters handle the packet first */
-    ret = filter_receive(sender, NET_FILTER_DIRECTION_TX,
-                         sender, flags, buf, size, sent_cb);
-    if (ret) {
-        return ret;
-    }
+    if (qemu_net_has_filters(sender)) {
+        ret = filter_receive(sender, NET_FILTER_DIRECTION_TX,
+                             sender, flags, buf, size, sent_cb);
+        if (ret) {
+            return ret;
+        }
 
-    ret = filter_receive(sender->peer, NET_FILTER_DIRECTION_RX,
-                         sender, flags, buf, size, sent_cb);
-    if (ret) {
-        return ret;
+        ret = filter_receive(sender->peer, NET_FILTER_DIRECTION_RX,
+                             sender, flags, buf, size, sent_cb);
+        if (ret) {
+            return ret;
+        }
     }
 
     queue = sender->peer->incoming_queue;
@@ -673,6 +755,19 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
     return qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
 }
 
+static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
+                                                 unsigned flags,
+                                                 const uint8_t *buf, int size,
+                                                 NetPacketSent *sent_cb)
+{
+    AioContext *ctx = net_client_acquire(sender);
+    ssize_t ret;
+
+    ret = qemu_do_send_packet_async(sender, flags, buf, size, sent_cb);
+    net_client_release(ctx);
+    return ret;
+}
+
 ssize_t qemu_send_packet_async(NetClientState *sender,
                                const uint8_t *buf, int size,
                                NetPacketSent *sent_cb)
@@ -681,6 +776,75 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+static int qemu_deliver_packet_batch(NetClientState *sender,
+                                     const struct iovec *pkts,
+                                     int count,
+                                     void *opaque)
+{
+    NetClientState *nc = opaque;
+    int ret;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    ret = nc->info->receive_batch(nc, pkts, count);
+    if (ret < count) {
+        nc->receive_disabled = 1;
+    }
+
+    return ret;
+}
+
+/*
+ * Send @count packets, each in a single buffer.  If the peer can take
+ * them in one go and no filter needs to see them, they bypass the
+ * per-packet path.  Like qemu_send_packet_async(), returns 0 if some
+ * packet was queued and @sent_cb will be invoked.
+ */
+int qemu_send_packet_batch_async(NetClientState *sender,
+                                 const struct iovec *pkts, int count,
+                                 NetPacketSent *sent_cb)
+{
+    AioContext *ctx = net_client_acquire(sender);
+    NetClientState *peer = sender->peer;
+    bool queued = false;
+    int i = 0;
+
+    if (peer && !sender->link_down && peer->info->receive_batch &&
+        !qemu_net_has_filters(sender)) {
+        i = qemu_net_queue_send_batch(peer->incoming_queue, sender,
+                                      pkts, count,
+                                      qemu_deliver_packet_batch);
+        /*
+         * The peer stopped taking packets part way through, the rest
+         * would only be queued one by one.
+         */
+        if (i > 0 && i < count) {
+            qemu_net_queue_append_batch(peer->incoming_queue, sender,
+                                        QEMU_NET_PACKET_FLAG_NONE,
+                                        pkts + i, count - i, sent_cb);
+            net_client_release(ctx);
+            return 0;
+        }
+    }
+
+    for (; i < count; i++) {
+        if (qemu_do_send_packet_async(sender, QEMU_NET_PACKET_FLAG_NONE,
+                                      pkts[i].iov_base, pkts[i].iov_len,
+                                      sent_cb) == 0) {
+            queued = true;
+        }
+    }
+
+    net_client_release(ctx);
+    return queued ? 0 : count;
+}
+
 ssize_t qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     return qemu_send_packet_async(nc, buf, size, NULL);
@@ -773,9 +937,9 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_do_sendv_packet_async(NetClientState *sender,
+                                          const struct iovec *iov, int iovcnt,
+                                          NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     size_t size = iov_size(iov, iovcnt);
@@ -790,16 +954,20 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
     }
 
     /* Let filters handle the packet first */
-    ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
-    if (ret) {
-        return ret;
-    }
+    if (qemu_net_has_filters(sender)) {
+        ret = filter_receive_iov(sender, NET_FILTER_DIRECTION_TX, sender,
+                                 QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt,
+                                 sent_cb);
+        if (ret) {
+            return ret;
+        }
 
-    ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
-                             QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt, sent_cb);
-    if (ret) {
-        return ret;
+        ret = filter_receive_iov(sender->peer, NET_FILTER_DIRECTION_RX, sender,
+                                 QEMU_NET_PACKET_FLAG_NONE, iov, iovcnt,
+                                 sent_cb);
+        if (ret) {
+            return ret;
+        }
     }
 
     queue = sender->peer->incoming_queue;
@@ -809,6 +977,18 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    AioContext *ctx = net_client_acquire(sender);
+    ssize_t ret;
+
+    ret = qemu_do_sendv_packet_async(sender, iov, iovcnt, sent_cb);
+    net_client_release(ctx);
+    return ret;
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -990,6 +1170,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1083,6 +1266,9 @@ void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
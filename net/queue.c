@@ -45,10 +45,23 @@ struct NetPacket {
     NetClientState *sender;
     unsigned flags;
     int size;
+    int alloc;
     NetPacketSent *sent_cb;
     uint8_t data[];
 };
 
+/*
+ * Full-size packets, more than NET_QUEUE_POOL_MINSIZE and up to
+ * NET_QUEUE_POOL_BUFSIZE bytes which covers a standard MTU frame plus
+ * vnet header, are allocated at NET_QUEUE_POOL_BUFSIZE and recycled
+ * through a small per-queue pool instead of going back to the allocator.
+ * Smaller packets such as ACKs are allocated at their own size, so a
+ * stalled queue of them does not pin 2K per packet.
+ */
+#define NET_QUEUE_POOL_BUFSIZE 2048
+#define NET_QUEUE_POOL_MINSIZE (NET_QUEUE_POOL_BUFSIZE / 2)
+#define NET_QUEUE_POOL_MAX 256
+
 struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
@@ -57,6 +70,9 @@ struct NetQueue {
 
     QTAILQ_HEAD(, NetPacket) packets;
 
+    QTAILQ_HEAD(, NetPacket) pool;
+    uint32_t pool_count;
+
     unsigned delivering : 1;
 };
 
@@ -72,12 +88,46 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->deliver = deliver;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->pool);
 
     queue->delivering = 0;
 
     return queue;
 }
 
+static NetPacket *qemu_net_queue_packet_alloc(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (size <= NET_QUEUE_POOL_MINSIZE || size > NET_QUEUE_POOL_BUFSIZE) {
+        packet = g_malloc(sizeof(NetPacket) + size);
+        packet->alloc = size;
+        return packet;
+    }
+
+    packet = QTAILQ_FIRST(&queue->pool);
+    if (packet) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        queue->pool_count--;
+    } else {
+        packet = g_malloc(sizeof(NetPacket) + NET_QUEUE_POOL_BUFSIZE);
+        packet->alloc = NET_QUEUE_POOL_BUFSIZE;
+    }
+    return packet;
+}
+
+static void qemu_net_queue_packet_free(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->alloc != NET_QUEUE_POOL_BUFSIZE ||
+        queue->pool_count >= NET_QUEUE_POOL_MAX) {
+        g_free(packet);
+        return;
+    }
+
+    QTAILQ_INSERT_HEAD(&queue->pool, packet, entry);
+    queue->pool_count++;
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
@@ -87,6 +137,11 @@ void qemu_del_net_queue(NetQueue *queue)
         g_free(packet);
     }
 
+    QTAILQ_FOREACH_SAFE(packet, &queue->pool, entry, next) {
+        QTAILQ_REMOVE(&queue->pool, packet, entry);
+        g_free(packet);
+    }
+
     g_free(queue);
 }
 
@@ -102,7 +157,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_queue_packet_alloc(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
@@ -131,7 +186,7 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_queue_packet_alloc(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -148,6 +203,25 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
+/*
+ * Queue @count packets, each in a single buffer, as if each had been
+ * passed to qemu_net_queue_append_iov().
+ */
+void qemu_net_queue_append_batch(NetQueue *queue,
+                                 NetClientState *sender,
+                                 unsigned flags,
+                                 const struct iovec *pkts,
+                                 int count,
+                                 NetPacketSent *sent_cb)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        qemu_net_queue_append(queue, sender, flags, pkts[i].iov_base,
+                              pkts[i].iov_len, sent_cb);
+    }
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -254,6 +328,31 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+/*
+ * Hand @pkts, one buffer per packet, to @deliver_batch in a single call.
+ * This is only done while nothing is queued, so that ordering is kept;
+ * the caller sends whatever was not consumed with qemu_net_queue_send().
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              const struct iovec *pkts,
+                              int count,
+                              NetQueueDeliverBatchFunc *deliver_batch)
+{
+    int ret;
+
+    if (queue->delivering || !QTAILQ_EMPTY(&queue->packets) ||
+        !qemu_can_send_packet(sender)) {
+        return 0;
+    }
+
+    queue->delivering = 1;
+    ret = deliver_batch(sender, pkts, count, queue->opaque);
+    queue->delivering = 0;
+
+    return ret;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -265,7 +364,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_queue_packet_free(queue, packet);
         }
     }
 }
@@ -298,7 +397,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_queue_packet_free(queue, packet);
     }
     return true;
 }
@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/log.h"
+#include "qemu/units.h"
 #include "net/slirp.h"
 
 
@@ -38,6 +39,8 @@
 #include "monitor/monitor.h"
 #include "qemu/error-report.h"
 #include "qemu/sockets.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
 #include <libslirp.h>
 #include "chardev/char-fe.h"
 #include "sysemu/sysemu.h"
@@ -83,8 +86,13 @@ struct GuestFwd {
     struct in_addr server;
     int port;
     Slirp *slirp;
+    NetClientState *nc;
 };
 
+/* Guest-bound packets collected before they are handed to the peer */
+#define SLIRP_BATCH_MAX     64
+#define SLIRP_BATCH_BUFSIZE (256 * KiB)
+
 typedef struct SlirpState {
     NetClientState nc;
     QTAILQ_ENTRY(SlirpState) entry;
@@ -95,8 +103,30 @@ typedef struct SlirpState {
     gchar *smb_dir;
 #endif
     GSList *fwd;
+
+    /*
+     * When the peer runs in an IOThread, slirp is polled there through
+     * fd handlers instead of the main loop poll notifier.
+     */
+    AioContext *ctx;
+    GArray *pollfds;
+    QEMUBH *poll_bh;
+    QEMUTimer *poll_timer;
+
+    QEMUBH *batch_bh;
+    struct iovec batch[SLIRP_BATCH_MAX];
+    int batch_count;
+    size_t batch_used;
+    uint8_t *batch_buf;
 } SlirpState;
 
+typedef struct SlirpTimer {
+    QEMUTimer timer;
+    SlirpState *s;
+    SlirpTimerCb cb;
+    void *cb_opaque;
+} SlirpTimer;
+
 static struct slirp_config_str *slirp_configs;
 static QTAILQ_HEAD(, SlirpState) slirp_stacks =
     QTAILQ_HEAD_INITIALIZER(slirp_stacks);
@@ -112,21 +142,74 @@ static void slirp_smb_cleanup(SlirpState *s);
 static inline void slirp_smb_cleanup(SlirpState *s) { }
 #endif
 
+static void net_slirp_flush_batch(SlirpState *s)
+{
+    if (!s->batch_count) {
+        return;
+    }
+
+    qemu_send_packet_batch_async(&s->nc, s->batch, s->batch_count, NULL);
+    s->batch_count = 0;
+    s->batch_used = 0;
+}
+
+static void net_slirp_batch_bh(void *opaque)
+{
+    SlirpState *s = opaque;
+    AioContext *ctx = net_client_acquire(&s->nc);
+
+    net_slirp_flush_batch(s);
+    net_client_release(ctx);
+}
+
+/*
+ * If the peer takes packets in batches, the packets slirp emits during
+ * one pass (a poll, a guest packet, a timer) are copied into the batch
+ * buffer and delivered together at the end of the pass.  The bottom half
+ * catches the passes that do not flush explicitly.
+ */
 static ssize_t net_slirp_send_packet(const void *pkt, size_t pkt_len,
                                      void *opaque)
 {
     SlirpState *s = opaque;
     uint8_t min_pkt[ETH_ZLEN];
     size_t min_pktsz = sizeof(min_pkt);
+    size_t size;
+    uint8_t *buf;
+
+    if (!s->nc.peer || !s->nc.peer->info->receive_batch ||
+        pkt_len > SLIRP_BATCH_BUFSIZE) {
+        if (net_peer_needs_padding(&s->nc)) {
+            if (eth_pad_short_frame(min_pkt, &min_pktsz, pkt, pkt_len)) {
+                pkt = min_pkt;
+                pkt_len = min_pktsz;
+            }
+        }
 
+        return qemu_send_packet(&s->nc, pkt, pkt_len);
+    }
+
+    size = pkt_len;
     if (net_peer_needs_padding(&s->nc)) {
-        if (eth_pad_short_frame(min_pkt, &min_pktsz, pkt, pkt_len)) {
-            pkt = min_pkt;
-            pkt_len = min_pktsz;
-        }
+        size = MAX(size, ETH_ZLEN);
+    }
+    if (s->batch_count == SLIRP_BATCH_MAX ||
+        size > SLIRP_BATCH_BUFSIZE - s->batch_used) {
+        net_slirp_flush_batch(s);
     }
+    if (!s->batch_count) {
+        qemu_bh_schedule(s->batch_bh);
+    }
+
+    buf = s->batch_buf + s->batch_used;
+    memcpy(buf, pkt, pkt_len);
+    memset(buf + pkt_len, 0, size - pkt_len);
+    s->batch[s->batch_count].iov_base = buf;
+    s->batch[s->batch_count].iov_len = size;
+    s->batch_count++;
+    s->batch_used += ROUND_UP(size, sizeof(uint64_t));
 
-    return qemu_send_packet(&s->nc, pkt, pkt_len);
+    return pkt_len;
 }
 
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
@@ -134,6 +217,12 @@ static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
 
     slirp_input(s->slirp, buf, size);
+    net_slirp_flush_batch(s);
+
+    /* The packet may have opened a socket that must be polled */
+    if (s->ctx) {
+        qemu_bh_schedule(s->poll_bh);
+    }
 
     return size;
 }
@@ -152,14 +241,25 @@ static void slirp_free_fwd(gpointer data)
     g_free(data);
 }
 
+static void net_slirp_aio_detach(SlirpState *s);
+
 static void net_slirp_cleanup(NetClientState *nc)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+    AioContext *ctx = net_client_acquire(nc);
+
+    if (s->ctx) {
+        net_slirp_aio_detach(s);
+    } else {
+        main_loop_poll_remove_notifier(&s->poll_notifier);
+    }
+    net_client_release(ctx);
 
     g_slist_free_full(s->fwd, slirp_free_fwd);
-    main_loop_poll_remove_notifier(&s->poll_notifier);
-    unregister_savevm(NULL, "slirp", s->slirp);
+    unregister_savevm(NULL, "slirp", s);
     slirp_cleanup(s->slirp);
+    qemu_bh_delete(s->batch_bh);
+    g_free(s->batch_buf);
     if (s->exit_notifier.notify) {
         qemu_remove_exit_notifier(&s->exit_notifier);
     }
@@ -167,11 +267,18 @@ static void net_slirp_cleanup(NetClientState *nc)
     QTAILQ_REMOVE(&slirp_stacks, s, entry);
 }
 
+#ifndef _WIN32
+static void net_slirp_set_aio_context(NetClientState *nc, AioContext *ctx);
+#endif
+
 static NetClientInfo net_slirp_info = {
     .type = NET_CLIENT_DRIVER_USER,
     .size = sizeof(SlirpState),
     .receive = net_slirp_receive,
     .cleanup = net_slirp_cleanup,
+#ifndef _WIN32
+    .set_aio_context = net_slirp_set_aio_context,
+#endif
 };
 
 static void net_slirp_guest_error(const char *msg, void *opaque)
@@ -184,23 +291,45 @@ static int64_t net_slirp_clock_get_ns(void *opaque)
     return qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
 }
 
+/* Slirp timers fire in the main loop, even when slirp runs elsewhere */
+static void net_slirp_timer_cb(void *opaque)
+{
+    SlirpTimer *t = opaque;
+    AioContext *ctx = net_client_acquire(&t->s->nc);
+
+    t->cb(t->cb_opaque);
+    net_slirp_flush_batch(t->s);
+    net_client_release(ctx);
+}
+
 static void *net_slirp_timer_new(SlirpTimerCb cb,
                                  void *cb_opaque, void *opaque)
 {
-    return timer_new_full(NULL, QEMU_CLOCK_VIRTUAL,
-                          SCALE_MS, QEMU_TIMER_ATTR_EXTERNAL,
-                          cb, cb_opaque);
+    SlirpTimer *t = g_new0(SlirpTimer, 1);
+
+    t->s = opaque;
+    t->cb = cb;
+    t->cb_opaque = cb_opaque;
+    timer_init_full(&t->timer, NULL, QEMU_CLOCK_VIRTUAL,
+                    SCALE_MS, QEMU_TIMER_ATTR_EXTERNAL,
+                    net_slirp_timer_cb, t);
+    return t;
 }
 
 static void net_slirp_timer_free(void *timer, void *opaque)
 {
-    timer_free(timer);
+    SlirpTimer *t = timer;
+
+    timer_del(&t->timer);
+    g_free(t);
 }
 
 static void net_slirp_timer_mod(void *timer, int64_t expire_timer,
                                 void *opaque)
 {
-    timer_mod(timer, expire_timer);
+    SlirpTimer *t = timer;
+
+    timer_mod(&t->timer, expire_timer);
 }
 
 static void net_slirp_register_poll_fd(int fd, void *opaque)
@@ -215,7 +344,13 @@ static void net_slirp_unregister_poll_fd(int fd, void *opaque)
 
 static void net_slirp_notify(void *opaque)
 {
-    qemu_notify_event();
+    SlirpState *s = opaque;
+
+    if (s->ctx) {
+        qemu_bh_schedule(s->poll_bh);
+    } else {
+        qemu_notify_event();
+    }
 }
 
 static const SlirpCb slirp_cb = {
@@ -309,12 +444,160 @@ static void net_slirp_poll_notify(Notifier *notifier, void *data)
     case MAIN_LOOP_POLL_ERR:
         slirp_pollfds_poll(s->slirp, poll->state == MAIN_LOOP_POLL_ERR,
                            net_slirp_get_revents, poll->pollfds);
+        net_slirp_flush_batch(s);
         break;
     default:
         g_assert_not_reached();
     }
 }
 
+#ifndef _WIN32
+static void net_slirp_aio_event(void *opaque)
+{
+    SlirpState *s = opaque;
+
+    qemu_bh_schedule(s->poll_bh);
+}
+
+/*
+ * Ask slirp which fds it wants to watch and update the fd handlers in
+ * the AioContext.  Only fds whose events changed are touched, most of
+ * them stay registered from one pass to the next.
+ */
+static void net_slirp_aio_fill(SlirpState *s)
+{
+    GArray *old = s->pollfds;
+    GHashTable *stale = g_hash_table_new(NULL, NULL);
+    uint32_t timeout = UINT32_MAX;
+    GHashTableIter iter;
+    gpointer key;
+    int i;
+
+    for (i = 0; i < old->len; i++) {
+        GPollFD *pfd = &g_array_index(old, GPollFD, i);
+
+        g_hash_table_insert(stale, GINT_TO_POINTER(pfd->fd),
+                            GINT_TO_POINTER(pfd->events));
+    }
+
+    s->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    slirp_pollfds_fill(s->slirp, &timeout, net_slirp_add_poll, s->pollfds);
+
+    for (i = 0; i < s->pollfds->len; i++) {
+        GPollFD *pfd = &g_array_index(s->pollfds, GPollFD, i);
+        gpointer events;
+
+        if (g_hash_table_lookup_extended(stale, GINT_TO_POINTER(pfd->fd),
+                                         NULL, &events)) {
+            g_hash_table_remove(stale, GINT_TO_POINTER(pfd->fd));
+            if (GPOINTER_TO_INT(events) == pfd->events) {
+                continue;
+            }
+        }
+        aio_set_fd_handler(s->ctx, pfd->fd, false,
+                           pfd->events & (G_IO_IN | G_IO_PRI) ?
+                           net_slirp_aio_event : NULL,
+                           pfd->events & G_IO_OUT ?
+                           net_slirp_aio_event : NULL,
+                           NULL, s);
+    }
+
+    g_hash_table_iter_init(&iter, stale);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        aio_set_fd_handler(s->ctx, GPOINTER_TO_INT(key), false,
+                           NULL, NULL, NULL, NULL);
+    }
+    g_hash_table_destroy(stale);
+    g_array_free(old, TRUE);
+
+    if (timeout == UINT32_MAX) {
+        timer_del(s->poll_timer);
+    } else {
+        timer_mod(s->poll_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + timeout);
+    }
+}
+
+static void net_slirp_aio_poll(void *opaque)
+{
+    SlirpState *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    GArray *pollfds;
+    int ret;
+
+    aio_context_acquire(ctx);
+    if (s->ctx == ctx) {
+        /* The fd handlers do not tell which fds are ready, look at all */
+        pollfds = s->pollfds;
+        ret = g_poll((GPollFD *)pollfds->data, pollfds->len, 0);
+        slirp_pollfds_poll(s->slirp, ret < 0, net_slirp_get_revents, pollfds);
+        net_slirp_flush_batch(s);
+        net_slirp_aio_fill(s);
+    }
+    aio_context_release(ctx);
+}
+
+static void net_slirp_aio_attach(SlirpState *s)
+{
+    s->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    s->poll_bh = aio_bh_new(s->ctx, net_slirp_aio_poll, s);
+    s->poll_timer = aio_timer_new(s->ctx, QEMU_CLOCK_REALTIME, SCALE_MS,
+                                  net_slirp_aio_poll, s);
+    net_slirp_aio_fill(s);
+}
+
+static void net_slirp_aio_detach(SlirpState *s)
+{
+    int i;
+
+    for (i = 0; i < s->pollfds->len; i++) {
+        aio_set_fd_handler(s->ctx, g_array_index(s->pollfds, GPollFD, i).fd,
+                           false, NULL, NULL, NULL, NULL);
+    }
+    g_array_free(s->pollfds, TRUE);
+    s->pollfds = NULL;
+    qemu_bh_delete(s->poll_bh);
+    s->poll_bh = NULL;
+    timer_free(s->poll_timer);
+    s->poll_timer = NULL;
+}
+
+/*
+ * Follow the peer into its IOThread, so that packets between the guest
+ * and slirp never go through the main loop.
+ */
+static void net_slirp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
+
+    net_slirp_flush_batch(s);
+    qemu_bh_delete(s->batch_bh);
+
+    if (s->ctx) {
+        net_slirp_aio_detach(s);
+    } else {
+        main_loop_poll_remove_notifier(&s->poll_notifier);
+    }
+
+    s->ctx = ctx;
+    s->batch_bh = aio_bh_new(ctx ? ctx : qemu_get_aio_context(),
+                             net_slirp_batch_bh, s);
+
+    if (ctx) {
+        aio_context_acquire(ctx);
+        net_slirp_aio_attach(s);
+        aio_context_release(ctx);
+    } else {
+        main_loop_poll_add_notifier(&s->poll_notifier);
+        qemu_notify_event();
+    }
+}
+#else
+static void net_slirp_aio_detach(SlirpState *s)
+{
+}
+#endif
+
 static ssize_t
 net_slirp_stream_read(void *buf, size_t size, void *opaque)
 {
@@ -338,16 +621,22 @@ net_slirp_stream_write(const void *buf, size_t size, void *opaque)
 
 static int net_slirp_state_load(QEMUFile *f, void *opaque, int version_id)
 {
-    Slirp *slirp = opaque;
+    SlirpState *s = opaque;
+    AioContext *ctx = net_client_acquire(&s->nc);
+    int ret;
 
-    return slirp_state_load(slirp, version_id, net_slirp_stream_read, f);
+    ret = slirp_state_load(s->slirp, version_id, net_slirp_stream_read, f);
+    net_client_release(ctx);
+    return ret;
 }
 
 static void net_slirp_state_save(QEMUFile *f, void *opaque)
 {
-    Slirp *slirp = opaque;
+    SlirpState *s = opaque;
+    AioContext *ctx = net_client_acquire(&s->nc);
 
-    slirp_state_save(slirp, net_slirp_stream_write, f);
+    slirp_state_save(s->slirp, net_slirp_stream_write, f);
+    net_client_release(ctx);
 }
 
 static SaveVMHandlers savevm_slirp_state = {
@@ -586,7 +875,10 @@ static int net_slirp_init(NetClientState *peer, const char *model,
      */
     g_assert(slirp_state_version() == 4);
     register_savevm_live("slirp", 0, slirp_state_version(),
-                         &savevm_slirp_state, s->slirp);
+                         &savevm_slirp_state, s);
+
+    s->batch_buf = g_malloc(SLIRP_BATCH_BUFSIZE);
+    s->batch_bh = qemu_bh_new(net_slirp_batch_bh, s);
 
     s->poll_notifier.notify = net_slirp_poll_notify;
     main_loop_poll_add_notifier(&s->poll_notifier);
@@ -648,6 +940,7 @@ void hmp_hostfwd_remove(Monitor *mon, const QDict *qdict)
     char buf[256];
     const char *src_str, *p;
     SlirpState *s;
+    AioContext *ctx;
     int is_udp = 0;
     int err;
     const char *arg1 = qdict_get_str(qdict, "arg1");
@@ -688,7 +981,9 @@ void hmp_hostfwd_remove(Monitor *mon, const QDict *qdict)
         goto fail_syntax;
     }
 
+    ctx = net_client_acquire(&s->nc);
     err = slirp_remove_hostfwd(s->slirp, is_udp, host_addr, host_port);
+    net_client_release(ctx);
 
     monitor_printf(mon, "host forwarding rule for %s %s\n", src_str,
                    err ? "not found" : "removed");
@@ -708,6 +1003,8 @@ static int slirp_hostfwd(SlirpState *s, const char *redir_str, Error **errp)
     int is_udp;
     char *end;
     const char *fail_reason = "Unknown reason";
+    AioContext *ctx;
+    int ret;
 
     p = redir_str;
     if (!p || get_str_sep(buf, sizeof(buf), &p, ':') < 0) {
@@ -757,8 +1054,13 @@ static int slirp_hostfwd(SlirpState *s, const char *redir_str, Error **errp)
         goto fail_syntax;
     }
 
-    if (slirp_add_hostfwd(s->slirp, is_udp, host_addr, host_port, guest_addr,
-                          guest_port) < 0) {
+    ctx = net_client_acquire(&s->nc);
+    ret = slirp_add_hostfwd(s->slirp, is_udp, host_addr, host_port,
+                            guest_addr, guest_port);
+    /* Have the new listening socket polled */
+    net_slirp_notify(s);
+    net_client_release(ctx);
+    if (ret < 0) {
         error_setg(errp, "Could not set up host forwarding rule '%s'",
                    redir_str);
         return -1;
@@ -914,13 +1216,21 @@ static int slirp_smb(SlirpState* s, const char *exported_dir,
 static int guestfwd_can_read(void *opaque)
 {
     struct GuestFwd *fwd = opaque;
-    return slirp_socket_can_recv(fwd->slirp, fwd->server, fwd->port);
+    AioContext *ctx = net_client_acquire(fwd->nc);
+    int ret;
+
+    ret = slirp_socket_can_recv(fwd->slirp, fwd->server, fwd->port);
+    net_client_release(ctx);
+    return ret;
 }
 
 static void guestfwd_read(void *opaque, const uint8_t *buf, int size)
 {
     struct GuestFwd *fwd = opaque;
+    AioContext *ctx = net_client_acquire(fwd->nc);
+
     slirp_socket_recv(fwd->slirp, fwd->server, fwd->port, buf, size);
+    net_client_release(ctx);
 }
 
 static ssize_t guestfwd_write(const void *buf, size_t len, void *chr)
@@ -1001,6 +1311,7 @@ static int slirp_guestfwd(SlirpState *s, const char *config_str, Error **errp)
         fwd->server = server;
         fwd->port = port;
         fwd->slirp = s->slirp;
+        fwd->nc = &s->nc;
 
         qemu_chr_fe_set_handlers(&fwd->hd, guestfwd_can_read, guestfwd_read,
                                  NULL, NULL, fwd, NULL, true);
@@ -1020,7 +1331,10 @@ void hmp_info_usernet(Monitor *mon, const QDict *qdict)
     QTAILQ_FOREACH(s, &slirp_stacks, entry) {
         int id;
         bool got_hub_id = net_hub_id_for_client(&s->nc, &id) == 0;
+        AioContext *ctx = net_client_acquire(&s->nc);
         char *info = slirp_connection_info(s->slirp);
+
+        net_client_release(ctx);
         monitor_printf(mon, "Hub %d (%s):\n%s",
                        got_hub_id ? id : -1,
                        s->nc.name, info);
@@ -44,13 +44,25 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+    AioContext *ctx;              /* IOThread running the fd handlers, or NULL */
 } NetSocketState;
 
 static void net_socket_accept(void *opaque);
 static void net_socket_writable(void *opaque);
+static void net_socket_send_aio(void *opaque);
+static void net_socket_writable_aio(void *opaque);
 
 static void net_socket_update_fd_handler(NetSocketState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false,
+                           s->read_poll && s->send_fn ?
+                           net_socket_send_aio : NULL,
+                           s->write_poll ? net_socket_writable_aio : NULL,
+                           NULL, s);
+        return;
+    }
+
     qemu_set_fd_handler(s->fd,
                         s->read_poll ? s->send_fn : NULL,
                         s->write_poll ? net_socket_writable : NULL,
@@ -213,6 +225,55 @@ static void net_socket_send_dgram(void *opaque)
     }
 }
 
+/*
+ * fd handlers in an IOThread: the client may have been moved back to the
+ * main loop while the handler was waiting for the AioContext lock.
+ */
+static void net_socket_send_aio(void *opaque)
+{
+    NetSocketState *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    aio_context_acquire(ctx);
+    if (s->ctx == ctx && s->send_fn) {
+        s->send_fn(s);
+    }
+    aio_context_release(ctx);
+}
+
+static void net_socket_writable_aio(void *opaque)
+{
+    NetSocketState *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    aio_context_acquire(ctx);
+    if (s->ctx == ctx) {
+        net_socket_writable(s);
+    }
+    aio_context_release(ctx);
+}
+
+static void net_socket_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool write_poll = s->write_poll;
+
+    if (s->fd == -1) {
+        s->ctx = ctx;
+        return;
+    }
+
+    /* Unregister from the old context, then register in the new one */
+    s->read_poll = false;
+    s->write_poll = false;
+    net_socket_update_fd_handler(s);
+    s->ctx = ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    net_socket_update_fd_handler(s);
+}
+
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr,
                                    struct in_addr *localaddr,
                                    Error **errp)
@@ -327,6 +388,7 @@ static NetClientInfo net_dgram_socket_info = {
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
     .cleanup = net_socket_cleanup,
+    .set_aio_context = net_socket_set_aio_context,
 };
 
 static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
@@ -419,6 +481,7 @@ static NetClientInfo net_socket_info = {
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
     .cleanup = net_socket_cleanup,
+    .set_aio_context = net_socket_set_aio_context,
 };
 
 static NetSocketState *net_socket_fd_init_stream(NetClientState *peer,
@@ -48,12 +48,25 @@
 
 #include "net/vhost_net.h"
 
+/*
+ * When the host keeps receiving more packets while tap_send() is
+ * running we can hog the QEMU global mutex.  Limit the number of
+ * packets that are processed per tap_send() callback to prevent
+ * stalling the guest.
+ */
+#define TAP_SEND_MAX_PACKETS 50
+
+/* Room for several maximum-size packets, or a full batch of small ones */
+#define TAP_BATCH_BUFSIZE (4 * NET_BUFSIZE)
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
     uint8_t buf[NET_BUFSIZE];
+    /* Packets read in one tap_send() call, when the peer takes batches */
+    uint8_t *batch_buf;
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -62,6 +75,8 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    /* IOThread context the fd handlers run in, NULL for the main loop */
+    AioContext *ctx;
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -69,9 +84,20 @@ static void launch_script(const char *setup_script, const char *ifname,
 
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
+static void tap_send_aio(void *opaque);
+static void tap_writable_aio(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false,
+                           s->read_poll && s->enabled ? tap_send_aio : NULL,
+                           s->write_poll && s->enabled ?
+                           tap_writable_aio : NULL,
+                           NULL, s);
+        return;
+    }
+
     qemu_set_fd_handler(s->fd,
                         s->read_poll && s->enabled ? tap_send : NULL,
                         s->write_poll && s->enabled ? tap_writable : NULL,
@@ -182,12 +208,79 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
     tap_read_poll(s, true);
 }
 
+/*
+ * Read up to TAP_SEND_MAX_PACKETS packets back to back and hand them to
+ * the peer in one call, so that it can e.g. notify the guest once.
+ */
+static void tap_send_batch(TAPState *s)
+{
+    struct iovec pkts[TAP_SEND_MAX_PACKETS];
+    bool pad = net_peer_needs_padding(&s->nc);
+    int packets = 0;
+    bool drained = false;
+
+    if (!s->batch_buf) {
+        s->batch_buf = g_malloc(TAP_BATCH_BUFSIZE);
+    }
+
+    while (!drained && packets < TAP_SEND_MAX_PACKETS) {
+        uint8_t *end = s->batch_buf + TAP_BATCH_BUFSIZE;
+        uint8_t *p = s->batch_buf;
+        int count = 0;
+
+        while (packets + count < TAP_SEND_MAX_PACKETS &&
+               end - p >= NET_BUFSIZE) {
+            uint8_t *buf = p;
+            int size;
+
+            size = tap_read_packet(s->fd, p, NET_BUFSIZE);
+            if (size <= 0) {
+                drained = true;
+                break;
+            }
+            p += ROUND_UP(size, sizeof(uint64_t));
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+
+            /* The read left NET_BUFSIZE of room, pad in place */
+            if (pad && size < ETH_ZLEN) {
+                memset(buf + size, 0, ETH_ZLEN - size);
+                size = ETH_ZLEN;
+                p = MAX(p, buf + ROUND_UP(ETH_ZLEN, sizeof(uint64_t)));
+            }
+
+            pkts[count].iov_base = buf;
+            pkts[count].iov_len = size;
+            count++;
+        }
+
+        if (!count) {
+            break;
+        }
+        packets += count;
+
+        if (qemu_send_packet_batch_async(&s->nc, pkts, count,
+                                         tap_send_completed) == 0) {
+            tap_read_poll(s, false);
+            break;
+        }
+    }
+}
+
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
     int size;
     int packets = 0;
 
+    if (s->nc.peer && s->nc.peer->info->receive_batch) {
+        tap_send_batch(s);
+        return;
+    }
+
     while (true) {
         uint8_t *buf = s->buf;
         uint8_t min_pkt[ETH_ZLEN];
@@ -218,14 +311,8 @@ static void tap_send(void *opaque)
             break;
         }
 
-        /*
-         * When the host keeps receiving more packets while tap_send() is
-         * running we can hog the QEMU global mutex.  Limit the number of
-         * packets that are processed per tap_send() callback to prevent
-         * stalling the guest.
-         */
         packets++;
-        if (packets >= 50) {
+        if (packets >= TAP_SEND_MAX_PACKETS) {
             break;
         }
     }
@@ -319,6 +406,48 @@ static void tap_exit_notify(Notifier *notifier, void *data)
     }
 }
 
+/*
+ * In an IOThread the handlers run with its AioContext held, which is
+ * what excludes the device model's main loop code.  The fd may have
+ * been moved back to the main loop meanwhile.
+ */
+static void tap_send_aio(void *opaque)
+{
+    TAPState *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    aio_context_acquire(ctx);
+    if (s->ctx == ctx) {
+        tap_send(s);
+    }
+    aio_context_release(ctx);
+}
+
+static void tap_writable_aio(void *opaque)
+{
+    TAPState *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    aio_context_acquire(ctx);
+    if (s->ctx == ctx) {
+        tap_writable(s);
+    }
+    aio_context_release(ctx);
+}
+
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool enabled = s->enabled;
+
+    /* Unregister from the old context, then register in the new one */
+    s->enabled = false;
+    tap_update_fd_handler(s);
+    s->ctx = ctx;
+    s->enabled = enabled;
+    tap_update_fd_handler(s);
+}
+
 static void tap_cleanup(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -338,6 +467,8 @@ static void tap_cleanup(NetClientState *nc)
     tap_write_poll(s, false);
     close(s->fd);
     s->fd = -1;
+    g_free(s->batch_buf);
+    s->batch_buf = NULL;
 }
 
 static void tap_poll(NetClientState *nc, bool enable)
@@ -381,6 +512,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
     .set_steering_ebpf = tap_set_steering_ebpf,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include <getopt.h>
+#include <math.h>
 
 #include "qemu-common.h"
 #include "qemu-version.h"
@@ -33,6 +34,7 @@
 #include "qapi/qobject-output-visitor.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qnum.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
 #include "qemu/option.h"
@@ -83,6 +85,11 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_THREADS = 278,
+    OPTION_STATS = 279,
+    OPTION_RWMIXREAD = 280,
+    OPTION_ACCESS = 281,
+    OPTION_WORKERS = 282,
 };
 
 typedef enum OutputFormat {
@@ -200,6 +207,9 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--threads' specifies how many threads compress clusters in parallel\n"
+           "       for compressed qcow2 targets (defaults to 1)\n"
+           "  '--stats' prints the time taken and what was copied once done\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1235,6 +1245,34 @@ static int is_allocated_sectors_min(const uint8_t *buf, int n, int *pnum,
     return 1;
 }
 
+/*
+ * Like is_allocated_sectors, but for compressed targets, which can only skip
+ * clusters that are completely zeroed.  'pnum' is set to the number of
+ * sectors in the run of whole clusters that are in the same state as the
+ * first one; the last cluster may be short at the end of the buffer.
+ */
+static int is_allocated_clusters(const uint8_t *buf, int n, int *pnum,
+                                 int cluster_sectors)
+{
+    bool is_zero;
+    int i;
+
+    if (n <= 0) {
+        *pnum = 0;
+        return 0;
+    }
+    is_zero = buffer_is_zero(buf, MIN(n, cluster_sectors) * BDRV_SECTOR_SIZE);
+    for (i = cluster_sectors; i < n; i += cluster_sectors) {
+        if (is_zero != buffer_is_zero(buf + i * BDRV_SECTOR_SIZE,
+                                      MIN(n - i, cluster_sectors) *
+                                      BDRV_SECTOR_SIZE)) {
+            break;
+        }
+    }
+    *pnum = MIN(i, n);
+    return !is_zero;
+}
+
 /*
  * Compares two buffers sector by sector. Returns 0 if the first
  * sector of each buffer matches, non-zero otherwise.
@@ -1621,8 +1659,19 @@ enum ImgConvertBlockStatus {
 };
 
 #define MAX_COROUTINES 16
+#define MAX_CONVERT_THREADS 64
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
+/* Upper limit for the number of extents remembered from the first pass */
+#define MAX_CONVERT_EXTENTS (1 << 20)
+
+/* Block status of the sectors [start, end) found in the first pass */
+typedef struct ImgConvertExtent {
+    int64_t start;
+    int64_t end;
+    enum ImgConvertBlockStatus status;
+} ImgConvertExtent;
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1635,14 +1684,20 @@ typedef struct ImgConvertState {
     int64_t wr_offs;
     enum ImgConvertBlockStatus status;
     int64_t sector_next_status;
+    /* Block status found by the first pass, reused by the copy phase */
+    GArray *extents;
+    guint next_extent;
+    bool scanned;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
+    int compress_clusters;
     bool target_is_new;
     bool target_has_backing;
     int64_t target_backing_sectors; /* negative if unknown */
     bool wr_in_order;
     bool copy_range;
+    BdrvCopyRangeFallback copy_range_fallback;
     bool salvage;
     bool quiet;
     int min_sparse;
@@ -1650,11 +1705,17 @@ typedef struct ImgConvertState {
     size_t cluster_sectors;
     size_t buf_sectors;
     long num_coroutines;
+    long threads;
     int running_coroutines;
     Coroutine *co[MAX_COROUTINES];
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+
+    /* Statistics for --stats */
+    int64_t data_sectors;
+    int64_t offloaded_sectors;
+    int64_t zero_sectors;
 } ImgConvertState;
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
@@ -1669,6 +1730,29 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
+/*
+ * Look up the block status of @sector_num in the extents found by the first
+ * pass over the source.  Returns false if it was not recorded.
+ */
+static bool convert_recorded_status(ImgConvertState *s, int64_t sector_num)
+{
+    while (s->next_extent < s->extents->len) {
+        ImgConvertExtent *e = &g_array_index(s->extents, ImgConvertExtent,
+                                             s->next_extent);
+
+        if (e->start > sector_num) {
+            return false;
+        }
+        if (e->end > sector_num) {
+            s->status = e->status;
+            s->sector_next_status = e->end;
+            return true;
+        }
+        s->next_extent++;
+    }
+    return false;
+}
+
 static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
 {
     int64_t src_cur_offset;
@@ -1690,7 +1774,9 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
-    if (s->sector_next_status <= sector_num) {
+    if (s->sector_next_status <= sector_num &&
+        !(s->scanned && convert_recorded_status(s, sector_num)))
+    {
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
         int tail;
@@ -1753,6 +1839,16 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
 
         s->sector_next_status = sector_num + n;
+
+        /* Save the copy phase from querying the same block status again */
+        if (!s->scanned && s->extents->len < MAX_CONVERT_EXTENTS) {
+            ImgConvertExtent e = {
+                .start = sector_num,
+                .end = s->sector_next_status,
+                .status = s->status,
+            };
+            g_array_append_val(s->extents, e);
+        }
     }
 
     n = MIN(n, s->sector_next_status - sector_num);
@@ -1852,14 +1948,14 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * is real non-zero data, we must write it. Otherwise we can treat
              * it as zero sectors.
              * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
+             * case we can only save the write for completely zeroed
+             * clusters. */
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
                                           sector_num, s->alignment)) ||
                 (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
+                 is_allocated_clusters(buf, n, &n, s->cluster_sectors)))
             {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
@@ -1977,7 +2073,8 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         }
 
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
+        copy_range = status == BLK_DATA &&
+            bdrv_copy_range_fallback_try(&s->copy_range_fallback);
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -2002,12 +2099,18 @@ retry:
         if (s->ret == -EINPROGRESS) {
             if (copy_range) {
                 ret = convert_co_copy_range(s, sector_num, n);
+                bdrv_copy_range_fallback_done(&s->copy_range_fallback, ret);
                 if (ret) {
-                    s->copy_range = false;
                     goto retry;
                 }
+                s->offloaded_sectors += n;
             } else {
                 ret = convert_co_write(s, sector_num, n, buf, status);
+                if (ret == 0 && status == BLK_DATA) {
+                    s->data_sectors += n;
+                } else if (ret == 0 && status == BLK_ZERO) {
+                    s->zero_sectors += n;
+                }
             }
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
@@ -2054,16 +2157,20 @@ static int convert_do_copy(ImgConvertState *s)
         s->has_zero_init = bdrv_has_zero_init(blk_bs(s->target));
     }
 
-    /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+    /* Allocate buffer for copied data. For compressed images, only
+     * s->compress_clusters whole clusters can be copied at a time, which the
+     * target compresses in parallel. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = s->cluster_sectors * s->compress_clusters;
     }
 
+    bdrv_copy_range_fallback_init(&s->copy_range_fallback, s->copy_range);
+
+    s->extents = g_array_new(false, false, sizeof(ImgConvertExtent));
     while (sector_num < s->total_sectors) {
         n = convert_iteration_sectors(s, sector_num);
         if (n < 0) {
@@ -2078,6 +2185,8 @@ static int convert_do_copy(ImgConvertState *s)
 
     /* Do the copy */
     s->sector_next_status = 0;
+    s->next_extent = 0;
+    s->scanned = true;
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
@@ -2102,6 +2211,25 @@ static int convert_do_copy(ImgConvertState *s)
     return s->ret;
 }
 
+static void convert_print_stats(ImgConvertState *s, int64_t elapsed_us)
+{
+    int64_t unallocated = s->total_sectors - s->data_sectors -
+                          s->offloaded_sectors - s->zero_sectors;
+    double seconds = MAX(elapsed_us, 1) / 1e6;
+    g_autofree char *total = size_to_str(s->total_sectors * BDRV_SECTOR_SIZE);
+    g_autofree char *rate = size_to_str(s->total_sectors * BDRV_SECTOR_SIZE /
+                                        seconds);
+    g_autofree char *data = size_to_str(s->data_sectors * BDRV_SECTOR_SIZE);
+    g_autofree char *offloaded = size_to_str(s->offloaded_sectors *
+                                             BDRV_SECTOR_SIZE);
+    g_autofree char *zero = size_to_str(s->zero_sectors * BDRV_SECTOR_SIZE);
+    g_autofree char *skipped = size_to_str(unallocated * BDRV_SECTOR_SIZE);
+
+    printf("Converted %s in %.3f seconds (%s/s)\n", total, seconds, rate);
+    printf("Data: %s, offloaded: %s, zero: %s, unallocated: %s\n",
+           data, offloaded, zero, skipped);
+}
+
 /* Check that bitmaps can be copied, or output an error */
 static int convert_check_bitmaps(BlockDriverState *src, bool skip_broken)
 {
@@ -2199,7 +2327,9 @@ static int img_convert(int argc, char **argv)
     bool explict_min_sparse = false;
     bool bitmaps = false;
     bool skip_broken = false;
+    bool stats = false;
     int64_t rate_limit = 0;
+    int64_t start_time = 0;
 
     ImgConvertState s = (ImgConvertState) {
         /* Need at least 4k of zeros for sparse detection */
@@ -2208,6 +2338,8 @@ static int img_convert(int argc, char **argv)
         .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
         .wr_in_order        = true,
         .num_coroutines     = 8,
+        .threads            = 1,
+        .compress_clusters  = 1,
     };
 
     for(;;) {
@@ -2221,6 +2353,8 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"threads", required_argument, 0, OPTION_THREADS},
+            {"stats", no_argument, 0, OPTION_STATS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:Cco:l:S:pt:T:qnm:WUr:",
@@ -2352,6 +2486,18 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_THREADS:
+            if (qemu_strtol(optarg, NULL, 0, &s.threads) ||
+                s.threads < 1 || s.threads > MAX_CONVERT_THREADS) {
+                error_report("Invalid number of threads. Allowed number of"
+                             " threads is between 1 and %d",
+                             MAX_CONVERT_THREADS);
+                goto fail_getopt;
+            }
+            break;
+        case OPTION_STATS:
+            stats = true;
+            break;
         }
     }
 
@@ -2628,7 +2774,17 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    if (skip_create) {
+    /* qcow2 compresses clusters in its thread pool, so size the pool */
+    if (s.compressed && s.threads > 1 && !tgt_image_opts &&
+        !strcmp(out_fmt, "qcow2"))
+    {
+        if (!open_opts) {
+            open_opts = qdict_new();
+        }
+        qdict_put_int(open_opts, "compression-threads", s.threads);
+    }
+
+    if (skip_create && !open_opts) {
         s.target = img_open(tgt_image_opts, out_filename, out_fmt,
                             flags, writethrough, s.quiet, false);
     } else {
@@ -2710,13 +2866,25 @@ static int img_convert(int argc, char **argv)
     } else {
         s.compressed = s.compressed || bdi.needs_compressed_writes;
         s.cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
+        if (s.compressed && bdi.parallel_compressed_writes &&
+            s.cluster_sectors > 0)
+        {
+            /* Give each thread a cluster to compress in every write */
+            s.compress_clusters = MIN(s.threads,
+                                      MAX(1, MAX_BUF_SECTORS /
+                                             s.cluster_sectors));
+        }
     }
 
     if (rate_limit) {
         set_rate_limit(s.target, rate_limit);
     }
 
+    start_time = g_get_monotonic_time();
     ret = convert_do_copy(&s);
+    if (ret == 0 && stats && !s.quiet) {
+        convert_print_stats(&s, g_get_monotonic_time() - start_time);
+    }
 
     /* Now copy the bitmaps */
     if (bitmaps && ret == 0) {
@@ -2740,6 +2908,9 @@ out:
     }
     g_free(s.src_sectors);
     g_free(s.src_alignment);
+    if (s.extents) {
+        g_array_free(s.extents, true);
+    }
 fail_getopt:
     qemu_opts_del(sn_opts);
     g_free(options);
@@ -4221,23 +4392,103 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+typedef enum BenchAccess {
+    BENCH_ACCESS_SEQUENTIAL,
+    BENCH_ACCESS_RANDOM,
+    BENCH_ACCESS_ZIPFIAN,
+} BenchAccess;
+
+/* Skew of zipfian offsets, the same as the YCSB default */
+#define BENCH_ZIPF_THETA 0.99
+
+/* Number of terms summed up exactly for the zipfian normalization constant */
+#define BENCH_ZIPF_EXACT_TERMS 1000000
+
+#define BENCH_MAX_WORKERS 64
+
+/* Latency histogram bins per decade, from 1 us up to 100 s */
+#define BENCH_HIST_BINS_PER_DECADE 20
+#define BENCH_HIST_DECADES 8
+
+/*
+ * Generates zipfian distributed block numbers in [0, n), using the
+ * method of Gray et al., "Quickly Generating Billion-Record Synthetic
+ * Databases".  Lower block numbers are the more popular ones.
+ */
+typedef struct BenchZipf {
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} BenchZipf;
+
+static void bench_zipf_init(BenchZipf *z, uint64_t n, double theta)
+{
+    uint64_t exact = MIN(n, BENCH_ZIPF_EXACT_TERMS);
+    double zeta2 = 1 + pow(0.5, theta);
+    uint64_t i;
+
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = 0;
+    for (i = 1; i <= exact; i++) {
+        z->zetan += pow(i, -theta);
+    }
+    if (n > exact) {
+        /* Approximate the rest of the sum by its integral */
+        z->zetan += (pow(n + 0.5, 1 - theta) - pow(exact + 0.5, 1 - theta)) /
+                    (1 - theta);
+    }
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+static uint64_t bench_zipf_next(BenchZipf *z, double u)
+{
+    double uz = u * z->zetan;
+
+    if (z->n == 1 || uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, z->theta)) {
+        return 1;
+    }
+    return MIN(z->n - 1, z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+}
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector read_qiov;
+    QEMUIOVector write_qiov;
+    BlockAcctCookie acct;
+} BenchRequest;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
-    bool write;
+    int read_percent;
+    BenchAccess access;
+    BenchZipf *zipf;
+    GRand *rand;
+    uint64_t start;
+    uint64_t nb_blocks;
     int bufsize;
     int step;
     int nrreq;
     int n;
     int flush_interval;
     bool drain_on_flush;
-    uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchRequest *reqs;
+    BenchRequest **free_reqs;
+    int nb_free;
 
     int in_flight;
     bool in_flush;
     uint64_t offset;
-} BenchData;
+};
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -4247,69 +4498,250 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
-static void bench_cb(void *opaque, int ret)
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset;
+
+    switch (b->access) {
+    case BENCH_ACCESS_RANDOM:
+        offset = g_rand_double(b->rand) * b->nb_blocks;
+        return b->start + MIN(offset, b->nb_blocks - 1) * b->bufsize;
+    case BENCH_ACCESS_ZIPFIAN:
+        offset = bench_zipf_next(b->zipf, g_rand_double(b->rand));
+        return b->start + offset * b->bufsize;
+    default:
+        offset = b->offset;
+        b->offset += b->step;
+        b->offset %= b->image_size;
+        return offset;
+    }
+}
+
+static void bench_req_cb(void *opaque, int ret);
+
+static void bench_submit(BenchData *b)
 {
-    BenchData *b = opaque;
     BlockAIOCB *acb;
 
+    while (b->n > b->in_flight && b->in_flight < b->nrreq) {
+        BenchRequest *req = b->free_reqs[--b->nb_free];
+        int64_t offset = bench_next_offset(b);
+        bool write = b->read_percent < 100 &&
+                     g_rand_int_range(b->rand, 0, 100) >= b->read_percent;
+
+        /* blk_aio_* might look for completed I/Os and kick bench_req_cb
+         * again, so make sure this operation is counted by in_flight
+         * and b->offset is ready for the next submission.
+         */
+        b->in_flight++;
+        block_acct_start(blk_get_stats(b->blk), &req->acct, b->bufsize,
+                         write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ);
+        if (write) {
+            acb = blk_aio_pwritev(b->blk, offset, &req->write_qiov, 0,
+                                  bench_req_cb, req);
+        } else {
+            acb = blk_aio_preadv(b->blk, offset, &req->read_qiov, 0,
+                                 bench_req_cb, req);
+        }
+        if (!acb) {
+            error_report("Failed to issue request");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Finished a flush with drained queue: Start next requests */
+static void bench_drained_flush_cb(void *opaque, int ret)
+{
+    BenchData *b = opaque;
+
     if (ret < 0) {
-        error_report("Failed request: %s", strerror(-ret));
+        error_report("Failed flush request: %s", strerror(-ret));
         exit(EXIT_FAILURE);
     }
 
-    if (b->in_flush) {
-        /* Just finished a flush with drained queue: Start next requests */
-        assert(b->in_flight == 0);
-        b->in_flush = false;
-    } else if (b->in_flight > 0) {
-        int remaining = b->n - b->in_flight;
+    assert(b->in_flush && b->in_flight == 0);
+    b->in_flush = false;
+    bench_submit(b);
+}
+
+static void bench_req_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+    BlockAIOCB *acb;
+    int remaining = b->n - b->in_flight;
 
-        b->n--;
-        b->in_flight--;
+    if (ret < 0) {
+        error_report("Failed request: %s", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
 
-        /* Time for flush? Drain queue if requested, then flush */
-        if (b->flush_interval && remaining % b->flush_interval == 0) {
-            if (!b->in_flight || !b->drain_on_flush) {
-                BlockCompletionFunc *cb;
+    block_acct_done(blk_get_stats(b->blk), &req->acct);
+    b->free_reqs[b->nb_free++] = req;
+    b->n--;
+    b->in_flight--;
 
-                if (b->drain_on_flush) {
-                    b->in_flush = true;
-                    cb = bench_cb;
-                } else {
-                    cb = bench_undrained_flush_cb;
-                }
+    /* Time for flush? Drain queue if requested, then flush */
+    if (b->flush_interval && remaining % b->flush_interval == 0) {
+        if (!b->in_flight || !b->drain_on_flush) {
+            BlockCompletionFunc *cb;
 
-                acb = blk_aio_flush(b->blk, cb, b);
-                if (!acb) {
-                    error_report("Failed to issue flush request");
-                    exit(EXIT_FAILURE);
-                }
-            }
             if (b->drain_on_flush) {
-                return;
+                b->in_flush = true;
+                cb = bench_drained_flush_cb;
+            } else {
+                cb = bench_undrained_flush_cb;
+            }
+
+            acb = blk_aio_flush(b->blk, cb, b);
+            if (!acb) {
+                error_report("Failed to issue flush request");
+                exit(EXIT_FAILURE);
             }
         }
+        if (b->drain_on_flush) {
+            return;
+        }
     }
 
-    while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
-        /* blk_aio_* might look for completed I/Os and kick bench_cb
-         * again, so make sure this operation is counted by in_flight
-         * and b->offset is ready for the next submission.
-         */
-        b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
-        } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+    bench_submit(b);
+}
+
+static void bench_histogram_init(BlockAcctStats *stats)
+{
+    uint64List *boundaries = NULL;
+    int i;
+
+    for (i = BENCH_HIST_BINS_PER_DECADE * BENCH_HIST_DECADES; i >= 0; i--) {
+        QAPI_LIST_PREPEND(boundaries,
+                          SCALE_US * pow(10, (double)i /
+                                             BENCH_HIST_BINS_PER_DECADE));
+    }
+    block_latency_histogram_set(stats, BLOCK_ACCT_READ, boundaries);
+    block_latency_histogram_set(stats, BLOCK_ACCT_WRITE, boundaries);
+    qapi_free_uint64List(boundaries);
+}
+
+/*
+ * Returns the latency in nanoseconds that @percentile percent of the
+ * requests did not exceed, rounded up to the end of its histogram bin.
+ */
+static uint64_t bench_percentile(BlockLatencyHistogram *hist,
+                                 double percentile)
+{
+    uint64_t total = 0, sum = 0;
+    int i;
+
+    for (i = 0; i < hist->nbins; i++) {
+        total += hist->bins[i];
+    }
+    if (!total) {
+        return 0;
+    }
+    for (i = 0; i < hist->nbins - 1; i++) {
+        sum += hist->bins[i];
+        if (sum >= total * percentile / 100) {
+            break;
         }
-        if (!acb) {
-            error_report("Failed to issue request");
-            exit(EXIT_FAILURE);
+    }
+    return hist->boundaries[MIN(i, hist->nbins - 2)];
+}
+
+static const struct {
+    const char *name;
+    double value;
+} bench_percentiles[] = {
+    { "p50", 50 },
+    { "p90", 90 },
+    { "p99", 99 },
+    { "p99.9", 99.9 },
+};
+
+static QDict *bench_op_stats(BlockAcctStats *stats, enum BlockAcctType type,
+                             double seconds)
+{
+    QDict *dict = qdict_new();
+    QDict *latency = qdict_new();
+    uint64_t ops = stats->nr_ops[type];
+    int i;
+
+    qdict_put_int(dict, "requests", ops);
+    qdict_put_int(dict, "bytes", stats->nr_bytes[type]);
+    qdict_put_int(dict, "iops", ops / seconds);
+    qdict_put_int(dict, "bandwidth", stats->nr_bytes[type] / seconds);
+    qdict_put_int(latency, "mean", ops ? stats->total_time_ns[type] / ops : 0);
+    for (i = 0; i < ARRAY_SIZE(bench_percentiles); i++) {
+        qdict_put_int(latency, bench_percentiles[i].name,
+                      bench_percentile(&stats->latency_histogram[type],
+                                       bench_percentiles[i].value));
+    }
+    qdict_put(dict, "latency-ns", latency);
+
+    return dict;
+}
+
+static void dump_human_bench_stats(BlockAcctStats *stats, double seconds)
+{
+    static const struct {
+        const char *name;
+        enum BlockAcctType type;
+    } types[] = {
+        { "read", BLOCK_ACCT_READ },
+        { "write", BLOCK_ACCT_WRITE },
+    };
+    int i, j;
+
+    printf("Run completed in %3.3f seconds.\n", seconds);
+
+    for (i = 0; i < ARRAY_SIZE(types); i++) {
+        enum BlockAcctType type = types[i].type;
+        uint64_t ops = stats->nr_ops[type];
+        g_autofree char *bandwidth = NULL;
+
+        if (!ops) {
+            continue;
+        }
+        bandwidth = size_to_str(stats->nr_bytes[type] / seconds);
+        printf("%s: %" PRIu64 " requests, %.0f IOPS, %s/s, latency mean "
+               "%.1f us", types[i].name, ops, ops / seconds, bandwidth,
+               (double)stats->total_time_ns[type] / ops / SCALE_US);
+        for (j = 0; j < ARRAY_SIZE(bench_percentiles); j++) {
+            printf(", %s %.1f us", bench_percentiles[j].name,
+                   (double)bench_percentile(&stats->latency_histogram[type],
+                                            bench_percentiles[j].value) /
+                   SCALE_US);
+        }
+        printf("\n");
+    }
+}
+
+static void dump_json_bench_stats(BlockAcctStats *stats, double seconds)
+{
+    QDict *dict = qdict_new();
+    GString *str;
+
+    qdict_put(dict, "elapsed", qnum_from_double(seconds));
+    qdict_put(dict, "read", bench_op_stats(stats, BLOCK_ACCT_READ, seconds));
+    qdict_put(dict, "write", bench_op_stats(stats, BLOCK_ACCT_WRITE, seconds));
+
+    str = qobject_to_json_pretty(QOBJECT(dict), true);
+    assert(str != NULL);
+    printf("%s\n", str->str);
+    qobject_unref(dict);
+    g_string_free(str, true);
+}
+
+static bool bench_done(BenchData *data, int workers)
+{
+    int i;
+
+    for (i = 0; i < workers; i++) {
+        if (data[i].n > 0) {
+            return false;
         }
     }
+    return true;
 }
 
 static int img_bench(int argc, char **argv)
@@ -4327,15 +4759,24 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
+    int read_percent = -1;
+    BenchAccess access = BENCH_ACCESS_SEQUENTIAL;
+    int workers = 1;
+    OutputFormat output_format = OFORMAT_HUMAN;
+    const char *output = NULL;
     int64_t image_size;
     BlockBackend *blk = NULL;
-    BenchData data = {};
+    BenchData *data = NULL;
+    BenchZipf zipf;
+    uint8_t *buf = NULL;
     int flags = 0;
     bool writethrough = false;
     struct timeval t1, t2;
-    int i;
+    double seconds;
+    int i, j;
     bool force_share = false;
     size_t buf_size;
+    uint64_t stride = 0;
 
     for (;;) {
         static const struct option long_options[] = {
@@ -4345,6 +4786,10 @@ static int img_bench(int argc, char **argv)
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
             {"force-share", no_argument, 0, 'U'},
+            {"rwmixread", required_argument, 0, OPTION_RWMIXREAD},
+            {"access", required_argument, 0, OPTION_ACCESS},
+            {"workers", required_argument, 0, OPTION_WORKERS},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hc:d:f:ni:o:qs:S:t:wU", long_options,
@@ -4478,6 +4923,47 @@ static int img_bench(int argc, char **argv)
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
+        case OPTION_RWMIXREAD:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid read percentage specified");
+                return 1;
+            }
+            read_percent = res;
+            break;
+        }
+        case OPTION_ACCESS:
+            if (!strcmp(optarg, "sequential")) {
+                access = BENCH_ACCESS_SEQUENTIAL;
+            } else if (!strcmp(optarg, "random")) {
+                access = BENCH_ACCESS_RANDOM;
+            } else if (!strcmp(optarg, "zipfian")) {
+                access = BENCH_ACCESS_ZIPFIAN;
+            } else {
+                error_report("Invalid access pattern (expecting 'sequential', "
+                             "'random' or 'zipfian'): %s", optarg);
+                return 1;
+            }
+            break;
+        case OPTION_WORKERS:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res < 1 ||
+                res > BENCH_MAX_WORKERS) {
+                error_report("Invalid number of workers. Allowed number of"
+                             " workers is between 1 and %d",
+                             BENCH_MAX_WORKERS);
+                return 1;
+            }
+            workers = res;
+            break;
+        }
+        case OPTION_OUTPUT:
+            output = optarg;
+            break;
         }
     }
 
@@ -4486,6 +4972,26 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
+    if (output && !strcmp(output, "json")) {
+        output_format = OFORMAT_JSON;
+    } else if (output && !strcmp(output, "human")) {
+        output_format = OFORMAT_HUMAN;
+    } else if (output) {
+        error_report("--output must be used with human or json as argument.");
+        return 1;
+    }
+
+    if (read_percent >= 0 && is_write) {
+        error_report("-w and --rwmixread are mutually exclusive");
+        ret = -1;
+        goto out;
+    } else if (read_percent < 0) {
+        read_percent = is_write ? 0 : 100;
+    } else if (read_percent < 100) {
+        flags |= BDRV_O_RDWR;
+        is_write = true;
+    }
+
     if (!is_write && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
@@ -4510,56 +5016,135 @@ static int img_bench(int argc, char **argv)
         goto out;
     }
 
-    data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
-        .bufsize        = bufsize,
-        .step           = step ?: bufsize,
-        .nrreq          = depth,
-        .n              = count,
-        .offset         = offset,
-        .write          = is_write,
-        .flush_interval = flush_interval,
-        .drain_on_flush = drain_on_flush,
-    };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
+    if (access != BENCH_ACCESS_SEQUENTIAL &&
+        (bufsize == 0 || offset + bufsize > image_size)) {
+        error_report("Random access needs at least one buffer of %zu bytes "
+                     "after the offset", bufsize);
+        ret = -1;
+        goto out;
+    }
+    if (access == BENCH_ACCESS_ZIPFIAN) {
+        bench_zipf_init(&zipf, (image_size - offset) / bufsize,
+                        BENCH_ZIPF_THETA);
     }
 
-    buf_size = data.nrreq * data.bufsize;
-    data.buf = blk_blockalign(blk, buf_size);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
+    if (output_format == OFORMAT_HUMAN) {
+        printf("Sending %d %s requests, %zu bytes each, %d in parallel",
+               count, read_percent == 100 ? "read" :
+                      read_percent == 0 ? "write" : "mixed",
+               bufsize, depth);
+        if (workers > 1) {
+            printf(" by each of %d workers", workers);
+        }
+        if (access == BENCH_ACCESS_SEQUENTIAL) {
+            printf(" (starting at offset %" PRId64 ", step size %zu)\n",
+                   offset, step ?: bufsize);
+        } else {
+            printf(" (%s offsets from %" PRId64 ")\n",
+                   access == BENCH_ACCESS_RANDOM ? "random" : "zipfian",
+                   offset);
+        }
+        if (read_percent > 0 && read_percent < 100) {
+            printf("Reading in %d%% of the requests\n", read_percent);
+        }
+        if (flush_interval) {
+            printf("Sending flush every %d requests\n", flush_interval);
+        }
+    }
+
+    /* Mixed workloads keep separate buffers so that reads don't overwrite
+     * the pattern that is written */
+    buf_size = (size_t)workers * depth * bufsize *
+               (read_percent > 0 && read_percent < 100 ? 2 : 1);
+    buf = blk_blockalign(blk, buf_size);
+    memset(buf, pattern, buf_size);
+
+    blk_register_buf(blk, buf, buf_size);
+
+    bench_histogram_init(blk_get_stats(blk));
+
+    /* Sequential workers start at evenly spaced offsets */
+    if (workers > 1 && offset < image_size) {
+        stride = QEMU_ALIGN_DOWN((image_size - offset) / workers,
+                                 MAX(step ?: bufsize, 1));
+    }
+
+    data = g_new0(BenchData, workers);
+    for (i = 0; i < workers; i++) {
+        BenchData *b = &data[i];
+
+        *b = (BenchData) {
+            .blk            = blk,
+            .image_size     = image_size,
+            .read_percent   = read_percent,
+            .access         = access,
+            .zipf           = &zipf,
+            .rand           = g_rand_new_with_seed(i + 1),
+            .start          = offset,
+            .nb_blocks      = bufsize ? (image_size - offset) / bufsize : 0,
+            .bufsize        = bufsize,
+            .step           = step ?: bufsize,
+            .nrreq          = depth,
+            .n              = count / workers + (i < count % workers),
+            .offset         = offset + i * stride,
+            .flush_interval = flush_interval,
+            .drain_on_flush = drain_on_flush,
+            .reqs           = g_new0(BenchRequest, depth),
+            .free_reqs      = g_new(BenchRequest *, depth),
+            .nb_free        = depth,
+        };
 
-    blk_register_buf(blk, data.buf, buf_size);
+        for (j = 0; j < depth; j++) {
+            BenchRequest *req = &b->reqs[j];
+            uint8_t *req_buf = buf + ((size_t)i * depth + j) * bufsize;
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
+            req->b = b;
+            qemu_iovec_init(&req->read_qiov, 1);
+            qemu_iovec_add(&req->read_qiov, req_buf, bufsize);
+            qemu_iovec_init(&req->write_qiov, 1);
+            if (read_percent > 0 && read_percent < 100) {
+                req_buf += (size_t)workers * depth * bufsize;
+            }
+            qemu_iovec_add(&req->write_qiov, req_buf, bufsize);
+            b->free_reqs[j] = req;
+        }
     }
 
     gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
+    for (i = 0; i < workers; i++) {
+        bench_submit(&data[i]);
+    }
 
-    while (data.n > 0) {
+    while (!bench_done(data, workers)) {
         main_loop_wait(false);
     }
     gettimeofday(&t2, NULL);
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    seconds = (t2.tv_sec - t1.tv_sec)
+              + ((double)(t2.tv_usec - t1.tv_usec) / 1000000);
+    if (output_format == OFORMAT_JSON) {
+        dump_json_bench_stats(blk_get_stats(blk), seconds);
+    } else {
+        dump_human_bench_stats(blk_get_stats(blk), seconds);
+    }
 
 out:
-    if (data.buf) {
-        blk_unregister_buf(blk, data.buf);
+    if (data) {
+        for (i = 0; i < workers; i++) {
+            for (j = 0; j < depth; j++) {
+                qemu_iovec_destroy(&data[i].reqs[j].read_qiov);
+                qemu_iovec_destroy(&data[i].reqs[j].write_qiov);
+            }
+            g_free(data[i].reqs);
+            g_free(data[i].free_reqs);
+            g_rand_free(data[i].rand);
+        }
+        g_free(data);
+    }
+    if (buf) {
+        blk_unregister_buf(blk, buf);
     }
-    qemu_vfree(data.buf);
+    qemu_vfree(buf);
     blk_unref(blk);
 
     if (ret) {
@@ -1224,6 +1224,17 @@ SRST
             supporting platforms, and 0 on other platforms. Setting it
             to 0 disables this feature.
 
+        ``bitmap-sync-interval``
+            Keep persistent dirty bitmaps valid in the image while it is
+            in use instead of marking them in use, writing out the parts
+            that changed at this interval (in seconds). Setting it to 0
+            disables this feature (default: 0).
+
+        ``compression-threads``
+            Maximum number of threads that compress or decompress clusters
+            of the image in parallel (default: 4). Ignored for encrypted
+            images.
+
         ``pass-discard-request``
             Whether discard requests to the qcow2 device should be
             forwarded to the data source (on/off; default: on if
@@ -2648,6 +2659,19 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]\n"
+    "                attach to the existing network interface 'name' with AF_XDP socket\n"
+    "                use 'mode=MODE' to specify an XDP program attach mode\n"
+    "                use 'force-copy=on|off' to force XDP copy mode even if device supports zero-copy (default: off)\n"
+    "                use 'inhibit=on|off' to inhibit loading of a default XDP program (default: off)\n"
+    "                with inhibit=on,\n"
+    "                  use 'sock-fds' to provide file descriptors for already open AF_XDP sockets\n"
+    "                  added to a socket map in XDP program.  One socket per queue.\n"
+    "                use 'queues=n' to specify how many queues of a multiqueue interface should be used\n"
+    "                use 'start-queue=m' to specify the first queue that should be used\n"
+#endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -2672,6 +2696,9 @@ DEF("nic", HAS_ARG, QEMU_OPTION_nic,
 #ifdef CONFIG_NETMAP
     "netmap|"
 #endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
+#endif
 #ifdef CONFIG_POSIX
     "vhost-user|"
 #endif
@@ -2696,6 +2723,9 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #endif
 #ifdef CONFIG_NETMAP
     "netmap|"
+#endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
 #endif
     "socket][,option][,option][,...]\n"
     "                old way to initialize a host network interface\n"
@@ -2725,7 +2755,10 @@ SRST
 
 ``-netdev user,id=id[,option][,option][,...]``
     Configure user mode host network backend which requires no
-    administrator privilege to run. Valid options are:
+    administrator privilege to run. If the NIC runs its queues in
+    IOThreads (for example virtio-net with ``iothreads``), the backend
+    is polled in the same IOThread instead of the main loop. Valid
+    options are:
 
     ``id=id``
         Assign symbolic name for use in monitor commands.
@@ -3115,6 +3148,64 @@ SRST
         # launch QEMU instance
         |qemu_system| linux.img -nic vde,sock=/tmp/myswitch
 
+``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m][,inhibit=on|off][,sock-fds=x:y:...:z]``
+    Configure AF_XDP backend to connect to a network interface 'name'
+    using AF_XDP socket.  A specific program attach mode for a default
+    XDP program can be forced with 'mode', defaults to best-effort,
+    where the likely most performant mode will be in use.  Number of queues
+    'n' should generally match the number of queues in the interface,
+    defaults to 1.  Traffic arriving on non-configured device queues will
+    not be delivered to the network backend.
+
+    .. parsed-literal::
+
+        # set number of queues to 4
+        ethtool -L eth0 combined 4
+        # launch QEMU instance
+        |qemu_system| linux.img -device virtio-net-pci,netdev=n1 \\
+            -netdev af-xdp,id=n1,ifname=eth0,queues=4
+
+    'start-queue' option can be specified if a particular range of queues
+    [m, m + n] should be in use.  For example, this may be necessary in
+    order to use certain NICs in native mode.  Kernel allows the driver to
+    create a separate set of XDP queues on top of regular ones, and only
+    these queues can be used for AF_XDP sockets.  NICs that work this way
+    may also require an additional traffic redirection with ethtool to these
+    special queues.
+
+    .. parsed-literal::
+
+        # set number of queues to 1
+        ethtool -L eth0 combined 1
+        # redirect all the traffic to the second queue (id: 1)
+        # note: drivers may require non-empty key/mask pair.
+        ethtool -N eth0 flow-type ether \\
+            dst 00:00:00:00:00:00 m FF:FF:FF:FF:FF:FE action 1
+        ethtool -N eth0 flow-type ether \\
+            dst 00:00:00:00:00:01 m FF:FF:FF:FF:FF:FE action 1
+        |qemu_system| linux.img -device virtio-net-pci,netdev=n1 \\
+            -netdev af-xdp,id=n1,ifname=eth0,queues=1,start-queue=1
+
+    XDP program can also be loaded externally.  In this case 'inhibit' option
+    should be set to 'on' and 'sock-fds' provided with file descriptors for
+    already open but not bound XDP sockets already added to a socket map for
+    corresponding queues.  One socket per queue.
+
+    .. parsed-literal::
+
+        |qemu_system| linux.img -device virtio-net-pci,netdev=n1 \\
+            -netdev af-xdp,id=n1,ifname=eth0,queues=3,inhibit=on,sock-fds=15:16:17
+
+    For testing without a physical NIC, a veth pair works in 'skb' mode:
+
+    .. parsed-literal::
+
+        ip link add veth0 type veth peer name veth1
+        ip link set veth0 up
+        ip link set veth1 up
+        |qemu_system| linux.img -device virtio-net-pci,netdev=n1 \\
+            -netdev af-xdp,id=n1,ifname=veth0,mode=skb
+
 ``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
@@ -4317,6 +4408,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                accept incoming migration from a given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -4336,6 +4429,9 @@ SRST
     Accept incoming migration as an output from specified external
     command.
 
+``-incoming file:filename``
+    Accept incoming migration from a given file.
+
 ``-incoming defer``
     Wait for the URI to be specified via migrate\_incoming. The monitor
     can be used to change settings (such as migration parameters) prior
@@ -4925,6 +5021,24 @@ SRST
 
         ``behind``: insert behind the specified filter (default).
 
+    ``-object filter-gro,id=id,netdev=netdevid[,interval=t][,max-size=n][,vnet_hdr_support][,queue=all|rx|tx][,status=on|off][,position=head|tail|id=<id>][,insert=behind|before]``
+        filter-gro coalesces consecutive TCP segments of the same IPv4
+        flow on netdev netdevid into larger packets, so that the NIC and
+        the guest handle one packet per burst. A segment is held for at
+        most t microseconds (default 50) waiting for the next one; pushed,
+        short or out of order segments and control segments end the burst
+        immediately. If it has the vnet\_hdr\_support flag, coalesced
+        packets carry GSO information in their vnet header.
+        ``max-size`` is the largest coalesced packet in bytes; an
+        explicit value must not exceed what the guest NIC accepts. By
+        default it is 65535 when the netdev uses vnet headers and the
+        NIC model has enabled TSO on it, and otherwise 1514, so that
+        merged frames still fit a 1500 bytes MTU. The number of
+        segments seen, segments coalesced and packets flushed can be
+        read from the ``segments``, ``coalesced`` and ``flushed``
+        properties, and for each TCP connection from the ``flows``
+        property.
+
     ``-object filter-mirror,id=id,netdev=netdevid,outdev=chardevid,queue=all|rx|tx[,vnet_hdr_support][,position=head|tail|id=<id>][,insert=behind|before]``
         filter-mirror on netdev netdevid,mirror net packet to
         chardevchardevid, if it has the vnet\_hdr\_support flag,
@@ -4957,7 +5071,7 @@ SRST
         stored. The file format is libpcap, so it can be analyzed with
         tools such as tcpdump or Wireshark.
 
-    ``-object colo-compare,id=id,primary_in=chardevid,secondary_in=chardevid,outdev=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}]``
+    ``-object colo-compare,id=id,primary_in=chardevid,secondary_in=chardevid,outdev=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}][,compare_threads=@var{n}]``
         Colo-compare gets packet from primary\_in chardevid and
         secondary\_in, then compare whether the payload of primary packet
         and secondary packet are the same. If same, it will output
@@ -4971,6 +5085,11 @@ SRST
         is to set the period of scanning expired primary node network packets.
         The max\_queue\_size=@var{size} is to set the max compare queue
         size depend on user environment.
+        The compare\_threads=@var{n} spreads the comparison of
+        connections over @var{n} threads besides the iothread, which
+        helps guests with many concurrent connections. The age of the
+        oldest primary packet held back is reported by the read-only
+        max\_lag\_ms property.
         If user want to use Xen COLO, need to add the notify\_dev to
         notify Xen colo-frame to do checkpoint.
 
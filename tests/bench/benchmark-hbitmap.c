@@ -0,0 +1,152 @@
+/*
+ * HBitmap benchmark
+ *
+ * Measures the bitmap operations that backup, mirror and incremental
+ * bitmap merges spend their time in, for dirty bitmaps of typical disk
+ * sizes and granularities, with dense and sparse dirty patterns.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/hbitmap.h"
+
+/* Number of bitmap bits to go through for each test */
+#define TOTAL_BITS (1ULL << 30)
+
+typedef enum HBitmapBenchOp {
+    BENCH_MERGE,
+    BENCH_NEXT_DIRTY_AREA,
+    BENCH_ITER,
+} HBitmapBenchOp;
+
+typedef struct HBitmapBenchOpts {
+    char name[64];
+    HBitmapBenchOp op;
+    uint64_t disk_size;
+    int granularity;            /* log2 of the bytes per bit */
+    bool sparse;
+} HBitmapBenchOpts;
+
+/*
+ * Dense bitmaps have half of the clusters dirty in runs of 32; sparse
+ * ones have one cluster in 4096 dirty.
+ */
+static void bench_fill(HBitmap *hb, const HBitmapBenchOpts *opts)
+{
+    uint64_t cluster = 1ULL << opts->granularity;
+    uint64_t stride = (opts->sparse ? 4096 : 64) * cluster;
+    uint64_t run = (opts->sparse ? 1 : 32) * cluster;
+    uint64_t offset;
+
+    for (offset = 0; offset < opts->disk_size; offset += stride) {
+        hbitmap_set(hb, offset, MIN(run, opts->disk_size - offset));
+    }
+}
+
+static void test_hbitmap_speed(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    uint64_t bits = opts->disk_size >> opts->granularity;
+    uint64_t reps = MAX(TOTAL_BITS / bits, 1);
+    HBitmap *dst = hbitmap_alloc(opts->disk_size, opts->granularity);
+    HBitmap *src = hbitmap_alloc(opts->disk_size, opts->granularity);
+    uint64_t found = 0;
+    uint64_t i;
+
+    bench_fill(dst, &(HBitmapBenchOpts) {
+        .disk_size = opts->disk_size, .granularity = opts->granularity,
+    });
+    bench_fill(src, opts);
+
+    g_test_timer_start();
+    for (i = 0; i < reps; i++) {
+        switch (opts->op) {
+        case BENCH_MERGE:
+            g_assert(hbitmap_merge(dst, src, dst));
+            found += hbitmap_count(dst);
+            break;
+        case BENCH_NEXT_DIRTY_AREA: {
+            int64_t offset = 0, count;
+
+            /* The way block-copy looks for the next area to copy */
+            while (hbitmap_next_dirty_area(src, offset, opts->disk_size,
+                                           64 * MiB, &offset, &count)) {
+                found += count;
+                offset += count;
+            }
+            break;
+        }
+        case BENCH_ITER: {
+            HBitmapIter hbi;
+
+            hbitmap_iter_init(&hbi, src, 0);
+            while (hbitmap_iter_next(&hbi) >= 0) {
+                found++;
+            }
+            break;
+        }
+        }
+    }
+    g_test_timer_elapsed();
+
+    g_assert_cmpint(found, >, 0);
+    g_test_message("hbitmap %s: %.3f ms per pass, %.2f Gbit/s",
+                   opts->name, g_test_timer_last() * 1000 / reps,
+                   bits * reps / g_test_timer_last() / 1e9);
+
+    hbitmap_free(dst);
+    hbitmap_free(src);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        uint64_t disk_size;
+        int granularity;
+    } sizes[] = {
+        { "64G-64k", 64 * GiB, 16 },
+        { "1T-64k", 1 * TiB, 16 },
+        { "4T-64k", 4 * TiB, 16 },
+        { "1T-4k", 1 * TiB, 12 },
+    };
+    static const struct {
+        const char *name;
+        HBitmapBenchOp op;
+        bool sparse;
+    } ops[] = {
+        { "merge/dense", BENCH_MERGE, false },
+        { "merge/sparse", BENCH_MERGE, true },
+        { "next-dirty-area/dense", BENCH_NEXT_DIRTY_AREA, false },
+        { "next-dirty-area/sparse", BENCH_NEXT_DIRTY_AREA, true },
+        { "iter/dense", BENCH_ITER, false },
+        { "iter/sparse", BENCH_ITER, true },
+    };
+    int i, j;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(ops); i++) {
+        for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+            HBitmapBenchOpts *opts = g_new0(HBitmapBenchOpts, 1);
+            char *path;
+
+            g_snprintf(opts->name, sizeof(opts->name), "%s/%s",
+                       ops[i].name, sizes[j].name);
+            opts->op = ops[i].op;
+            opts->sparse = ops[i].sparse;
+            opts->disk_size = sizes[j].disk_size;
+            opts->granularity = sizes[j].granularity;
+
+            path = g_strdup_printf("/hbitmap/benchmark/%s", opts->name);
+            g_test_add_data_func_full(path, opts, test_hbitmap_speed,
+                                      g_free);
+            g_free(path);
+        }
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,240 @@
+/*
+ * Multifd receive side decompression benchmark
+ *
+ * Measures how fast the recv_pages method of a compression method places
+ * a multifd packet into guest pages.  The pages of the packet are mapped
+ * to guest memory by multifd_iov_from_offsets(), the function the receive
+ * side uses, or one page per entry as the receive side did before pages
+ * were merged.  The packets are produced by the send methods of the same
+ * compression method, and read back from a buffer channel.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/module.h"
+#include "qapi/error.h"
+#include "exec/target_page.h"
+#include "io/channel-buffer.h"
+#include "../migration/migration.h"
+#include "../migration/multifd.h"
+#include "../migration/multifd-iov.h"
+
+/* Same as MULTIFD_PACKET_SIZE with 4KiB target pages */
+#define PACKET_SIZE (512 * KiB)
+#define PAGE_SIZE_BENCH (4 * KiB)
+#define PAGES (PACKET_SIZE / PAGE_SIZE_BENCH)
+#define BLOCK_SIZE (64 * MiB)
+/* Packets of one stream, received between recv_setup and recv_cleanup */
+#define STREAM_PACKETS 64
+
+typedef struct MultiFDRecvOpts {
+    const char *method;
+    MultiFDCompression compression;
+    uint32_t flag;
+    bool coalesce;
+} MultiFDRecvOpts;
+
+typedef struct MultiFDRecvBench {
+    uint8_t *block;
+    uint64_t offset[PAGES];
+    struct iovec iov[PAGES];
+    MultiFDPages_t pages;
+    QIOChannelBuffer *bioc;
+    uint32_t packet_size[STREAM_PACKETS];
+    size_t zlen;
+} MultiFDRecvBench;
+
+static MultiFDMethods *multifd_ops[MULTIFD_COMPRESSION__MAX];
+
+/*
+ * The methods register themselves with multifd.c, which is not linked
+ * in: keep them here instead.
+ */
+void multifd_register_ops(int method, MultiFDMethods *ops)
+{
+    assert(0 < method && method < MULTIFD_COMPRESSION__MAX);
+    multifd_ops[method] = ops;
+}
+
+size_t qemu_target_page_size(void)
+{
+    return PAGE_SIZE_BENCH;
+}
+
+int migrate_multifd_zlib_level(void)
+{
+    return 1;
+}
+
+int migrate_multifd_zstd_level(void)
+{
+    return 1;
+}
+
+/*
+ * Pick the pages of the packet in bitmap order, as the sender does, in
+ * runs of 1 to 32 dirty pages separated by clean ones.
+ */
+static void fill_offsets(MultiFDRecvBench *b)
+{
+    uint64_t page = 0;
+    int i = 0;
+
+    while (i < PAGES) {
+        int run = g_test_rand_int_range(1, 33);
+
+        for (; run && i < PAGES; run--, i++) {
+            b->offset[i] = cpu_to_be64(page++ * PAGE_SIZE_BENCH);
+        }
+        page += g_test_rand_int_range(1, 9);
+    }
+    g_assert(page * PAGE_SIZE_BENCH <= BLOCK_SIZE);
+}
+
+/* Half of each page is zero, the rest a few distinct bytes */
+static uint8_t *fill_pages(size_t size)
+{
+    uint8_t *pages = g_malloc0(size);
+    size_t i;
+
+    for (i = 0; i < size; i += 2) {
+        if ((i % PAGE_SIZE_BENCH) < PAGE_SIZE_BENCH / 2) {
+            pages[i] = g_test_rand_int_range(0, 16);
+        }
+    }
+    return pages;
+}
+
+/* Compress a stream of packets into b->bioc with the send methods */
+static void send_stream(MultiFDRecvBench *b, const MultiFDRecvOpts *opts)
+{
+    MultiFDMethods *ops = multifd_ops[opts->compression];
+    g_autofree uint8_t *pages = fill_pages(STREAM_PACKETS * PACKET_SIZE);
+    g_autofree struct iovec *iov = g_new(struct iovec, PAGES);
+    MultiFDPages_t send_pages = { .used = PAGES, .allocated = PAGES,
+                                  .iov = iov };
+    MultiFDSendParams p = { .name = (char *)"bench",
+                            .c = QIO_CHANNEL(b->bioc),
+                            .pages = &send_pages };
+    int i, j;
+
+    ops->send_setup(&p, &error_abort);
+    for (i = 0; i < STREAM_PACKETS; i++) {
+        for (j = 0; j < PAGES; j++) {
+            iov[j].iov_base = pages + (size_t)i * PACKET_SIZE +
+                              j * PAGE_SIZE_BENCH;
+            iov[j].iov_len = PAGE_SIZE_BENCH;
+        }
+        p.flags = 0;
+        g_assert(ops->send_prepare(&p, PAGES, &error_abort) == 0);
+        g_assert(p.flags == opts->flag);
+        g_assert(ops->send_write(&p, PAGES, &error_abort) == 0);
+        b->packet_size[i] = p.next_packet_size;
+    }
+    ops->send_cleanup(&p, &error_abort);
+    b->zlen = b->bioc->usage;
+}
+
+/* Map the pages of the packet to the block, as multifd_recv_unfill_packet */
+static uint32_t map_pages(MultiFDRecvBench *b, bool coalesce)
+{
+    int i;
+
+    if (coalesce) {
+        return multifd_iov_from_offsets(b->iov, b->block, BLOCK_SIZE,
+                                        b->offset, PAGES, PAGE_SIZE_BENCH,
+                                        &error_abort);
+    }
+
+    for (i = 0; i < PAGES; i++) {
+        b->iov[i].iov_base = b->block + be64_to_cpu(b->offset[i]);
+        b->iov[i].iov_len = PAGE_SIZE_BENCH;
+    }
+    return PAGES;
+}
+
+static void test_recv_speed(const void *opaque)
+{
+    const MultiFDRecvOpts *opts = opaque;
+    MultiFDMethods *ops = multifd_ops[opts->compression];
+    MultiFDRecvBench b = {};
+    MultiFDRecvParams p = {};
+    const size_t total = 2 * GiB;
+    size_t remain;
+    int i;
+
+    b.block = g_malloc0(BLOCK_SIZE);
+    b.bioc = qio_channel_buffer_new(STREAM_PACKETS * PACKET_SIZE);
+    b.pages.used = PAGES;
+    b.pages.allocated = PAGES;
+    b.pages.iov = b.iov;
+    fill_offsets(&b);
+    send_stream(&b, opts);
+
+    p.name = (char *)"bench";
+    p.c = QIO_CHANNEL(b.bioc);
+    p.pages = &b.pages;
+
+    g_test_timer_start();
+    for (remain = total; remain; ) {
+        /* Every stream is received from its start, on a fresh channel */
+        b.bioc->offset = 0;
+        g_assert(ops->recv_setup(&p, &error_abort) == 0);
+        for (i = 0; i < STREAM_PACKETS && remain; i++) {
+            p.iovs_num = map_pages(&b, opts->coalesce);
+            p.flags = opts->flag;
+            p.next_packet_size = b.packet_size[i];
+            g_assert(ops->recv_pages(&p, PAGES, &error_abort) == 0);
+            remain -= PACKET_SIZE;
+        }
+        ops->recv_cleanup(&p);
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("multifd recv(%s): %s, %d entries, ratio %.2f, "
+                   "%.2f MB/sec", opts->method,
+                   opts->coalesce ? "per run" : "per page", p.iovs_num,
+                   (double)STREAM_PACKETS * PACKET_SIZE / b.zlen,
+                   total / MiB / g_test_timer_last());
+
+    object_unref(OBJECT(b.bioc));
+    g_free(b.block);
+}
+
+int main(int argc, char **argv)
+{
+    static const MultiFDRecvOpts zlib_page = {
+        "zlib", MULTIFD_COMPRESSION_ZLIB, MULTIFD_FLAG_ZLIB, false
+    };
+    static const MultiFDRecvOpts zlib_run = {
+        "zlib", MULTIFD_COMPRESSION_ZLIB, MULTIFD_FLAG_ZLIB, true
+    };
+#ifdef CONFIG_ZSTD
+    static const MultiFDRecvOpts zstd_page = {
+        "zstd", MULTIFD_COMPRESSION_ZSTD, MULTIFD_FLAG_ZSTD, false
+    };
+    static const MultiFDRecvOpts zstd_run = {
+        "zstd", MULTIFD_COMPRESSION_ZSTD, MULTIFD_FLAG_ZSTD, true
+    };
+#endif
+
+    module_call_init(MODULE_INIT_QOM);
+    module_call_init(MODULE_INIT_MIGRATION);
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/multifd/benchmark/recv/zlib/per-page",
+                         &zlib_page, test_recv_speed);
+    g_test_add_data_func("/multifd/benchmark/recv/zlib/per-run",
+                         &zlib_run, test_recv_speed);
+#ifdef CONFIG_ZSTD
+    g_test_add_data_func("/multifd/benchmark/recv/zstd/per-page",
+                         &zstd_page, test_recv_speed);
+    g_test_add_data_func("/multifd/benchmark/recv/zstd/per-run",
+                         &zstd_run, test_recv_speed);
+#endif
+
+    return g_test_run();
+}
@@ -0,0 +1,249 @@
+/*
+ * Net packet delivery benchmark
+ *
+ * Measures the cost of sending packets from one net client to its peer
+ * through the real send path of net/net.c and net/queue.c, both when
+ * the peer takes them right away and when they have to be queued and
+ * flushed later, one by one or in batches.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "monitor/monitor.h"
+#include "net/net.h"
+#include "net/filter.h"
+#include "net/colo-compare.h"
+#include "sysemu/runstate.h"
+#include "../net/clients.h"
+
+#define PKT_SIZE 1514
+#define BATCH 64
+#define TOTAL_PKTS (8 * 1000 * 1000)
+
+typedef enum NetQueueBenchMode {
+    BENCH_SEND,
+    BENCH_SENDV,
+    BENCH_APPEND,
+    BENCH_BATCH,
+    BENCH_APPEND_BATCH,
+} NetQueueBenchMode;
+
+typedef struct NetQueueBenchOpts {
+    const char *name;
+    NetQueueBenchMode mode;
+} NetQueueBenchOpts;
+
+static bool receiver_ready;
+static int batch_limit;
+static uint64_t delivered;
+
+/*
+ * The bench links net.c, hub.c and queue.c; these come from the rest of
+ * the emulator, and none of them is reached by the send path.
+ */
+bool runstate_is_running(void)
+{
+    return true;
+}
+
+int monitor_printf(Monitor *mon, const char *fmt, ...)
+{
+    g_assert_not_reached();
+}
+
+void colo_compare_cleanup(void)
+{
+}
+
+#define NET_INIT_STUB(fn)                                               \
+int fn(const Netdev *netdev, const char *name, NetClientState *peer,    \
+       Error **errp)                                                    \
+{                                                                       \
+    g_assert_not_reached();                                             \
+}
+
+NET_INIT_STUB(net_init_tap)
+NET_INIT_STUB(net_init_socket)
+#ifdef CONFIG_SLIRP
+NET_INIT_STUB(net_init_slirp)
+#endif
+#ifdef CONFIG_VDE
+NET_INIT_STUB(net_init_vde)
+#endif
+#ifdef CONFIG_NETMAP
+NET_INIT_STUB(net_init_netmap)
+#endif
+#ifdef CONFIG_AF_XDP
+NET_INIT_STUB(net_init_af_xdp)
+#endif
+#ifdef CONFIG_NET_BRIDGE
+NET_INIT_STUB(net_init_bridge)
+#endif
+#ifdef CONFIG_VHOST_NET_USER
+NET_INIT_STUB(net_init_vhost_user)
+#endif
+#ifdef CONFIG_VHOST_NET_VDPA
+NET_INIT_STUB(net_init_vhost_vdpa)
+#endif
+#ifdef CONFIG_L2TPV3
+NET_INIT_STUB(net_init_l2tpv3)
+#endif
+
+ssize_t qemu_netfilter_receive(NetFilterState *nf,
+                               NetFilterDirection direction,
+                               NetClientState *sender,
+                               unsigned flags,
+                               const struct iovec *iov,
+                               int iovcnt,
+                               NetPacketSent *sent_cb)
+{
+    g_assert_not_reached();
+}
+
+static bool bench_can_receive(NetClientState *nc)
+{
+    return receiver_ready;
+}
+
+static ssize_t bench_receive(NetClientState *nc, const uint8_t *buf,
+                             size_t size)
+{
+    delivered += size;
+    return size;
+}
+
+static ssize_t bench_receive_iov(NetClientState *nc, const struct iovec *iov,
+                                 int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+
+    delivered += size;
+    return size;
+}
+
+static int bench_receive_batch(NetClientState *nc, const struct iovec *pkts,
+                               int count)
+{
+    int i;
+
+    count = MIN(count, batch_limit);
+    for (i = 0; i < count; i++) {
+        delivered += pkts[i].iov_len;
+    }
+    return count;
+}
+
+static NetClientInfo bench_info = {
+    .type = NET_CLIENT_DRIVER_SOCKET,
+    .size = sizeof(NetClientState),
+    .can_receive = bench_can_receive,
+    .receive = bench_receive,
+    .receive_iov = bench_receive_iov,
+    .receive_batch = bench_receive_batch,
+};
+
+static void bench_sent(NetClientState *nc, ssize_t len)
+{
+}
+
+static void bench_flush(NetClientState *peer)
+{
+    receiver_ready = true;
+    peer->receive_disabled = 0;
+    g_assert(qemu_net_queue_flush(peer->incoming_queue));
+}
+
+static void test_net_queue_speed(const void *opaque)
+{
+    const NetQueueBenchOpts *opts = opaque;
+    NetClientState *sender, *peer;
+    struct iovec pkts[BATCH];
+    uint8_t *buf = g_malloc0(PKT_SIZE * BATCH);
+    int done, i;
+
+    /* A pair of filter-less clients */
+    sender = qemu_new_net_client(&bench_info, NULL, "bench", "sender");
+    peer = qemu_new_net_client(&bench_info, sender, "bench", "peer");
+
+    for (i = 0; i < BATCH; i++) {
+        pkts[i].iov_base = buf + i * PKT_SIZE;
+        pkts[i].iov_len = PKT_SIZE;
+    }
+    delivered = 0;
+
+    g_test_timer_start();
+    for (done = 0; done < TOTAL_PKTS; done += BATCH) {
+        switch (opts->mode) {
+        case BENCH_SEND:
+            receiver_ready = true;
+            for (i = 0; i < BATCH; i++) {
+                qemu_send_packet_async(sender, pkts[i].iov_base, PKT_SIZE,
+                                       NULL);
+            }
+            break;
+        case BENCH_SENDV:
+            receiver_ready = true;
+            for (i = 0; i < BATCH; i++) {
+                qemu_sendv_packet_async(sender, &pkts[i], 1, NULL);
+            }
+            break;
+        case BENCH_APPEND:
+            receiver_ready = false;
+            for (i = 0; i < BATCH; i++) {
+                qemu_sendv_packet_async(sender, &pkts[i], 1, bench_sent);
+            }
+            bench_flush(peer);
+            break;
+        case BENCH_BATCH:
+            receiver_ready = true;
+            batch_limit = BATCH;
+            qemu_send_packet_batch_async(sender, pkts, BATCH, bench_sent);
+            break;
+        case BENCH_APPEND_BATCH:
+            /* The peer stops half way, the rest is queued and flushed */
+            receiver_ready = true;
+            batch_limit = BATCH / 2;
+            qemu_send_packet_batch_async(sender, pkts, BATCH, bench_sent);
+            bench_flush(peer);
+            break;
+        }
+    }
+    g_test_timer_elapsed();
+
+    g_assert_cmpint(delivered, ==, (uint64_t)TOTAL_PKTS * PKT_SIZE);
+    g_test_message("net queue %s: %.2f Mpps",
+                   opts->name, TOTAL_PKTS / g_test_timer_last() / 1e6);
+
+    qemu_del_net_client(peer);
+    qemu_del_net_client(sender);
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    static const NetQueueBenchOpts send = { "send", BENCH_SEND };
+    static const NetQueueBenchOpts sendv = { "sendv", BENCH_SENDV };
+    static const NetQueueBenchOpts append = { "append", BENCH_APPEND };
+    static const NetQueueBenchOpts batch = { "batch", BENCH_BATCH };
+    static const NetQueueBenchOpts append_batch = {
+        "append-batch", BENCH_APPEND_BATCH
+    };
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/net/benchmark/queue/send",
+                         &send, test_net_queue_speed);
+    g_test_add_data_func("/net/benchmark/queue/sendv",
+                         &sendv, test_net_queue_speed);
+    g_test_add_data_func("/net/benchmark/queue/append",
+                         &append, test_net_queue_speed);
+    g_test_add_data_func("/net/benchmark/queue/batch",
+                         &batch, test_net_queue_speed);
+    g_test_add_data_func("/net/benchmark/queue/append-batch",
+                         &append_batch, test_net_queue_speed);
+
+    return g_test_run();
+}
@@ -35,6 +35,28 @@
 #include "qemu/bitops.h"
 #include "libqos/malloc.h"
 #include "libqos/e1000e.h"
+#include "qapi/qmp/qdict.h"
+
+/*
+ * With an IOThread the ring is processed after the tail write returns, and
+ * a pending MSI-X bit may be left from an earlier packet: wait for the
+ * device to set @dd in the status dword at @off of the descriptor.
+ */
+static void e1000e_wait_descr_done(uint64_t descr_addr, size_t off,
+                                   uint32_t dd)
+{
+    guint64 end_time = g_get_monotonic_time() + 5 * G_TIME_SPAN_SECOND;
+    uint32_t status;
+
+    for (;;) {
+        memread(descr_addr + off, &status, sizeof(status));
+        if (le32_to_cpu(status) & dd) {
+            return;
+        }
+        g_assert(g_get_monotonic_time() < end_time);
+        clock_step(10000);
+    }
+}
 
 static void e1000e_send_verify(QE1000E *d, int *test_sockets, QGuestAllocator *alloc)
 {
@@ -67,6 +89,7 @@ static void e1000e_send_verify(QE1000E *d, int *test_sockets, QGuestAllocator *a
     char buffer[64];
     int ret;
     uint32_t recv_len;
+    uint64_t descr_addr;
 
     /* Prepare test data buffer */
     uint64_t data = guest_alloc(alloc, data_len);
@@ -82,11 +105,15 @@ static void e1000e_send_verify(QE1000E *d, int *test_sockets, QGuestAllocator *a
                                    data_len);
 
     /* Put descriptor to the ring */
-    e1000e_tx_ring_push(d, &descr);
+    descr_addr = e1000e_tx_ring_push(d, &descr);
 
     /* Wait for TX WB interrupt */
     e1000e_wait_isr(d, E1000E_TX0_MSG_ID);
 
+    e1000e_wait_descr_done(descr_addr, offsetof(typeof(descr), upper),
+                           dsta_dd);
+    memread(descr_addr, &descr, sizeof(descr));
+
     /* Check DD bit */
     g_assert_cmphex(le32_to_cpu(descr.upper.data) & dsta_dd, ==, dsta_dd);
 
@@ -101,7 +128,12 @@ static void e1000e_send_verify(QE1000E *d, int *test_sockets, QGuestAllocator *a
     guest_free(alloc, data);
 }
 
-static void e1000e_receive_verify(QE1000E *d, int *test_sockets, QGuestAllocator *alloc)
+/*
+ * With @stop, the packet is sent while the VM is stopped, and must only
+ * reach the guest after 'cont'.
+ */
+static void e1000e_do_receive_verify(QE1000E *d, int *test_sockets,
+                                     QGuestAllocator *alloc, bool stop)
 {
     union {
         struct {
@@ -144,10 +176,8 @@ static void e1000e_receive_verify(QE1000E *d, int *test_sockets, QGuestAllocator
     static const int data_len = 64;
     char buffer[64];
     int ret;
-
-    /* Send a dummy packet to device's socket*/
-    ret = iov_send(test_sockets[0], iov, 2, 0, sizeof(len) + sizeof(test));
-    g_assert_cmpint(ret, == , sizeof(test) + sizeof(len));
+    uint64_t descr_addr;
+    QDict *rsp;
 
     /* Prepare test data buffer */
     uint64_t data = guest_alloc(alloc, data_len);
@@ -156,12 +186,39 @@ static void e1000e_receive_verify(QE1000E *d, int *test_sockets, QGuestAllocator
     memset(&descr, 0, sizeof(descr));
     descr.read.buffer_addr = cpu_to_le64(data);
 
-    /* Put descriptor to the ring */
-    e1000e_rx_ring_push(d, &descr);
+    if (stop) {
+        /* The device has a buffer, but must not fill it while stopped */
+        descr_addr = e1000e_rx_ring_push(d, &descr);
+        rsp = qmp("{ 'execute' : 'stop'}");
+        qobject_unref(rsp);
+
+        ret = iov_send(test_sockets[0], iov, 2, 0, sizeof(len) + sizeof(test));
+        g_assert_cmpint(ret, == , sizeof(test) + sizeof(len));
+
+        /* Make sure the packet gets queued in QEMU before 'cont' */
+        rsp = qmp("{ 'execute' : 'query-status'}");
+        qobject_unref(rsp);
+        memread(descr_addr, &descr, sizeof(descr));
+        g_assert_cmphex(le32_to_cpu(descr.wb.upper.status_error) &
+            esta_dd, ==, 0);
+        rsp = qmp("{ 'execute' : 'cont'}");
+        qobject_unref(rsp);
+    } else {
+        /* Send a dummy packet to device's socket*/
+        ret = iov_send(test_sockets[0], iov, 2, 0, sizeof(len) + sizeof(test));
+        g_assert_cmpint(ret, == , sizeof(test) + sizeof(len));
+
+        /* Put descriptor to the ring */
+        descr_addr = e1000e_rx_ring_push(d, &descr);
+    }
 
     /* Wait for TX WB interrupt */
     e1000e_wait_isr(d, E1000E_RX0_MSG_ID);
 
+    e1000e_wait_descr_done(descr_addr, offsetof(typeof(descr), wb.upper),
+                           esta_dd);
+    memread(descr_addr, &descr, sizeof(descr));
+
     /* Check DD bit */
     g_assert_cmphex(le32_to_cpu(descr.wb.upper.status_error) &
         esta_dd, ==, esta_dd);
@@ -174,6 +231,12 @@ static void e1000e_receive_verify(QE1000E *d, int *test_sockets, QGuestAllocator
     guest_free(alloc, data);
 }
 
+static void e1000e_receive_verify(QE1000E *d, int *test_sockets,
+                                  QGuestAllocator *alloc)
+{
+    e1000e_do_receive_verify(d, test_sockets, alloc, false);
+}
+
 static void test_e1000e_init(void *obj, void *data, QGuestAllocator * alloc)
 {
     /* init does nothing */
@@ -240,6 +303,59 @@ static void test_e1000e_hotplug(void *obj, void *data, QGuestAllocator * alloc)
     qpci_unplug_acpi_device_test(qts, "e1000e_net", 0x06);
 }
 
+/*
+ * The same transfers with the rings, the moderation timers and the socket
+ * backend in an IOThread, then across a stop/cont of the VM.
+ */
+static void test_e1000e_iothread_transfers(void *obj, void *data,
+                                           QGuestAllocator *alloc)
+{
+    QE1000E_PCI *e1000e = obj;
+    QE1000E *d = &e1000e->e1000e;
+    QOSGraphObject *e_object = obj;
+    QPCIDevice *dev = e_object->get_driver(e_object, "pci-device");
+    int i;
+
+    /* FIXME: add spapr support */
+    if (qpci_check_buggy_msi(dev)) {
+        return;
+    }
+
+    for (i = 0; i < 64; i++) {
+        e1000e_send_verify(d, data, alloc);
+        e1000e_receive_verify(d, data, alloc);
+    }
+}
+
+static void test_e1000e_iothread_stop_cont(void *obj, void *data,
+                                           QGuestAllocator *alloc)
+{
+    QE1000E_PCI *e1000e = obj;
+    QE1000E *d = &e1000e->e1000e;
+    QOSGraphObject *e_object = obj;
+    QPCIDevice *dev = e_object->get_driver(e_object, "pci-device");
+
+    /* FIXME: add spapr support */
+    if (qpci_check_buggy_msi(dev)) {
+        return;
+    }
+
+    e1000e_do_receive_verify(d, data, alloc, true);
+    e1000e_send_verify(d, data, alloc);
+    e1000e_receive_verify(d, data, alloc);
+}
+
+static void test_e1000e_iothread_hotplug(void *obj, void *data,
+                                         QGuestAllocator *alloc)
+{
+    QTestState *qts = global_qtest;  /* TODO: get rid of global_qtest here */
+
+    qtest_qmp_device_add(qts, "e1000e", "e1000e_net",
+                         "{'addr': '0x06', 'netdev': 'hs1',"
+                         " 'iothread': 'thread0'}");
+    qpci_unplug_acpi_device_test(qts, "e1000e_net", 0x06);
+}
+
 static void data_test_clear(void *sockets)
 {
     int *test_sockets = sockets;
@@ -263,6 +379,35 @@ static void *data_test_init(GString *cmd_line, void *arg)
     return test_sockets;
 }
 
+static void data_test_clear_iothread(void *sockets)
+{
+    int *test_sockets = sockets;
+
+    close(test_sockets[2]);
+    close(test_sockets[3]);
+    data_test_clear(sockets);
+}
+
+/* hs1 is the backend of the device plugged by the hotplug test */
+static void *data_test_init_iothread(GString *cmd_line, void *arg)
+{
+    int *test_sockets = g_new(int, 4);
+    int ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, test_sockets);
+    g_assert_cmpint(ret, != , -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, test_sockets + 2);
+    g_assert_cmpint(ret, != , -1);
+
+    g_string_append_printf(cmd_line, " -object iothread,id=thread0 "
+                           "-netdev socket,fd=%d,id=hs0 "
+                           "-netdev socket,fd=%d,id=hs1 ",
+                           test_sockets[1], test_sockets[3]);
+
+    g_test_queue_destroy(data_test_clear_iothread, test_sockets);
+    return test_sockets;
+}
+
 static void register_e1000e_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -275,6 +420,15 @@ static void register_e1000e_test(void)
     qos_add_test("multiple_transfers", "e1000e",
                       test_e1000e_multiple_transfers, &opts);
     qos_add_test("hotplug", "e1000e", test_e1000e_hotplug, &opts);
+
+    opts.before = data_test_init_iothread;
+    opts.edge.extra_device_opts = "iothread=thread0";
+    qos_add_test("iothread/multiple_transfers", "e1000e",
+                 test_e1000e_iothread_transfers, &opts);
+    qos_add_test("iothread/stop_cont", "e1000e",
+                 test_e1000e_iothread_stop_cont, &opts);
+    qos_add_test("iothread/hotplug", "e1000e",
+                 test_e1000e_iothread_hotplug, &opts);
 }
 
 libqos_init(register_e1000e_test);
@@ -83,7 +83,11 @@ static uint32_t e1000e_macreg_read(QE1000E *d, uint32_t reg)
     return qpci_io_readl(&d_pci->pci_dev, d_pci->mac_regs, reg);
 }
 
-void e1000e_tx_ring_push(QE1000E *d, void *descr)
+/*
+ * Returns the guest address of the descriptor, for callers that read its
+ * write-back again once the device has processed it.
+ */
+uint64_t e1000e_tx_ring_push(QE1000E *d, void *descr)
 {
     QE1000E_PCI *d_pci = container_of(d, QE1000E_PCI, e1000e);
     uint32_t tail = e1000e_macreg_read(d, E1000E_TDT);
@@ -96,9 +100,12 @@ void e1000e_tx_ring_push(QE1000E *d, void *descr)
     /* Read WB data for the packet transmitted */
     qtest_memread(d_pci->pci_dev.bus->qts, d->tx_ring + tail * E1000E_TXD_LEN,
                   descr, E1000E_TXD_LEN);
+
+    return d->tx_ring + tail * E1000E_TXD_LEN;
 }
 
-void e1000e_rx_ring_push(QE1000E *d, void *descr)
+/* Same as e1000e_tx_ring_push(), for the RX ring */
+uint64_t e1000e_rx_ring_push(QE1000E *d, void *descr)
 {
     QE1000E_PCI *d_pci = container_of(d, QE1000E_PCI, e1000e);
     uint32_t tail = e1000e_macreg_read(d, E1000E_RDT);
@@ -111,6 +118,8 @@ void e1000e_rx_ring_push(QE1000E *d, void *descr)
     /* Read WB data for the packet received */
     qtest_memread(d_pci->pci_dev.bus->qts, d->rx_ring + tail * E1000E_RXD_LEN,
                   descr, E1000E_RXD_LEN);
+
+    return d->rx_ring + tail * E1000E_RXD_LEN;
 }
 
 static void e1000e_foreach_callback(QPCIDevice *dev, int devfn, void *data)
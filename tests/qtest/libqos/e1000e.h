@@ -47,7 +47,7 @@ struct QE1000E_PCI {
 };
 
 void e1000e_wait_isr(QE1000E *d, uint16_t msg_id);
-void e1000e_tx_ring_push(QE1000E *d, void *descr);
-void e1000e_rx_ring_push(QE1000E *d, void *descr);
+uint64_t e1000e_tx_ring_push(QE1000E *d, void *descr);
+uint64_t e1000e_rx_ring_push(QE1000E *d, void *descr);
 
 #endif
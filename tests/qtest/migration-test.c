@@ -15,6 +15,7 @@
 #include "libqos/libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -474,6 +475,8 @@ typedef struct {
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
     bool use_dirty_ring;
+    /* Send the urgent postcopy pages on a separate channel */
+    bool postcopy_preempt;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -654,6 +657,7 @@ static void test_migrate_end(QTestState *from, QTestState *to, bool test_dest)
 
     cleanup("bootsect");
     cleanup("migsocket");
+    cleanup("migfile");
     cleanup("src_serial");
     cleanup("dest_serial");
 }
@@ -673,6 +677,11 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (args->postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -719,6 +728,20 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_preempt = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -1066,6 +1089,44 @@ static void test_migrate_fd_proto(void)
     test_migrate_end(from, to, true);
 }
 
+static void test_precopy_file_mapped_ram(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    /* The whole file has to be written before the destination reads it */
+    migrate_qmp(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+}
+
 static void do_test_validate_uuid(MigrateStart *args, bool should_fail)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -1394,6 +1455,112 @@ static void test_multifd_tcp_cancel(void)
     test_migrate_end(from, to2, true);
 }
 
+static void calc_dirty_rate(QTestState *who, const char *mode)
+{
+    qobject_unref(wait_command(who,
+                               "{ 'execute': 'calc-dirty-rate',"
+                               "  'arguments': { 'calc-time': 1,"
+                               "                 'mode': %s }}", mode));
+}
+
+static QDict *query_dirty_rate_measured(QTestState *who)
+{
+    QDict *rsp;
+
+    for (;;) {
+        rsp = wait_command(who, "{ 'execute': 'query-dirty-rate' }");
+        if (g_str_equal(qdict_get_str(rsp, "status"), "measured")) {
+            return rsp;
+        }
+        qobject_unref(rsp);
+        usleep(1000 * 100);
+    }
+}
+
+/*
+ * Measure the dirty rate of the running guest in @mode and return the
+ * sum of the rates reported in the per-vcpu or per-RAMBlock list
+ * @list_key, which must be present.
+ */
+static int64_t check_dirty_rate(QTestState *who, const char *mode,
+                                const char *list_key)
+{
+    QDict *rsp;
+    QList *rates;
+    QListEntry *entry;
+    int64_t sum = 0;
+
+    calc_dirty_rate(who, mode);
+    rsp = query_dirty_rate_measured(who);
+
+    g_assert_cmpstr(qdict_get_str(rsp, "mode"), ==, mode);
+    g_assert(qdict_haskey(rsp, "dirty-rate"));
+
+    rates = qdict_get_qlist(rsp, list_key);
+    g_assert(rates);
+    g_assert(!qlist_empty(rates));
+    QLIST_FOREACH_ENTRY(rates, entry) {
+        QDict *rate = qobject_to(QDict, qlist_entry_obj(entry));
+
+        g_assert(qdict_haskey(rate, "id"));
+        g_assert_cmpint(qdict_get_int(rate, "dirty-rate"), >=, 0);
+        sum += qdict_get_int(rate, "dirty-rate");
+    }
+    g_assert_cmpint(sum, <=, qdict_get_int(rsp, "dirty-rate"));
+
+    qobject_unref(rsp);
+    return sum;
+}
+
+static void test_dirty_rate_common(bool dirty_ring)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+
+    args->use_dirty_ring = dirty_ring;
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    /* Wait for the guest to start dirtying its memory */
+    wait_for_serial("src_serial");
+
+    calc_dirty_rate(from, "page-sampling");
+    rsp = query_dirty_rate_measured(from);
+    g_assert_cmpstr(qdict_get_str(rsp, "mode"), ==, "page-sampling");
+    g_assert(!qdict_haskey(rsp, "vcpu-dirty-rate"));
+    g_assert(!qdict_haskey(rsp, "ramblock-dirty-rate"));
+    qobject_unref(rsp);
+
+    /* The guest touches every page of its test area in a loop */
+    g_assert_cmpint(check_dirty_rate(from, "dirty-bitmap",
+                                     "ramblock-dirty-rate"), >, 0);
+
+    if (dirty_ring) {
+        g_assert_cmpint(check_dirty_rate(from, "dirty-ring",
+                                         "vcpu-dirty-rate"), >, 0);
+    } else {
+        rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                              "  'arguments': { 'calc-time': 1,"
+                              "                 'mode': 'dirty-ring' }}");
+        g_assert(qdict_haskey(rsp, "error"));
+        qobject_unref(rsp);
+    }
+
+    test_migrate_end(from, to, false);
+}
+
+static void test_dirty_rate(void)
+{
+    test_dirty_rate_common(false);
+}
+
+static void test_dirty_rate_dirty_ring(void)
+{
+    test_dirty_rate_common(true);
+}
+
 static bool kvm_dirty_ring_supported(void)
 {
 #if defined(__linux__) && defined(HOST_X86_64)
@@ -1466,12 +1633,15 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt/unix", test_postcopy_preempt);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/precopy/file/mapped-ram",
+                   test_precopy_file_mapped_ram);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
     qtest_add_func("/migration/validate_uuid_src_not_set",
@@ -1487,9 +1657,13 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
 #endif
 
+    qtest_add_func("/migration/dirty_rate", test_dirty_rate);
+
     if (kvm_dirty_ring_supported()) {
         qtest_add_func("/migration/dirty_ring",
                        test_precopy_unix_dirty_ring);
+        qtest_add_func("/migration/dirty_rate/dirty_ring",
+                       test_dirty_rate_dirty_ring);
     }
 
     ret = g_test_run();
@@ -13,6 +13,7 @@
 #include "libqos/libqtest.h"
 #include "libqos/qgraph.h"
 #include "libqos/pci.h"
+#include "qapi/qmp/qdict.h"
 #include "include/block/nvme.h"
 
 typedef struct QNvme QNvme;
@@ -142,6 +143,394 @@ static void nvmetest_pmr_reg_test(void *obj, void *data, QGuestAllocator *alloc)
     qpci_iounmap(pdev, pmr_bar);
 }
 
+#define NVMETEST_TIMEOUT_US (30 * 1000 * 1000)
+#define NVMETEST_AQ_SIZE 8
+#define NVMETEST_IOSQ_SIZE 16
+#define NVMETEST_IOCQ_SIZE 8
+
+typedef struct NvmeTestQueue {
+    uint64_t sq, cq;
+    uint16_t sq_size, cq_size;
+    uint16_t qid, tail, head;
+    bool phase;
+} NvmeTestQueue;
+
+static void nvmetest_submit(QTestState *qts, NvmeTestQueue *q, NvmeCmd *cmd)
+{
+    cmd->cid = cpu_to_le16(q->tail);
+    qtest_memwrite(qts, q->sq + q->tail * sizeof(NvmeCmd), cmd, sizeof(*cmd));
+    q->tail = (q->tail + 1) % q->sq_size;
+}
+
+static uint16_t nvmetest_wait_cqe(QTestState *qts, NvmeTestQueue *q)
+{
+    uint64_t addr = q->cq + q->head * sizeof(NvmeCqe);
+    gint64 start_time = g_get_monotonic_time();
+    NvmeCqe cqe;
+
+    for (;;) {
+        qtest_memread(qts, addr, &cqe, sizeof(cqe));
+        if ((le16_to_cpu(cqe.status) & 0x1) == q->phase) {
+            break;
+        }
+        qtest_clock_step(qts, 100);
+        g_assert(g_get_monotonic_time() - start_time <= NVMETEST_TIMEOUT_US);
+    }
+
+    g_assert_cmpint(le16_to_cpu(cqe.sq_id), ==, q->qid);
+
+    q->head = (q->head + 1) % q->cq_size;
+    if (!q->head) {
+        q->phase = !q->phase;
+    }
+
+    return le16_to_cpu(cqe.status) >> 1;
+}
+
+static uint16_t nvmetest_admin_cmd(QPCIDevice *pdev, QPCIBar bar,
+                                   NvmeTestQueue *aq, NvmeCmd *cmd)
+{
+    QTestState *qts = pdev->bus->qts;
+    uint16_t status;
+
+    nvmetest_submit(qts, aq, cmd);
+    qpci_io_writel(pdev, bar, 0x1000, aq->tail);
+    status = nvmetest_wait_cqe(qts, aq);
+    qpci_io_writel(pdev, bar, 0x1004, aq->head);
+
+    return status;
+}
+
+static void nvmetest_enable(QPCIDevice *pdev, QPCIBar bar, NvmeTestQueue *aq)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint32_t cc;
+
+    qpci_io_writel(pdev, bar, NVME_REG_AQA,
+                   (aq->cq_size - 1) << 16 | (aq->sq_size - 1));
+    qpci_io_writeq(pdev, bar, NVME_REG_ASQ, aq->sq);
+    qpci_io_writeq(pdev, bar, NVME_REG_ACQ, aq->cq);
+
+    cc = 1 << CC_EN_SHIFT | 6 << CC_IOSQES_SHIFT | 4 << CC_IOCQES_SHIFT;
+    qpci_io_writel(pdev, bar, NVME_REG_CC, cc);
+
+    while (!(qpci_io_readl(pdev, bar, NVME_REG_CSTS) & 0x1)) {
+        qtest_clock_step(pdev->bus->qts, 100);
+        g_assert(g_get_monotonic_time() - start_time <= NVMETEST_TIMEOUT_US);
+    }
+}
+
+static void nvmetest_create_ioq(QPCIDevice *pdev, QPCIBar bar,
+                                NvmeTestQueue *aq, NvmeTestQueue *ioq)
+{
+    NvmeCmd cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_CREATE_CQ;
+    cmd.dptr.prp1 = cpu_to_le64(ioq->cq);
+    cmd.cdw10 = cpu_to_le32((ioq->cq_size - 1) << 16 | ioq->qid);
+    cmd.cdw11 = cpu_to_le32(0x1);
+    g_assert_cmphex(nvmetest_admin_cmd(pdev, bar, aq, &cmd), ==,
+                    NVME_SUCCESS);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_CREATE_SQ;
+    cmd.dptr.prp1 = cpu_to_le64(ioq->sq);
+    cmd.cdw10 = cpu_to_le32((ioq->sq_size - 1) << 16 | ioq->qid);
+    cmd.cdw11 = cpu_to_le32(ioq->qid << 16 | 0x1);
+    g_assert_cmphex(nvmetest_admin_cmd(pdev, bar, aq, &cmd), ==,
+                    NVME_SUCCESS);
+}
+
+/*
+ * Drive an I/O queue pair through the shadow doorbells only: the MMIO
+ * doorbell is rung once per batch with a stale value, the controller has
+ * to pick up the real tail and the consumed CQ head from the shadow buffer
+ * and publish its progress in the EventIdx buffer.
+ */
+static void nvmetest_dbbuf_test(void *obj, void *data, QGuestAllocator *alloc)
+{
+    QNvme *nvme = obj;
+    QPCIDevice *pdev = &nvme->dev;
+    QTestState *qts = pdev->bus->qts;
+    NvmeTestQueue aq = {
+        .sq_size = NVMETEST_AQ_SIZE,
+        .cq_size = NVMETEST_AQ_SIZE,
+        .phase = true,
+    };
+    NvmeTestQueue ioq = {
+        .sq_size = NVMETEST_IOSQ_SIZE,
+        .cq_size = NVMETEST_IOCQ_SIZE,
+        .qid = 1,
+        .phase = true,
+    };
+    /* Offsets of the SQ 1 tail and CQ 1 head in both buffers */
+    const uint64_t sq_db = 2 * 1 * 4, cq_db = (2 * 1 + 1) * 4;
+    uint64_t dbs, eis;
+    NvmeCmd cmd;
+    QPCIBar bar;
+    int i;
+
+    qpci_device_enable(pdev);
+    bar = qpci_iomap(pdev, 0, NULL);
+
+    aq.sq = guest_alloc(alloc, NVMETEST_AQ_SIZE * sizeof(NvmeCmd));
+    aq.cq = guest_alloc(alloc, NVMETEST_AQ_SIZE * sizeof(NvmeCqe));
+    ioq.sq = guest_alloc(alloc, NVMETEST_IOSQ_SIZE * sizeof(NvmeCmd));
+    ioq.cq = guest_alloc(alloc, NVMETEST_IOCQ_SIZE * sizeof(NvmeCqe));
+    dbs = guest_alloc(alloc, 4096);
+    eis = guest_alloc(alloc, 4096);
+    qtest_memset(qts, aq.cq, 0, NVMETEST_AQ_SIZE * sizeof(NvmeCqe));
+    qtest_memset(qts, ioq.cq, 0, NVMETEST_IOCQ_SIZE * sizeof(NvmeCqe));
+    qtest_memset(qts, dbs, 0xff, 4096);
+    qtest_memset(qts, eis, 0xff, 4096);
+
+    nvmetest_enable(pdev, bar, &aq);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_ADM_CMD_DBBUF_CONFIG;
+    cmd.dptr.prp1 = cpu_to_le64(dbs);
+    cmd.dptr.prp2 = cpu_to_le64(eis);
+    g_assert_cmphex(nvmetest_admin_cmd(pdev, bar, &aq, &cmd), ==,
+                    NVME_SUCCESS);
+
+    nvmetest_create_ioq(pdev, bar, &aq, &ioq);
+
+    /* New queues start with their shadow doorbell and EventIdx at zero */
+    g_assert_cmpint(qtest_readl(qts, dbs + sq_db), ==, 0);
+    g_assert_cmpint(qtest_readl(qts, eis + sq_db), ==, 0);
+    g_assert_cmpint(qtest_readl(qts, dbs + cq_db), ==, 0);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = NVME_CMD_FLUSH;
+    cmd.nsid = cpu_to_le32(1);
+
+    /* One command, the MMIO doorbell only wakes the controller up */
+    nvmetest_submit(qts, &ioq, &cmd);
+    qtest_writel(qts, dbs + sq_db, ioq.tail);
+    qpci_io_writel(pdev, bar, 0x1000 + sq_db, ioq.tail);
+    g_assert_cmphex(nvmetest_wait_cqe(qts, &ioq), ==, NVME_SUCCESS);
+    g_assert_cmpint(qtest_readl(qts, eis + sq_db), ==, ioq.tail);
+
+    /* A batch announced through the shadow tail, rung with a stale value */
+    for (i = 0; i < 3; i++) {
+        nvmetest_submit(qts, &ioq, &cmd);
+    }
+    qtest_writel(qts, dbs + sq_db, ioq.tail);
+    qpci_io_writel(pdev, bar, 0x1000 + sq_db, ioq.tail - 2);
+    for (i = 0; i < 3; i++) {
+        g_assert_cmphex(nvmetest_wait_cqe(qts, &ioq), ==, NVME_SUCCESS);
+    }
+    g_assert_cmpint(qtest_readl(qts, eis + sq_db), ==, ioq.tail);
+
+    /*
+     * More commands than free CQ slots: they can only all complete if the
+     * controller reads the consumed head from the shadow CQ doorbell, which
+     * is never rung through MMIO.
+     */
+    qtest_writel(qts, dbs + cq_db, ioq.head);
+    for (i = 0; i < NVMETEST_IOCQ_SIZE - 2; i++) {
+        nvmetest_submit(qts, &ioq, &cmd);
+    }
+    qtest_writel(qts, dbs + sq_db, ioq.tail);
+    qpci_io_writel(pdev, bar, 0x1000 + sq_db, ioq.tail);
+    for (i = 0; i < NVMETEST_IOCQ_SIZE - 2; i++) {
+        g_assert_cmphex(nvmetest_wait_cqe(qts, &ioq), ==, NVME_SUCCESS);
+        qtest_writel(qts, dbs + cq_db, ioq.head);
+    }
+    g_assert_cmpint(qtest_readl(qts, eis + sq_db), ==, ioq.tail);
+
+    qpci_iounmap(pdev, bar);
+}
+
+#define NVMETEST_IO_BLOCKS 8
+#define NVMETEST_LBA_SIZE 512
+
+/*
+ * Submit a one block read or write of @lba on namespace @nsid, to or from
+ * @buf, for each of @n consecutive blocks, ring the doorbell once and
+ * return without waiting for the completions.
+ */
+static void nvmetest_submit_rw(QPCIDevice *pdev, QPCIBar bar,
+                               NvmeTestQueue *ioq, uint8_t opcode,
+                               uint32_t nsid, uint64_t lba, uint64_t buf,
+                               int n)
+{
+    NvmeRwCmd rw;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        memset(&rw, 0, sizeof(rw));
+        rw.opcode = opcode;
+        rw.nsid = cpu_to_le32(nsid);
+        rw.dptr.prp1 = cpu_to_le64(buf + i * 4096);
+        rw.slba = cpu_to_le64(lba + i);
+        nvmetest_submit(pdev->bus->qts, ioq, (NvmeCmd *)&rw);
+    }
+    qpci_io_writel(pdev, bar, 0x1000 + 2 * ioq->qid * 4, ioq->tail);
+}
+
+static void nvmetest_wait_rw(QPCIDevice *pdev, QPCIBar bar,
+                             NvmeTestQueue *ioq, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        g_assert_cmphex(nvmetest_wait_cqe(pdev->bus->qts, ioq), ==,
+                        NVME_SUCCESS);
+    }
+    qpci_io_writel(pdev, bar, 0x1000 + (2 * ioq->qid + 1) * 4, ioq->head);
+}
+
+/* Read the blocks back and check block i holds the byte @seed + i */
+static void nvmetest_check_blocks(QPCIDevice *pdev, QPCIBar bar,
+                                  NvmeTestQueue *ioq, uint64_t buf,
+                                  uint8_t seed)
+{
+    QTestState *qts = pdev->bus->qts;
+    uint8_t data[NVMETEST_LBA_SIZE];
+    int i, j;
+
+    qtest_memset(qts, buf, 0, NVMETEST_IO_BLOCKS * 4096);
+    nvmetest_submit_rw(pdev, bar, ioq, NVME_CMD_READ, 2, 0, buf,
+                       NVMETEST_IO_BLOCKS);
+    nvmetest_wait_rw(pdev, bar, ioq, NVMETEST_IO_BLOCKS);
+
+    for (i = 0; i < NVMETEST_IO_BLOCKS; i++) {
+        qtest_memread(qts, buf + i * 4096, data, sizeof(data));
+        for (j = 0; j < sizeof(data); j++) {
+            g_assert_cmphex(data[j], ==, (uint8_t)(seed + i));
+        }
+    }
+}
+
+static void nvmetest_fill_blocks(QTestState *qts, uint64_t buf, uint8_t seed)
+{
+    int i;
+
+    for (i = 0; i < NVMETEST_IO_BLOCKS; i++) {
+        qtest_memset(qts, buf + i * 4096, seed + i, NVMETEST_LBA_SIZE);
+    }
+}
+
+/*
+ * Reads and writes on a namespace backed by an image, with the I/O queues
+ * processed in an IOThread: across a stop/cont of the VM with requests in
+ * flight, and across a controller reset.
+ */
+static void nvmetest_iothread_test(void *obj, void *data,
+                                   QGuestAllocator *alloc)
+{
+    QNvme *nvme = obj;
+    QPCIDevice *pdev = &nvme->dev;
+    QTestState *qts = pdev->bus->qts;
+    NvmeTestQueue aq = {
+        .sq_size = NVMETEST_AQ_SIZE,
+        .cq_size = NVMETEST_AQ_SIZE,
+        .phase = true,
+    };
+    NvmeTestQueue ioq = {
+        .sq_size = NVMETEST_IOSQ_SIZE,
+        .cq_size = NVMETEST_IOSQ_SIZE,
+        .qid = 1,
+        .phase = true,
+    };
+    gint64 start_time;
+    uint64_t buf;
+    QDict *rsp;
+    QPCIBar bar;
+
+    qpci_device_enable(pdev);
+    bar = qpci_iomap(pdev, 0, NULL);
+
+    aq.sq = guest_alloc(alloc, NVMETEST_AQ_SIZE * sizeof(NvmeCmd));
+    aq.cq = guest_alloc(alloc, NVMETEST_AQ_SIZE * sizeof(NvmeCqe));
+    ioq.sq = guest_alloc(alloc, NVMETEST_IOSQ_SIZE * sizeof(NvmeCmd));
+    ioq.cq = guest_alloc(alloc, NVMETEST_IOSQ_SIZE * sizeof(NvmeCqe));
+    buf = guest_alloc(alloc, NVMETEST_IO_BLOCKS * 4096);
+    qtest_memset(qts, aq.cq, 0, NVMETEST_AQ_SIZE * sizeof(NvmeCqe));
+    qtest_memset(qts, ioq.cq, 0, NVMETEST_IOSQ_SIZE * sizeof(NvmeCqe));
+
+    nvmetest_enable(pdev, bar, &aq);
+    nvmetest_create_ioq(pdev, bar, &aq, &ioq);
+
+    nvmetest_fill_blocks(qts, buf, 0x10);
+    nvmetest_submit_rw(pdev, bar, &ioq, NVME_CMD_WRITE, 2, 0, buf,
+                       NVMETEST_IO_BLOCKS);
+    nvmetest_wait_rw(pdev, bar, &ioq, NVMETEST_IO_BLOCKS);
+    nvmetest_check_blocks(pdev, bar, &ioq, buf, 0x10);
+
+    /* Stop the VM with writes in flight, none of them may get lost */
+    nvmetest_fill_blocks(qts, buf, 0x20);
+    nvmetest_submit_rw(pdev, bar, &ioq, NVME_CMD_WRITE, 2, 0, buf,
+                       NVMETEST_IO_BLOCKS);
+    rsp = qtest_qmp(qts, "{ 'execute': 'stop' }");
+    qobject_unref(rsp);
+    rsp = qtest_qmp(qts, "{ 'execute': 'cont' }");
+    qobject_unref(rsp);
+    nvmetest_wait_rw(pdev, bar, &ioq, NVMETEST_IO_BLOCKS);
+    nvmetest_check_blocks(pdev, bar, &ioq, buf, 0x20);
+
+    /* Reset the controller with writes in flight, then set it up again */
+    nvmetest_fill_blocks(qts, buf, 0x30);
+    nvmetest_submit_rw(pdev, bar, &ioq, NVME_CMD_WRITE, 2,
+                       NVMETEST_IO_BLOCKS, buf, NVMETEST_IO_BLOCKS);
+    qpci_io_writel(pdev, bar, NVME_REG_CC, 0);
+    start_time = g_get_monotonic_time();
+    while (qpci_io_readl(pdev, bar, NVME_REG_CSTS) & 0x1) {
+        qtest_clock_step(qts, 100);
+        g_assert(g_get_monotonic_time() - start_time <= NVMETEST_TIMEOUT_US);
+    }
+
+    aq.tail = aq.head = 0;
+    aq.phase = true;
+    ioq.tail = ioq.head = 0;
+    ioq.phase = true;
+    qtest_memset(qts, aq.cq, 0, NVMETEST_AQ_SIZE * sizeof(NvmeCqe));
+    qtest_memset(qts, ioq.cq, 0, NVMETEST_IOSQ_SIZE * sizeof(NvmeCqe));
+
+    nvmetest_enable(pdev, bar, &aq);
+    nvmetest_create_ioq(pdev, bar, &aq, &ioq);
+
+    /* The queues work again and the blocks written before are still there */
+    nvmetest_check_blocks(pdev, bar, &ioq, buf, 0x20);
+    nvmetest_fill_blocks(qts, buf, 0x40);
+    nvmetest_submit_rw(pdev, bar, &ioq, NVME_CMD_WRITE, 2, 0, buf,
+                       NVMETEST_IO_BLOCKS);
+    nvmetest_wait_rw(pdev, bar, &ioq, NVMETEST_IO_BLOCKS);
+    nvmetest_check_blocks(pdev, bar, &ioq, buf, 0x40);
+
+    qpci_iounmap(pdev, bar);
+}
+
+static void drive_destroy(void *path)
+{
+    unlink(path);
+    g_free(path);
+    qos_invalidate_command_line();
+}
+
+/* Namespace 2 is backed by a temporary image, so that data can be read back */
+static void *nvme_iothread_before(GString *cmd_line, void *arg)
+{
+    char *t_path = g_strdup("/tmp/qtest.XXXXXX");
+    int fd, ret;
+
+    fd = mkstemp(t_path);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, 1 * MiB);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+    g_test_queue_destroy(drive_destroy, t_path);
+
+    g_string_append_printf(cmd_line,
+                           " -object iothread,id=thread0"
+                           " -drive id=drv1,if=none,file=%s,format=raw"
+                           " -device nvme-ns,bus=nvme0,drive=drv1,nsid=2 ",
+                           t_path);
+    return arg;
+}
+
 static void nvme_register_nodes(void)
 {
     QOSGraphEdgeOptions opts = {
@@ -168,6 +557,14 @@ static void nvme_register_nodes(void)
     });
 
     qos_add_test("reg-read", "nvme", nvmetest_reg_read_test, NULL);
+
+    qos_add_test("dbbuf", "nvme", nvmetest_dbbuf_test, NULL);
+
+    qos_add_test("iothread", "nvme", nvmetest_iothread_test,
+                 &(QOSGraphTestOptions) {
+        .before = nvme_iothread_before,
+        .edge.extra_device_opts = "id=nvme0,iothread=thread0",
+    });
 }
 
 libqos_init(nvme_register_nodes);
@@ -0,0 +1,289 @@
+/*
+ * QTest testcase for colo-compare
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "libqos/libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+#define FLOWS 8
+#define PAYLOAD_LEN 32
+#define HDR_LEN (14 + 20 + 8)
+#define FRAME_LEN (HDR_LEN + PAYLOAD_LEN)
+#define COMPARE_THREADS 4
+#define TIMEOUT_MS 10000
+
+typedef struct CompareTest {
+    QTestState *qts;
+    int pri_sock[2];
+    int sec_sock[2];
+    int out_sock[2];
+    int notify_sock[2];
+} CompareTest;
+
+/* An Ethernet frame holding a UDP datagram of flow @flow */
+static void build_frame(uint8_t *frame, int flow, uint8_t seq)
+{
+    static const uint8_t eth[] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,     /* dst */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,     /* src */
+        0x08, 0x00,                             /* IPv4 */
+    };
+    uint8_t *ip = frame + 14;
+    uint8_t *udp = ip + 20;
+
+    memset(frame, 0, FRAME_LEN);
+    memcpy(frame, eth, sizeof(eth));
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + 8 + PAYLOAD_LEN);
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    stl_be_p(ip + 12, 0x0a000001);
+    stl_be_p(ip + 16, 0x0a000002);
+
+    stw_be_p(udp, 1000 + flow);
+    stw_be_p(udp + 2, 5000);
+    stw_be_p(udp + 4, 8 + PAYLOAD_LEN);
+
+    memset(frame + HDR_LEN, flow, PAYLOAD_LEN);
+    frame[HDR_LEN] = seq;
+}
+
+static void send_packet(int sock, const void *buf, size_t len)
+{
+    uint32_t size = htonl(len);
+    struct iovec iov[] = {
+        {
+            .iov_base = &size,
+            .iov_len = sizeof(size),
+        }, {
+            .iov_base = (void *)buf,
+            .iov_len = len,
+        },
+    };
+    ssize_t ret;
+
+    ret = iov_send(sock, iov, 2, 0, sizeof(size) + len);
+    g_assert_cmpint(ret, ==, sizeof(size) + len);
+}
+
+static void send_frame(int sock, int flow, uint8_t seq)
+{
+    uint8_t frame[FRAME_LEN];
+
+    build_frame(frame, flow, seq);
+    send_packet(sock, frame, sizeof(frame));
+}
+
+static void recv_all(int sock, void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = qemu_recv(sock, (uint8_t *)buf + done, len - done, 0);
+
+        g_assert_cmpint(ret, >, 0);
+        done += ret;
+    }
+}
+
+/*
+ * Receive @n primary packets from outdev; the compare threads release
+ * them in any order across flows.  Return the flows they belong to as a
+ * bitmap, after checking each is the packet that was sent.
+ */
+static uint32_t recv_frames(CompareTest *t, int n, uint8_t seq)
+{
+    uint32_t flows = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        uint8_t frame[FRAME_LEN], expected[FRAME_LEN];
+        uint32_t len;
+        int flow;
+
+        recv_all(t->out_sock[0], &len, sizeof(len));
+        g_assert_cmpint(ntohl(len), ==, FRAME_LEN);
+        recv_all(t->out_sock[0], frame, sizeof(frame));
+
+        flow = lduw_be_p(frame + 14 + 20) - 1000;
+        g_assert_cmpint(flow, >=, 0);
+        g_assert_cmpint(flow, <, FLOWS);
+        build_frame(expected, flow, seq);
+        g_assert(!memcmp(frame, expected, FRAME_LEN));
+        g_assert_false(flows & (1u << flow));
+        flows |= 1u << flow;
+    }
+    return flows;
+}
+
+static void assert_no_frame(CompareTest *t)
+{
+    uint8_t c;
+    ssize_t ret;
+
+    ret = recv(t->out_sock[0], &c, 1, MSG_DONTWAIT);
+    g_assert_cmpint(ret, ==, -1);
+    g_assert(errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static int64_t get_max_lag(CompareTest *t)
+{
+    QDict *rsp;
+    int64_t value;
+
+    rsp = qtest_qmp(t->qts, "{'execute': 'qom-get',"
+                            " 'arguments': {"
+                            "   'path': '/objects/comp0',"
+                            "   'property': 'max_lag_ms'"
+                            "}}");
+    value = qdict_get_int(rsp, "return");
+    qobject_unref(rsp);
+    return value;
+}
+
+/* Wait for the compare threads to scan their connections */
+static void wait_max_lag(CompareTest *t, bool held)
+{
+    int i;
+
+    for (i = 0; i < TIMEOUT_MS / 10; i++) {
+        int64_t lag = get_max_lag(t);
+
+        if (held ? lag >= 200 : lag == 0) {
+            return;
+        }
+        g_usleep(10 * 1000);
+    }
+    g_assert_not_reached();
+}
+
+static void compare_test_start(CompareTest *t)
+{
+    QDict *rsp;
+    int ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, t->pri_sock);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, t->sec_sock);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, t->out_sock);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, t->notify_sock);
+    g_assert_cmpint(ret, !=, -1);
+
+    /*
+     * compare_timeout is long enough that held packets are only released
+     * by a match or a checkpoint.
+     */
+    t->qts = qtest_initf(
+        "-object iothread,id=iothread0 "
+        "-chardev socket,id=pri0,fd=%d "
+        "-chardev socket,id=sec0,fd=%d "
+        "-chardev socket,id=out0,fd=%d "
+        "-chardev socket,id=notify0,fd=%d "
+        "-object colo-compare,id=comp0,primary_in=pri0,secondary_in=sec0,"
+        "outdev=out0,notify_dev=notify0,iothread=iothread0,"
+        "compare_threads=%d,compare_timeout=60000,expired_scan_cycle=50 ",
+        t->pri_sock[1], t->sec_sock[1], t->out_sock[1], t->notify_sock[1],
+        COMPARE_THREADS);
+
+    /* Make sure the chardevs are connected */
+    rsp = qtest_qmp(t->qts, "{ 'execute' : 'query-status'}");
+    qobject_unref(rsp);
+}
+
+static void compare_test_end(CompareTest *t)
+{
+    qtest_quit(t->qts);
+    close(t->pri_sock[0]);
+    close(t->pri_sock[1]);
+    close(t->sec_sock[0]);
+    close(t->sec_sock[1]);
+    close(t->out_sock[0]);
+    close(t->out_sock[1]);
+    close(t->notify_sock[0]);
+    close(t->notify_sock[1]);
+}
+
+/*
+ * Primary packets of connections spread over the compare threads are
+ * released once the secondary sends the same ones.
+ */
+static void test_compare_threads_match(void)
+{
+    CompareTest t;
+    int i;
+
+    compare_test_start(&t);
+
+    for (i = 0; i < FLOWS; i++) {
+        send_frame(t.pri_sock[0], i, 0);
+    }
+    for (i = 0; i < FLOWS; i++) {
+        send_frame(t.sec_sock[0], i, 0);
+    }
+    g_assert_cmphex(recv_frames(&t, FLOWS, 0), ==, (1u << FLOWS) - 1);
+
+    /* Secondary first works as well */
+    for (i = 0; i < FLOWS; i++) {
+        send_frame(t.sec_sock[0], i, 1);
+    }
+    for (i = 0; i < FLOWS; i++) {
+        send_frame(t.pri_sock[0], i, 1);
+    }
+    g_assert_cmphex(recv_frames(&t, FLOWS, 1), ==, (1u << FLOWS) - 1);
+
+    wait_max_lag(&t, false);
+    assert_no_frame(&t);
+
+    compare_test_end(&t);
+}
+
+/*
+ * Unmatched primary packets are held back and show up in max_lag_ms,
+ * until a checkpoint makes every compare thread release them.
+ */
+static void test_compare_threads_flush(void)
+{
+    static const char checkpoint[] = "COLO_CHECKPOINT";
+    CompareTest t;
+    int i;
+
+    compare_test_start(&t);
+
+    for (i = 0; i < FLOWS; i++) {
+        send_frame(t.pri_sock[0], i, 0);
+    }
+    wait_max_lag(&t, true);
+    assert_no_frame(&t);
+
+    send_packet(t.notify_sock[0], checkpoint, strlen(checkpoint));
+    g_assert_cmphex(recv_frames(&t, FLOWS, 0), ==, (1u << FLOWS) - 1);
+    wait_max_lag(&t, false);
+
+    /* The connections keep working after the flush */
+    send_frame(t.pri_sock[0], 3, 1);
+    send_frame(t.sec_sock[0], 3, 1);
+    g_assert_cmphex(recv_frames(&t, 1, 1), ==, 1u << 3);
+
+    compare_test_end(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/colo-compare/threads/match", test_compare_threads_match);
+    qtest_add_func("/colo-compare/threads/flush", test_compare_threads_flush);
+
+    return g_test_run();
+}
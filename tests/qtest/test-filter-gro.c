@@ -0,0 +1,243 @@
+/*
+ * QTest testcase for filter-gro
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "libqos/libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+#define SEGMENTS 3
+#define MSS 100
+#define HDR_LEN (14 + 20 + 20)
+
+static const char flow_name[] = "10.0.0.1:1234-10.0.0.2:80";
+
+/* An Ethernet frame holding a TCP segment of the flow, checksums unset */
+static size_t build_segment(uint8_t *frame, uint32_t seq, uint8_t flags,
+                            const uint8_t *payload, size_t len)
+{
+    static const uint8_t eth[] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,     /* dst */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,     /* src */
+        0x08, 0x00,                             /* IPv4 */
+    };
+    uint8_t *ip = frame + 14;
+    uint8_t *tcp = ip + 20;
+
+    memset(frame, 0, HDR_LEN);
+    memcpy(frame, eth, sizeof(eth));
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + 20 + len);
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    stl_be_p(ip + 12, 0x0a000001);
+    stl_be_p(ip + 16, 0x0a000002);
+
+    stw_be_p(tcp, 1234);
+    stw_be_p(tcp + 2, 80);
+    stl_be_p(tcp + 4, seq);
+    stl_be_p(tcp + 8, 1);
+    tcp[12] = 5 << 4;
+    tcp[13] = flags;
+    stw_be_p(tcp + 14, 65535);
+
+    memcpy(frame + HDR_LEN, payload, len);
+    return HDR_LEN + len;
+}
+
+static void send_frame(int sock, uint8_t *frame, size_t len)
+{
+    uint32_t size = htonl(len);
+    struct iovec iov[] = {
+        {
+            .iov_base = &size,
+            .iov_len = sizeof(size),
+        }, {
+            .iov_base = frame,
+            .iov_len = len,
+        },
+    };
+    ssize_t ret;
+
+    ret = iov_send(sock, iov, 2, 0, sizeof(size) + len);
+    g_assert_cmpint(ret, ==, sizeof(size) + len);
+}
+
+static int64_t get_counter(QTestState *qts, const char *property)
+{
+    QDict *rsp;
+    int64_t value;
+
+    rsp = qtest_qmp(qts, "{'execute': 'qom-get',"
+                         " 'arguments': {"
+                         "   'path': '/objects/qtest-gro',"
+                         "   'property': %s"
+                         "}}", property);
+    value = qdict_get_int(rsp, "return");
+    qobject_unref(rsp);
+    return value;
+}
+
+/*
+ * Send a burst of full segments, the last one pushed, into the netdev
+ * and check that the filter-mirror behind filter-gro sees them as a
+ * single packet with the payload of all of them.
+ */
+static void test_gro_merge(void)
+{
+    int send_sock[2], recv_sock[2];
+    uint8_t payload[SEGMENTS * MSS];
+    uint8_t frame[HDR_LEN + SEGMENTS * MSS];
+    uint32_t len;
+    const char *devstr = "e1000";
+    QTestState *qts;
+    QDict *rsp, *flows, *flow;
+    ssize_t ret;
+    int i;
+
+    if (g_str_equal(qtest_get_arch(), "s390x")) {
+        devstr = "virtio-net-ccw";
+    }
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, send_sock);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, recv_sock);
+    g_assert_cmpint(ret, !=, -1);
+
+    /* Packets from the netdev to the NIC go through gro, then mirror */
+    qts = qtest_initf(
+        "-netdev socket,id=qtest-bn0,fd=%d "
+        "-device %s,netdev=qtest-bn0,id=qtest-e0 "
+        "-chardev socket,id=mirror0,fd=%d "
+        "-object filter-gro,id=qtest-gro,netdev=qtest-bn0,queue=tx,"
+        "interval=1000000 "
+        "-object filter-mirror,id=qtest-f0,netdev=qtest-bn0,queue=tx,"
+        "outdev=mirror0 ",
+        send_sock[1], devstr, recv_sock[1]);
+
+    for (i = 0; i < sizeof(payload); i++) {
+        payload[i] = i;
+    }
+
+    /* Make sure the socket netdev is connected */
+    qobject_unref(qtest_qmp(qts, "{ 'execute' : 'query-status'}"));
+    for (i = 0; i < SEGMENTS; i++) {
+        uint8_t flags = i == SEGMENTS - 1 ? 0x18 : 0x10;   /* PSH, ACK */
+        size_t size = build_segment(frame, 1000 + i * MSS, flags,
+                                    payload + i * MSS, MSS);
+
+        send_frame(send_sock[0], frame, size);
+    }
+
+    ret = qemu_recv(recv_sock[0], &len, sizeof(len), 0);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpint(len, ==, HDR_LEN + SEGMENTS * MSS);
+
+    ret = qemu_recv(recv_sock[0], frame, len, MSG_WAITALL);
+    g_assert_cmpint(ret, ==, len);
+    g_assert_cmpint(lduw_be_p(frame + 14 + 2), ==, 20 + 20 + SEGMENTS * MSS);
+    g_assert_cmpint(ldl_be_p(frame + 14 + 20 + 4), ==, 1000);
+    g_assert_cmpint(frame[14 + 20 + 13], ==, 0x18);
+    g_assert(!memcmp(frame + HDR_LEN, payload, sizeof(payload)));
+
+    g_assert_cmpint(get_counter(qts, "segments"), ==, SEGMENTS);
+    g_assert_cmpint(get_counter(qts, "coalesced"), ==, SEGMENTS - 1);
+    g_assert_cmpint(get_counter(qts, "flushed"), ==, 1);
+
+    rsp = qtest_qmp(qts, "{'execute': 'qom-get',"
+                         " 'arguments': {"
+                         "   'path': '/objects/qtest-gro',"
+                         "   'property': 'flows'"
+                         "}}");
+    flows = qdict_get_qdict(rsp, "return");
+    g_assert(flows);
+    flow = qdict_get_qdict(flows, flow_name);
+    g_assert(flow);
+    g_assert_cmpint(qdict_get_int(flow, "segments"), ==, SEGMENTS);
+    g_assert_cmpint(qdict_get_int(flow, "coalesced"), ==, SEGMENTS - 1);
+    g_assert_cmpint(qdict_get_int(flow, "flushed"), ==, 1);
+    qobject_unref(rsp);
+
+    close(send_sock[0]);
+    close(send_sock[1]);
+    close(recv_sock[0]);
+    close(recv_sock[1]);
+    qtest_quit(qts);
+}
+
+/* Without GSO, merged frames must still fit the MTU */
+static void test_gro_mtu(void)
+{
+    int send_sock[2], recv_sock[2];
+    uint8_t payload[1000] = { 0 };
+    uint8_t frame[HDR_LEN + sizeof(payload)];
+    uint32_t len;
+    const char *devstr = "e1000";
+    QTestState *qts;
+    ssize_t ret;
+    int i;
+
+    if (g_str_equal(qtest_get_arch(), "s390x")) {
+        devstr = "virtio-net-ccw";
+    }
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, send_sock);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, recv_sock);
+    g_assert_cmpint(ret, !=, -1);
+
+    qts = qtest_initf(
+        "-netdev socket,id=qtest-bn0,fd=%d "
+        "-device %s,netdev=qtest-bn0,id=qtest-e0 "
+        "-chardev socket,id=mirror0,fd=%d "
+        "-object filter-gro,id=qtest-gro,netdev=qtest-bn0,queue=tx,"
+        "interval=1000000 "
+        "-object filter-mirror,id=qtest-f0,netdev=qtest-bn0,queue=tx,"
+        "outdev=mirror0 ",
+        send_sock[1], devstr, recv_sock[1]);
+
+    qobject_unref(qtest_qmp(qts, "{ 'execute' : 'query-status'}"));
+
+    /* Two 1000 bytes segments don't fit in 1514 bytes: nothing is merged */
+    for (i = 0; i < 2; i++) {
+        size_t size = build_segment(frame, 1000 + i * sizeof(payload), 0x10,
+                                    payload, sizeof(payload));
+
+        send_frame(send_sock[0], frame, size);
+    }
+
+    for (i = 0; i < 2; i++) {
+        ret = qemu_recv(recv_sock[0], &len, sizeof(len), 0);
+        g_assert_cmpint(ret, ==, sizeof(len));
+        len = ntohl(len);
+        g_assert_cmpint(len, ==, HDR_LEN + sizeof(payload));
+        ret = qemu_recv(recv_sock[0], frame, len, MSG_WAITALL);
+        g_assert_cmpint(ret, ==, len);
+    }
+    g_assert_cmpint(get_counter(qts, "coalesced"), ==, 0);
+
+    close(send_sock[0]);
+    close(send_sock[1]);
+    close(recv_sock[0]);
+    close(recv_sock[1]);
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/netfilter/gro/merge", test_gro_merge);
+    qtest_add_func("/netfilter/gro/mtu", test_gro_mtu);
+
+    return g_test_run();
+}
@@ -174,6 +174,42 @@ static void remove_netdev_with_multi_netfilter(void)
     qobject_unref(response);
 }
 
+/* add a filter-gro to a netdev, check its counters and then remove it */
+static void add_gro_netfilter(void)
+{
+    QDict *response;
+
+    response = qmp("{'execute': 'object-add',"
+                   " 'arguments': {"
+                   "   'qom-type': 'filter-gro',"
+                   "   'id': 'qtest-f0',"
+                   "   'netdev': 'qtest-bn0',"
+                   "   'queue': 'rx',"
+                   "   'interval': 100,"
+                   "   'max-size': 9000"
+                   "}}");
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    response = qmp("{'execute': 'qom-get',"
+                   " 'arguments': {"
+                   "   'path': '/objects/qtest-f0',"
+                   "   'property': 'coalesced'"
+                   "}}");
+    g_assert(response);
+    g_assert_cmpint(qdict_get_int(response, "return"), ==, 0);
+    qobject_unref(response);
+
+    response = qmp("{'execute': 'object-del',"
+                   " 'arguments': {"
+                   "   'id': 'qtest-f0'"
+                   "}}");
+    g_assert(response);
+    g_assert(!qdict_haskey(response, "error"));
+    qobject_unref(response);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -191,6 +227,7 @@ int main(int argc, char **argv)
     qtest_add_func("/netfilter/addremove_multi", add_multi_netfilter);
     qtest_add_func("/netfilter/remove_netdev_multi",
                    remove_netdev_with_multi_netfilter);
+    qtest_add_func("/netfilter/addremove_gro", add_gro_netfilter);
 
     args = g_strdup_printf("-netdev user,id=qtest-bn0 "
                            "-device %s,netdev=qtest-bn0", devstr);
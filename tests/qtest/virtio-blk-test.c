@@ -12,6 +12,8 @@
 #include "libqtest-single.h"
 #include "qemu/bswap.h"
 #include "qemu/module.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "standard-headers/linux/virtio_blk.h"
 #include "standard-headers/linux/virtio_pci.h"
 #include "libqos/qgraph.h"
@@ -23,6 +25,8 @@
 #define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
 #define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
 #define PCI_SLOT_HP             0x06
+#define COALESCE_FRAMES         4
+#define COALESCE_USECS          200000
 
 typedef struct QVirtioBlkReq {
     uint32_t type;
@@ -766,6 +770,199 @@ static void resize(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+static QVirtQueue *coalesce_setup(QVirtioDevice *dev, QGuestAllocator *alloc)
+{
+    uint64_t features;
+    QVirtQueue *vq;
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, alloc, 0);
+    qvirtio_set_driver_ok(dev);
+
+    return vq;
+}
+
+/* Queue a 512 byte read of @sector, the caller kicks the virtqueue */
+static uint64_t coalesce_add_read(QTestState *qts, QVirtioDevice *dev,
+                                  QGuestAllocator *alloc, QVirtQueue *vq,
+                                  uint64_t sector)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+
+    req.type = VIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 512, true, true);
+    qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+
+    return req_addr;
+}
+
+/* The query-blockstats counters of drive0 */
+static QDict *coalesce_get_stats(QTestState *qts)
+{
+    QDict *rsp, *stats = NULL;
+    QListEntry *entry;
+
+    rsp = qtest_qmp(qts, "{ 'execute': 'query-blockstats' }");
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(rsp, "return"), entry) {
+        QDict *dev = qobject_to(QDict, qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_try_str(dev, "device") ?: "", "drive0")) {
+            stats = qdict_get_qdict(dev, "stats");
+            qobject_ref(stats);
+            break;
+        }
+    }
+    qobject_unref(rsp);
+
+    g_assert(stats);
+    return stats;
+}
+
+/*
+ * With notify-coalesce-frames, completions do not raise an interrupt
+ * until that many are pending, and are then signalled as one batch.
+ */
+static void notify_coalesce_frames(void *obj, void *data,
+                                   QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QTestState *qts = global_qtest;
+    uint64_t req_addr[COALESCE_FRAMES];
+    uint32_t free_head;
+    QVirtQueue *vq;
+    QDict *stats;
+    int i;
+
+    vq = coalesce_setup(dev, t_alloc);
+
+    /* Sectors are apart so that the requests are not merged */
+    for (i = 0; i < COALESCE_FRAMES - 1; i++) {
+        free_head = vq->free_head;
+        req_addr[i] = coalesce_add_read(qts, dev, t_alloc, vq, i * 8);
+        qvirtqueue_kick(qts, dev, vq, free_head);
+    }
+
+    for (i = 0; i < COALESCE_FRAMES - 1; i++) {
+        uint8_t status;
+
+        status = qvirtio_wait_status_byte_no_isr(qts, dev, vq,
+                                                 req_addr[i] + 528,
+                                                 QVIRTIO_BLK_TIMEOUT_US);
+        g_assert_cmpint(status, ==, 0);
+    }
+
+    /* The kicks may be picked up together or one by one */
+    stats = coalesce_get_stats(qts);
+    g_assert_cmpint(qdict_get_int(stats, "submit_batches"), >=, 1);
+    g_assert_cmpint(qdict_get_int(stats, "submit_batches"), <=,
+                    COALESCE_FRAMES - 1);
+    g_assert_cmpint(qdict_get_int(stats, "submit_batched_requests"), ==,
+                    COALESCE_FRAMES - 1);
+    g_assert_cmpint(qdict_get_int(stats, "completion_batches"), ==, 0);
+    g_assert_cmpint(qdict_get_int(stats, "completion_batched_requests"), ==, 0);
+    qobject_unref(stats);
+
+    /* The last completion raises the interrupt for all of them */
+    free_head = vq->free_head;
+    req_addr[i] = coalesce_add_read(qts, dev, t_alloc, vq, i * 8);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_queue_isr(qts, dev, vq, QVIRTIO_BLK_TIMEOUT_US);
+    for (i = 0; i < COALESCE_FRAMES; i++) {
+        g_assert(qvirtqueue_get_buf(qts, vq, NULL, NULL));
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+        guest_free(t_alloc, req_addr[i]);
+    }
+    g_assert_false(qvirtqueue_get_buf(qts, vq, NULL, NULL));
+
+    stats = coalesce_get_stats(qts);
+    g_assert_cmpint(qdict_get_int(stats, "submit_batches"), <=,
+                    COALESCE_FRAMES);
+    g_assert_cmpint(qdict_get_int(stats, "submit_batched_requests"), ==,
+                    COALESCE_FRAMES);
+    g_assert_cmpint(qdict_get_int(stats, "completion_batches"), ==, 1);
+    g_assert_cmpint(qdict_get_int(stats, "completion_batched_requests"), ==,
+                    COALESCE_FRAMES);
+    g_assert_cmpint(qdict_get_int(stats, "completion_delay_total_ns"), >, 0);
+    qobject_unref(stats);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+/*
+ * With only notify-coalesce-usecs, a lone completion is signalled once
+ * it has waited that long.
+ */
+static void notify_coalesce_usecs(void *obj, void *data,
+                                  QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QTestState *qts = global_qtest;
+    uint64_t req_addr;
+    uint32_t free_head;
+    QVirtQueue *vq;
+    QDict *stats;
+
+    vq = coalesce_setup(dev, t_alloc);
+
+    free_head = vq->free_head;
+    req_addr = coalesce_add_read(qts, dev, t_alloc, vq, 0);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    g_assert_cmpint(readb(req_addr + 528), ==, 0);
+    guest_free(t_alloc, req_addr);
+
+    stats = coalesce_get_stats(qts);
+    g_assert_cmpint(qdict_get_int(stats, "submit_batches"), ==, 1);
+    g_assert_cmpint(qdict_get_int(stats, "submit_batched_requests"), ==, 1);
+    g_assert_cmpint(qdict_get_int(stats, "completion_batches"), ==, 1);
+    g_assert_cmpint(qdict_get_int(stats, "completion_batched_requests"), ==, 1);
+    g_assert_cmpint(qdict_get_int(stats, "completion_delay_total_ns"), >=,
+                    COALESCE_USECS * 1000LL);
+    qobject_unref(stats);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
+/* notify-coalesce-frames is refused without notify-coalesce-usecs */
+static void notify_coalesce_invalid(void *obj, void *data,
+                                    QGuestAllocator *t_alloc)
+{
+    QVirtioPCIDevice *dev1 = obj;
+    QTestState *qts = dev1->pdev->bus->qts;
+    QDict *rsp;
+
+    rsp = qtest_qmp(qts, "{'execute': 'device_add', 'arguments': {"
+                         " 'driver': 'virtio-blk-pci', 'id': 'drv1',"
+                         " 'drive': 'drive1', 'addr': %s,"
+                         " 'notify-coalesce-frames': %d }}",
+                    stringify(PCI_SLOT_HP) ".0", COALESCE_FRAMES);
+    g_assert(qdict_haskey(rsp, "error"));
+    g_assert_cmpstr(qdict_get_str(qdict_get_qdict(rsp, "error"), "desc"), ==,
+                    "notify-coalesce-frames requires notify-coalesce-usecs");
+    qobject_unref(rsp);
+}
+
 static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
 {
     char *tmp_path = drive_create();
@@ -797,6 +994,20 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+    qos_add_test("notify-coalesce/invalid", "virtio-blk-pci",
+                 notify_coalesce_invalid, &opts);
+
+    /* A timeout long enough that only the frame count raises interrupts */
+    opts.edge.extra_device_opts = "notify-coalesce-usecs=30000000,"
+                                  "notify-coalesce-frames="
+                                  stringify(COALESCE_FRAMES);
+    qos_add_test("notify-coalesce/frames", "virtio-blk-pci",
+                 notify_coalesce_frames, &opts);
+    opts.edge.extra_device_opts = "notify-coalesce-usecs="
+                                  stringify(COALESCE_USECS);
+    qos_add_test("notify-coalesce/usecs", "virtio-blk-pci",
+                 notify_coalesce_usecs, &opts);
+    opts.edge.extra_device_opts = NULL;
 }
 
 libqos_init(register_virtio_blk_test);
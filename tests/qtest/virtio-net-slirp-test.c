@@ -0,0 +1,253 @@
+/*
+ * QTest testcase for VirtIO NIC with the user (slirp) backend
+ *
+ * A UDP datagram goes from the guest through slirp to a server on the
+ * host loopback, and the server's answer comes back to the guest.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "libqtest-single.h"
+#include "qemu/module.h"
+#include "net/eth.h"
+#include "hw/virtio/virtio-net.h"
+#include "libqos/qgraph.h"
+#include "libqos/virtio-net.h"
+
+#define QVIRTIO_NET_TIMEOUT_US (30 * 1000 * 1000)
+#define VNET_HDR_SIZE sizeof(struct virtio_net_hdr_mrg_rxbuf)
+
+#define GUEST_MAC "\x52\x54\x00\x12\x34\x56"
+#define HOST_MAC "\x52\x55\x0a\x00\x02\x02"
+#define GUEST_IP 0x0a00020f     /* 10.0.2.15 */
+#define HOST_IP 0x0a000202      /* 10.0.2.2, the host loopback */
+#define GUEST_PORT 5555
+#define RX_BUF_SIZE 2048
+
+#ifndef _WIN32
+
+static uint16_t ip_checksum(const uint8_t *buf, size_t len)
+{
+    uint32_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < len; i += 2) {
+        sum += (buf[i] << 8) | buf[i + 1];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static void send_frame(QVirtioDevice *dev, QGuestAllocator *alloc,
+                       QVirtQueue *vq, const uint8_t *frame, size_t len)
+{
+    QTestState *qts = global_qtest;
+    uint64_t req_addr;
+    uint32_t free_head;
+
+    req_addr = guest_alloc(alloc, VNET_HDR_SIZE + len);
+    qtest_memset(qts, req_addr, 0, VNET_HDR_SIZE);
+    memwrite(req_addr + VNET_HDR_SIZE, frame, len);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, VNET_HDR_SIZE + len,
+                               false, false);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_NET_TIMEOUT_US);
+    guest_free(alloc, req_addr);
+}
+
+/* Tells slirp where the guest is, so that it can answer */
+static void send_arp_request(QVirtioDevice *dev, QGuestAllocator *alloc,
+                             QVirtQueue *vq)
+{
+    uint8_t frame[ETH_ZLEN] = { 0 };
+    uint8_t *arp = frame + ETH_HLEN;
+
+    memset(frame, 0xff, ETH_ALEN);
+    memcpy(frame + ETH_ALEN, GUEST_MAC, ETH_ALEN);
+    stw_be_p(frame + 2 * ETH_ALEN, ETH_P_ARP);
+
+    stw_be_p(arp, 1);                   /* Ethernet */
+    stw_be_p(arp + 2, ETH_P_IP);
+    arp[4] = ETH_ALEN;
+    arp[5] = 4;
+    stw_be_p(arp + 6, 1);               /* request */
+    memcpy(arp + 8, GUEST_MAC, ETH_ALEN);
+    stl_be_p(arp + 14, GUEST_IP);
+    stl_be_p(arp + 24, HOST_IP);
+
+    send_frame(dev, alloc, vq, frame, sizeof(frame));
+}
+
+static void send_udp(QVirtioDevice *dev, QGuestAllocator *alloc,
+                     QVirtQueue *vq, uint16_t port, const char *payload)
+{
+    size_t len = strlen(payload);
+    size_t frame_len = ETH_HLEN + sizeof(struct ip_header) +
+                       sizeof(struct udp_header) + len;
+    g_autofree uint8_t *frame = g_malloc0(frame_len);
+    uint8_t *ip = frame + ETH_HLEN;
+    uint8_t *udp = ip + sizeof(struct ip_header);
+
+    memcpy(frame, HOST_MAC, ETH_ALEN);
+    memcpy(frame + ETH_ALEN, GUEST_MAC, ETH_ALEN);
+    stw_be_p(frame + 2 * ETH_ALEN, ETH_P_IP);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, frame_len - ETH_HLEN);
+    ip[8] = 64;
+    ip[9] = IP_PROTO_UDP;
+    stl_be_p(ip + 12, GUEST_IP);
+    stl_be_p(ip + 16, HOST_IP);
+    stw_be_p(ip + 10, ip_checksum(ip, sizeof(struct ip_header)));
+
+    /* A zero UDP checksum means none */
+    stw_be_p(udp, GUEST_PORT);
+    stw_be_p(udp + 2, port);
+    stw_be_p(udp + 4, sizeof(struct udp_header) + len);
+    memcpy(udp + sizeof(struct udp_header), payload, len);
+
+    send_frame(dev, alloc, vq, frame, frame_len);
+}
+
+/* Returns the payload of the next UDP datagram slirp sends the guest */
+static char *recv_udp(QVirtioDevice *dev, QGuestAllocator *alloc,
+                      QVirtQueue *vq)
+{
+    QTestState *qts = global_qtest;
+    uint8_t frame[RX_BUF_SIZE];
+    int i;
+
+    /* Skip the ARP reply and anything else slirp sends first */
+    for (i = 0; i < 8; i++) {
+        uint64_t req_addr = guest_alloc(alloc, RX_BUF_SIZE);
+        uint32_t free_head, len;
+        uint8_t *ip = frame + ETH_HLEN;
+        uint8_t *udp = ip + sizeof(struct ip_header);
+
+        free_head = qvirtqueue_add(qts, vq, req_addr, RX_BUF_SIZE, true,
+                                   false);
+        qvirtqueue_kick(qts, dev, vq, free_head);
+        qvirtio_wait_used_elem(qts, dev, vq, free_head, &len,
+                               QVIRTIO_NET_TIMEOUT_US);
+        memread(req_addr + VNET_HDR_SIZE, frame, len - VNET_HDR_SIZE);
+        guest_free(alloc, req_addr);
+        len -= VNET_HDR_SIZE;
+
+        if (len < ETH_HLEN + sizeof(struct ip_header) +
+                  sizeof(struct udp_header) ||
+            lduw_be_p(frame + 2 * ETH_ALEN) != ETH_P_IP ||
+            ip[9] != IP_PROTO_UDP) {
+            continue;
+        }
+
+        g_assert(!memcmp(frame, GUEST_MAC, ETH_ALEN));
+        g_assert_cmphex(ldl_be_p(ip + 16), ==, GUEST_IP);
+        g_assert_cmphex(ip_checksum(ip, sizeof(struct ip_header)), ==, 0);
+        g_assert_cmpint(lduw_be_p(udp + 2), ==, GUEST_PORT);
+        return g_strndup((char *)udp + sizeof(struct udp_header),
+                         lduw_be_p(udp + 4) - sizeof(struct udp_header));
+    }
+
+    g_assert_not_reached();
+}
+
+static void slirp_udp_test(void *obj, void *data, QGuestAllocator *t_alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *rx = net_if->queues[0];
+    QVirtQueue *tx = net_if->queues[1];
+    int *server = data;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    g_autofree char *reply = NULL;
+    char buf[64];
+    ssize_t ret;
+
+    ret = getsockname(*server, (struct sockaddr *)&addr, &addrlen);
+    g_assert_cmpint(ret, ==, 0);
+
+    send_arp_request(dev, t_alloc, tx);
+    send_udp(dev, t_alloc, tx, ntohs(addr.sin_port), "PING");
+
+    addrlen = sizeof(addr);
+    ret = recvfrom(*server, buf, sizeof(buf), 0,
+                   (struct sockaddr *)&addr, &addrlen);
+    g_assert_cmpint(ret, ==, 4);
+    g_assert(!memcmp(buf, "PING", 4));
+
+    ret = sendto(*server, "PONG", 4, 0, (struct sockaddr *)&addr, addrlen);
+    g_assert_cmpint(ret, ==, 4);
+
+    reply = recv_udp(dev, t_alloc, rx);
+    g_assert_cmpstr(reply, ==, "PONG");
+}
+
+static void iothread_slirp_udp_test(void *obj, void *data,
+                                    QGuestAllocator *t_alloc)
+{
+    QVirtioNetPCI *net_pci = obj;
+
+    slirp_udp_test(&net_pci->net, data, t_alloc);
+}
+
+static void virtio_net_slirp_test_cleanup(void *server)
+{
+    int *fd = server;
+
+    qos_invalidate_command_line();
+    close(*fd);
+    g_free(fd);
+}
+
+static void *virtio_net_slirp_test_setup(GString *cmd_line, void *arg)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int *fd = g_new(int, 1);
+    int ret;
+
+    *fd = socket(AF_INET, SOCK_DGRAM, 0);
+    g_assert_cmpint(*fd, !=, -1);
+    ret = bind(*fd, (struct sockaddr *)&addr, sizeof(addr));
+    g_assert_cmpint(ret, ==, 0);
+
+    g_string_append(cmd_line, " -netdev user,id=hs0,ipv6=off ");
+
+    g_test_queue_destroy(virtio_net_slirp_test_cleanup, fd);
+    return fd;
+}
+
+static void *virtio_net_slirp_test_setup_iothread(GString *cmd_line,
+                                                  void *arg)
+{
+    g_string_append(cmd_line, " -object iothread,id=thread0 ");
+    return virtio_net_slirp_test_setup(cmd_line, arg);
+}
+
+static void register_virtio_net_slirp_test(void)
+{
+    QOSGraphTestOptions opts = {
+        .before = virtio_net_slirp_test_setup,
+    };
+
+    qos_add_test("slirp/udp", "virtio-net", slirp_udp_test, &opts);
+
+    opts.before = virtio_net_slirp_test_setup_iothread;
+    opts.edge.extra_device_opts = "len-iothreads=1,iothreads[0]=thread0";
+    qos_add_test("iothread/slirp/udp", "virtio-net-pci",
+                 iothread_slirp_udp_test, &opts);
+}
+
+libqos_init(register_virtio_net_slirp_test);
+
+#endif
@@ -166,6 +166,26 @@ static void stop_cont_test(void *obj, void *data, QGuestAllocator *t_alloc)
     rx_stop_cont_test(dev, t_alloc, rx, sv[0]);
 }
 
+/*
+ * Same as send_recv_test and stop_cont_test, with the queues and the
+ * socket backend running in an IOThread
+ */
+static void iothread_send_recv_test(void *obj, void *data,
+                                    QGuestAllocator *t_alloc)
+{
+    QVirtioNetPCI *net_pci = obj;
+
+    send_recv_test(&net_pci->net, data, t_alloc);
+}
+
+static void iothread_stop_cont_test(void *obj, void *data,
+                                    QGuestAllocator *t_alloc)
+{
+    QVirtioNetPCI *net_pci = obj;
+
+    stop_cont_test(&net_pci->net, data, t_alloc);
+}
+
 #endif
 
 static void hotplug(void *obj, void *data, QGuestAllocator *t_alloc)
@@ -307,6 +327,12 @@ static void large_tx(void *obj, void *data, QGuestAllocator *t_alloc)
     guest_free(t_alloc, req_addr);
 }
 
+static void *virtio_net_test_setup_iothread(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line, " -object iothread,id=thread0 ");
+    return virtio_net_test_setup(cmd_line, arg);
+}
+
 static void *virtio_net_test_setup_nosocket(GString *cmd_line, void *arg)
 {
     g_string_append(cmd_line, " -netdev hubport,hubid=0,id=hs0 ");
@@ -326,6 +352,16 @@ static void register_virtio_net_test(void)
 #endif
     qos_add_test("announce-self", "virtio-net", announce_self, &opts);
 
+#ifndef _WIN32
+    opts.before = virtio_net_test_setup_iothread;
+    opts.edge.extra_device_opts = "len-iothreads=1,iothreads[0]=thread0";
+    qos_add_test("iothread/basic", "virtio-net-pci",
+                 iothread_send_recv_test, &opts);
+    qos_add_test("iothread/rx_stop_cont", "virtio-net-pci",
+                 iothread_stop_cont_test, &opts);
+    opts.edge.extra_device_opts = NULL;
+#endif
+
     /* These tests do not need a loopback backend.  */
     opts.before = virtio_net_test_setup_nosocket;
     opts.arg = (gpointer)UINT_MAX;
@@ -620,7 +620,7 @@ static void test_propagate_mirror(void)
                  MIRROR_SYNC_MODE_NONE, MIRROR_OPEN_BACKING_CHAIN, false,
                  BLOCKDEV_ON_ERROR_REPORT, BLOCKDEV_ON_ERROR_REPORT,
                  false, "filter_node", MIRROR_COPY_MODE_BACKGROUND,
-                 &error_abort);
+                 false, &error_abort);
     job = job_get("job0");
     filter = bdrv_find_node("filter_node");
 
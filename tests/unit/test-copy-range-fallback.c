@@ -0,0 +1,96 @@
+/*
+ * Test when callers of bdrv_co_copy_range() attempt offloaded copy again
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block.h"
+
+/* Count the requests that go before the next attempt */
+static int requests_skipped(BdrvCopyRangeFallback *f)
+{
+    int n = 0;
+
+    while (!bdrv_copy_range_fallback_try(f)) {
+        n++;
+        g_assert_cmpint(n, <=, 1024);
+    }
+    return n;
+}
+
+static void test_fallback_disabled(void)
+{
+    BdrvCopyRangeFallback f;
+    int i;
+
+    bdrv_copy_range_fallback_init(&f, false);
+    for (i = 0; i < 2000; i++) {
+        g_assert_false(bdrv_copy_range_fallback_try(&f));
+    }
+}
+
+static void test_fallback_success(void)
+{
+    BdrvCopyRangeFallback f;
+    int i;
+
+    bdrv_copy_range_fallback_init(&f, true);
+    for (i = 0; i < 100; i++) {
+        g_assert_true(bdrv_copy_range_fallback_try(&f));
+        bdrv_copy_range_fallback_done(&f, 0);
+    }
+}
+
+static void test_fallback_enotsup(void)
+{
+    BdrvCopyRangeFallback f;
+    int i;
+
+    bdrv_copy_range_fallback_init(&f, true);
+    g_assert_true(bdrv_copy_range_fallback_try(&f));
+    bdrv_copy_range_fallback_done(&f, -ENOTSUP);
+
+    for (i = 0; i < 2000; i++) {
+        g_assert_false(bdrv_copy_range_fallback_try(&f));
+    }
+}
+
+static void test_fallback_backoff(void)
+{
+    BdrvCopyRangeFallback f;
+    int i;
+
+    bdrv_copy_range_fallback_init(&f, true);
+    g_assert_true(bdrv_copy_range_fallback_try(&f));
+
+    /* The number of skipped requests doubles up to 1024 */
+    for (i = 1; i <= 12; i++) {
+        bdrv_copy_range_fallback_done(&f, -EINVAL);
+        g_assert_cmpint(requests_skipped(&f), ==, 1 << MIN(i, 10));
+    }
+
+    /* A success resets the backoff */
+    bdrv_copy_range_fallback_done(&f, 0);
+    g_assert_cmpint(requests_skipped(&f), ==, 0);
+    bdrv_copy_range_fallback_done(&f, -EIO);
+    g_assert_cmpint(requests_skipped(&f), ==, 2);
+
+    /* -ENOTSUP still disables offloading after other failures */
+    bdrv_copy_range_fallback_done(&f, -ENOTSUP);
+    for (i = 0; i < 2000; i++) {
+        g_assert_false(bdrv_copy_range_fallback_try(&f));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/copy-range-fallback/disabled", test_fallback_disabled);
+    g_test_add_func("/copy-range-fallback/success", test_fallback_success);
+    g_test_add_func("/copy-range-fallback/enotsup", test_fallback_enotsup);
+    g_test_add_func("/copy-range-fallback/backoff", test_fallback_backoff);
+
+    return g_test_run();
+}
@@ -0,0 +1,122 @@
+/*
+ * eBPF RSS loader unit tests
+ *
+ * Loading the steering program needs CAP_BPF, the tests that do are
+ * skipped when it cannot be loaded.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <bpf/bpf.h>
+#include "hw/virtio/virtio-net.h"
+#include "ebpf/ebpf_rss.h"
+
+#define TABLE_LEN VIRTIO_NET_RSS_MAX_TABLE_LEN
+
+static uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE];
+
+static bool set_table(struct EBPFRSSContext *ctx, uint16_t *table,
+                      uint16_t len)
+{
+    struct EBPFRSSConfig config = {
+        .redirect = 1,
+        .hash_types = VIRTIO_NET_RSS_HASH_TYPE_IPv4,
+        .indirections_len = len,
+    };
+
+    return ebpf_rss_set_all(ctx, &config, table, key);
+}
+
+static void check_map(struct EBPFRSSContext *ctx, const uint16_t *table,
+                      uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; i++) {
+        uint16_t value;
+
+        g_assert_cmpint(bpf_map_lookup_elem(ctx->map_indirections_table,
+                                            &i, &value), ==, 0);
+        g_assert_cmpint(value, ==, table[i]);
+    }
+}
+
+static bool load_program(struct EBPFRSSContext *ctx)
+{
+    ebpf_rss_init(ctx);
+    if (!ebpf_rss_load(ctx)) {
+        g_test_skip("the eBPF RSS program cannot be loaded");
+        return false;
+    }
+    return true;
+}
+
+/* Without a program nothing can be set, and the caller keeps in-QEMU RSS */
+static void test_ebpf_rss_unloaded(void)
+{
+    struct EBPFRSSContext ctx;
+    uint16_t table[TABLE_LEN] = {};
+
+    ebpf_rss_init(&ctx);
+    g_assert_false(ebpf_rss_is_loaded(&ctx));
+    g_assert_false(set_table(&ctx, table, TABLE_LEN));
+
+    /* Unloading what was never loaded is harmless */
+    ebpf_rss_unload(&ctx);
+    g_assert_false(ebpf_rss_is_loaded(&ctx));
+}
+
+/* Only changed entries are written, the map must still match the table */
+static void test_ebpf_rss_indirections(void)
+{
+    struct EBPFRSSContext ctx;
+    uint16_t table[TABLE_LEN];
+    int i;
+
+    if (!load_program(&ctx)) {
+        return;
+    }
+
+    for (i = 0; i < TABLE_LEN; i++) {
+        table[i] = i % 4;
+    }
+    g_assert_true(set_table(&ctx, table, TABLE_LEN));
+    check_map(&ctx, table, TABLE_LEN);
+
+    /* Move a few entries to another queue */
+    table[5] = 3;
+    table[77] = 0;
+    table[TABLE_LEN - 1] = 2;
+    g_assert_true(set_table(&ctx, table, TABLE_LEN));
+    check_map(&ctx, table, TABLE_LEN);
+
+    /* A shorter table leaves the rest of the map alone */
+    for (i = 0; i < TABLE_LEN / 2; i++) {
+        table[i] = 1;
+    }
+    g_assert_true(set_table(&ctx, table, TABLE_LEN / 2));
+    check_map(&ctx, table, TABLE_LEN);
+
+    /* Too long a table is refused */
+    g_assert_false(set_table(&ctx, table, TABLE_LEN + 1));
+
+    /* A reloaded program starts from a zeroed map */
+    ebpf_rss_unload(&ctx);
+    g_assert_true(load_program(&ctx));
+    g_assert_true(set_table(&ctx, table, TABLE_LEN));
+    check_map(&ctx, table, TABLE_LEN);
+
+    ebpf_rss_unload(&ctx);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/ebpf-rss/unloaded", test_ebpf_rss_unloaded);
+    g_test_add_func("/ebpf-rss/indirections", test_ebpf_rss_indirections);
+
+    return g_test_run();
+}
@@ -1042,6 +1042,76 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+#define MERGE_SIZE                 (L3 * 2 + 7)
+
+/* Set a range in @hb and in the shadow bitmap @bits, without checking.  */
+static void hbitmap_test_merge_set(HBitmap *hb, unsigned long *bits,
+                                   uint64_t first, uint64_t count)
+{
+    hbitmap_set(hb, first, count);
+    bitmap_set(bits, first, count);
+}
+
+static void test_hbitmap_merge_do(TestHBitmapData *data, bool sparse)
+{
+    HBitmap *b = hbitmap_alloc(MERGE_SIZE, 0);
+    unsigned long *bits_b = bitmap_new(MERGE_SIZE);
+    uint64_t i;
+
+    hbitmap_test_init(data, MERGE_SIZE, 0);
+    for (i = 0; i < MERGE_SIZE / 2; i += 1000) {
+        hbitmap_test_merge_set(data->hb, data->bits, i, 300);
+    }
+    hbitmap_test_merge_set(data->hb, data->bits, MERGE_SIZE - 3, 3);
+
+    if (sparse) {
+        /* Mostly in words that are empty in the destination */
+        for (i = 5; i < MERGE_SIZE; i += L2 + 1) {
+            hbitmap_test_merge_set(b, bits_b, i, 1);
+        }
+        hbitmap_test_merge_set(b, bits_b, L3 - 70, 2 * L1);
+        hbitmap_test_merge_set(b, bits_b, MERGE_SIZE - 1, 1);
+    } else {
+        for (i = 100; i < MERGE_SIZE; i += 777) {
+            hbitmap_test_merge_set(b, bits_b, i, MIN(50, MERGE_SIZE - i));
+        }
+    }
+
+    g_assert(hbitmap_merge(data->hb, b, data->hb));
+    bitmap_or(data->bits, data->bits, bits_b, MERGE_SIZE);
+    hbitmap_test_check(data, 0);
+
+    hbitmap_free(b);
+    g_free(bits_b);
+    hbitmap_test_teardown(data, NULL);
+}
+
+static void test_hbitmap_next_zero_long(TestHBitmapData *data)
+{
+    hbitmap_test_init(data, MERGE_SIZE, 0);
+    hbitmap_set(data->hb, 0, L2 + 17);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, MERGE_SIZE), ==, L2 + 17);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, L1 + 3, MERGE_SIZE), ==,
+                    L2 + 17);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, L2), ==, -1);
+
+    hbitmap_set(data->hb, L2, MERGE_SIZE - L2);
+    g_assert_cmpint(hbitmap_next_zero(data->hb, 0, MERGE_SIZE), ==, -1);
+    hbitmap_test_teardown(data, NULL);
+}
+
+/* Go through all the implementations of the bulk operations.  This has to
+ * be a single test, because there is no way back to the best one.
+ */
+static void test_hbitmap_accel(TestHBitmapData *data, const void *unused)
+{
+    do {
+        test_hbitmap_merge_do(data, false);
+        test_hbitmap_merge_do(data, true);
+        test_hbitmap_next_zero_long(data);
+    } while (test_hbitmap_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1183,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add("/hbitmap/accel", test_hbitmap_accel);
+
     g_test_run();
 
     return 0;
@@ -0,0 +1,138 @@
+/*
+ * Test the adaptive request sizing of block jobs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "block/job-tuner.h"
+
+/*
+ * Complete requests in rounds of t->in_flight parallel requests until one
+ * sampling period has passed.  @latency_ns returns the latency of a request
+ * for a given number of parallel requests.
+ */
+static void run_period(BlockJobTuner *t, int64_t *now,
+                       int64_t (*latency_ns)(int in_flight))
+{
+    int64_t end = *now + BLOCK_JOB_TUNER_PERIOD_NS;
+
+    while (*now < end) {
+        int n = t->in_flight;
+        int64_t chunk = t->chunk;
+        int64_t lat = latency_ns(n);
+        int i;
+
+        *now += lat;
+        for (i = 0; i < n; i++) {
+            block_job_tuner_done(t, chunk, *now - lat, *now, 0);
+        }
+    }
+}
+
+/* The target serves any number of parallel requests in the same time */
+static int64_t latency_flat(int in_flight)
+{
+    return SCALE_MS;
+}
+
+/* Beyond 8 parallel requests, requests just queue up in the target */
+static int64_t latency_queueing(int in_flight)
+{
+    return SCALE_MS * MAX(in_flight, 8) / 8;
+}
+
+static void test_job_tuner_grow(void)
+{
+    BlockJobTuner t;
+    int64_t now = SCALE_MS;
+    int i;
+
+    block_job_tuner_init(&t, 1 * MiB, 64 * KiB, 16 * MiB, 4, 1, 64);
+    for (i = 0; i < 100; i++) {
+        run_period(&t, &now, latency_flat);
+    }
+
+    /* Parallelism is raised first, then the request length */
+    g_assert_cmpint(t.in_flight, ==, 64);
+    g_assert_cmpint(t.chunk, ==, 16 * MiB);
+    g_assert_cmpint(t.adjustments, ==, 60 + 4);
+}
+
+static void test_job_tuner_congestion(void)
+{
+    BlockJobTuner t;
+    int64_t now = SCALE_MS;
+    int max_seen = 0;
+    int i;
+
+    block_job_tuner_init(&t, 1 * MiB, 64 * KiB, 16 * MiB, 4, 1, 64);
+    for (i = 0; i < 100; i++) {
+        run_period(&t, &now, latency_queueing);
+        max_seen = MAX(max_seen, t.in_flight);
+    }
+
+    /*
+     * Latency doubles over the baseline at 17 parallel requests without
+     * any throughput gain, so parallelism must be cut back there.
+     */
+    g_assert_cmpint(max_seen, ==, 17);
+    g_assert_cmpint(t.in_flight, >=, 8);
+    g_assert_cmpint(t.in_flight, <=, 17);
+    g_assert_cmpint(t.chunk, ==, 1 * MiB);
+}
+
+static void test_job_tuner_error(void)
+{
+    BlockJobTuner t;
+    int i;
+
+    block_job_tuner_init(&t, 1 * MiB, 256 * KiB, 16 * MiB, 16, 1, 64);
+
+    block_job_tuner_done(&t, 1 * MiB, SCALE_MS, 2 * SCALE_MS, -EIO);
+    g_assert_cmpint(t.in_flight, ==, 8);
+    g_assert_cmpint(t.chunk, ==, 1 * MiB);
+
+    /* Once parallelism is at its minimum, the request length is halved */
+    for (i = 0; i < 10; i++) {
+        block_job_tuner_done(&t, 1 * MiB, SCALE_MS, 2 * SCALE_MS, -EIO);
+    }
+    g_assert_cmpint(t.in_flight, ==, 1);
+    g_assert_cmpint(t.chunk, ==, 256 * KiB);
+    g_assert_cmpint(t.adjustments, ==, 4 + 2);
+}
+
+static void test_job_tuner_info(void)
+{
+    BlockJobTuner t;
+    BlockJobTuningInfo *info;
+    int64_t now = SCALE_MS;
+
+    block_job_tuner_init(&t, 1 * MiB, 64 * KiB, 16 * MiB, 4, 1, 64);
+    g_assert_null(block_job_tuner_info(&t));
+
+    run_period(&t, &now, latency_flat);
+    info = block_job_tuner_info(&t);
+    g_assert_nonnull(info);
+    g_assert_cmpint(info->chunk_size, ==, 1 * MiB);
+    g_assert_cmpint(info->max_in_flight, ==, 5);
+    g_assert_cmpint(info->latency_ns, ==, SCALE_MS);
+    /* 4 MiB per millisecond, give or take the requests at the edges */
+    g_assert_cmpint(info->throughput, >, 3 * GiB);
+    g_assert_cmpint(info->throughput, <=, 4 * GiB);
+    g_assert_cmpint(info->adjustments, ==, 1);
+    qapi_free_BlockJobTuningInfo(info);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/job-tuner/grow", test_job_tuner_grow);
+    g_test_add_func("/job-tuner/congestion", test_job_tuner_congestion);
+    g_test_add_func("/job-tuner/error", test_job_tuner_error);
+    g_test_add_func("/job-tuner/info", test_job_tuner_info);
+
+    return g_test_run();
+}
@@ -0,0 +1,143 @@
+/*
+ * Internet checksum unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+
+#define MAX_LEN 1500
+#define MAX_OFFSET 8
+
+/* RFC 1071, one 16-bit big endian word at a time */
+static uint16_t ref_checksum(const uint8_t *buf, int len)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += (buf[i] << 8) | buf[i + 1];
+    }
+    if (i < len) {
+        sum += buf[i] << 8;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static void fill_random(uint8_t *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = g_test_rand_int_range(0, 256);
+    }
+}
+
+static void test_checksum_lengths(void)
+{
+    uint8_t *mem = g_malloc(MAX_LEN + MAX_OFFSET);
+    int len, off;
+
+    for (off = 0; off < MAX_OFFSET; off++) {
+        uint8_t *buf = mem + off;
+
+        for (len = 0; len <= MAX_LEN; len++) {
+            fill_random(buf, len);
+            g_assert_cmphex(net_raw_checksum(buf, len), ==,
+                            ref_checksum(buf, len));
+        }
+    }
+
+    g_free(mem);
+}
+
+static void test_checksum_carry(void)
+{
+    uint8_t *buf = g_malloc(MAX_LEN);
+    int len;
+
+    /* All ones stresses the folding of the wide accumulator */
+    memset(buf, 0xff, MAX_LEN);
+    for (len = 0; len <= MAX_LEN; len++) {
+        g_assert_cmphex(net_raw_checksum(buf, len), ==,
+                        ref_checksum(buf, len));
+    }
+
+    g_free(buf);
+}
+
+static void test_checksum_cont(void)
+{
+    uint8_t *buf = g_malloc(MAX_LEN);
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        int len = g_test_rand_int_range(0, MAX_LEN + 1);
+        int split = g_test_rand_int_range(0, len + 1);
+        uint32_t sum;
+
+        fill_random(buf, len);
+
+        /* An odd split makes the second chunk start at an odd offset */
+        sum = net_checksum_add_cont(split, buf, 0);
+        sum += net_checksum_add_cont(len - split, buf + split, split);
+        g_assert_cmphex(net_checksum_finish(sum), ==,
+                        ref_checksum(buf, len));
+    }
+
+    g_free(buf);
+}
+
+static void test_checksum_iov(void)
+{
+    uint8_t *buf = g_malloc(MAX_LEN);
+    struct iovec iov[16];
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        int len = g_test_rand_int_range(1, MAX_LEN + 1);
+        int skip = g_test_rand_int_range(0, len);
+        int pos = 0;
+        unsigned int cnt = 0;
+        uint32_t sum;
+
+        fill_random(buf, len);
+
+        /* Cut the buffer into randomly sized, mostly odd, chunks */
+        while (pos < len && cnt < ARRAY_SIZE(iov) - 1) {
+            int chunk = MIN(g_test_rand_int_range(1, 200), len - pos);
+
+            iov[cnt].iov_base = buf + pos;
+            iov[cnt].iov_len = chunk;
+            pos += chunk;
+            cnt++;
+        }
+        if (pos < len) {
+            iov[cnt].iov_base = buf + pos;
+            iov[cnt].iov_len = len - pos;
+            cnt++;
+        }
+
+        sum = net_checksum_add_iov(iov, cnt, skip, len - skip, 0);
+        g_assert_cmphex(net_checksum_finish(sum), ==,
+                        ref_checksum(buf + skip, len - skip));
+    }
+
+    g_free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum/lengths", test_checksum_lengths);
+    g_test_add_func("/net/checksum/carry", test_checksum_carry);
+    g_test_add_func("/net/checksum/cont", test_checksum_cont);
+    g_test_add_func("/net/checksum/iov", test_checksum_iov);
+    return g_test_run();
+}
@@ -0,0 +1,366 @@
+/*
+ * Tap batched receive unit tests
+ *
+ * The tap backend is opened with fd= on one end of a SOCK_SEQPACKET
+ * socketpair, which like a tap fd returns one packet per read(), and
+ * its peer is a NIC-like client that takes packets in batches.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/socket.h>
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/main-loop.h"
+#include "monitor/monitor.h"
+#include "net/net.h"
+#include "net/filter.h"
+#include "net/colo-compare.h"
+#include "net/vhost_net.h"
+#include "sysemu/runstate.h"
+#include "sysemu/sysemu.h"
+#include "../net/clients.h"
+
+/* Same as in net/tap.c */
+#define TAP_SEND_MAX_PACKETS 50
+
+#define SMALL_PKT 64
+#define LARGE_PKT 16000
+#define MAX_BATCHES 64
+
+typedef struct TapTestNic {
+    NetClientState *nc;
+    /* Packets taken per receive_batch call */
+    int batch_limit;
+    int batches[MAX_BATCHES];
+    int nbatches;
+    /* Packets received, through either callback */
+    int received;
+    int received_single;
+} TapTestNic;
+
+static TapTestNic nic;
+
+/*
+ * The test links net.c, hub.c, queue.c, util.c and tap.c; these come
+ * from the rest of the emulator, and only the first four are reached.
+ */
+bool runstate_is_running(void)
+{
+    return true;
+}
+
+int monitor_fd_param(Monitor *mon, const char *fdname, Error **errp)
+{
+    int fd = qemu_parse_fd(fdname);
+
+    if (fd < 0) {
+        error_setg(errp, "invalid fd '%s'", fdname);
+    }
+    return fd;
+}
+
+void qemu_add_exit_notifier(Notifier *notify)
+{
+}
+
+void qemu_remove_exit_notifier(Notifier *notify)
+{
+}
+
+int monitor_printf(Monitor *mon, const char *fmt, ...)
+{
+    g_assert_not_reached();
+}
+
+void colo_compare_cleanup(void)
+{
+}
+
+ssize_t qemu_netfilter_receive(NetFilterState *nf,
+                               NetFilterDirection direction,
+                               NetClientState *sender,
+                               unsigned flags,
+                               const struct iovec *iov,
+                               int iovcnt,
+                               NetPacketSent *sent_cb)
+{
+    g_assert_not_reached();
+}
+
+struct vhost_net *vhost_net_init(VhostNetOptions *options)
+{
+    g_assert_not_reached();
+}
+
+void vhost_net_cleanup(struct vhost_net *net)
+{
+    g_assert_not_reached();
+}
+
+#define NET_INIT_STUB(fn)                                               \
+int fn(const Netdev *netdev, const char *name, NetClientState *peer,    \
+       Error **errp)                                                    \
+{                                                                       \
+    g_assert_not_reached();                                             \
+}
+
+NET_INIT_STUB(net_init_socket)
+#ifdef CONFIG_SLIRP
+NET_INIT_STUB(net_init_slirp)
+#endif
+#ifdef CONFIG_VDE
+NET_INIT_STUB(net_init_vde)
+#endif
+#ifdef CONFIG_NETMAP
+NET_INIT_STUB(net_init_netmap)
+#endif
+#ifdef CONFIG_AF_XDP
+NET_INIT_STUB(net_init_af_xdp)
+#endif
+#ifdef CONFIG_VHOST_NET_USER
+NET_INIT_STUB(net_init_vhost_user)
+#endif
+#ifdef CONFIG_VHOST_NET_VDPA
+NET_INIT_STUB(net_init_vhost_vdpa)
+#endif
+#ifdef CONFIG_L2TPV3
+NET_INIT_STUB(net_init_l2tpv3)
+#endif
+
+/* Packets carry their sequence number in the first two bytes */
+static void check_packet(const uint8_t *buf, size_t size)
+{
+    g_assert_cmpint(size, >=, SMALL_PKT);
+    g_assert_cmpint(lduw_be_p(buf), ==, nic.received);
+    nic.received++;
+}
+
+static ssize_t nic_receive(NetClientState *nc, const uint8_t *buf,
+                           size_t size)
+{
+    check_packet(buf, size);
+    nic.received_single++;
+    return size;
+}
+
+static int nic_receive_batch(NetClientState *nc, const struct iovec *pkts,
+                             int count)
+{
+    int i;
+
+    g_assert_cmpint(count, <=, TAP_SEND_MAX_PACKETS);
+    g_assert_cmpint(nic.nbatches, <, MAX_BATCHES);
+    nic.batches[nic.nbatches++] = count;
+
+    count = MIN(count, nic.batch_limit);
+    for (i = 0; i < count; i++) {
+        check_packet(pkts[i].iov_base, pkts[i].iov_len);
+    }
+    return count;
+}
+
+static NetClientInfo nic_info = {
+    .type = NET_CLIENT_DRIVER_SOCKET,
+    .size = sizeof(NetClientState),
+    .receive = nic_receive,
+    .receive_batch = nic_receive_batch,
+};
+
+/* Create the NIC and a tap on @sock[1], return the tap */
+static NetClientState *tap_test_init(int *sock)
+{
+    g_autofree char *fd = NULL;
+    Netdev netdev = {
+        .type = NET_CLIENT_DRIVER_TAP,
+    };
+    int sndbuf = 1024 * 1024;
+    int ret;
+
+    memset(&nic, 0, sizeof(nic));
+    nic.batch_limit = TAP_SEND_MAX_PACKETS;
+    nic.nc = qemu_new_net_client(&nic_info, NULL, "nic", "nic0");
+
+    ret = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sock);
+    g_assert_cmpint(ret, ==, 0);
+    setsockopt(sock[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    fd = g_strdup_printf("%d", sock[1]);
+    netdev.u.tap.has_fd = true;
+    netdev.u.tap.fd = fd;
+    ret = net_init_tap(&netdev, "tap0", nic.nc, &error_abort);
+    g_assert_cmpint(ret, ==, 0);
+
+    g_assert(nic.nc->peer);
+    return nic.nc->peer;
+}
+
+static void tap_test_cleanup(NetClientState *tap, int *sock)
+{
+    if (tap) {
+        qemu_del_net_client(tap);
+    }
+    qemu_del_net_client(nic.nc);
+    close(sock[0]);
+}
+
+static void send_packets(int sock, int first, int count, size_t size)
+{
+    g_autofree uint8_t *buf = g_malloc0(size);
+    int i;
+
+    for (i = first; i < first + count; i++) {
+        stw_be_p(buf, i);
+        g_assert_cmpint(send(sock, buf, size, 0), ==, size);
+    }
+}
+
+static void wait_received(int count)
+{
+    while (nic.received < count) {
+        main_loop_wait(false);
+    }
+    g_assert_cmpint(nic.received, ==, count);
+}
+
+/* Let the main loop run without blocking, as long as it has work */
+static void drain_main_loop(void)
+{
+    int i;
+
+    for (i = 0; i < 10; i++) {
+        main_loop_wait(true);
+    }
+}
+
+/* A wakeup reads at most TAP_SEND_MAX_PACKETS packets, in one batch */
+static void test_tap_batch_max_packets(void)
+{
+    NetClientState *tap;
+    int sock[2];
+
+    tap = tap_test_init(sock);
+
+    send_packets(sock[0], 0, 120, SMALL_PKT);
+    wait_received(120);
+
+    g_assert_cmpint(nic.nbatches, ==, 3);
+    g_assert_cmpint(nic.batches[0], ==, 50);
+    g_assert_cmpint(nic.batches[1], ==, 50);
+    g_assert_cmpint(nic.batches[2], ==, 20);
+    g_assert_cmpint(nic.received_single, ==, 0);
+
+    /* A lone packet is a batch of one */
+    send_packets(sock[0], 120, 1, SMALL_PKT);
+    wait_received(121);
+    g_assert_cmpint(nic.nbatches, ==, 4);
+    g_assert_cmpint(nic.batches[3], ==, 1);
+
+    tap_test_cleanup(tap, sock);
+}
+
+/* Large packets fill the batch buffer before the packet limit */
+static void test_tap_batch_large_packets(void)
+{
+    NetClientState *tap;
+    int sock[2];
+    int i, total = 0;
+
+    tap = tap_test_init(sock);
+
+    send_packets(sock[0], 0, 16, LARGE_PKT);
+    wait_received(16);
+
+    g_assert_cmpint(nic.nbatches, >, 1);
+    for (i = 0; i < nic.nbatches; i++) {
+        g_assert_cmpint(nic.batches[i], <, 16);
+        total += nic.batches[i];
+    }
+    g_assert_cmpint(total, ==, 16);
+
+    tap_test_cleanup(tap, sock);
+}
+
+/*
+ * The NIC takes part of a batch: the rest is queued, tap stops reading
+ * until the queue is flushed, then batches resume.
+ */
+static void test_tap_batch_partial(void)
+{
+    NetClientState *tap;
+    int sock[2];
+
+    tap = tap_test_init(sock);
+
+    nic.batch_limit = 3;
+    send_packets(sock[0], 0, 10, SMALL_PKT);
+    wait_received(3);
+    g_assert_cmpint(nic.nbatches, ==, 1);
+    g_assert_cmpint(nic.batches[0], ==, 10);
+
+    /* Stalled: new packets stay in the socket */
+    send_packets(sock[0], 10, 5, SMALL_PKT);
+    drain_main_loop();
+    g_assert_cmpint(nic.received, ==, 3);
+    g_assert_cmpint(nic.nbatches, ==, 1);
+
+    /* The NIC has room again, the queued packets go one by one */
+    nic.batch_limit = TAP_SEND_MAX_PACKETS;
+    qemu_flush_queued_packets(nic.nc);
+    g_assert_cmpint(nic.received, ==, 10);
+    g_assert_cmpint(nic.received_single, ==, 7);
+
+    /* and tap reads again, in batches */
+    wait_received(15);
+    g_assert_cmpint(nic.nbatches, ==, 2);
+    g_assert_cmpint(nic.batches[1], ==, 5);
+    g_assert_cmpint(nic.received_single, ==, 7);
+
+    tap_test_cleanup(tap, sock);
+}
+
+/* Deleting the tap drops the rest of a partially taken batch */
+static void test_tap_batch_teardown(void)
+{
+    NetClientState *tap;
+    int sock[2];
+    uint8_t c = 0;
+
+    tap = tap_test_init(sock);
+
+    nic.batch_limit = 2;
+    send_packets(sock[0], 0, 10, SMALL_PKT);
+    wait_received(2);
+
+    qemu_del_net_client(tap);
+    g_assert_null(nic.nc->peer);
+
+    /* Nothing from the tap is left in the NIC's queue */
+    nic.batch_limit = TAP_SEND_MAX_PACKETS;
+    qemu_flush_queued_packets(nic.nc);
+    drain_main_loop();
+    g_assert_cmpint(nic.received, ==, 2);
+    g_assert_cmpint(nic.received_single, ==, 0);
+
+    /* and the tap fd is closed */
+    g_assert_cmpint(send(sock[0], &c, 1, MSG_NOSIGNAL), ==, -1);
+
+    tap_test_cleanup(NULL, sock);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qemu_init_main_loop(&error_abort);
+
+    g_test_add_func("/net/tap/batch/max-packets", test_tap_batch_max_packets);
+    g_test_add_func("/net/tap/batch/large-packets",
+                    test_tap_batch_large_packets);
+    g_test_add_func("/net/tap/batch/partial", test_tap_batch_partial);
+    g_test_add_func("/net/tap/batch/teardown", test_tap_batch_teardown);
+
+    return g_test_run();
+}
@@ -0,0 +1,194 @@
+/*
+ * NetTxPkt software segmentation unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "net/net.h"
+#include "hw/pci/pci.h"
+#include "hw/net/net_tx_pkt.h"
+
+#define MSS 1000
+#define PAYLOAD_LEN 2500
+#define TCP_HDR_LEN 20
+#define SEQ 0x12345678
+#define IP_ID 0x4321
+
+static PCIDevice pci_dev;
+static GPtrArray *sent;
+
+/*
+ * The guest buffers are test memory, so DMA addresses are host pointers
+ * and sending a packet only records it.
+ */
+void *address_space_map(AddressSpace *as, hwaddr addr,
+                        hwaddr *plen, bool is_write, MemTxAttrs attrs)
+{
+    return (void *)(uintptr_t)addr;
+}
+
+void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
+                         bool is_write, hwaddr access_len)
+{
+}
+
+ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
+                          int iovcnt)
+{
+    GByteArray *pkt = g_byte_array_sized_new(iov_size(iov, iovcnt));
+
+    g_byte_array_set_size(pkt, iov_size(iov, iovcnt));
+    iov_to_buf(iov, iovcnt, 0, pkt->data, pkt->len);
+    g_ptr_array_add(sent, pkt);
+    return pkt->len;
+}
+
+ssize_t qemu_receive_packet_iov(NetClientState *nc, const struct iovec *iov,
+                                int iovcnt)
+{
+    return qemu_sendv_packet(nc, iov, iovcnt);
+}
+
+static size_t build_frame(uint8_t *frame, bool ipv6)
+{
+    size_t l3_len = ipv6 ? sizeof(struct ip6_header) :
+                           sizeof(struct ip_header);
+    uint8_t *l3 = frame + ETH_HLEN;
+    uint8_t *tcp = l3 + l3_len;
+    int i;
+
+    memset(frame, 0, ETH_HLEN + l3_len + TCP_HDR_LEN);
+
+    /* Ethernet */
+    memcpy(frame, "\x52\x54\x00\x12\x34\x56", ETH_ALEN);
+    memcpy(frame + ETH_ALEN, "\x52\x54\x00\x12\x34\x57", ETH_ALEN);
+    stw_be_p(frame + 2 * ETH_ALEN, ipv6 ? ETH_P_IPV6 : ETH_P_IP);
+
+    if (ipv6) {
+        stl_be_p(l3, 0x60000000);
+        stw_be_p(l3 + 4, TCP_HDR_LEN + PAYLOAD_LEN);
+        l3[6] = IP_PROTO_TCP;
+        l3[7] = 64;
+        for (i = 0; i < 32; i++) {
+            l3[8 + i] = i;
+        }
+    } else {
+        l3[0] = 0x45;
+        stw_be_p(l3 + 2, l3_len + TCP_HDR_LEN + PAYLOAD_LEN);
+        stw_be_p(l3 + 4, IP_ID);
+        l3[8] = 64;
+        l3[9] = IP_PROTO_TCP;
+        stl_be_p(l3 + 12, 0x0a000001);
+        stl_be_p(l3 + 16, 0x0a000002);
+    }
+
+    /* TCP with ACK and PSH */
+    stw_be_p(tcp, 1234);
+    stw_be_p(tcp + 2, 80);
+    stl_be_p(tcp + 4, SEQ);
+    stl_be_p(tcp + 8, 1);
+    tcp[12] = (TCP_HDR_LEN / 4) << 4;
+    tcp[13] = TH_ACK | TH_PUSH;
+    stw_be_p(tcp + 14, 65535);
+
+    for (i = 0; i < PAYLOAD_LEN; i++) {
+        tcp[TCP_HDR_LEN + i] = g_test_rand_int_range(0, 256);
+    }
+
+    return ETH_HLEN + l3_len + TCP_HDR_LEN + PAYLOAD_LEN;
+}
+
+static uint16_t tcp_checksum(const uint8_t *l3, uint8_t *tcp, size_t len,
+                             bool ipv6)
+{
+    uint32_t sum;
+
+    if (ipv6) {
+        sum = net_checksum_add(32, (uint8_t *)l3 + 8);
+    } else {
+        sum = net_checksum_add(8, (uint8_t *)l3 + 12);
+    }
+    sum += IP_PROTO_TCP + len;
+    sum += net_checksum_add(len, tcp);
+    return net_checksum_finish(sum);
+}
+
+static void test_tso(const void *opaque)
+{
+    bool ipv6 = GPOINTER_TO_INT(opaque);
+    size_t l3_len = ipv6 ? sizeof(struct ip6_header) :
+                           sizeof(struct ip_header);
+    size_t hdr_len = ETH_HLEN + l3_len + TCP_HDR_LEN;
+    /* Odd cuts, one of them inside the headers */
+    size_t cuts[] = { 0, 61, 1001, 1778, 0 };
+    uint8_t *frame = g_malloc(hdr_len + PAYLOAD_LEN);
+    struct NetTxPkt *pkt;
+    size_t frame_len, offset = 0;
+    int i;
+
+    sent = g_ptr_array_new_with_free_func((GDestroyNotify)g_byte_array_unref);
+    frame_len = build_frame(frame, ipv6);
+    cuts[ARRAY_SIZE(cuts) - 1] = frame_len;
+
+    net_tx_pkt_init(&pkt, &pci_dev, 64, false);
+    for (i = 0; i < ARRAY_SIZE(cuts) - 1; i++) {
+        g_assert(net_tx_pkt_add_raw_fragment(pkt,
+                                             (uintptr_t)frame + cuts[i],
+                                             cuts[i + 1] - cuts[i]));
+    }
+    g_assert(net_tx_pkt_parse(pkt));
+    net_tx_pkt_build_vheader(pkt, true, true, MSS);
+    g_assert(net_tx_pkt_send(pkt, NULL));
+
+    g_assert_cmpint(sent->len, ==, DIV_ROUND_UP(PAYLOAD_LEN, MSS));
+
+    for (i = 0; i < sent->len; i++) {
+        GByteArray *seg = g_ptr_array_index(sent, i);
+        uint8_t *l3 = seg->data + ETH_HLEN;
+        uint8_t *tcp = l3 + l3_len;
+        size_t seg_len = MIN(MSS, PAYLOAD_LEN - offset);
+        bool last = i == sent->len - 1;
+
+        g_assert_cmpint(seg->len, ==, hdr_len + seg_len);
+        g_assert(!memcmp(seg->data, frame, ETH_HLEN));
+
+        if (ipv6) {
+            g_assert_cmpint(lduw_be_p(l3 + 4), ==, TCP_HDR_LEN + seg_len);
+        } else {
+            g_assert_cmpint(lduw_be_p(l3 + 2), ==,
+                            l3_len + TCP_HDR_LEN + seg_len);
+            g_assert_cmpint(lduw_be_p(l3 + 4), ==, IP_ID + i);
+            g_assert_cmphex(net_raw_checksum(l3, l3_len), ==, 0);
+        }
+
+        g_assert_cmphex(ldl_be_p(tcp + 4), ==, SEQ + offset);
+        g_assert_cmphex(tcp[13], ==, last ? TH_ACK | TH_PUSH : TH_ACK);
+        g_assert_cmphex(tcp_checksum(l3, tcp, TCP_HDR_LEN + seg_len, ipv6),
+                        ==, 0);
+        g_assert(!memcmp(tcp + TCP_HDR_LEN, frame + hdr_len + offset,
+                         seg_len));
+
+        offset += seg_len;
+    }
+    g_assert_cmpint(offset, ==, PAYLOAD_LEN);
+
+    net_tx_pkt_reset(pkt);
+    net_tx_pkt_uninit(pkt);
+    g_ptr_array_free(sent, true);
+    g_free(frame);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/net/tx-pkt/tso/ipv4", GINT_TO_POINTER(false),
+                         test_tso);
+    g_test_add_data_func("/net/tx-pkt/tso/ipv6", GINT_TO_POINTER(true),
+                         test_tso);
+    return g_test_run();
+}
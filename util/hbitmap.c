@@ -101,6 +101,271 @@ struct HBitmap {
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+/* Bulk operations on the words of a level.  These are the inner loops of
+ * hbitmap_merge, hbitmap_next_zero and hbitmap_deserialize_finish, which
+ * go over every word of the bottom level; they are vectorized on hosts
+ * that support it.
+ */
+
+/* Return the number of set bits in the @n words at @p.  */
+static uint64_t hb_count_words_int(const unsigned long *p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        count += ctpopl(p[i]);
+    }
+    return count;
+}
+
+/* Store @a | @b into @dst for @n words and return the number of set bits
+ * in the result.  @dst may be equal to @a or @b.
+ */
+static uint64_t hb_or_words_int(unsigned long *dst, const unsigned long *a,
+                                const unsigned long *b, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] | b[i];
+        count += ctpopl(dst[i]);
+    }
+    return count;
+}
+
+/* Return the index of the first word in [@i, @n) that is not all ones,
+ * or @n if there is none.
+ */
+static size_t hb_find_not_ones_int(const unsigned long *p, size_t i, size_t n)
+{
+    while (i < n && p[i] == ~0UL) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef CONFIG_AVX2_OPT
+/* Without -mpopcnt, ctpopl is a table lookup in libgcc.  As in
+ * bufferiszero.c, the includes have to be within the corresponding
+ * push_options region, ordered with increasing ISA.
+ */
+#pragma GCC push_options
+#pragma GCC target("popcnt")
+
+static uint64_t hb_count_words_popcnt(const unsigned long *p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        count += __builtin_popcountl(p[i]);
+    }
+    return count;
+}
+
+static uint64_t hb_or_words_popcnt(unsigned long *dst, const unsigned long *a,
+                                   const unsigned long *b, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] | b[i];
+        count += __builtin_popcountl(dst[i]);
+    }
+    return count;
+}
+
+#pragma GCC pop_options
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+#define HB_WORDS_PER_VEC   (sizeof(__m256i) / sizeof(unsigned long))
+
+/* Add the number of set bits in each 8-byte lane of @v to @acc, using
+ * a nibble lookup table; this beats one popcnt per word.
+ */
+static inline __m256i hb_popcount_avx2(__m256i v, __m256i acc)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low));
+    __m256i hi = _mm256_shuffle_epi8(lookup,
+                                     _mm256_and_si256(_mm256_srli_epi16(v, 4),
+                                                      low));
+    __m256i bytes = _mm256_add_epi8(lo, hi);
+
+    return _mm256_add_epi64(acc, _mm256_sad_epu8(bytes,
+                                                 _mm256_setzero_si256()));
+}
+
+static inline uint64_t hb_popcount_sum_avx2(__m256i acc)
+{
+    uint64_t lanes[4];
+
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+static uint64_t hb_count_words_avx2(const unsigned long *p, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + HB_WORDS_PER_VEC <= n; i += HB_WORDS_PER_VEC) {
+        acc = hb_popcount_avx2(_mm256_loadu_si256((const __m256i *)(p + i)),
+                               acc);
+    }
+    return hb_popcount_sum_avx2(acc) + hb_count_words_int(p + i, n - i);
+}
+
+static uint64_t hb_or_words_avx2(unsigned long *dst, const unsigned long *a,
+                                 const unsigned long *b, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i;
+
+    for (i = 0; i + HB_WORDS_PER_VEC <= n; i += HB_WORDS_PER_VEC) {
+        __m256i v = _mm256_or_si256(
+            _mm256_loadu_si256((const __m256i *)(a + i)),
+            _mm256_loadu_si256((const __m256i *)(b + i)));
+
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+        acc = hb_popcount_avx2(v, acc);
+    }
+    return hb_popcount_sum_avx2(acc) +
+           hb_or_words_int(dst + i, a + i, b + i, n - i);
+}
+
+static size_t hb_find_not_ones_avx2(const unsigned long *p, size_t i, size_t n)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+
+    /* Skip whole vectors of ones, the scalar loop finds the word.  */
+    for (; i + HB_WORDS_PER_VEC <= n; i += HB_WORDS_PER_VEC) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+
+        if (!_mm256_testc_si256(v, ones)) {
+            break;
+        }
+    }
+    return hb_find_not_ones_int(p, i, n);
+}
+
+#pragma GCC pop_options
+
+/* Note that for test_hbitmap_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_POPCNT  2
+
+static unsigned cpuid_cache;
+static uint64_t (*hb_count_words)(const unsigned long *, size_t) =
+    hb_count_words_int;
+static uint64_t (*hb_or_words)(unsigned long *, const unsigned long *,
+                               const unsigned long *, size_t) =
+    hb_or_words_int;
+static size_t (*hb_find_not_ones)(const unsigned long *, size_t, size_t) =
+    hb_find_not_ones_int;
+
+static void init_accel(unsigned cache)
+{
+    hb_count_words = hb_count_words_int;
+    hb_or_words = hb_or_words_int;
+    hb_find_not_ones = hb_find_not_ones_int;
+    if (cache & CACHE_POPCNT) {
+        hb_count_words = hb_count_words_popcnt;
+        hb_or_words = hb_or_words_popcnt;
+    }
+    if (cache & CACHE_AVX2) {
+        hb_count_words = hb_count_words_avx2;
+        hb_or_words = hb_or_words_avx2;
+        hb_find_not_ones = hb_find_not_ones_avx2;
+    }
+}
+
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (c & bit_POPCNT) {
+            cache |= CACHE_POPCNT;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+
+bool test_hbitmap_next_accel(void)
+{
+    /* If no bits set, we just tested the plain C loops, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+#else
+#define hb_count_words    hb_count_words_int
+#define hb_or_words       hb_or_words_int
+#define hb_find_not_ones  hb_find_not_ones_int
+
+bool test_hbitmap_next_accel(void)
+{
+    return false;
+}
+#endif /* CONFIG_AVX2_OPT */
+
+/* Count the set bits in the bottom level word that is only partially
+ * covered by the bitmap.  Bits past the end may be set by
+ * hbitmap_deserialize_ones(), so they are masked out.
+ */
+static uint64_t hb_count_partial_word(const HBitmap *hb)
+{
+    unsigned bits = hb->size & (BITS_PER_LONG - 1);
+    unsigned long cur;
+
+    if (!bits) {
+        return 0;
+    }
+    cur = hb->levels[HBITMAP_LEVELS - 1][hb->size >> BITS_PER_LEVEL];
+    return ctpopl(cur & ((1UL << bits) - 1));
+}
+
+/* Count the set bits in the whole bottom level.  */
+static uint64_t hb_count_all(const HBitmap *hb)
+{
+    return hb_count_words(hb->levels[HBITMAP_LEVELS - 1],
+                          hb->size >> BITS_PER_LEVEL) +
+           hb_count_partial_word(hb);
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -245,10 +510,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
-
+        pos = hb_find_not_ones(last_lev, pos + 1, sz);
         if (pos >= sz) {
             return -1;
         }
@@ -745,7 +1007,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
-    bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
+    bitmap->count = hb_count_all(bitmap);
 }
 
 void hbitmap_free(HBitmap *hb)
@@ -864,6 +1126,46 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/**
+ * hbitmap_sparse_merge_words: performs dst = dst | src
+ * requires equal granularities.
+ * only visits the nonzero words of src, found through its upper levels,
+ * so it is best used when src is sparsely populated.
+ */
+static void hbitmap_sparse_merge_words(HBitmap *dst, const HBitmap *src)
+{
+    unsigned long *last_lev = dst->levels[HBITMAP_LEVELS - 1];
+    size_t partial = src->size >> BITS_PER_LEVEL;
+    HBitmapIter hbi;
+    unsigned long cur, old;
+    size_t pos;
+
+    hbitmap_iter_init(&hbi, src, 0);
+    while ((pos = hbitmap_iter_next_word(&hbi, &cur)) != -1) {
+        if (pos == partial) {
+            /* Ignore bits past the end, see hb_count_partial_word.  */
+            cur &= (1UL << (src->size & (BITS_PER_LONG - 1))) - 1;
+        }
+
+        old = last_lev[pos];
+        last_lev[pos] |= cur;
+        dst->count += ctpopl(last_lev[pos]) - ctpopl(old);
+        if (!old && last_lev[pos]) {
+            hb_set_between(dst, HBITMAP_LEVELS - 2, pos, pos);
+        }
+    }
+}
+
+/* A word-by-word merge costs more per word than a linear pass, so only
+ * use it if it visits a small fraction of the words.
+ */
+#define HBITMAP_SPARSE_RATIO 16
+
+static bool hbitmap_is_sparse(const HBitmap *hb)
+{
+    return hb->count * HBITMAP_SPARSE_RATIO < hb->sizes[HBITMAP_LEVELS - 1];
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -874,8 +1176,8 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
  */
 bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
-    int i;
-    uint64_t j;
+    int i, last;
+    uint64_t j, full;
 
     if (!hbitmap_can_merge(a, b) || !hbitmap_can_merge(a, result)) {
         return false;
@@ -905,19 +1207,37 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return true;
     }
 
+    assert(a->size == b->size);
+
+    /* Merging a sparse bitmap into another only needs to visit its nonzero
+     * words, which the upper levels point to.
+     */
+    if (result == a && hbitmap_is_sparse(b)) {
+        hbitmap_sparse_merge_words(result, b);
+        return true;
+    }
+    if (result == b && hbitmap_is_sparse(a)) {
+        hbitmap_sparse_merge_words(result, a);
+        return true;
+    }
+
     /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+     * The bottom level is merged and counted in a single pass.
      */
-    assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
 
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
+    last = HBITMAP_LEVELS - 1;
+    full = a->size >> BITS_PER_LEVEL;
+    result->count = hb_or_words(result->levels[last], a->levels[last],
+                                b->levels[last], full);
+    for (j = full; j < a->sizes[last]; j++) {
+        result->levels[last][j] = a->levels[last][j] | b->levels[last][j];
+    }
+    result->count += hb_count_partial_word(result);
 
     return true;
 }
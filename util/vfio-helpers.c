@@ -84,8 +84,9 @@ struct QEMUVFIOState {
      * - Addresses lower than QEMU_VFIO_IOVA_MIN are reserved as invalid;
      *
      * - Fixed mappings of HVAs are assigned "low" IOVAs in the range of
-     *   [QEMU_VFIO_IOVA_MIN, low_water_mark).  Once allocated they will not be
-     *   reclaimed - low_water_mark never shrinks;
+     *   [QEMU_VFIO_IOVA_MIN, low_water_mark).  When a fixed mapping is
+     *   removed, its IOVAs go to @free_iovas, or lower low_water_mark if
+     *   they were the topmost ones, and are handed out again first;
      *
      * - IOVAs in range [low_water_mark, high_water_mark) are free;
      *
@@ -98,6 +99,10 @@ struct QEMUVFIOState {
     uint64_t high_water_mark;
     IOVAMapping *mappings;
     int nr_mappings;
+    int max_mappings;
+    /* Freed fixed IOVA ranges below low_water_mark, sorted and disjoint */
+    struct IOVARange *free_iovas;
+    int nr_free_iovas;
 };
 
 /**
@@ -524,6 +529,9 @@ QEMUVFIOState *qemu_vfio_open_pci(const char *device, Error **errp)
 
 static void qemu_vfio_dump_mappings(QEMUVFIOState *s)
 {
+    if (!trace_event_get_state_backends(TRACE_QEMU_VFIO_DUMP_MAPPING)) {
+        return;
+    }
     for (int i = 0; i < s->nr_mappings; ++i) {
         trace_qemu_vfio_dump_mapping(s->mappings[i].host,
                                      s->mappings[i].iova,
@@ -541,13 +549,14 @@ static IOVAMapping *qemu_vfio_find_mapping(QEMUVFIOState *s, void *host,
                                            int *index)
 {
     IOVAMapping *p = s->mappings;
-    IOVAMapping *q = p ? p + s->nr_mappings - 1 : NULL;
+    IOVAMapping *q;
     IOVAMapping *mid;
     trace_qemu_vfio_find_mapping(s, host);
-    if (!p) {
+    if (!s->nr_mappings) {
         *index = -1;
         return NULL;
     }
+    q = p + s->nr_mappings - 1;
     while (true) {
         mid = p + (q - p) / 2;
         if (mid == p) {
@@ -595,8 +604,11 @@ static IOVAMapping *qemu_vfio_add_mapping(QEMUVFIOState *s,
     trace_qemu_vfio_new_mapping(s, host, size, index, iova);
 
     assert(index >= 0);
+    if (s->nr_mappings == s->max_mappings) {
+        s->max_mappings = MAX(s->max_mappings * 2, 16);
+        s->mappings = g_renew(IOVAMapping, s->mappings, s->max_mappings);
+    }
     s->nr_mappings++;
-    s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
     insert = &s->mappings[index];
     shift = s->nr_mappings - index - 1;
     if (shift) {
@@ -626,6 +638,56 @@ static int qemu_vfio_do_mapping(QEMUVFIOState *s, void *host, size_t size,
     return 0;
 }
 
+/* Return the fixed IOVA range [iova, iova + size) for reuse. */
+static void qemu_vfio_free_fixed_iova(QEMUVFIOState *s, uint64_t iova,
+                                      size_t size)
+{
+    uint64_t end = iova + size - 1;
+    struct IOVARange *r;
+    int i;
+
+    trace_qemu_vfio_free_fixed_iova(s, iova, size);
+    if (end + 1 == s->low_water_mark) {
+        s->low_water_mark = iova;
+        if (s->nr_free_iovas &&
+            s->free_iovas[s->nr_free_iovas - 1].end + 1 == iova) {
+            s->low_water_mark = s->free_iovas[s->nr_free_iovas - 1].start;
+            s->nr_free_iovas--;
+        }
+        return;
+    }
+
+    for (i = 0; i < s->nr_free_iovas; i++) {
+        if (s->free_iovas[i].start > iova) {
+            break;
+        }
+    }
+
+    /* Merge with the neighbours where possible */
+    if (i > 0 && s->free_iovas[i - 1].end + 1 == iova) {
+        r = &s->free_iovas[i - 1];
+        r->end = end;
+        if (i < s->nr_free_iovas && end + 1 == s->free_iovas[i].start) {
+            r->end = s->free_iovas[i].end;
+            memmove(&s->free_iovas[i], &s->free_iovas[i + 1],
+                    sizeof(s->free_iovas[0]) * (s->nr_free_iovas - i - 1));
+            s->nr_free_iovas--;
+        }
+        return;
+    }
+    if (i < s->nr_free_iovas && end + 1 == s->free_iovas[i].start) {
+        s->free_iovas[i].start = iova;
+        return;
+    }
+
+    s->free_iovas = g_renew(struct IOVARange, s->free_iovas,
+                            s->nr_free_iovas + 1);
+    memmove(&s->free_iovas[i + 1], &s->free_iovas[i],
+            sizeof(s->free_iovas[0]) * (s->nr_free_iovas - i));
+    s->free_iovas[i] = (struct IOVARange) { .start = iova, .end = end };
+    s->nr_free_iovas++;
+}
+
 /**
  * Undo the DMA mapping from @s with VFIO, and remove from mapping list.
  */
@@ -647,10 +709,10 @@ static void qemu_vfio_undo_mapping(QEMUVFIOState *s, IOVAMapping *mapping,
     if (ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
         error_setg_errno(errp, errno, "VFIO_UNMAP_DMA failed");
     }
+    qemu_vfio_free_fixed_iova(s, mapping->iova, mapping->size);
     memmove(mapping, &s->mappings[index + 1],
             sizeof(s->mappings[0]) * (s->nr_mappings - index - 1));
     s->nr_mappings--;
-    s->mappings = g_renew(IOVAMapping, s->mappings, s->nr_mappings);
 }
 
 /* Check if the mapping list is (ascending) ordered. */
@@ -680,6 +742,25 @@ qemu_vfio_find_fixed_iova(QEMUVFIOState *s, size_t size, uint64_t *iova)
 {
     int i;
 
+    /* First fit in the IOVAs of removed mappings */
+    for (i = 0; i < s->nr_free_iovas; i++) {
+        struct IOVARange *r = &s->free_iovas[i];
+
+        if (r->end - r->start + 1 >= size) {
+            *iova = r->start;
+            r->start += size;
+            if (r->start > r->end) {
+                memmove(r, r + 1,
+                        sizeof(s->free_iovas[0]) * (s->nr_free_iovas - i - 1));
+                s->nr_free_iovas--;
+            }
+            return 0;
+        }
+    }
+
+    if (s->high_water_mark - s->low_water_mark + 1 < size) {
+        return -ENOMEM;
+    }
     for (i = 0; i < s->nb_iova_ranges; i++) {
         if (s->usable_iova_ranges[i].end < s->low_water_mark) {
             continue;
@@ -740,10 +821,6 @@ int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
     if (mapping) {
         iova0 = mapping->iova + ((uint8_t *)host - (uint8_t *)mapping->host);
     } else {
-        if (s->high_water_mark - s->low_water_mark + 1 < size) {
-            ret = -ENOMEM;
-            goto out;
-        }
         if (!temporary) {
             if (qemu_vfio_find_fixed_iova(s, size, &iova0)) {
                 ret = -ENOMEM;
@@ -763,6 +840,10 @@ int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
             }
             qemu_vfio_dump_mappings(s);
         } else {
+            if (s->high_water_mark - s->low_water_mark + 1 < size) {
+                ret = -ENOMEM;
+                goto out;
+            }
             if (qemu_vfio_find_temp_iova(s, size, &iova0)) {
                 ret = -ENOMEM;
                 goto out;
@@ -831,14 +912,14 @@ static void qemu_vfio_reset(QEMUVFIOState *s)
 /* Close and free the VFIO resources. */
 void qemu_vfio_close(QEMUVFIOState *s)
 {
-    int i;
-
     if (!s) {
         return;
     }
-    for (i = 0; i < s->nr_mappings; ++i) {
-        qemu_vfio_undo_mapping(s, &s->mappings[i], NULL);
+    while (s->nr_mappings) {
+        qemu_vfio_undo_mapping(s, &s->mappings[s->nr_mappings - 1], NULL);
     }
+    g_free(s->mappings);
+    g_free(s->free_iovas);
     ram_block_notifier_remove(&s->ram_notifier);
     g_free(s->usable_iova_ranges);
     s->nb_iova_ranges = 0;